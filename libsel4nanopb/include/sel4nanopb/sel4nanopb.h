@@ -8,6 +8,9 @@
 #include <pb.h>
 #include <sel4/sel4.h>
 
+/* bytes of the IPC buffer after the first offset words */
+size_t pb_size_of_IPC(seL4_Word offset);
+
 /* bind a nanopb stream to the IPC buffer of the thread */
 pb_ostream_t pb_ostream_from_IPC(seL4_Word offset);
 pb_istream_t pb_istream_from_IPC(seL4_Word offset);
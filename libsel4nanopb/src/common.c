@@ -10,16 +10,19 @@
 #include <sel4nanopb/sel4nanopb.h>
 #include <sel4/sel4.h>
 
+size_t pb_size_of_IPC(seL4_Word offset)
+{
+    return (seL4_MsgMaxLength - offset) * sizeof(seL4_Word);
+}
+
 pb_ostream_t pb_ostream_from_IPC(seL4_Word offset)
 {
     pb_byte_t *msg_buffer = (pb_byte_t *) & (seL4_GetIPCBuffer()->msg[offset]);
-    size_t size = seL4_MsgMaxLength * sizeof(seL4_Word) - offset;
-    return pb_ostream_from_buffer(msg_buffer, size);
+    return pb_ostream_from_buffer(msg_buffer, pb_size_of_IPC(offset));
 }
 
 pb_istream_t pb_istream_from_IPC(seL4_Word offset)
 {
     pb_byte_t *msg_buffer = (pb_byte_t *) & (seL4_GetIPCBuffer()->msg[offset]);
-    size_t size = seL4_MsgMaxLength * sizeof(seL4_Word) - offset;
-    return pb_istream_from_buffer(msg_buffer, size);
+    return pb_istream_from_buffer(msg_buffer, pb_size_of_IPC(offset));
 }
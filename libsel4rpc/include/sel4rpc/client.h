@@ -6,16 +6,53 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <sel4/sel4.h>
 
 struct _RpcMessage;
 typedef struct _RpcMessage RpcMessage;
 
+/* Most requests carried by a single batch call */
+#define SEL4RPC_BATCH_MAX (32)
+
 typedef struct sel4rpc_client_env {
     seL4_CPtr server_ep;
     seL4_Word magic;
+    /* Region shared with the server for messages too large for the IPC buffer, NULL if there is none */
+    void *shmem;
+    size_t shmem_size;
+    /* Optional features (SEL4RPC_FEATURE_*) the server agreed to, none until sel4rpc_client_negotiate */
+    seL4_Word features;
 } sel4rpc_client_t;
 
 int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic);
+
+/*
+ * Initialise a client that sends messages too large for the IPC buffer through
+ * a region it shares with the server. The region is offered to the server, which
+ * has to have been given its side with sel4rpc_server_set_shmem. If the server
+ * refuses it, the client is still initialised to use the IPC buffer only.
+ */
+int sel4rpc_client_init_shmem(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic,
+                              void *shmem, size_t size);
+
+/*
+ * Ask the server to agree to optional features (SEL4RPC_FEATURE_*), once the
+ * client is initialised. Only features the server agrees to are used: a client
+ * that never asks, or a server that doesn't know about features, keeps to
+ * delimited RpcMessages, so either side can be older than the other.
+ * Returns -1 if the call failed, otherwise 0, even if nothing was agreed to.
+ */
+int sel4rpc_client_negotiate(sel4rpc_client_t *client, seL4_Word features);
 int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
                  seL4_CPtr capPtr, seL4_Word capDepth);
+
+/*
+ * Send many requests, packing as many into each call as fit in the IPC buffer,
+ * or in the shared region if the client has one.
+ * Each request is replaced by its reply, as with sel4rpc_call. The cap for
+ * msgs[i], if any, is placed at slot capPtr + i of the CNode root, which is
+ * sent to the server with each call, so the endpoint needs grant rights.
+ */
+int sel4rpc_call_batch(sel4rpc_client_t *client, RpcMessage *msgs, size_t count, seL4_CPtr root,
+                       seL4_CPtr capPtr, seL4_Word capDepth);
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+struct _RpcMessage;
+typedef struct _RpcMessage RpcMessage;
+
+/*
+ * Features a client can ask the server to agree to with sel4rpc_client_negotiate.
+ * SEL4RPC_FEATURE_FIXED: the common messages may use a fixed layout.
+ */
+#define SEL4RPC_FEATURE_FIXED BIT(0)
+
+/*
+ * Encodings of a message, given by the label of its message info. The common
+ * messages have a fixed layout of one message register per field, listed below,
+ * which avoids protobuf encoding and decoding on every call. Anything else, and
+ * everything sent between peers that haven't agreed to SEL4RPC_FEATURE_FIXED, is
+ * a delimited RpcMessage with label 0, as it always was.
+ * A request with a fixed layout gets a reply with a fixed layout.
+ */
+enum sel4rpc_encoding {
+    SEL4RPC_ENC_PROTOBUF = 0,
+    /*
+     * A delimited RpcMessage asking for features. The label shows the server's
+     * receive loop passes labels on, which the fixed layouts depend on.
+     */
+    SEL4RPC_ENC_NEGOTIATE,
+    /* errorCode, cookie */
+    SEL4RPC_ENC_RET,
+    /* address, size_bits, type */
+    SEL4RPC_ENC_MEMORY_ALLOC,
+    SEL4RPC_ENC_MEMORY_FREE,
+    /* setTrigger, irq, trigger */
+    SEL4RPC_ENC_IRQ_SIMPLE,
+    /* ioapic, pin, level, polarity, vector */
+    SEL4RPC_ENC_IRQ_IOAPIC,
+    /* pci_bus, pci_dev, pci_func, handle, vector */
+    SEL4RPC_ENC_IRQ_MSI,
+    /* start, end */
+    SEL4RPC_ENC_IOPORT,
+};
+
+/*
+ * Encode msg into the message registers from offset on, if it has a fixed layout.
+ * Returns its encoding, with *words set to the number of registers used, or
+ * SEL4RPC_ENC_PROTOBUF if msg has no fixed layout, or a field doesn't fit in a word.
+ */
+seL4_Word sel4rpc_fixed_encode(const RpcMessage *msg, seL4_Word offset, seL4_Word *words);
+
+/*
+ * Decode a message with a fixed layout from the message registers from offset on.
+ * Returns -1 if encoding isn't a fixed layout, otherwise 0.
+ */
+int sel4rpc_fixed_decode(seL4_Word encoding, seL4_Word offset, RpcMessage *msg);
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4rpc/server.h>
+#include <sel4utils/thread.h>
+#include <sync/mutex.h>
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+
+/*
+ * A vka many threads can share: each call into the vka underneath is made
+ * holding a lock
+ */
+typedef struct sel4rpc_locked_vka {
+    vka_t vka;
+    vka_t *parent;
+    sync_mutex_t lock;
+} sel4rpc_locked_vka_t;
+
+/* A server thread, with its own reply object and server environment */
+typedef struct sel4rpc_server_worker {
+    sel4rpc_server_env_t env;
+    vka_object_t reply;
+    sel4utils_thread_t thread;
+    seL4_CPtr ep;
+} sel4rpc_server_worker_t;
+
+/* Server threads all receiving on the same endpoint */
+typedef struct sel4rpc_server_pool {
+    /* The vka of the server, locked for the workers */
+    sel4rpc_locked_vka_t vka;
+    sel4rpc_server_worker_t *workers;
+    size_t num_workers;
+} sel4rpc_server_pool_t;
+
+/*
+ * Wrap a vka so many threads can share it. The lock's notification is
+ * allocated from vka.
+ */
+int sel4rpc_locked_vka_init(sel4rpc_locked_vka_t *locked, vka_t *vka);
+
+/*
+ * Start num_workers threads serving requests on ep, as sel4rpc_server_run does.
+ * Each worker copies env, but uses its own reply object and the pool's locked vka.
+ * The lock is held for the whole of each vka call, so allocations are serialised
+ * and a slow one still holds up every worker that allocates. A server with a
+ * shared region can't be pooled. Calls into env->simple are made holding
+ * env->simple_lock, or the vka lock if it isn't set. Once the pool is started,
+ * other threads must allocate through pool->vka.vka too, and take the same lock
+ * to use env->simple. vspace allocates from env->vka directly, without the lock,
+ * so it can't be used while the workers are allocating. Handlers that touch any
+ * other shared state have to lock it themselves.
+ * Returns -1 if a worker could not be started, having stopped and freed the
+ * workers already started.
+ */
+int sel4rpc_server_pool_start(sel4rpc_server_pool_t *pool, sel4rpc_server_env_t *env, seL4_CPtr ep,
+                              vspace_t *vspace, seL4_CPtr cspace, seL4_Word cspace_root_data,
+                              uint8_t prio, size_t num_workers);
@@ -7,6 +7,7 @@
 #pragma once
 
 #include <simple/simple.h>
+#include <sync/mutex.h>
 #include <vka/object.h>
 #include <vka/vka.h>
 #include <rpc.pb.h>
@@ -25,11 +26,50 @@ typedef struct sel4rpc_env {
     void *data;
 
     simple_t *simple;
+    /*
+     * Held around each call into simple when set, for servers whose simple is shared
+     * between threads. Handlers that call into simple have to hold it too
+     */
+    sync_mutex_t *simple_lock;
+
+    /* Slot the CNode sent with a batch is received into, empty if batches aren't served */
+    cspacepath_t cnode_path;
+
+    /* Badge of the request being handled, set by sel4rpc_server_run */
+    seL4_Word badge;
+    /*
+     * Label of the request being handled, which gives its encoding (see sel4rpc/fixed.h), set by
+     * sel4rpc_server_run. Loops calling sel4rpc_server_recv themselves that leave it at SEL4RPC_ENC_PROTOBUF
+     * never agree to the fixed layouts
+     */
+    seL4_Word label;
+
+    /* Region shared with the client for messages too large for the IPC buffer, NULL if there is none */
+    void *shmem;
+    size_t shmem_size;
+    /* Badge of the client the region belongs to, requests with any other badge can't use it */
+    seL4_Word shmem_badge;
 } sel4rpc_server_env_t;
 
 int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
                         sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple);
 int sel4rpc_server_recv(sel4rpc_server_env_t *env);
-int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie);
+
+/*
+ * Give the server its mapping of a region shared with the client whose requests
+ * carry badge, which the client offers with sel4rpc_client_init_shmem. A region
+ * serves that single client: shared messages and offers from other badges are
+ * refused. Loops calling sel4rpc_server_recv themselves have to set env->badge
+ * to the badge of each request. Can't be used with a server pool.
+ */
+int sel4rpc_server_set_shmem(sel4rpc_server_env_t *env, void *shmem, size_t size, seL4_Word badge);
+int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, seL4_Word cookie);
 int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg);
 
+/*
+ * Serve requests on ep forever. Unlike a loop calling sel4rpc_server_recv,
+ * this also receives the CNode sent with a batch, so batches can be served.
+ * Only returns if setting up fails.
+ */
+int sel4rpc_server_run(sel4rpc_server_env_t *env, seL4_CPtr ep);
+
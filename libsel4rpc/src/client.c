@@ -4,34 +4,119 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <inttypes.h>
 #include <rpc.pb.h>
 #include <pb_encode.h>
 #include <pb_decode.h>
 #include <sel4nanopb/sel4nanopb.h>
 #include <sel4rpc/client.h>
+#include <sel4rpc/fixed.h>
 #include <sel4rpc/server.h>
 
+#include <utils/util.h>
 #include <utils/zf_log.h>
 
+/* the magic header */
 #define IPC_RESERVED_WORDS (1)
 
 int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic)
 {
     client->server_ep = server_ep;
     client->magic = magic;
+    client->shmem = NULL;
+    client->shmem_size = 0;
+    client->features = 0;
     return 0;
 }
 
-int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
-                 seL4_CPtr capPtr, seL4_Word capDepth)
+/* Bytes a message takes when encoded delimited, 0 if it can't be encoded */
+static size_t delimited_size(const RpcMessage *msg)
+{
+    size_t size;
+    if (!pb_get_encoded_size(&size, &RpcMessage_msg, msg)) {
+        return 0;
+    }
+
+    size_t total = size + 1;
+    while (size >= 0x80) {
+        size >>= 7;
+        total++;
+    }
+    return total;
+}
+
+/* Decode the first message of a reply into reply, leaving istream at the rest of it */
+static int sel4rpc_client_reply(sel4rpc_client_t *client, seL4_MessageInfo_t info, RpcMessage *reply,
+                                pb_istream_t *istream)
+{
+    seL4_Word encoding = seL4_MessageInfo_get_label(info);
+    if (encoding != SEL4RPC_ENC_PROTOBUF) {
+        *istream = pb_istream_from_buffer(NULL, 0);
+        if (sel4rpc_fixed_decode(encoding, 0, reply)) {
+            ZF_LOGE("Unknown server reply encoding %"PRIuPTR, (uintptr_t) encoding);
+            return -1;
+        }
+        return 0;
+    }
+
+    *istream = pb_istream_from_IPC(0);
+    bool ret = pb_decode_delimited(istream, &RpcMessage_msg, reply);
+    if (ret && reply->which_msg == RpcMessage_shmem_tag) {
+        if (reply->msg.shmem.length > client->shmem_size) {
+            ZF_LOGE("Server reply of %u bytes is outside the shared region", (unsigned) reply->msg.shmem.length);
+            return -1;
+        }
+        *istream = pb_istream_from_buffer(client->shmem, reply->msg.shmem.length);
+        ret = pb_decode_delimited(istream, &RpcMessage_msg, reply);
+    }
+    if (!ret) {
+        ZF_LOGE("Failed to decode server reply (%s)", PB_GET_ERROR(istream));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send a request made of an optional header and count messages, size bytes when
+ * encoded, and decode the first message of the reply into reply. The request goes
+ * through the shared region if it doesn't fit in the IPC buffer. label is
+ * SEL4RPC_ENC_PROTOBUF, or SEL4RPC_ENC_NEGOTIATE for a features request.
+ * istream is left at the rest of the reply.
+ */
+static int sel4rpc_client_call(sel4rpc_client_t *client, seL4_Word label, RpcMessage *header, RpcMessage *msgs,
+                               size_t count, size_t size, int caps, RpcMessage *reply, pb_istream_t *istream)
 {
-    pb_ostream_t stream = pb_ostream_from_IPC(IPC_RESERVED_WORDS);
-    bool ret = pb_encode_delimited(&stream, &RpcMessage_msg, msg);
+    bool shared = size > pb_size_of_IPC(IPC_RESERVED_WORDS);
+    if (shared && size > client->shmem_size) {
+        ZF_LOGE("Message of %zu bytes is too large", size);
+        return -1;
+    }
+
+    pb_ostream_t stream = shared ? pb_ostream_from_buffer(client->shmem, client->shmem_size) :
+                          pb_ostream_from_IPC(IPC_RESERVED_WORDS);
+    bool ret = !header || pb_encode_delimited(&stream, &RpcMessage_msg, header);
+    for (size_t i = 0; ret && i < count; i++) {
+        ret = pb_encode_delimited(&stream, &RpcMessage_msg, &msgs[i]);
+    }
     if (!ret) {
         ZF_LOGE("Failed to encode message (%s)", PB_GET_ERROR(&stream));
         return -1;
     }
 
+    if (shared) {
+        /* only the descriptor of the message goes through IPC */
+        RpcMessage desc = {
+            .which_msg = RpcMessage_shmem_tag,
+            .msg.shmem.length = stream.bytes_written,
+        };
+        stream = pb_ostream_from_IPC(IPC_RESERVED_WORDS);
+        if (!pb_encode_delimited(&stream, &RpcMessage_msg, &desc)) {
+            ZF_LOGE("Failed to encode message (%s)", PB_GET_ERROR(&stream));
+            return -1;
+        }
+    }
+
     size_t stream_size = stream.bytes_written / sizeof(seL4_Word);
     /* add an extra word if bytes_written is not divisible by sizeof(seL4_Word). */
     if (stream.bytes_written % sizeof(seL4_Word)) {
@@ -41,18 +126,136 @@ int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
     /* add an extra word for the magic header */
     stream_size += IPC_RESERVED_WORDS;
 
-    /* set cap receive path */
-    seL4_SetCapReceivePath(root, capPtr, capDepth);
     /* set magic header */
     seL4_SetMR(0, client->magic);
-    seL4_Call(client->server_ep, seL4_MessageInfo_new(0, 0, 0, stream_size));
+    seL4_MessageInfo_t info = seL4_Call(client->server_ep, seL4_MessageInfo_new(label, 0, caps, stream_size));
 
-    pb_istream_t istream = pb_istream_from_IPC(0);
-    ret = pb_decode_delimited(&istream, &RpcMessage_msg, msg);
-    if (!ret) {
-        ZF_LOGE("Failed to decode server reply (%s)", PB_GET_ERROR(&stream));
+    return sel4rpc_client_reply(client, info, reply, istream);
+}
+
+int sel4rpc_client_init_shmem(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic,
+                              void *shmem, size_t size)
+{
+    sel4rpc_client_init(client, server_ep, magic);
+
+    RpcMessage msg = {
+        .which_msg = RpcMessage_shmem_setup_tag,
+        .msg.shmem_setup.size = size,
+    };
+    int error = sel4rpc_call(client, &msg, seL4_CapNull, seL4_CapNull, 0);
+    if (error || msg.which_msg != RpcMessage_ret_tag || msg.msg.ret.errorCode) {
+        ZF_LOGE("Server refused a shared region of %zu bytes", size);
+        return -1;
+    }
+
+    client->shmem = shmem;
+    client->shmem_size = MIN(size, msg.msg.ret.cookie);
+    return 0;
+}
+
+int sel4rpc_client_negotiate(sel4rpc_client_t *client, seL4_Word features)
+{
+    RpcMessage msg = {
+        .which_msg = RpcMessage_features_tag,
+        .msg.features.flags = features,
+    };
+    pb_istream_t istream;
+    client->features = 0;
+    int error = sel4rpc_client_call(client, SEL4RPC_ENC_NEGOTIATE, NULL, &msg, 1, 0, 0, &msg, &istream);
+    if (error) {
         return -1;
     }
 
+    /* servers that don't know about features refuse the request, and agree to none */
+    if (msg.which_msg == RpcMessage_ret_tag && msg.msg.ret.errorCode == 0) {
+        client->features = msg.msg.ret.cookie & features;
+    }
+    return 0;
+}
+
+int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
+                 seL4_CPtr capPtr, seL4_Word capDepth)
+{
+    /* set cap receive path */
+    seL4_SetCapReceivePath(root, capPtr, capDepth);
+
+    pb_istream_t istream;
+    seL4_Word words;
+    seL4_Word encoding = SEL4RPC_ENC_PROTOBUF;
+    if (client->features & SEL4RPC_FEATURE_FIXED) {
+        encoding = sel4rpc_fixed_encode(msg, IPC_RESERVED_WORDS, &words);
+    }
+    if (encoding != SEL4RPC_ENC_PROTOBUF) {
+        /* fast path: one message register per field, the label gives the layout */
+        seL4_SetMR(0, client->magic);
+        seL4_MessageInfo_t info = seL4_Call(client->server_ep,
+                                            seL4_MessageInfo_new(encoding, 0, 0, IPC_RESERVED_WORDS + words));
+        return sel4rpc_client_reply(client, info, msg, &istream);
+    }
+
+    /* without a shared region the message has to fit in the IPC buffer anyway */
+    size_t size = client->shmem ? delimited_size(msg) : 0;
+    return sel4rpc_client_call(client, SEL4RPC_ENC_PROTOBUF, NULL, msg, 1, size, 0, msg, &istream);
+}
+
+int sel4rpc_call_batch(sel4rpc_client_t *client, RpcMessage *msgs, size_t count, seL4_CPtr root,
+                       seL4_CPtr capPtr, seL4_Word capDepth)
+{
+    size_t space = MAX(pb_size_of_IPC(IPC_RESERVED_WORDS), client->shmem_size);
+    size_t done = 0;
+
+    while (done < count) {
+        RpcMessage header = {
+            .which_msg = RpcMessage_batch_tag,
+            .msg.batch = {
+                .count = MIN(count - done, SEL4RPC_BATCH_MAX),
+                .index = capPtr + done,
+                .depth = capDepth,
+            },
+        };
+
+        /* pack as many requests as fit, the header only shrinks as count drops */
+        size_t used = delimited_size(&header);
+        size_t batch = 0;
+        while (batch < header.msg.batch.count) {
+            size_t size = delimited_size(&msgs[done + batch]);
+            if (size == 0) {
+                ZF_LOGE("Failed to size request %zu", done + batch);
+                return -1;
+            }
+            if (used + size > space) {
+                break;
+            }
+            used += size;
+            batch++;
+        }
+        if (batch == 0) {
+            ZF_LOGE("Request %zu does not fit in a call", done);
+            return -1;
+        }
+        header.msg.batch.count = batch;
+
+        /* send the CNode the server puts the caps into */
+        seL4_SetCap(0, root);
+        pb_istream_t istream;
+        int error = sel4rpc_client_call(client, SEL4RPC_ENC_PROTOBUF, &header, &msgs[done], batch, used, 1,
+                                        &header, &istream);
+        if (error) {
+            return error;
+        }
+        if (header.which_msg != RpcMessage_batch_tag || header.msg.batch.count != batch) {
+            ZF_LOGE("Server refused batch of %zu requests", batch);
+            return -1;
+        }
+        for (size_t i = 0; i < batch; i++) {
+            if (!pb_decode_delimited(&istream, &RpcMessage_msg, &msgs[done + i])) {
+                ZF_LOGE("Failed to decode server reply (%s)", PB_GET_ERROR(&istream));
+                return -1;
+            }
+        }
+
+        done += batch;
+    }
+
     return 0;
 }
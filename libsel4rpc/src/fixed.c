@@ -0,0 +1,157 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <rpc.pb.h>
+#include <sel4rpc/fixed.h>
+
+#include <utils/util.h>
+
+/* Most fields of a message with a fixed layout */
+#define FIXED_MAX_WORDS (5)
+
+seL4_Word sel4rpc_fixed_encode(const RpcMessage *msg, seL4_Word offset, seL4_Word *words)
+{
+    uint64_t fields[FIXED_MAX_WORDS];
+    seL4_Word encoding;
+    seL4_Word count;
+
+    switch (msg->which_msg) {
+    case RpcMessage_ret_tag:
+        encoding = SEL4RPC_ENC_RET;
+        fields[0] = msg->msg.ret.errorCode;
+        fields[1] = msg->msg.ret.cookie;
+        count = 2;
+        break;
+    case RpcMessage_memory_tag: {
+        const MemoryAllocMessage *memory = &msg->msg.memory;
+        encoding = (memory->action == Action_ALLOCATE) ? SEL4RPC_ENC_MEMORY_ALLOC : SEL4RPC_ENC_MEMORY_FREE;
+        fields[0] = memory->address;
+        fields[1] = memory->size_bits;
+        fields[2] = memory->type;
+        count = 3;
+        break;
+    }
+    case RpcMessage_irq_tag:
+        switch (msg->msg.irq.which_type) {
+        case IrqAllocMessage_simple_tag: {
+            const IrqAllocMessageSimple *simple = &msg->msg.irq.type.simple;
+            encoding = SEL4RPC_ENC_IRQ_SIMPLE;
+            fields[0] = simple->setTrigger;
+            fields[1] = simple->irq;
+            fields[2] = simple->trigger;
+            count = 3;
+            break;
+        }
+        case IrqAllocMessage_ioapic_tag: {
+            const IrqAllocMessagex86_IOAPIC *ioapic = &msg->msg.irq.type.ioapic;
+            encoding = SEL4RPC_ENC_IRQ_IOAPIC;
+            fields[0] = ioapic->ioapic;
+            fields[1] = ioapic->pin;
+            fields[2] = ioapic->level;
+            fields[3] = ioapic->polarity;
+            fields[4] = ioapic->vector;
+            count = 5;
+            break;
+        }
+        case IrqAllocMessage_msi_tag: {
+            const IrqAllocMessagex86_MSI *msi = &msg->msg.irq.type.msi;
+            encoding = SEL4RPC_ENC_IRQ_MSI;
+            fields[0] = msi->pci_bus;
+            fields[1] = msi->pci_dev;
+            fields[2] = msi->pci_func;
+            fields[3] = msi->handle;
+            fields[4] = msi->vector;
+            count = 5;
+            break;
+        }
+        default:
+            return SEL4RPC_ENC_PROTOBUF;
+        }
+        break;
+    case RpcMessage_ioport_tag:
+        encoding = SEL4RPC_ENC_IOPORT;
+        fields[0] = msg->msg.ioport.start;
+        fields[1] = msg->msg.ioport.end;
+        count = 2;
+        break;
+    default:
+        return SEL4RPC_ENC_PROTOBUF;
+    }
+
+    /* 64-bit fields only have a fixed layout on 32-bit platforms if their values fit */
+    for (seL4_Word i = 0; i < count; i++) {
+        if (fields[i] != (seL4_Word) fields[i]) {
+            return SEL4RPC_ENC_PROTOBUF;
+        }
+    }
+    for (seL4_Word i = 0; i < count; i++) {
+        seL4_SetMR(offset + i, fields[i]);
+    }
+
+    *words = count;
+    return encoding;
+}
+
+int sel4rpc_fixed_decode(seL4_Word encoding, seL4_Word offset, RpcMessage *msg)
+{
+    switch (encoding) {
+    case SEL4RPC_ENC_RET:
+        msg->which_msg = RpcMessage_ret_tag;
+        msg->msg.ret.errorCode = seL4_GetMR(offset);
+        msg->msg.ret.cookie = seL4_GetMR(offset + 1);
+        break;
+    case SEL4RPC_ENC_MEMORY_ALLOC:
+    case SEL4RPC_ENC_MEMORY_FREE: {
+        MemoryAllocMessage *memory = &msg->msg.memory;
+        msg->which_msg = RpcMessage_memory_tag;
+        memory->address = seL4_GetMR(offset);
+        memory->size_bits = seL4_GetMR(offset + 1);
+        memory->type = seL4_GetMR(offset + 2);
+        memory->action = (encoding == SEL4RPC_ENC_MEMORY_ALLOC) ? Action_ALLOCATE : Action_FREE;
+        break;
+    }
+    case SEL4RPC_ENC_IRQ_SIMPLE: {
+        IrqAllocMessageSimple *simple = &msg->msg.irq.type.simple;
+        msg->which_msg = RpcMessage_irq_tag;
+        msg->msg.irq.which_type = IrqAllocMessage_simple_tag;
+        simple->setTrigger = seL4_GetMR(offset);
+        simple->irq = seL4_GetMR(offset + 1);
+        simple->trigger = seL4_GetMR(offset + 2);
+        break;
+    }
+    case SEL4RPC_ENC_IRQ_IOAPIC: {
+        IrqAllocMessagex86_IOAPIC *ioapic = &msg->msg.irq.type.ioapic;
+        msg->which_msg = RpcMessage_irq_tag;
+        msg->msg.irq.which_type = IrqAllocMessage_ioapic_tag;
+        ioapic->ioapic = seL4_GetMR(offset);
+        ioapic->pin = seL4_GetMR(offset + 1);
+        ioapic->level = seL4_GetMR(offset + 2);
+        ioapic->polarity = seL4_GetMR(offset + 3);
+        ioapic->vector = seL4_GetMR(offset + 4);
+        break;
+    }
+    case SEL4RPC_ENC_IRQ_MSI: {
+        IrqAllocMessagex86_MSI *msi = &msg->msg.irq.type.msi;
+        msg->which_msg = RpcMessage_irq_tag;
+        msg->msg.irq.which_type = IrqAllocMessage_msi_tag;
+        msi->pci_bus = seL4_GetMR(offset);
+        msi->pci_dev = seL4_GetMR(offset + 1);
+        msi->pci_func = seL4_GetMR(offset + 2);
+        msi->handle = seL4_GetMR(offset + 3);
+        msi->vector = seL4_GetMR(offset + 4);
+        break;
+    }
+    case SEL4RPC_ENC_IOPORT:
+        msg->which_msg = RpcMessage_ioport_tag;
+        msg->msg.ioport.start = seL4_GetMR(offset);
+        msg->msg.ioport.end = seL4_GetMR(offset + 1);
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
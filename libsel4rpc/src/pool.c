@@ -0,0 +1,223 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <stdlib.h>
+#include <sel4rpc/pool.h>
+#include <sel4rpc/server.h>
+#include <sel4utils/thread.h>
+#include <sel4utils/thread_config.h>
+#include <sync/mutex.h>
+#include <vka/vka.h>
+#include <vka/object.h>
+
+#include <utils/zf_log.h>
+
+static int locked_cspace_alloc(void *data, seL4_CPtr *res)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    int error = vka_cspace_alloc(locked->parent, res);
+    sync_mutex_unlock(&locked->lock);
+    return error;
+}
+
+static void locked_cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    /* only works out a path, there is no allocator state to protect */
+    vka_cspace_make_path(locked->parent, slot, res);
+}
+
+static int locked_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                seL4_Word *res)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    int error = vka_utspace_alloc(locked->parent, dest, type, size_bits, res);
+    sync_mutex_unlock(&locked->lock);
+    return error;
+}
+
+static int locked_utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4_Word type,
+                                             seL4_Word size_bits, bool can_use_dev, seL4_Word *res)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    int error = vka_utspace_alloc_maybe_device(locked->parent, dest, type, size_bits, can_use_dev, res);
+    sync_mutex_unlock(&locked->lock);
+    return error;
+}
+
+static int locked_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                   uintptr_t paddr, seL4_Word *cookie)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    int error = vka_utspace_alloc_at(locked->parent, dest, type, size_bits, paddr, cookie);
+    sync_mutex_unlock(&locked->lock);
+    return error;
+}
+
+static void locked_cspace_free(void *data, seL4_CPtr slot)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    vka_cspace_free(locked->parent, slot);
+    sync_mutex_unlock(&locked->lock);
+}
+
+static void locked_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    vka_utspace_free(locked->parent, type, size_bits, target);
+    sync_mutex_unlock(&locked->lock);
+}
+
+static uintptr_t locked_utspace_paddr(void *data, seL4_Word target, seL4_Word type, seL4_Word size_bits)
+{
+    sel4rpc_locked_vka_t *locked = data;
+    sync_mutex_lock(&locked->lock);
+    uintptr_t paddr = vka_utspace_paddr(locked->parent, target, type, size_bits);
+    sync_mutex_unlock(&locked->lock);
+    return paddr;
+}
+
+int sel4rpc_locked_vka_init(sel4rpc_locked_vka_t *locked, vka_t *vka)
+{
+    int error = sync_mutex_new(vka, &locked->lock);
+    if (error) {
+        ZF_LOGE("Failed to create vka lock: %d", error);
+        return -1;
+    }
+
+    locked->parent = vka;
+    locked->vka = (vka_t) {
+        .data = locked,
+        .cspace_alloc = locked_cspace_alloc,
+        .cspace_make_path = locked_cspace_make_path,
+        .utspace_alloc = locked_utspace_alloc,
+        .utspace_alloc_maybe_device = locked_utspace_alloc_maybe_device,
+        .utspace_alloc_at = locked_utspace_alloc_at,
+        .cspace_free = locked_cspace_free,
+        .utspace_free = locked_utspace_free,
+        .utspace_paddr = locked_utspace_paddr,
+    };
+    return 0;
+}
+
+static void sel4rpc_server_worker_entry(void *arg0, UNUSED void *arg1, UNUSED void *ipc_buf)
+{
+    sel4rpc_server_worker_t *worker = arg0;
+    sel4rpc_server_run(&worker->env, worker->ep);
+
+    ZF_LOGE("RPC server worker failed to start serving");
+    seL4_TCB_Suspend(worker->thread.tcb.cptr);
+}
+
+/*
+ * Stop the started workers, free the threads and reply objects of the first count
+ * workers, then the lock and the workers
+ */
+static void sel4rpc_server_pool_unwind(sel4rpc_server_pool_t *pool, vspace_t *vspace, size_t count)
+{
+    /* with the lock held, no worker is part way through a call into the vka or simple */
+    sync_mutex_lock(&pool->vka.lock);
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        seL4_TCB_Suspend(pool->workers[i].thread.tcb.cptr);
+    }
+    sync_mutex_unlock(&pool->vka.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        sel4utils_clean_up_thread(&pool->vka.vka, vspace, &pool->workers[i].thread);
+#ifdef CONFIG_KERNEL_MCS
+        vka_free_object(&pool->vka.vka, &pool->workers[i].reply);
+#endif
+    }
+
+    sync_mutex_destroy(pool->vka.parent, &pool->vka.lock);
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->num_workers = 0;
+}
+
+int sel4rpc_server_pool_start(sel4rpc_server_pool_t *pool, sel4rpc_server_env_t *env, seL4_CPtr ep,
+                              vspace_t *vspace, seL4_CPtr cspace, seL4_Word cspace_root_data,
+                              uint8_t prio, size_t num_workers)
+{
+    pool->num_workers = 0;
+    pool->workers = NULL;
+    /* Workers would share the one region, and could handle two calls using it at once */
+    if (env->shmem) {
+        ZF_LOGE("A server pool can't serve a shared region");
+        return -1;
+    }
+
+    pool->workers = calloc(num_workers, sizeof(*pool->workers));
+    if (pool->workers == NULL) {
+        ZF_LOGE("Failed to allocate %zu workers", num_workers);
+        return -1;
+    }
+
+    int error = sel4rpc_locked_vka_init(&pool->vka, env->vka);
+    if (error) {
+        free(pool->workers);
+        pool->workers = NULL;
+        return -1;
+    }
+    vka_t *vka = &pool->vka.vka;
+    /* the workers all call into the one simple */
+    sync_mutex_t *simple_lock = env->simple_lock ? env->simple_lock : &pool->vka.lock;
+
+    /*
+     * Configure every worker before starting any: the vspace maps their stacks and IPC
+     * buffers through its own vka, the parent, which running workers would be using too
+     */
+    for (size_t i = 0; i < num_workers; i++) {
+        sel4rpc_server_worker_t *worker = &pool->workers[i];
+        worker->env = *env;
+        worker->env.vka = vka;
+        worker->env.reply = &worker->reply;
+        worker->env.simple_lock = simple_lock;
+        worker->env.cnode_path.capPtr = seL4_CapNull;
+        worker->ep = ep;
+
+#ifdef CONFIG_KERNEL_MCS
+        error = vka_alloc_reply(vka, &worker->reply);
+        if (error) {
+            ZF_LOGE("Failed to allocate reply object for worker %zu: %d", i, error);
+            sel4rpc_server_pool_unwind(pool, vspace, i);
+            return -1;
+        }
+#endif
+
+        sel4utils_thread_config_t config = thread_config_default(env->simple, cspace, cspace_root_data,
+                                                                 seL4_CapNull, prio);
+        error = sel4utils_configure_thread_config(vka, vspace, vspace, config, &worker->thread);
+        if (error) {
+            ZF_LOGE("Failed to configure worker %zu: %d", i, error);
+#ifdef CONFIG_KERNEL_MCS
+            vka_free_object(vka, &worker->reply);
+#endif
+            sel4rpc_server_pool_unwind(pool, vspace, i);
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < num_workers; i++) {
+        sel4rpc_server_worker_t *worker = &pool->workers[i];
+        error = sel4utils_start_thread(&worker->thread, sel4rpc_server_worker_entry, worker, NULL, 1);
+        if (error) {
+            ZF_LOGE("Failed to start worker %zu: %d", i, error);
+            sel4rpc_server_pool_unwind(pool, vspace, num_workers);
+            return -1;
+        }
+        pool->num_workers++;
+    }
+
+    return 0;
+}
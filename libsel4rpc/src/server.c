@@ -5,7 +5,10 @@
  */
 
 #include <autoconf.h>
+#include <inttypes.h>
 #include <sel4nanopb/sel4nanopb.h>
+#include <sel4rpc/client.h>
+#include <sel4rpc/fixed.h>
 #include <sel4rpc/server.h>
 #include <sel4utils/api.h>
 #include <simple/simple.h>
@@ -18,82 +21,106 @@
 
 #include <utils/zf_log.h>
 
-static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
-{
+/* Largest a delimited reply to one request of a batch gets: a ReturnMessage in an RpcMessage */
+#define BATCH_REPLY_MAX (ReturnMessage_size + 3)
+#define BATCH_HEADER_MAX (BatchMessage_size + 3)
+
+/* Words of a request before its message: the magic */
+#define REQUEST_HEADER_WORDS (1)
+
+/*
+ * Outcome of handling a request: what to reply, and the slot holding the cap
+ * to hand back with the reply (capPtr is seL4_CapNull if there is none)
+ */
+typedef struct sel4rpc_result {
+    int errorCode;
+    seL4_Word cookie;
     cspacepath_t path;
+} sel4rpc_result_t;
+
+static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, RpcMessage *rpcMsg, sel4rpc_result_t *res)
+{
     int error;
     if (rpcMsg->msg.memory.action == Action_ALLOCATE) {
-        error = vka_cspace_alloc_path(env->vka, &path);
+        error = vka_cspace_alloc_path(env->vka, &res->path);
         if (error) {
             ZF_LOGE("Failed to alloc path: %d\n", error);
-            sel4rpc_server_reply(env, 0, 1, 0);
+            res->path.capPtr = seL4_CapNull;
+            res->errorCode = 1;
             return -1;
         }
 
         uintptr_t cookie;
-        error = vka_utspace_alloc_at(env->vka, &path, rpcMsg->msg.memory.type, rpcMsg->msg.memory.size_bits,
+        error = vka_utspace_alloc_at(env->vka, &res->path, rpcMsg->msg.memory.type, rpcMsg->msg.memory.size_bits,
                                      rpcMsg->msg.memory.address, &cookie);
         if (error) {
             ZF_LOGE("Failed to alloc at: %d\n", error);
-            vka_cspace_free_path(env->vka, path);
-            sel4rpc_server_reply(env, 0, 1, 0);
+            res->errorCode = 1;
             return -1;
         }
 
-        seL4_SetCap(0, path.capPtr);
-        int ret = sel4rpc_server_reply(env, 1, 0, cookie);
-
-        vka_cnode_delete(&path);
-        vka_cspace_free_path(env->vka, path);
-
-        return ret;
+        res->cookie = cookie;
+        return 0;
     } else {
         vka_utspace_free(env->vka, rpcMsg->msg.memory.type, rpcMsg->msg.memory.size_bits,
                          rpcMsg->msg.memory.address);
 
-        return sel4rpc_server_reply(env, 0, 0, 0);
+        return 0;
     }
 }
 
-static int sel4rpc_handle_ioport(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+/* Serialise calls into simple, for servers whose simple is shared between threads */
+static void sel4rpc_simple_lock(sel4rpc_server_env_t *env)
+{
+    if (env->simple_lock) {
+        sync_mutex_lock(env->simple_lock);
+    }
+}
+
+static void sel4rpc_simple_unlock(sel4rpc_server_env_t *env)
+{
+    if (env->simple_lock) {
+        sync_mutex_unlock(env->simple_lock);
+    }
+}
+
+static int sel4rpc_handle_ioport(sel4rpc_server_env_t *env, RpcMessage *rpcMsg, sel4rpc_result_t *res)
 {
-    cspacepath_t path;
     int error;
-    error = vka_cspace_alloc_path(env->vka, &path);
+    error = vka_cspace_alloc_path(env->vka, &res->path);
     if (error) {
         ZF_LOGE("Failed to alloc path: %d\n", error);
-        sel4rpc_server_reply(env, 0, 1, 0);
+        res->path.capPtr = seL4_CapNull;
+        res->errorCode = 1;
         return -1;
     }
 
+    sel4rpc_simple_lock(env);
     seL4_Error err = simple_get_IOPort_cap(env->simple, rpcMsg->msg.ioport.start, rpcMsg->msg.ioport.end,
-                                           path.root, path.capPtr, path.capDepth);
+                                           res->path.root, res->path.capPtr, res->path.capDepth);
+    sel4rpc_simple_unlock(env);
     if (err != seL4_NoError) {
-        vka_cspace_free_path(env->vka, path);
-        sel4rpc_server_reply(env, 0, 1, 0);
+        res->errorCode = 1;
         return err;
     }
 
-    seL4_SetCap(0, path.capPtr);
-    int ret = sel4rpc_server_reply(env, 1, 0, 0);
-
-    vka_cnode_delete(&path);
-    vka_cspace_free_path(env->vka, path);
-    return ret;
+    return 0;
 }
 
-static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, RpcMessage *rpcMsg, sel4rpc_result_t *res)
 {
     cspacepath_t path;
     int error;
     error = vka_cspace_alloc_path(env->vka, &path);
     if (error) {
         ZF_LOGE("Failed to alloc path: %d\n", error);
-        sel4rpc_server_reply(env, 0, 1, 0);
+        res->errorCode = 1;
         return -1;
     }
+    res->path = path;
 
     seL4_Error err = seL4_InvalidArgument;
+    sel4rpc_simple_lock(env);
     switch (rpcMsg->msg.irq.which_type) {
     case IrqAllocMessage_msi_tag: {
         /* x86 MSI IRQ */
@@ -128,43 +155,79 @@ static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
         break;
     }
     default:
+        sel4rpc_simple_unlock(env);
         ZF_LOGE("Unknown IRQ type");
-        vka_cspace_free_path(env->vka, path);
+        res->errorCode = 1;
         return -1;
     }
+    sel4rpc_simple_unlock(env);
 
     if (err != seL4_NoError) {
-        vka_cspace_free_path(env->vka, path);
-        sel4rpc_server_reply(env, 0, 1, 0);
+        res->errorCode = 1;
         return err;
     }
 
-    seL4_SetCap(0, path.capPtr);
-    int ret = sel4rpc_server_reply(env, 1, 0, 0);
-
-    vka_cnode_delete(&path);
-    vka_cspace_free_path(env->vka, path);
-    return ret;
+    return 0;
 }
 
-int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
+static int sel4rpc_handle(sel4rpc_server_env_t *env, RpcMessage *rpcMsg, sel4rpc_result_t *res)
 {
-    cspacepath_t path;
-    path.capPtr = seL4_CapNull;
+    *res = (sel4rpc_result_t) {
+        .path.capPtr = seL4_CapNull
+    };
+
     switch (rpcMsg->which_msg) {
     case RpcMessage_memory_tag:
-        return sel4rpc_handle_memory(env, rpcMsg);
+        return sel4rpc_handle_memory(env, rpcMsg, res);
     case RpcMessage_ioport_tag:
-        return sel4rpc_handle_ioport(env, rpcMsg);
+        return sel4rpc_handle_ioport(env, rpcMsg, res);
     case RpcMessage_irq_tag:
-        return sel4rpc_handle_irq(env, rpcMsg);
+        return sel4rpc_handle_irq(env, rpcMsg, res);
     default:
         ZF_LOGE("Not sure what to do!");
+        res->errorCode = 1;
     }
 
     return -1;
 }
 
+/* Release the slot of a result, and the cap in it if it wasn't handed over */
+static void sel4rpc_result_free(sel4rpc_server_env_t *env, sel4rpc_result_t *res)
+{
+    if (res->path.capPtr != seL4_CapNull) {
+        vka_cnode_delete(&res->path);
+        vka_cspace_free_path(env->vka, res->path);
+        res->path.capPtr = seL4_CapNull;
+    }
+}
+
+/* Undo a request whose cap couldn't be handed over */
+static void sel4rpc_result_undo(sel4rpc_server_env_t *env, RpcMessage *rpcMsg, sel4rpc_result_t *res)
+{
+    sel4rpc_result_free(env, res);
+    if (rpcMsg->which_msg == RpcMessage_memory_tag && rpcMsg->msg.memory.action == Action_ALLOCATE) {
+        vka_utspace_free(env->vka, rpcMsg->msg.memory.type, rpcMsg->msg.memory.size_bits, res->cookie);
+    }
+    res->errorCode = 1;
+    res->cookie = 0;
+}
+
+int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
+{
+    sel4rpc_result_t res;
+    int err = sel4rpc_handle(env, rpcMsg, &res);
+
+    int caps = 0;
+    if (res.errorCode == 0 && res.path.capPtr != seL4_CapNull) {
+        seL4_SetCap(0, res.path.capPtr);
+        caps = 1;
+    }
+    int ret = sel4rpc_server_reply(env, caps, res.errorCode, res.cookie);
+
+    sel4rpc_result_free(env, &res);
+    return err ? err : ret;
+}
+
 int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
                         sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple)
 {
@@ -173,11 +236,45 @@ int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
     env->handler = handler_func;
     env->data = data;
     env->simple = simple;
+    env->simple_lock = NULL;
+    env->cnode_path.capPtr = seL4_CapNull;
+    env->badge = 0;
+    env->label = SEL4RPC_ENC_PROTOBUF;
+    env->shmem = NULL;
+    env->shmem_size = 0;
+    env->shmem_badge = 0;
+    return 0;
+}
+
+int sel4rpc_server_set_shmem(sel4rpc_server_env_t *env, void *shmem, size_t size, seL4_Word badge)
+{
+    env->shmem = shmem;
+    env->shmem_size = size;
+    env->shmem_badge = badge;
     return 0;
 }
 
-int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie)
+/* The shared region of the client that sent the request being handled, NULL if it has none */
+static void *client_shmem(sel4rpc_server_env_t *env)
+{
+    return env->badge == env->shmem_badge ? env->shmem : NULL;
+}
+
+/* Whether the request being handled has a fixed layout, and so gets a reply with one */
+static bool request_is_fixed(sel4rpc_server_env_t *env)
 {
+    return env->label != SEL4RPC_ENC_PROTOBUF && env->label != SEL4RPC_ENC_NEGOTIATE;
+}
+
+int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, seL4_Word cookie)
+{
+    if (request_is_fixed(env)) {
+        seL4_SetMR(0, errorCode);
+        seL4_SetMR(1, cookie);
+        api_reply(env->reply->cptr, seL4_MessageInfo_new(SEL4RPC_ENC_RET, 0, caps, 2));
+        return 0;
+    }
+
     pb_ostream_t ostream = pb_ostream_from_IPC(0);
     RpcMessage rpcMsg;
     rpcMsg.which_msg = RpcMessage_ret_tag;
@@ -205,21 +302,235 @@ int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int
     return 0;
 }
 
-int sel4rpc_server_recv(sel4rpc_server_env_t *env)
+/* The slot of the CNode sent with a batch that the cap of request i goes into */
+static cspacepath_t batch_slot(sel4rpc_server_env_t *env, BatchMessage *batch, size_t i)
 {
-    RpcMessage rpcMsg;
-    pb_istream_t stream = pb_istream_from_IPC(1);
-    bool ret = pb_decode_delimited(&stream, &RpcMessage_msg, &rpcMsg);
+    cspacepath_t path = {
+        .root = env->cnode_path.capPtr,
+        .capPtr = batch->index + i,
+        .capDepth = batch->depth,
+    };
+    return path;
+}
+
+/* Undo the requests of a batch that succeeded, taking back the caps handed over */
+static void sel4rpc_batch_undo(sel4rpc_server_env_t *env, BatchMessage *batch, RpcMessage *requests,
+                               sel4rpc_result_t *results, bool *moved, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].errorCode) {
+            continue;
+        }
+        if (moved[i]) {
+            cspacepath_t slot = batch_slot(env, batch, i);
+            vka_cnode_delete(&slot);
+        }
+        if (requests[i].which_msg == RpcMessage_memory_tag && requests[i].msg.memory.action == Action_ALLOCATE) {
+            vka_utspace_free(env->vka, requests[i].msg.memory.type, requests[i].msg.memory.size_bits,
+                             results[i].cookie);
+        }
+    }
+}
+
+/*
+ * Handle a batch of requests, moving the caps of the replies into the CNode
+ * sent with the batch and answering them all with one reply
+ */
+static int sel4rpc_server_batch(sel4rpc_server_env_t *env, pb_istream_t *stream, BatchMessage *batch)
+{
+    RpcMessage requests[SEL4RPC_BATCH_MAX];
+    sel4rpc_result_t results[SEL4RPC_BATCH_MAX];
+    bool moved[SEL4RPC_BATCH_MAX];
+    size_t count = batch->count;
+
+    if (env->cnode_path.capPtr == seL4_CapNull) {
+        ZF_LOGE("No slot to receive the CNode of a batch");
+        sel4rpc_server_reply(env, 0, 1, 0);
+        return -1;
+    }
+    if (count > SEL4RPC_BATCH_MAX) {
+        ZF_LOGE("Batch of %zu requests is too large", count);
+        sel4rpc_server_reply(env, 0, 1, 0);
+        return -1;
+    }
+
+    /* Decode the whole batch first, as handling a request can overwrite the IPC buffer */
+    for (size_t i = 0; i < count; i++) {
+        if (!pb_decode_delimited(stream, &RpcMessage_msg, &requests[i])) {
+            ZF_LOGE("Invalid protobuf stream in batch (%s)", PB_GET_ERROR(stream));
+            sel4rpc_server_reply(env, 0, 1, 0);
+            return -1;
+        }
+    }
+
+    int err = 0;
+    for (size_t i = 0; i < count; i++) {
+        sel4rpc_result_t *res = &results[i];
+        moved[i] = false;
+        int error = sel4rpc_handle(env, &requests[i], res);
+        if (!error && res->path.capPtr != seL4_CapNull) {
+            cspacepath_t dest = batch_slot(env, batch, i);
+            error = vka_cnode_move(&dest, &res->path);
+            if (error) {
+                ZF_LOGE("Failed to move cap into slot %"PRIu64": %d", batch->index + i, error);
+                sel4rpc_result_undo(env, &requests[i], res);
+            } else {
+                vka_cspace_free_path(env->vka, res->path);
+                res->path.capPtr = seL4_CapNull;
+                moved[i] = true;
+            }
+        }
+        sel4rpc_result_free(env, res);
+        if (error && !err) {
+            err = error;
+        }
+    }
+
+    /* The replies go through the shared region if they might not fit in the IPC buffer */
+    bool shared = client_shmem(env) && BATCH_HEADER_MAX + count * BATCH_REPLY_MAX > pb_size_of_IPC(0);
+    pb_ostream_t ostream = shared ? pb_ostream_from_buffer(env->shmem, env->shmem_size) :
+                           pb_ostream_from_IPC(0);
+    RpcMessage rpcMsg = {
+        .which_msg = RpcMessage_batch_tag,
+        .msg.batch.count = count,
+    };
+    bool ret = pb_encode_delimited(&ostream, &RpcMessage_msg, &rpcMsg);
+    for (size_t i = 0; ret && i < count; i++) {
+        rpcMsg.which_msg = RpcMessage_ret_tag;
+        rpcMsg.msg.ret.errorCode = results[i].errorCode;
+        rpcMsg.msg.ret.cookie = results[i].cookie;
+        ret = pb_encode_delimited(&ostream, &RpcMessage_msg, &rpcMsg);
+    }
+    if (ret && shared) {
+        rpcMsg.which_msg = RpcMessage_shmem_tag;
+        rpcMsg.msg.shmem.length = ostream.bytes_written;
+        ostream = pb_ostream_from_IPC(0);
+        ret = pb_encode_delimited(&ostream, &RpcMessage_msg, &rpcMsg);
+    }
     if (!ret) {
-        ZF_LOGE("Invalid protobuf stream (%s)", PB_GET_ERROR(&stream));
+        /* The client can't tell which requests succeeded, so none of them do */
+        ZF_LOGE("Failed to encode batch reply (%s)", PB_GET_ERROR(&ostream));
+        sel4rpc_batch_undo(env, batch, requests, results, moved, count);
+        vka_cnode_delete(&env->cnode_path);
+        sel4rpc_server_reply(env, 0, 1, 0);
         return -1;
     }
+    vka_cnode_delete(&env->cnode_path);
 
+    size_t size = ostream.bytes_written / sizeof(seL4_Word);
+    if (ostream.bytes_written % sizeof(seL4_Word)) {
+        size++;
+    }
+
+    api_reply(env->reply->cptr, seL4_MessageInfo_new(0, 0, 0, size));
+
+    return err;
+}
+
+/* Pass a single request to the handler */
+static int sel4rpc_server_handle(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+{
     int err = 0;
     if (env->handler) {
-        err = env->handler(env, env->data, &rpcMsg);
+        err = env->handler(env, env->data, rpcMsg);
     } else {
-        err = sel4rpc_default_handler(env, NULL, &rpcMsg);
+        err = sel4rpc_default_handler(env, NULL, rpcMsg);
     }
     return err;
 }
+
+int sel4rpc_server_recv(sel4rpc_server_env_t *env)
+{
+    RpcMessage rpcMsg;
+    pb_istream_t stream;
+    if (request_is_fixed(env)) {
+        /* fast path: one message register per field */
+        if (sel4rpc_fixed_decode(env->label, REQUEST_HEADER_WORDS, &rpcMsg)) {
+            ZF_LOGE("Unknown message encoding %"PRIuPTR, (uintptr_t) env->label);
+            sel4rpc_server_reply(env, 0, 1, 0);
+            return -1;
+        }
+        return sel4rpc_server_handle(env, &rpcMsg);
+    }
+
+    stream = pb_istream_from_IPC(REQUEST_HEADER_WORDS);
+    bool ret = pb_decode_delimited(&stream, &RpcMessage_msg, &rpcMsg);
+    if (!ret) {
+        ZF_LOGE("Invalid protobuf stream (%s)", PB_GET_ERROR(&stream));
+        sel4rpc_server_reply(env, 0, 1, 0);
+        return -1;
+    }
+
+    if (rpcMsg.which_msg == RpcMessage_shmem_tag) {
+        /* The message itself is in the shared region, decode all of it before anything can overwrite it */
+        if (!client_shmem(env)) {
+            ZF_LOGE("Shared message from %"PRIuPTR", which has no shared region", (uintptr_t) env->badge);
+            sel4rpc_server_reply(env, 0, 1, 0);
+            return -1;
+        }
+        if (rpcMsg.msg.shmem.length > env->shmem_size) {
+            ZF_LOGE("Message of %u bytes is outside the shared region", (unsigned) rpcMsg.msg.shmem.length);
+            sel4rpc_server_reply(env, 0, 1, 0);
+            return -1;
+        }
+        stream = pb_istream_from_buffer(env->shmem, rpcMsg.msg.shmem.length);
+        ret = pb_decode_delimited(&stream, &RpcMessage_msg, &rpcMsg);
+        if (!ret) {
+            ZF_LOGE("Invalid protobuf stream in shared region (%s)", PB_GET_ERROR(&stream));
+            sel4rpc_server_reply(env, 0, 1, 0);
+            return -1;
+        }
+    }
+
+    if (rpcMsg.which_msg == RpcMessage_shmem_setup_tag) {
+        if (!client_shmem(env)) {
+            ZF_LOGE("Client %"PRIuPTR" offered a shared region, but it has none", (uintptr_t) env->badge);
+            return sel4rpc_server_reply(env, 0, 1, 0);
+        }
+        return sel4rpc_server_reply(env, 0, 0, MIN(rpcMsg.msg.shmem_setup.size, env->shmem_size));
+    }
+
+    if (rpcMsg.which_msg == RpcMessage_features_tag) {
+        /* The fixed layouts are given by the label, only offered if the receive loop passes it on */
+        seL4_Word supported = (env->label == SEL4RPC_ENC_NEGOTIATE) ? SEL4RPC_FEATURE_FIXED : 0;
+        return sel4rpc_server_reply(env, 0, 0, rpcMsg.msg.features.flags & supported);
+    }
+
+    if (rpcMsg.which_msg == RpcMessage_batch_tag) {
+        return sel4rpc_server_batch(env, &stream, &rpcMsg.msg.batch);
+    }
+
+    return sel4rpc_server_handle(env, &rpcMsg);
+}
+
+int sel4rpc_server_run(sel4rpc_server_env_t *env, seL4_CPtr ep)
+{
+    int error = vka_cspace_alloc_path(env->vka, &env->cnode_path);
+    if (error) {
+        ZF_LOGE("Failed to alloc path: %d\n", error);
+        env->cnode_path.capPtr = seL4_CapNull;
+        return -1;
+    }
+
+    while (1) {
+        seL4_SetCapReceivePath(env->cnode_path.root, env->cnode_path.capPtr, env->cnode_path.capDepth);
+        seL4_Word badge;
+        seL4_MessageInfo_t info = api_recv(ep, &badge, env->reply->cptr);
+        env->badge = badge;
+        if (seL4_GetMR(0) != SEL4RPC_MSG_MAGIC) {
+            /* The caller may still be waiting for a reply */
+            ZF_LOGE("Refusing message without the RPC magic from %"PRIuPTR, (uintptr_t) badge);
+            env->label = SEL4RPC_ENC_PROTOBUF;
+            sel4rpc_server_reply(env, 0, 1, 0);
+        } else {
+            env->label = seL4_MessageInfo_get_label(info);
+            sel4rpc_server_recv(env);
+        }
+        /* A cap sent with anything but a batch would block the slot for the next batch */
+        if (seL4_MessageInfo_get_extraCaps(info) && !(seL4_MessageInfo_get_capsUnwrapped(info) & BIT(0))) {
+            vka_cnode_delete(&env->cnode_path);
+        }
+    }
+
+    return 0;
+}
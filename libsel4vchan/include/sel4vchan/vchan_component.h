@@ -11,6 +11,16 @@
 
 typedef void (*callback_func_t)(void *);
 
+/* Events for poll sets */
+#define VCHAN_POLL_IN   BIT(0)
+#define VCHAN_POLL_OUT  BIT(1)
+
+/* A span of a vchan ring, handed out in place by the reserve/peek calls */
+typedef struct vchan_iov {
+    void *base;
+    size_t len;
+} vchan_iov_t;
+
 typedef struct camkes_vchan_con {
     /* Domain */
     int dest_dom_number;
@@ -38,9 +48,141 @@ struct libvchan {
     int server_persists;
     int blocking;
     int domain_num, port_num;
+    /* Ring sizes asked for by a server */
+    size_t read_min, write_min;
 
     camkes_vchan_con_t *con;
+    /* Ring locations, resolved through con->get_buf once per connection */
+    vchan_buf_t *send_buf;
+    vchan_buf_t *recv_buf;
+    /* Numbers of the rings in the connection's vchan_headers_t */
+    int send_ring, recv_ring;
+    /* Counter values at the last alert decision for each ring */
+    uint32_t send_notified, recv_notified;
+    /* Defer send alerts to libvchan_flush */
+    int batch;
 };
 
+/*
+    Set of vchans to wait on together
+        One slot per ring of the connection, indexed by the ring's number in vchan_headers_t.
+        The tables are sized for the connection's rings by libvchan_poll_set_init
+*/
+typedef struct libvchan_poll_set {
+    camkes_vchan_con_t *con;
+    int num_rings;
+    libvchan_t **in;
+    libvchan_t **out;
+    /* Rings to look at on the next wait, as their bits were taken or they were ready last time */
+    uint32_t *pending_in;
+    uint32_t *pending_out;
+} libvchan_poll_set_t;
+
+/* A channel found ready by libvchan_poll_set_wait */
+typedef struct libvchan_poll_event {
+    libvchan_t *ctrl;
+    int events;
+} libvchan_poll_event_t;
+
 libvchan_t *link_vchan_comp(libvchan_t *ctrl, camkes_vchan_con_t *vchan_com);
 vchan_buf_t *get_vchan_buf(vchan_ctrl_t *args, camkes_vchan_con_t *c, int action);
+
+/**
+* Lay out the headers and empty rings of a vchan dataport, for the side that owns it.
+* Must be done before either side connects, which checks the layout version.
+* @param dataport Start of the dataport
+* @param size Size of the dataport, at least vchan_headers_size(num_shared, ring_capacity)
+* @param num_shared Number of shared buffers, each holding the two rings of one vchan
+* @param ring_capacity Largest ring a server can ask for, a power of two of at least a cache line
+* @return -1 on error, otherwise 0
+*/
+int vchan_headers_init(void *dataport, size_t size, size_t num_shared, size_t ring_capacity);
+
+/**
+* Zero-copy send: get the free space of the send ring, to build data in place.
+* Blocks until at least $min bytes (and at least one byte) are free.
+* @param ctrl The vchan control structure
+* @param min Smallest amount of free space to wait for, no larger than the ring
+* @param iov Set to the free space, the second span is only used if the space wraps
+* @return -1 on error, otherwise the number of spans used (1 or 2)
+*/
+int libvchan_write_reserve(libvchan_t *ctrl, size_t min, vchan_iov_t iov[2]);
+
+/**
+* Zero-copy send: pass the first $size bytes of the reserved space to the peer
+* @return -1 on error (more than was reserved), otherwise 0
+*/
+int libvchan_write_commit(libvchan_t *ctrl, size_t size);
+
+/**
+* Zero-copy receive: get the unread data of the receive ring, to parse it in place.
+* Blocks until at least $min bytes (and at least one byte) are ready.
+* @param ctrl The vchan control structure
+* @param min Smallest amount of data to wait for, no larger than the ring
+* @param iov Set to the unread data, the second span is only used if the data wraps
+* @return -1 on error, otherwise the number of spans used (1 or 2)
+*/
+int libvchan_read_peek(libvchan_t *ctrl, size_t min, vchan_iov_t iov[2]);
+
+/**
+* Zero-copy receive: hand the first $size bytes of the peeked data back to the peer
+* @return -1 on error (more than was ready), otherwise 0
+*/
+int libvchan_read_consume(libvchan_t *ctrl, size_t size);
+
+/**
+* Batch sends: while set, writes don't alert the peer until libvchan_flush is
+* called, or the writer has to block. Clearing it flushes.
+*/
+void libvchan_set_batching(libvchan_t *ctrl, int batch);
+
+/**
+* Alert the peer of data sent since the last alert, if it is waiting for it
+*/
+void libvchan_flush(libvchan_t *ctrl);
+
+/**
+* Ask the peer to alert us once the channel has data to read (VCHAN_POLL_IN) or space to write (VCHAN_POLL_OUT).
+* Callers that block on the connection themselves, rather than in the libvchan calls, have to arm the channel
+* first: the peer only alerts on the events that were asked for. libvchan_data_ready and libvchan_buffer_space
+* don't arm anything.
+* @param events Events to be alerted on
+* @return -1 on error, otherwise the events that are ready already, the caller must not block on these
+*/
+int libvchan_arm(libvchan_t *ctrl, int events);
+
+/**
+* Initialise an empty poll set for the channels of a vchan connection, sized for the rings of its dataport.
+* All channels of a set have to share the connection, as the set blocks on its notification.
+* @return -1 on error, otherwise 0
+*/
+int libvchan_poll_set_init(libvchan_poll_set_t *set, camkes_vchan_con_t *con);
+
+/**
+* Free the tables of a poll set
+*/
+void libvchan_poll_set_destroy(libvchan_poll_set_t *set);
+
+/**
+* Add a channel of the set's connection to a poll set, or change the events it is polled for.
+* @param events VCHAN_POLL_IN for data to read, VCHAN_POLL_OUT for space to write, or both
+* @return -1 on error, otherwise 0
+*/
+int libvchan_poll_set_add(libvchan_poll_set_t *set, libvchan_t *ctrl, int events);
+
+/**
+* Remove a channel from a poll set
+*/
+void libvchan_poll_set_remove(libvchan_poll_set_t *set, libvchan_t *ctrl);
+
+/**
+* Block until at least one channel of a poll set is ready.
+* Only channels named by the shared readiness bitmaps, or found ready by the
+* previous call, are looked at while some are ready. A channel ready for both
+* events is listed once for each. Channels closed while in the set are
+* dropped from it.
+* @param ready Array to be filled with the ready channels
+* @param max Number of entries in ready
+* @return -1 on error, otherwise the number of entries filled
+*/
+int libvchan_poll_set_wait(libvchan_poll_set_t *set, libvchan_poll_event_t *ready, size_t max);
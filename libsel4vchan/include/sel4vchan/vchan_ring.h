@@ -0,0 +1,138 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+/*
+    Layout of a vchan ring and the operations both of its sides perform on it
+
+    This header is freestanding, so that peers built outside of seL4 userland can include it too.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+    Version of the vchan_headers_t layout, the first word of the headers. Peers that find another version must
+        not touch the rings. The original layout, fixed 4K rings and no version word, reads as 0 or 1 here
+*/
+#define VCHAN_LAYOUT_VERSION 2
+
+/* Ring size used when the server doesn't ask for a size */
+#define VCHAN_BUF_DEFAULT_SIZE 4096
+
+#define VCHAN_CACHE_LINE_SIZE 64
+
+/*
+    A single producer, single consumer ring
+        read_pos and write_pos are free running byte counters, the ring holds (write_pos - read_pos) bytes.
+        Each side's fields live on their own cache line, so the sides don't false-share.
+
+    Alerts are suppressed event-index style: a side about to block sets its event to the counter value the peer
+    must move past to wake it, and the peer only alerts when an update crosses it. A side that doesn't set
+    VCHAN_EVENT_IDX in its flags is alerted on every update.
+*/
+#define VCHAN_EVENT_IDX (1u << 0)
+
+typedef struct vchan_buf {
+    int owner;
+    /* Bytes of sync_data, a power of two fixed when the headers are laid out */
+    uint32_t capacity;
+    /* Ring size in bytes, a power of two no larger than capacity. 0 if not set by the server */
+    uint32_t size;
+    /* Written by the producer */
+    uint32_t write_pos __attribute__((aligned(VCHAN_CACHE_LINE_SIZE)));
+    /* Alert the producer once read_pos moves past this */
+    uint32_t write_event;
+    uint32_t producer_flags;
+    /* Written by the consumer */
+    uint32_t read_pos __attribute__((aligned(VCHAN_CACHE_LINE_SIZE)));
+    /* Alert the consumer once write_pos moves past this */
+    uint32_t read_event;
+    uint32_t consumer_flags;
+    char sync_data[] __attribute__((aligned(VCHAN_CACHE_LINE_SIZE)));
+} vchan_buf_t;
+
+/* Bytes a ring with room for capacity bytes of data takes */
+static inline size_t vchan_buf_bytes(size_t capacity)
+{
+    return sizeof(vchan_buf_t) + capacity;
+}
+
+/* Size of a ring, rings the server hasn't sized yet use the default size */
+static inline size_t vchan_ring_size(vchan_buf_t *b)
+{
+    uint32_t size = __atomic_load_n(&b->size, __ATOMIC_ACQUIRE);
+    if (size) {
+        return size;
+    }
+    return b->capacity < VCHAN_BUF_DEFAULT_SIZE ? b->capacity : VCHAN_BUF_DEFAULT_SIZE;
+}
+
+/*
+    Bytes in a ring
+        The counters are free running, unsigned subtraction gives the right answer across wraps.
+        Acquire pairs with the release in vchan_ring_advance, data is visible before the counter moves
+*/
+static inline size_t vchan_ring_filled(vchan_buf_t *b)
+{
+    uint32_t write_pos = __atomic_load_n(&b->write_pos, __ATOMIC_ACQUIRE);
+    uint32_t read_pos = __atomic_load_n(&b->read_pos, __ATOMIC_ACQUIRE);
+    return write_pos - read_pos;
+}
+
+/* Bytes the producer (space) or the consumer (data) of a ring can move */
+static inline size_t vchan_ring_avail(vchan_buf_t *b, bool producer)
+{
+    size_t filled = vchan_ring_filled(b);
+    return producer ? vchan_ring_size(b) - filled : filled;
+}
+
+/* Move our counter of a ring on by size bytes, after the data has been copied in or out */
+static inline void vchan_ring_advance(vchan_buf_t *b, bool producer, size_t size)
+{
+    uint32_t *pos = producer ? &b->write_pos : &b->read_pos;
+    __atomic_store_n(pos, *pos + size, __ATOMIC_RELEASE);
+}
+
+/*
+    Ask the peer to alert us once a ring has min bytes of space (producer) or data (consumer), then look again,
+        as the peer may have moved its counter before it could see the event
+*/
+static inline size_t vchan_ring_arm(vchan_buf_t *b, bool producer, size_t min)
+{
+    if (producer) {
+        __atomic_store_n(&b->write_event, b->write_pos + min - vchan_ring_size(b) - 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&b->read_event, b->read_pos + min - 1, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return vchan_ring_avail(b, producer);
+}
+
+/* Whether moving a counter from old to new moved it past event */
+static inline bool vchan_ring_need_event(uint32_t event, uint32_t new, uint32_t old)
+{
+    return (uint32_t)(new - event - 1) < (uint32_t)(new - old);
+}
+
+/* Whether our counter moving on from old since the last alert means the peer has to be alerted */
+static inline bool vchan_ring_peer_waiting(vchan_buf_t *b, bool producer, uint32_t old)
+{
+    /* Order the counter update before reading the peer's event, pairs with the fence in vchan_ring_arm */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t pos, flags, event;
+    if (producer) {
+        pos = b->write_pos;
+        flags = __atomic_load_n(&b->consumer_flags, __ATOMIC_RELAXED);
+        event = __atomic_load_n(&b->read_event, __ATOMIC_RELAXED);
+    } else {
+        pos = b->read_pos;
+        flags = __atomic_load_n(&b->producer_flags, __ATOMIC_RELAXED);
+        event = __atomic_load_n(&b->write_event, __ATOMIC_RELAXED);
+    }
+    return !(flags & VCHAN_EVENT_IDX) || vchan_ring_need_event(event, pos, old);
+}
@@ -11,27 +11,74 @@
 #include <sel4/sel4.h>
 #include <sel4utils/util.h>
 #include <simple/simple.h>
+#include <sel4vchan/vchan_ring.h>
 
 
-#define VCHAN_BUF_SIZE PAGE_SIZE_4K
+/* Shared buffers a dataport is usually laid out with, each holds the two rings of one vchan */
 #define NUM_SHARED_VCHAN_BUFFERS 2
 
-typedef struct vchan_buf {
-    int owner;
-    int read_pos, write_pos;
-    char sync_data[VCHAN_BUF_SIZE];
-} vchan_buf_t;
-
 /*
     Handles managing of packets, storing packets in shared mem,
         copying in memory and reading from memory for sync comms
 */
 typedef struct vchan_shared_mem {
     int alloced;
-    vchan_buf_t bufs[2];
+    /* Byte offsets of the pair's rings from the start of the headers */
+    uint32_t buf_offset[2];
 } vchan_shared_mem_t;
 
+/* Words of a readiness bitmap covering num_rings rings */
+#define VCHAN_READY_WORDS(num_rings) (((num_rings) + 31) / 32)
+
+/*
+    Headers of a vchan dataport, laid out by vchan_headers_init
+        The shared buffer table, the readiness bitmaps and the rings follow the headers, all sized when the
+        headers are laid out. Both sides check version before using anything else
+*/
 typedef struct vchan_shared_mem_headers {
-    vchan_shared_mem_t shared_buffers[NUM_SHARED_VCHAN_BUFFERS];
+    uint32_t version;
     int token;
+    /* Entries in shared_buffers, rings are numbered shared buffer by shared buffer */
+    uint32_t num_shared;
+    /*
+        Byte offset of the readiness bitmaps, data_ready then space_ready, one bit per ring
+            A producer sets its ring's data_ready bit when it alerts the consumer, a consumer sets space_ready
+            when it alerts the producer. Pollers take the bits to find which of many rings changed.
+    */
+    uint32_t ready_offset;
+    vchan_shared_mem_t shared_buffers[];
 } vchan_headers_t;
+
+static inline int vchan_headers_num_rings(vchan_headers_t *headers)
+{
+    return headers->num_shared * 2;
+}
+
+/* A ring of a set of headers, by its number */
+static inline vchan_buf_t *vchan_headers_ring(vchan_headers_t *headers, int ring)
+{
+    return (void *) headers + headers->shared_buffers[ring / 2].buf_offset[ring % 2];
+}
+
+static inline uint32_t *vchan_headers_data_ready(vchan_headers_t *headers)
+{
+    return (void *) headers + headers->ready_offset;
+}
+
+static inline uint32_t *vchan_headers_space_ready(vchan_headers_t *headers)
+{
+    return vchan_headers_data_ready(headers) + VCHAN_READY_WORDS(vchan_headers_num_rings(headers));
+}
+
+/* Bytes of headers, up to the first ring */
+static inline size_t vchan_headers_table_size(size_t num_shared)
+{
+    return ROUND_UP(sizeof(vchan_headers_t) + num_shared * sizeof(vchan_shared_mem_t)
+                    + 2 * VCHAN_READY_WORDS(num_shared * 2) * sizeof(uint32_t), VCHAN_CACHE_LINE_SIZE);
+}
+
+/* Bytes of a dataport laid out with num_shared shared buffers, and rings of ring_capacity bytes each */
+static inline size_t vchan_headers_size(size_t num_shared, size_t ring_capacity)
+{
+    return vchan_headers_table_size(num_shared) + num_shared * 2 * vchan_buf_bytes(ring_capacity);
+}
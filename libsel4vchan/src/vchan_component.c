@@ -5,11 +5,18 @@
  */
 #define __NEED_off_t
 
+#include <stdbool.h>
+#include <limits.h>
+
 #include <sel4vchan/vmm_manager.h>
 #include <sel4vchan/vchan_component.h>
 #include <sel4vchan/vchan_sharemem.h>
 
-static libvchan_t *vchan_init(int domain, int port, int server);
+static libvchan_t *vchan_init(int domain, int port, int server, size_t read_min, size_t write_min);
+static vchan_buf_t *ctrl_buf(libvchan_t *ctrl, int action);
+static int set_ring_size(vchan_buf_t *buf, size_t min);
+static int ring_index(camkes_vchan_con_t *con, vchan_buf_t *b);
+static size_t get_actionsize(int type, size_t size, vchan_buf_t *buf);
 
 /*
     Set up the vchan connection interface
@@ -36,6 +43,22 @@ libvchan_t *link_vchan_comp(libvchan_t *ctrl, camkes_vchan_con_t *vchan_com)
         free(ctrl);
         return NULL;
     }
+    vchan_headers_t *headers = ctrl->con->data_buf;
+    if (headers == NULL || __atomic_load_n(&headers->version, __ATOMIC_ACQUIRE) != VCHAN_LAYOUT_VERSION) {
+        ZF_LOGE("vchan dataport is not laid out as version %d", VCHAN_LAYOUT_VERSION);
+        free(ctrl);
+        return NULL;
+    }
+    /* (Re)connecting may move the rings, resolve them again */
+    ctrl->send_buf = NULL;
+    ctrl->recv_buf = NULL;
+    vchan_buf_t *send_buf = ctrl_buf(ctrl, VCHAN_SEND);
+    vchan_buf_t *recv_buf = ctrl_buf(ctrl, VCHAN_RECV);
+    /* The server picks the ring sizes, the client uses whatever the server picked */
+    if (ctrl->is_server && (set_ring_size(send_buf, ctrl->write_min) || set_ring_size(recv_buf, ctrl->read_min))) {
+        free(ctrl);
+        return NULL;
+    }
     return ctrl;
 }
 
@@ -44,7 +67,7 @@ libvchan_t *link_vchan_comp(libvchan_t *ctrl, camkes_vchan_con_t *vchan_com)
 */
 libvchan_t *libvchan_server_init(int domain, int port, size_t read_min, size_t write_min)
 {
-    return vchan_init(domain, port, 1);
+    return vchan_init(domain, port, 1, read_min, write_min);
 }
 
 /*
@@ -52,13 +75,13 @@ libvchan_t *libvchan_server_init(int domain, int port, size_t read_min, size_t w
 */
 libvchan_t *libvchan_client_init(int domain, int port)
 {
-    return vchan_init(domain, port, 0);
+    return vchan_init(domain, port, 0, 0, 0);
 }
 
 /*
     Create a new client/server instance
 */
-libvchan_t *vchan_init(int domain, int port, int server)
+libvchan_t *vchan_init(int domain, int port, int server, size_t read_min, size_t write_min)
 {
     libvchan_t *new_connection = malloc(sizeof(libvchan_t));
     if (new_connection == NULL) {
@@ -70,6 +93,11 @@ libvchan_t *vchan_init(int domain, int port, int server)
     new_connection->blocking = 1;
     new_connection->domain_num = domain;
     new_connection->port_num = port;
+    new_connection->read_min = read_min;
+    new_connection->write_min = write_min;
+    new_connection->batch = 0;
+    new_connection->send_buf = NULL;
+    new_connection->recv_buf = NULL;
 
     return new_connection;
 }
@@ -134,15 +162,168 @@ vchan_buf_t *get_vchan_ctrl_databuf(libvchan_t *ctrl, int action)
     return get_vchan_buf(&args, ctrl->con, action);
 }
 
+/*
+    Lay out the headers and empty rings of a vchan dataport
+        Done once by the side that owns the dataport, before either side connects
+*/
+int vchan_headers_init(void *dataport, size_t size, size_t num_shared, size_t ring_capacity)
+{
+    if (ring_capacity < VCHAN_CACHE_LINE_SIZE || (ring_capacity & (ring_capacity - 1))) {
+        ZF_LOGE("Ring capacity %zu is not a power of two of at least a cache line", ring_capacity);
+        return -1;
+    }
+    if (num_shared == 0 || num_shared > INT_MAX / 2
+        || ring_capacity > (UINT32_MAX - vchan_headers_table_size(num_shared)) / (num_shared * 2 + 1)) {
+        ZF_LOGE("vchan dataport of %zu shared buffers with %zu byte rings is too large", num_shared, ring_capacity);
+        return -1;
+    }
+    size_t needed = vchan_headers_size(num_shared, ring_capacity);
+    if (size < needed) {
+        ZF_LOGE("vchan dataport of %zu bytes is too small, %zu bytes are needed", size, needed);
+        return -1;
+    }
+
+    vchan_headers_t *headers = dataport;
+    memset(headers, 0, needed);
+    headers->num_shared = num_shared;
+    headers->ready_offset = sizeof(vchan_headers_t) + num_shared * sizeof(vchan_shared_mem_t);
+    size_t offset = vchan_headers_table_size(num_shared);
+    for (int ring = 0; ring < vchan_headers_num_rings(headers); ring++) {
+        headers->shared_buffers[ring / 2].buf_offset[ring % 2] = offset;
+        vchan_headers_ring(headers, ring)->capacity = ring_capacity;
+        offset += vchan_buf_bytes(ring_capacity);
+    }
+    /* Publish the layout only once it is complete */
+    __atomic_store_n(&headers->version, VCHAN_LAYOUT_VERSION, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+    Number of a ring in the connection's headers, for the readiness bitmaps. -1 if it isn't one of them
+*/
+static int ring_index(camkes_vchan_con_t *con, vchan_buf_t *b)
+{
+    vchan_headers_t *headers = con->data_buf;
+    for (int ring = 0; ring < vchan_headers_num_rings(headers); ring++) {
+        if (vchan_headers_ring(headers, ring) == b) {
+            return ring;
+        }
+    }
+    return -1;
+}
+
+/*
+    Cached buffer for a vchan read/write action
+        get_buf is a call into the vchan component, only make it until the buffer has been found
+*/
+static vchan_buf_t *ctrl_buf(libvchan_t *ctrl, int action)
+{
+    vchan_buf_t **cached = (action == VCHAN_SEND) ? &ctrl->send_buf : &ctrl->recv_buf;
+    if (*cached == NULL) {
+        vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, action);
+        int ring = (b == NULL) ? -1 : ring_index(ctrl->con, b);
+        if (ring < 0) {
+            return NULL;
+        }
+        /* We arm events before blocking on this ring, so the peer may skip alerts we aren't waiting for */
+        if (action == VCHAN_SEND) {
+            ctrl->send_ring = ring;
+            ctrl->send_notified = b->write_pos;
+            __atomic_or_fetch(&b->producer_flags, VCHAN_EVENT_IDX, __ATOMIC_RELAXED);
+        } else {
+            ctrl->recv_ring = ring;
+            ctrl->recv_notified = b->read_pos;
+            __atomic_or_fetch(&b->consumer_flags, VCHAN_EVENT_IDX, __ATOMIC_RELAXED);
+        }
+        *cached = b;
+    }
+    return *cached;
+}
+
+/*
+    Size a ring to hold at least min bytes, no more than the capacity it was laid out with
+        Only an empty ring is resized, so a reconnecting server doesn't lose data in flight
+*/
+static int set_ring_size(vchan_buf_t *buf, size_t min)
+{
+    if (buf == NULL) {
+        return 0;
+    }
+    if (min > buf->capacity) {
+        ZF_LOGE("vchan ring of %zu bytes asked for, the dataport has room for %u", min, buf->capacity);
+        return -1;
+    }
+    if (buf->write_pos != buf->read_pos) {
+        return 0;
+    }
+    size_t size = VCHAN_CACHE_LINE_SIZE;
+    while (size < MAX(min, VCHAN_BUF_DEFAULT_SIZE)) {
+        size <<= 1;
+    }
+    __atomic_store_n(&buf->size, MIN(size, buf->capacity), __ATOMIC_RELEASE);
+    return 0;
+}
+
 static size_t get_actionsize(int type, size_t size, vchan_buf_t *buf)
 {
     assert(buf != NULL);
-    size_t filled = abs(buf->write_pos - buf->read_pos);
-    if (type == VCHAN_SEND) {
-        return MIN(VCHAN_BUF_SIZE - filled, size);
-    } else {
-        return MIN(filled, size);
+    return MIN(vchan_ring_avail(buf, type == VCHAN_SEND), size);
+}
+
+/*
+    Alert the peer if our updates to a ring since the last alert moved the counter past the peer's event
+*/
+static void ring_notify(libvchan_t *ctrl, int cmd)
+{
+    vchan_buf_t *b = (cmd == VCHAN_SEND) ? ctrl->send_buf : ctrl->recv_buf;
+    uint32_t *notified = (cmd == VCHAN_SEND) ? &ctrl->send_notified : &ctrl->recv_notified;
+    if (b == NULL) {
+        return;
+    }
+    uint32_t pos = (cmd == VCHAN_SEND) ? b->write_pos : b->read_pos;
+    if (pos == *notified) {
+        return;
+    }
+
+    uint32_t old = *notified;
+    *notified = pos;
+    if (vchan_ring_peer_waiting(b, cmd == VCHAN_SEND, old)) {
+        /* Tell pollers which ring changed, before they can be woken */
+        vchan_headers_t *headers = ctrl->con->data_buf;
+        int ring = (cmd == VCHAN_SEND) ? ctrl->send_ring : ctrl->recv_ring;
+        uint32_t *bitmap = (cmd == VCHAN_SEND) ? vchan_headers_data_ready(headers) : vchan_headers_space_ready(headers);
+        __atomic_fetch_or(&bitmap[ring / 32], BIT(ring % 32), __ATOMIC_RELEASE);
+        ctrl->con->alert();
+    }
+}
+
+/*
+    Our counter of a ring moved, alert the peer unless sends are being batched
+*/
+static void ring_updated(libvchan_t *ctrl, int cmd)
+{
+    if (cmd == VCHAN_RECV || !ctrl->batch) {
+        ring_notify(ctrl, cmd);
+    }
+}
+
+/*
+    Block until a ring has at least min bytes, and at least one byte, of space (send) or data (recv)
+*/
+static size_t ring_wait(libvchan_t *ctrl, vchan_buf_t *b, int cmd, size_t min)
+{
+    min = MAX(min, 1);
+    size_t avail = get_actionsize(cmd, SIZE_MAX, b);
+    while (avail < min) {
+        /* Batched sends have to reach the peer before we block on it */
+        ring_notify(ctrl, VCHAN_SEND);
+        avail = vchan_ring_arm(b, cmd == VCHAN_SEND, min);
+        if (avail < min) {
+            ctrl->con->wait();
+            avail = get_actionsize(cmd, SIZE_MAX, b);
+        }
     }
+    return avail;
 }
 
 /*
@@ -151,8 +332,8 @@ static size_t get_actionsize(int type, size_t size, vchan_buf_t *buf)
 */
 int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int stream)
 {
-    int *update;
-    vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, cmd);
+    uint32_t *update;
+    vchan_buf_t *b = ctrl_buf(ctrl, cmd);
     if (b == NULL) {
         return -1;
     }
@@ -161,7 +342,7 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
         How data is stored in a given vchan buffer
 
         Position of data in buffer is given by
-            (either b->write_pos or b->read_pos) % VCHAN_BUF_SIZE
+            (either b->write_pos or b->read_pos) % ring size, the ring size being a power of two
             read_pos is incremented by x when x bytes are read from the buffer
             write_pos is incremented by x when x bytes are read from the buffer
 
@@ -175,16 +356,12 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
     }
 
 
+    size_t buf_size = vchan_ring_size(b);
     size_t data_sz = size;
     while (data_sz > 0) {
-        size_t call_size = MIN(data_sz, VCHAN_BUF_SIZE);
-        size_t ssize = get_actionsize(cmd, call_size, b);
-        while (ssize == 0) {
-            ctrl->con->wait();
-            ssize = get_actionsize(cmd, call_size, b);
-        }
-
-        call_size = ssize;
+        size_t call_size = MIN(data_sz, buf_size);
+        size_t avail = ring_wait(ctrl, b, cmd, 1);
+        call_size = MIN(avail, call_size);
 
         /*
             Because this buffer is circular,
@@ -192,11 +369,11 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
                 This is achieved by doing two copies, one to buffer end
                 And one at start of buffer for remaining data
         */
-        off_t start = (*update % VCHAN_BUF_SIZE);
+        off_t start = (*update & (buf_size - 1));
         off_t remain = 0;
 
-        if (start + call_size > VCHAN_BUF_SIZE) {
-            remain = (start + call_size) - VCHAN_BUF_SIZE;
+        if (start + call_size > buf_size) {
+            remain = (start + call_size) - buf_size;
             call_size -= remain;
         }
 
@@ -217,45 +394,129 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
             memcpy(data, ((void *) dbuf) + start, call_size);
             memcpy(data + call_size, dbuf, remain);
         }
-        __sync_synchronize();
 
         /*
             Update either the read byte counter or the written byte counter
                 With how much was written or read
+                Release, so the peer sees the copy complete before it sees the counter move
         */
-        *update += (call_size + remain);
+        vchan_ring_advance(b, cmd == VCHAN_SEND, call_size + remain);
+        ring_updated(ctrl, cmd);
         /*
             If stream, we have written as much data as we can in one pass.
                 Otherwise, continue to write data and block block if the buffer is full
         */
         if (stream) {
-            ctrl->con->alert();
             return (call_size + remain);
         } else {
             data_sz -= (call_size + remain);
         }
 
         data = data + (call_size + remain);
-        ctrl->con->alert();
     }
 
     return size;
 }
 
 
+/*
+    Describe len bytes of a ring, starting at counter pos, as at most two spans
+        The second span is only used when the bytes wrap back to the start of the ring
+*/
+static int ring_iov(vchan_buf_t *b, uint32_t pos, size_t len, vchan_iov_t iov[2])
+{
+    size_t buf_size = vchan_ring_size(b);
+    size_t start = pos & (buf_size - 1);
+    size_t first = MIN(len, buf_size - start);
+
+    iov[0].base = b->sync_data + start;
+    iov[0].len = first;
+    iov[1].base = b->sync_data;
+    iov[1].len = len - first;
+    return iov[1].len ? 2 : 1;
+}
+
+/*
+    Hand out the free space (send) or the unread data (recv) of a ring in place
+        Blocks until at least min bytes, and at least one byte, are available
+*/
+static int ring_reserve(libvchan_t *ctrl, int cmd, size_t min, vchan_iov_t iov[2])
+{
+    vchan_buf_t *b = ctrl_buf(ctrl, cmd);
+    if (b == NULL) {
+        return -1;
+    }
+    if (min > vchan_ring_size(b)) {
+        ZF_LOGE("Reservation of %zu bytes is larger than the ring", min);
+        return -1;
+    }
+
+    size_t avail = ring_wait(ctrl, b, cmd, min);
+    uint32_t pos = (cmd == VCHAN_SEND) ? b->write_pos : b->read_pos;
+    return ring_iov(b, pos, avail, iov);
+}
+
+/*
+    Pass size bytes handed out by ring_reserve to the peer, and let it know
+*/
+static int ring_commit(libvchan_t *ctrl, int cmd, size_t size)
+{
+    vchan_buf_t *b = ctrl_buf(ctrl, cmd);
+    if (b == NULL) {
+        return -1;
+    }
+    if (size > get_actionsize(cmd, SIZE_MAX, b)) {
+        ZF_LOGE("Commit of %zu bytes is more than was available", size);
+        return -1;
+    }
+
+    vchan_ring_advance(b, cmd == VCHAN_SEND, size);
+    ring_updated(ctrl, cmd);
+    return 0;
+}
+
+int libvchan_write_reserve(libvchan_t *ctrl, size_t min, vchan_iov_t iov[2])
+{
+    return ring_reserve(ctrl, VCHAN_SEND, min, iov);
+}
+
+int libvchan_write_commit(libvchan_t *ctrl, size_t size)
+{
+    return ring_commit(ctrl, VCHAN_SEND, size);
+}
+
+int libvchan_read_peek(libvchan_t *ctrl, size_t min, vchan_iov_t iov[2])
+{
+    return ring_reserve(ctrl, VCHAN_RECV, min, iov);
+}
+
+int libvchan_read_consume(libvchan_t *ctrl, size_t size)
+{
+    return ring_commit(ctrl, VCHAN_RECV, size);
+}
+
+void libvchan_set_batching(libvchan_t *ctrl, int batch)
+{
+    ctrl->batch = batch;
+    if (!batch) {
+        ring_notify(ctrl, VCHAN_SEND);
+    }
+}
+
+void libvchan_flush(libvchan_t *ctrl)
+{
+    ring_notify(ctrl, VCHAN_SEND);
+}
+
+
 /*
     Wait for data to arrive to a component from a given vchan
 */
 int libvchan_wait(libvchan_t *ctrl)
 {
-    vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, VCHAN_RECV);
+    vchan_buf_t *b = ctrl_buf(ctrl, VCHAN_RECV);
     assert(b != NULL);
-    size_t filled = abs(b->write_pos - b->read_pos);
-    while (filled == 0) {
-        ctrl->con->wait();
-        b = get_vchan_ctrl_databuf(ctrl, VCHAN_RECV);
-        filled = abs(b->write_pos - b->read_pos);
-    }
+    ring_wait(ctrl, b, VCHAN_RECV, 1);
 
     return 0;
 }
@@ -270,6 +531,15 @@ void libvchan_close(libvchan_t *ctrl)
     };
 
     ctrl->con->disconnect(t);
+    /* Whoever uses the rings next may not arm events */
+    if (ctrl->send_buf != NULL) {
+        __atomic_and_fetch(&ctrl->send_buf->producer_flags, ~VCHAN_EVENT_IDX, __ATOMIC_RELAXED);
+    }
+    if (ctrl->recv_buf != NULL) {
+        __atomic_and_fetch(&ctrl->recv_buf->consumer_flags, ~VCHAN_EVENT_IDX, __ATOMIC_RELAXED);
+    }
+    ctrl->send_buf = NULL;
+    ctrl->recv_buf = NULL;
 }
 
 int libvchan_is_open(libvchan_t *ctrl)
@@ -297,11 +567,9 @@ int libvchan_is_eof(libvchan_t *ctrl)
 */
 int libvchan_data_ready(libvchan_t *ctrl)
 {
-    vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, VCHAN_RECV);
+    vchan_buf_t *b = ctrl_buf(ctrl, VCHAN_RECV);
     assert(b != NULL);
-    size_t filled = abs(b->write_pos - b->read_pos);
-
-    return filled;
+    return vchan_ring_filled(b);
 }
 
 /*
@@ -313,9 +581,212 @@ int libvchan_buffer_space(libvchan_t *ctrl)
         return 0;
     }
 
-    vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, VCHAN_SEND);
+    vchan_buf_t *b = ctrl_buf(ctrl, VCHAN_SEND);
     assert(b != NULL);
-    size_t filled = abs(b->write_pos - b->read_pos);
+    return vchan_ring_avail(b, true);
+}
 
-    return VCHAN_BUF_SIZE - filled;
+int libvchan_arm(libvchan_t *ctrl, int events)
+{
+    vchan_buf_t *recv_buf = (events & VCHAN_POLL_IN) ? ctrl_buf(ctrl, VCHAN_RECV) : NULL;
+    vchan_buf_t *send_buf = (events & VCHAN_POLL_OUT) ? ctrl_buf(ctrl, VCHAN_SEND) : NULL;
+    if (((events & VCHAN_POLL_IN) && recv_buf == NULL) || ((events & VCHAN_POLL_OUT) && send_buf == NULL)) {
+        ZF_LOGE("Channel is not connected");
+        return -1;
+    }
+
+    int ready = 0;
+    if (recv_buf != NULL && vchan_ring_arm(recv_buf, false, 1)) {
+        ready |= VCHAN_POLL_IN;
+    }
+    if (send_buf != NULL && vchan_ring_arm(send_buf, true, 1)) {
+        ready |= VCHAN_POLL_OUT;
+    }
+    /* Batched sends have to reach the peer before the caller blocks on it */
+    ring_notify(ctrl, VCHAN_SEND);
+    return ready;
+}
+
+int libvchan_poll_set_init(libvchan_poll_set_t *set, camkes_vchan_con_t *con)
+{
+    memset(set, 0, sizeof(*set));
+    vchan_headers_t *headers = con->data_buf;
+    if (headers == NULL || __atomic_load_n(&headers->version, __ATOMIC_ACQUIRE) != VCHAN_LAYOUT_VERSION) {
+        ZF_LOGE("vchan dataport is not laid out as version %d", VCHAN_LAYOUT_VERSION);
+        return -1;
+    }
+
+    int num_rings = vchan_headers_num_rings(headers);
+    set->in = calloc(num_rings * 2, sizeof(libvchan_t *));
+    set->pending_in = calloc(VCHAN_READY_WORDS(num_rings) * 2, sizeof(uint32_t));
+    if (set->in == NULL || set->pending_in == NULL) {
+        ZF_LOGE("Failed to allocate a poll set for %d rings", num_rings);
+        libvchan_poll_set_destroy(set);
+        return -1;
+    }
+    set->out = set->in + num_rings;
+    set->pending_out = set->pending_in + VCHAN_READY_WORDS(num_rings);
+    set->num_rings = num_rings;
+    set->con = con;
+    return 0;
+}
+
+void libvchan_poll_set_destroy(libvchan_poll_set_t *set)
+{
+    free(set->in);
+    free(set->pending_in);
+    memset(set, 0, sizeof(*set));
+}
+
+int libvchan_poll_set_add(libvchan_poll_set_t *set, libvchan_t *ctrl, int events)
+{
+    if (set->con != ctrl->con) {
+        ZF_LOGE("Channels of a poll set have to share a connection");
+        return -1;
+    }
+    vchan_buf_t *recv_buf = (events & VCHAN_POLL_IN) ? ctrl_buf(ctrl, VCHAN_RECV) : NULL;
+    vchan_buf_t *send_buf = (events & VCHAN_POLL_OUT) ? ctrl_buf(ctrl, VCHAN_SEND) : NULL;
+    if (((events & VCHAN_POLL_IN) && recv_buf == NULL) || ((events & VCHAN_POLL_OUT) && send_buf == NULL)) {
+        ZF_LOGE("Channel is not connected");
+        return -1;
+    }
+
+    libvchan_poll_set_remove(set, ctrl);
+    /* New channels may be ready already, look at them on the next wait */
+    if (recv_buf != NULL) {
+        set->in[ctrl->recv_ring] = ctrl;
+        set->pending_in[ctrl->recv_ring / 32] |= BIT(ctrl->recv_ring % 32);
+    }
+    if (send_buf != NULL) {
+        set->out[ctrl->send_ring] = ctrl;
+        set->pending_out[ctrl->send_ring / 32] |= BIT(ctrl->send_ring % 32);
+    }
+    return 0;
+}
+
+void libvchan_poll_set_remove(libvchan_poll_set_t *set, libvchan_t *ctrl)
+{
+    for (int i = 0; i < set->num_rings; i++) {
+        if (set->in[i] == ctrl) {
+            set->in[i] = NULL;
+        }
+        if (set->out[i] == ctrl) {
+            set->out[i] = NULL;
+        }
+    }
+}
+
+/*
+    Take the bits of the set's rings from a shared readiness bitmap
+        Only our own bits, the peer takes its bits from the same bitmaps
+*/
+static void poll_take_bits(int num_rings, uint32_t *shared, libvchan_t **slots, uint32_t *pending)
+{
+    for (int w = 0; w < VCHAN_READY_WORDS(num_rings); w++) {
+        uint32_t mask = 0;
+        for (int i = 0; i < 32 && w * 32 + i < num_rings; i++) {
+            if (slots[w * 32 + i] != NULL) {
+                mask |= BIT(i);
+            }
+        }
+        if (mask) {
+            pending[w] |= __atomic_fetch_and(&shared[w], ~mask, __ATOMIC_ACQUIRE) & mask;
+        }
+    }
+}
+
+/*
+    Report the pending rings that are ready, forgetting the ones that aren't.
+        Reported rings stay pending, so ready channels the caller doesn't drain are reported again
+*/
+static size_t poll_collect(int num_rings, libvchan_t **slots, uint32_t *pending, int cmd,
+                           libvchan_poll_event_t *ready, size_t n, size_t max)
+{
+    for (int w = 0; w < VCHAN_READY_WORDS(num_rings); w++) {
+        uint32_t bits = pending[w];
+        while (bits) {
+            int ring = w * 32 + CTZ(bits);
+            bits &= bits - 1;
+            libvchan_t *ctrl = slots[ring];
+            vchan_buf_t *b = NULL;
+            if (ctrl != NULL) {
+                b = (cmd == VCHAN_SEND) ? ctrl->send_buf : ctrl->recv_buf;
+            }
+            if (b == NULL || get_actionsize(cmd, SIZE_MAX, b) == 0) {
+                pending[w] &= ~BIT(ring % 32);
+                continue;
+            }
+            if (n < max) {
+                ready[n].ctrl = ctrl;
+                ready[n].events = (cmd == VCHAN_SEND) ? VCHAN_POLL_OUT : VCHAN_POLL_IN;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static size_t poll_scan(libvchan_poll_set_t *set, libvchan_poll_event_t *ready, size_t max)
+{
+    vchan_headers_t *headers = set->con->data_buf;
+    poll_take_bits(set->num_rings, vchan_headers_data_ready(headers), set->in, set->pending_in);
+    poll_take_bits(set->num_rings, vchan_headers_space_ready(headers), set->out, set->pending_out);
+    size_t n = poll_collect(set->num_rings, set->in, set->pending_in, VCHAN_RECV, ready, 0, max);
+    return poll_collect(set->num_rings, set->out, set->pending_out, VCHAN_SEND, ready, n, max);
+}
+
+int libvchan_poll_set_wait(libvchan_poll_set_t *set, libvchan_poll_event_t *ready, size_t max)
+{
+    if (set->con == NULL || max == 0) {
+        return -1;
+    }
+
+    while (true) {
+        size_t n = poll_scan(set, ready, max);
+        if (n) {
+            return n;
+        }
+
+        /*
+         * Nothing is ready: arm every ring, then look at all of them once more before blocking.
+         * Channels closed while in the set have no rings left, drop them
+         */
+        bool armed = false;
+        for (int ring = 0; ring < set->num_rings; ring++) {
+            if (set->in[ring] != NULL && set->in[ring]->recv_buf == NULL) {
+                set->in[ring] = NULL;
+            }
+            if (set->in[ring] != NULL) {
+                vchan_ring_arm(set->in[ring]->recv_buf, false, 1);
+                set->pending_in[ring / 32] |= BIT(ring % 32);
+                armed = true;
+            }
+            if (set->out[ring] != NULL && set->out[ring]->send_buf == NULL) {
+                set->out[ring] = NULL;
+            }
+            if (set->out[ring] != NULL) {
+                vchan_ring_arm(set->out[ring]->send_buf, true, 1);
+                set->pending_out[ring / 32] |= BIT(ring % 32);
+                armed = true;
+            }
+        }
+        if (!armed) {
+            ZF_LOGE("Poll set has no open channels to wait on");
+            return -1;
+        }
+        n = poll_scan(set, ready, max);
+        if (n) {
+            return n;
+        }
+        /* Batched sends have to reach their peers before we block */
+        for (int ring = 0; ring < set->num_rings; ring++) {
+            if (set->in[ring] != NULL) {
+                ring_notify(set->in[ring], VCHAN_SEND);
+            }
+            if (set->out[ring] != NULL) {
+                ring_notify(set->out[ring], VCHAN_SEND);
+            }
+        }
+        set->con->wait();
+    }
 }
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+/***
+ * @module cpuid.h
+ * The x86 cpuid interface provides access to the table of virtualised CPUID leaves presented to a guest VM.
+ * The table is computed from the host CPUID when the VM is initialised and guest CPUID exits are served from
+ * it. Library users can override individual leaves or replace the table to mask features per VM or to present
+ * a common baseline across hosts.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/* The leaf has multiple sub-leaves selected by ecx, and the index must match on lookup */
+#define VM_CPUID_FLAG_SIGNIFICANT_INDEX BIT(0)
+
+/***
+ * @struct vm_cpuid_entry
+ * A single virtualised CPUID leaf
+ * @param {uint32_t} function       CPUID function (eax on input)
+ * @param {uint32_t} index          CPUID sub-leaf (ecx on input), only used with VM_CPUID_FLAG_SIGNIFICANT_INDEX
+ * @param {uint32_t} flags          VM_CPUID_FLAG_* flags for the entry
+ * @param {uint32_t} eax            Value returned to the guest in eax
+ * @param {uint32_t} ebx            Value returned to the guest in ebx
+ * @param {uint32_t} ecx            Value returned to the guest in ecx
+ * @param {uint32_t} edx            Value returned to the guest in edx
+ */
+typedef struct vm_cpuid_entry {
+    uint32_t function;
+    uint32_t index;
+    uint32_t flags;
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} vm_cpuid_entry_t;
+
+/***
+ * @function vm_cpuid_get_entry(vm, function, index, entry)
+ * Get the virtualised CPUID leaf the guest will observe for a given function and index
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uint32_t} function           CPUID function
+ * @param {uint32_t} index              CPUID sub-leaf, ignored for leaves without a significant index
+ * @param {vm_cpuid_entry_t *} entry    Populated with the table entry
+ * @return                              0 on success, -1 if the leaf is not in the table
+ */
+int vm_cpuid_get_entry(vm_t *vm, uint32_t function, uint32_t index, vm_cpuid_entry_t *entry);
+
+/***
+ * @function vm_cpuid_set_entry(vm, entry)
+ * Add or replace a leaf in the VM's CPUID table. An existing entry is replaced if its function, and index
+ * for entries with a significant index, match
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_cpuid_entry_t *} entry    The leaf to install
+ * @return                              0 on success, -1 on error
+ */
+int vm_cpuid_set_entry(vm_t *vm, vm_cpuid_entry_t *entry);
+
+/***
+ * @function vm_cpuid_set_table(vm, entries, num_entries)
+ * Replace the VM's CPUID table with the given set of leaves. Guest CPUID queries for leaves
+ * missing from the table fall back to virtualising the host CPUID
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_cpuid_entry_t *} entries  Array of leaves to install, copied by the call
+ * @param {unsigned int} num_entries    Number of leaves in the array
+ * @return                              0 on success, -1 on error
+ */
+int vm_cpuid_set_table(vm_t *vm, vm_cpuid_entry_t *entries, unsigned int num_entries);
@@ -23,6 +23,8 @@
 typedef struct vm_lapic vm_lapic_t;
 typedef struct i8259 i8259_t;
 typedef struct guest_state guest_state_t;
+typedef struct vm_cpuid_entry vm_cpuid_entry_t;
+typedef struct vm_msr_entry vm_msr_entry_t;
 
 /* Function prototype for vm exit handlers */
 typedef int(*vmexit_handler_ptr)(vm_vcpu_t *vcpu);
@@ -46,6 +48,10 @@ typedef struct vmcall_handler {
  * @param {void *} unhandled_ioport_callback_cookie                     A cookie to supply to the ioport callback
  * @param {vm_io_port_list_t} ioport_list                               List of registered ioport handlers
  * @param {i8259_t *} i8259_gs                                          PIC machine state
+ * @param {vm_cpuid_entry_t *} cpuid_entries                            Virtualised CPUID table, sorted by function and index
+ * @param {unsigned int} cpuid_num_entries                              Number of entries in the CPUID table
+ * @param {vm_msr_entry_t *} msr_entries                                MSR policy table, sorted by MSR number
+ * @param {unsigned int} msr_num_entries                                Number of entries in the MSR policy table
  */
 struct vm_arch {
     vmexit_handler_ptr vmexit_handlers[VM_EXIT_REASON_NUM];
@@ -56,15 +62,64 @@ struct vm_arch {
     void *unhandled_ioport_callback_cookie;
     vm_io_port_list_t ioport_list;
     i8259_t *i8259_gs;
+    vm_cpuid_entry_t *cpuid_entries;
+    unsigned int cpuid_num_entries;
+    vm_msr_entry_t *msr_entries;
+    unsigned int msr_num_entries;
 };
 
+/***
+ * @struct vm_halt_poll
+ * Adaptive halt polling state of an x86 vcpu. After the guest executes HLT the vcpu polls the host notification for
+ * up to `window` cycles before blocking. The window grows when the vcpu is woken up shortly after blocking and
+ * shrinks when it stays halted for longer than `max_window`
+ * @param {uint64_t} window                     Current polling window in cycles
+ * @param {uint64_t} max_window                 Upper bound of the polling window in cycles, 0 disables halt polling
+ * @param {uint64_t} block_start                Timestamp at which the vcpu blocked after an unsuccessful poll
+ * @param {uint64_t} num_halts                  Number of times the vcpu has halted waiting for an interrupt
+ * @param {uint64_t} poll_success               Number of halts ended by an event arriving while polling
+ * @param {uint64_t} poll_fail                  Number of halts in which polling expired and the vcpu blocked
+ * @param {uint64_t} poll_cycles                Total number of cycles spent polling
+ */
+typedef struct vm_halt_poll {
+    uint64_t window;
+    uint64_t max_window;
+    uint64_t block_start;
+    uint64_t num_halts;
+    uint64_t poll_success;
+    uint64_t poll_fail;
+    uint64_t poll_cycles;
+} vm_halt_poll_t;
+
 /***
  * @struct vm_vcpu_arch
  * Structure representing x86 specific vcpu properties
  * @param {guest_state_t *} guest_state         Current VCPU State
  * @param {vm_lapic_t *} lapic                  VM local apic
+ * @param {vm_halt_poll_t} halt_poll            Adaptive halt polling state and statistics
  */
 struct vm_vcpu_arch {
     guest_state_t *guest_state;
     vm_lapic_t *lapic;
+    vm_halt_poll_t halt_poll;
 };
+
+/***
+ * @function vm_set_halt_poll_max(vcpu, max_cycles)
+ * Set the upper bound of the adaptive halt polling window of a vcpu. The initial value is taken from
+ * LibSel4VMHaltPollMaxCycles
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {uint64_t} max_cycles     Maximum number of cycles to poll for after a HLT, 0 to disable halt polling
+ * @return                          0 on success, -1 on error
+ */
+int vm_set_halt_poll_max(vm_vcpu_t *vcpu, uint64_t max_cycles);
+
+/***
+ * @function vm_get_halt_poll_stats(vcpu, stats)
+ * Get a snapshot of the halt polling state and statistics of a vcpu. The polling success rate is
+ * `poll_success / (poll_success + poll_fail)`
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {vm_halt_poll_t *} stats  Populated with the current halt polling state
+ * @return                          0 on success, -1 on error
+ */
+int vm_get_halt_poll_stats(vm_vcpu_t *vcpu, vm_halt_poll_t *stats);
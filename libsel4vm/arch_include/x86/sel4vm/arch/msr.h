@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+/***
+ * @module msr.h
+ * The x86 msr interface provides a per-VM policy table describing how guest RDMSR and WRMSR instructions are
+ * handled. Each MSR is either passed through to the state the kernel saves and restores for the vcpu, emulated
+ * with a callback, or presented as a constant. MSRs without an entry raise a general protection fault in the
+ * guest. A default table is installed when the VM is initialised and library users can extend or override it.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Type signature of an MSR read callback
+ * @param {vm_vcpu_t *} vcpu        A handle to the VCPU performing the RDMSR
+ * @param {uint32_t} msr            MSR number being read
+ * @param {uint64_t *} value        Populated with the value returned to the guest
+ * @param {void *} cookie           The cookie registered with the MSR
+ * @return                          0 on success, otherwise -1 to raise a general protection fault in the guest
+ */
+typedef int (*vm_msr_read_fn)(vm_vcpu_t *vcpu, uint32_t msr, uint64_t *value, void *cookie);
+
+/**
+ * Type signature of an MSR write callback
+ * @param {vm_vcpu_t *} vcpu        A handle to the VCPU performing the WRMSR
+ * @param {uint32_t} msr            MSR number being written
+ * @param {uint64_t} value          Value written by the guest
+ * @param {void *} cookie           The cookie registered with the MSR
+ * @return                          0 on success, otherwise -1 to raise a general protection fault in the guest
+ */
+typedef int (*vm_msr_write_fn)(vm_vcpu_t *vcpu, uint32_t msr, uint64_t value, void *cookie);
+
+typedef enum vm_msr_policy {
+    /* Accesses go to the MSR state the kernel saves and restores for the vcpu */
+    VM_MSR_PASSTHROUGH,
+    /* Accesses are handled by the read and write callbacks. A NULL callback raises a fault */
+    VM_MSR_EMULATED,
+    /* Reads return the constant value and writes are ignored */
+    VM_MSR_CONSTANT,
+    /* Reads return the constant value and writes raise a fault */
+    VM_MSR_CONSTANT_READ_ONLY,
+} vm_msr_policy_t;
+
+/***
+ * @struct vm_msr_entry
+ * Policy for handling guest accesses to a single MSR
+ * @param {uint32_t} msr                MSR number
+ * @param {vm_msr_policy_t} policy      How accesses to the MSR are handled
+ * @param {uint64_t} value              Value returned for VM_MSR_CONSTANT and VM_MSR_CONSTANT_READ_ONLY MSRs
+ * @param {vm_msr_read_fn} read         Read callback for VM_MSR_EMULATED MSRs
+ * @param {vm_msr_write_fn} write       Write callback for VM_MSR_EMULATED MSRs
+ * @param {void *} cookie               A cookie to supply to the callbacks
+ */
+typedef struct vm_msr_entry {
+    uint32_t msr;
+    vm_msr_policy_t policy;
+    uint64_t value;
+    vm_msr_read_fn read;
+    vm_msr_write_fn write;
+    void *cookie;
+} vm_msr_entry_t;
+
+/***
+ * @function vm_register_msr(vm, entry)
+ * Add an MSR to the VM's policy table, replacing any existing entry for the same MSR
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_msr_entry_t *} entry      The MSR policy to install, copied by the call
+ * @return                              0 on success, -1 on error
+ */
+int vm_register_msr(vm_t *vm, vm_msr_entry_t *entry);
+
+/***
+ * @function vm_unregister_msr(vm, msr)
+ * Remove an MSR from the VM's policy table. Subsequent guest accesses raise a general protection fault
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uint32_t} msr                MSR number to remove
+ * @return                              0 on success, -1 if the MSR is not in the table
+ */
+int vm_unregister_msr(vm_t *vm, uint32_t msr);
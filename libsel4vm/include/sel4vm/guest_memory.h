@@ -32,12 +32,14 @@ typedef struct vm_vcpu vm_vcpu_t;
  * @param {seL4_CapRights_t} rights     Mapping rights of frame
  * @param {uintptr_t} vaddr             Virtual address of which to map the frame into
  * @param {size_t} size_bits            Size of frame in bits
+ * @param {uintptr_t} cookie            Allocator cookie of frame's untyped, freed with the frame. 0 if none
  */
 typedef struct vm_frame {
     seL4_CPtr cptr; /** Capability to frame */
     seL4_CapRights_t rights; /** Mapping rights of frame */
     uintptr_t vaddr; /** Virtual address of which to map the frame into */
     size_t size_bits; /** Size of frame in bits */
+    uintptr_t cookie; /** Allocator cookie of frame's untyped, freed with the frame. 0 if none */
 } vm_frame_t;
 
 /**
@@ -183,12 +185,83 @@ size_t vm_reservation_size(vm_memory_reservation_t *reservation);
 
 /***
  * @function vm_reservation_page_size_bits(reservation)
- * Get size of pages in bits mapped on the reservation
+ * Get size of pages in bits mapped on the reservation. A reservation may be backed by frames of
+ * different sizes, in which case this is the size of the smallest one
  * @param {vm_memory_reservation_t *} reservation           Pointer to reservation object
  * @return                                                  Size of pages in bits, 0 if not mapped yet
  */
 size_t vm_reservation_page_size_bits(vm_memory_reservation_t *reservation);
 
+/***
+ * @function vm_reservation_page_size_bits_at(reservation, addr)
+ * Get size of the page in bits mapped at a given address of the reservation
+ * @param {vm_memory_reservation_t *} reservation           Pointer to reservation object
+ * @param {uintptr_t} addr                                  Guest address within the reservation
+ * @return                                                  Size of page in bits, 0 if addr is not mapped
+ */
+size_t vm_reservation_page_size_bits_at(vm_memory_reservation_t *reservation, uintptr_t addr);
+
+/***
+ * @function vm_set_dirty_log(reservation, enable)
+ * Enable or disable dirty page logging on a reservation. While enabled, the reservation's frames are mapped
+ * without write rights and the first write to each frame is recorded before write access is restored.
+ * Writes are logged at the granularity of the frame backing them, and DMA through an IO space is not logged
+ * @param {vm_memory_reservation_t *} reservation           Pointer to reservation object
+ * @param {bool} enable                                     True to start logging, false to stop
+ * @return                                                  0 on success, -1 on failure
+ */
+int vm_set_dirty_log(vm_memory_reservation_t *reservation, bool enable);
+
+/***
+ * @function vm_dirty_log_bitmap_size(reservation)
+ * Get the size of the bitmap filled in by `vm_get_dirty_log`
+ * @param {vm_memory_reservation_t *} reservation           Pointer to reservation object
+ * @return                                                  Size of the bitmap in bytes
+ */
+size_t vm_dirty_log_bitmap_size(vm_memory_reservation_t *reservation);
+
+/***
+ * @function vm_get_dirty_log(reservation, bitmap, clear)
+ * Get the pages of a reservation written since the log was last cleared. Bit n of the bitmap, counting from
+ * the least significant bit of the first word, represents the nth 4K page of the reservation
+ * @param {vm_memory_reservation_t *} reservation           Pointer to reservation object
+ * @param {unsigned long *} bitmap                          Buffer of `vm_dirty_log_bitmap_size` bytes to fill, or NULL
+ * @param {bool} clear                                      Clear the log and write protect the logged pages again
+ * @return                                                  0 on success, -1 on failure
+ */
+int vm_get_dirty_log(vm_memory_reservation_t *reservation, unsigned long *bitmap, bool clear);
+
+/***
+ * @function vm_memory_log_write(vm, addr, size)
+ * Log a write the VMM made to guest memory through its own mapping, which bypasses the write protection used
+ * for dirty logging. Writes made with `vm_ram_touch` or through a writable `vm_ram_map` mapping are logged
+ * already. This does nothing unless dirty logging is enabled
+ * @param {vm_t *} vm                                       A handle to the VM
+ * @param {uintptr_t} addr                                  Guest address written to
+ * @param {size_t} size                                     Number of bytes written
+ */
+void vm_memory_log_write(vm_t *vm, uintptr_t addr, size_t size);
+
+/***
+ * @function vm_memory_prefault(vm, max_bytes)
+ * Map up to max_bytes of lazily mapped reservations ahead of the guest faulting on them. This is
+ * intended to be called from the VMM's event loop while it would otherwise be idle. It must not
+ * run concurrently with other memory operations on the same VM.
+ * @param {vm_t *} vm                                       A handle to the VM
+ * @param {size_t} max_bytes                                Bytes to map, rounded up to whole chunks
+ * @return                                                  -1 on failure, 1 if more may be left to map, otherwise 0
+ */
+int vm_memory_prefault(vm_t *vm, size_t max_bytes);
+
+/***
+ * @function vm_memory_page_size_bits(vm, addr)
+ * Get size of the page in bits backing a given guest address
+ * @param {vm_t *} vm                                       A handle to the VM
+ * @param {uintptr_t} addr                                  Guest address
+ * @return                                                  Size of page in bits, 0 if addr is not mapped
+ */
+size_t vm_memory_page_size_bits(vm_t *vm, uintptr_t addr);
+
 /***
  * @function vm_reservation_is_mapped(reservation)
  * Check if reservation is mapped
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @module guest_merge.h
+ * The libsel4vm page merging interface deduplicates identical guest RAM pages, within a VM and across the VMs
+ * run by the same VMM. A scanner hashes the 4K pages of each registered VM's RAM, and pages whose contents are
+ * identical, and did not change between two passes of the scanner, are remapped read-only onto a single shared
+ * frame. Their own frames are returned to the allocator. A guest write to a merged page faults, and the page is
+ * given a private copy of the shared frame before the write is restarted. Writes made by the VMM through
+ * `vm_ram_touch` copy the page first in the same way. Scanning is incremental, the VMM calls `vm_merge_scan`
+ * with a page budget between runs of the guests, e.g. from a periodic timer, which bounds both the time spent
+ * scanning and the rate at which pages are merged. Pages backed by frames larger than 4K are not merged, nor
+ * are pages of VMs being dirty logged. Merging must not be enabled for VMs with devices passed through that
+ * DMA into guest RAM.
+ */
+
+typedef struct vm_merge vm_merge_t;
+
+/***
+ * @struct vm_merge_stats
+ * Page merging statistics
+ * @param {size_t} pages_shared             Number of shared frames in use
+ * @param {size_t} pages_sharing            Number of guest pages mapped onto shared frames. The memory saved is
+ *                                          pages_sharing - pages_shared pages
+ * @param {size_t} pages_scanned            Number of pages scanned
+ * @param {size_t} full_scans               Number of complete passes over the registered guest RAM
+ * @param {size_t} cow_breaks               Number of merged pages copied again on a write
+ */
+typedef struct vm_merge_stats {
+    size_t pages_shared;
+    size_t pages_sharing;
+    size_t pages_scanned;
+    size_t full_scans;
+    size_t cow_breaks;
+} vm_merge_stats_t;
+
+/***
+ * @function vm_merge_create(vka, vmm_vspace)
+ * Create a page merging instance. The VMs registered with it must be run by the same VMM, allocating from the
+ * same cspace
+ * @param {vka_t *} vka                 Allocator for the shared frames
+ * @param {vspace_t *} vmm_vspace       The VMM's vspace, into which shared frames are mapped while in use
+ * @return                              A handle to the page merging instance, NULL on error
+ */
+vm_merge_t *vm_merge_create(vka_t *vka, vspace_t *vmm_vspace);
+
+/***
+ * @function vm_merge_add_vm(merge, vm)
+ * Register the RAM of a VM for page merging. The VM's RAM must be registered before the VM is added, and must
+ * not be freed afterwards
+ * @param {vm_merge_t *} merge          A handle to the page merging instance
+ * @param {vm_t *} vm                   A handle to the VM
+ * @return                              0 on success, -1 on error
+ */
+int vm_merge_add_vm(vm_merge_t *merge, vm_t *vm);
+
+/***
+ * @function vm_merge_scan(merge, max_pages)
+ * Scan up to max_pages pages of the registered guest RAM, merging identical pages, continuing from where the
+ * previous scan stopped. The guests must not be running while scanning
+ * @param {vm_merge_t *} merge          A handle to the page merging instance
+ * @param {size_t} max_pages            Maximum number of pages to scan
+ * @return                              0 on success, -1 on error
+ */
+int vm_merge_scan(vm_merge_t *merge, size_t max_pages);
+
+/***
+ * @function vm_merge_get_stats(merge, stats)
+ * Get the page merging statistics
+ * @param {vm_merge_t *} merge          A handle to the page merging instance
+ * @param {vm_merge_stats_t *} stats    Pointer to be filled with the statistics
+ */
+void vm_merge_get_stats(vm_merge_t *merge, vm_merge_stats_t *stats);
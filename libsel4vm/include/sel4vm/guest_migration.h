@@ -0,0 +1,72 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_snapshot.h>
+
+/***
+ * @module guest_migration.h
+ * The libsel4vm migration interface sends a running VM to another VMM instance using iterative pre-copy.
+ * All of the guest RAM is sent while the guest keeps running, then the pages the guest dirtied in the meantime
+ * are sent again, round after round, until few enough pages are dirtied in a round. The VMM then stops the
+ * vcpus and completes the migration, sending the last dirty pages along with the vcpu and device state. The
+ * migration is written to a `vm_snapshot_stream_t` using the snapshot stream format, so the receiving VMM
+ * restores it into a freshly created VM with `vm_snapshot_restore`. The migration is driven by the VMM between
+ * runs of the guest, and must not run concurrently with other memory operations on the same VM.
+ */
+
+typedef struct vm_migration vm_migration_t;
+
+/***
+ * @struct vm_migration_params
+ * Parameters controlling when pre-copy stops iterating
+ * @param {size_t} stop_bytes               Stop iterating once a round dirties no more than this many bytes
+ * @param {unsigned int} max_rounds         Stop iterating after this many rounds following the initial copy
+ */
+typedef struct vm_migration_params {
+    size_t stop_bytes;
+    unsigned int max_rounds;
+} vm_migration_params_t;
+
+/***
+ * @function vm_migration_start(vm, stream, params)
+ * Start migrating a VM, enabling dirty logging on the guest RAM and sending all of it to the stream.
+ * The guest can keep running throughout
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_snapshot_stream_t *} stream       Stream to send the VM to
+ * @param {vm_migration_params_t *} params      Parameters controlling when pre-copy stops iterating
+ * @return                                      Handle to the migration, NULL on error
+ */
+vm_migration_t *vm_migration_start(vm_t *vm, vm_snapshot_stream_t *stream, vm_migration_params_t *params);
+
+/***
+ * @function vm_migration_iterate(migration)
+ * Send the guest RAM dirtied since the previous round. Iterating stops being worthwhile once a round dirties
+ * no more than `stop_bytes`, once `max_rounds` have been sent, or once the guest dirties pages at least as fast
+ * as they are sent
+ * @param {vm_migration_t *} migration          Handle to the migration
+ * @return                                      -1 on error, 1 if the VM should now be stopped and the migration
+ *                                              completed, otherwise 0
+ */
+int vm_migration_iterate(vm_migration_t *migration);
+
+/***
+ * @function vm_migration_complete(migration)
+ * Complete a migration by sending the remaining dirty RAM and the vcpu and device state. The VM's vcpus must
+ * be stopped, i.e. the VMM is not running the VM. The migration handle is freed, whether or not this succeeds
+ * @param {vm_migration_t *} migration          Handle to the migration
+ * @return                                      0 on success, -1 on error
+ */
+int vm_migration_complete(vm_migration_t *migration);
+
+/***
+ * @function vm_migration_abort(migration)
+ * Abandon a migration, disabling dirty logging and freeing the migration handle. The guest can keep running
+ * @param {vm_migration_t *} migration          Handle to the migration
+ */
+void vm_migration_abort(vm_migration_t *migration);
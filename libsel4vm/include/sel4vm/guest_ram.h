@@ -65,6 +65,65 @@ int vm_guest_ram_write_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, siz
  */
 int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie);
 
+/***
+ * @function vm_ram_touch_readonly(vm, addr, size, touch_callback, cookie)
+ * Touch a series of pages in the guest vm for reading and invoke a callback for each page accessed. Unlike
+ * vm_ram_touch, pages merged with other guests stay shared, so the callback must not write to them
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {uintptr_t} addr                  Address to access in the guest vm
+ * @param {size_t} size                     Size of memory region to access
+ * @param {ram_touch_callback_fn} callback  Callback to invoke on each page access
+ * @param {void *} cookie                   User data to pass onto callback
+ * @return                                  0 on success, -1 on error
+ */
+int vm_ram_touch_readonly(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie);
+
+/***
+ * @struct vm_ram_mapping
+ * A range of guest RAM mapped contiguously into the VMM's vspace by `vm_ram_map`
+ * @param {void *} vaddr                    Address in the VMM's vspace at which the start of the range is mapped
+ * @param {uintptr_t} addr                  Guest physical address of the start of the range
+ * @param {size_t} size                     Size of the range
+ * @param {bool} write                      Whether the range is mapped for writing
+ * @param {void *} base                     Start of the VMM reservation holding the mapping
+ * @param {uintptr_t} guest_base            Guest physical address mapped at base
+ * @param {uintptr_t} mapped_end            End of the frames mapped so far
+ * @param {reservation_t} reservation       Reservation in the VMM's vspace
+ */
+typedef struct vm_ram_mapping {
+    void *vaddr;
+    uintptr_t addr;
+    size_t size;
+    bool write;
+    void *base;
+    uintptr_t guest_base;
+    uintptr_t mapped_end;
+    reservation_t reservation;
+} vm_ram_mapping_t;
+
+/***
+ * @function vm_ram_map(vm, addr, size, write, mapping)
+ * Map a range of guest RAM contiguously into the VMM's vspace, so that it can be accessed as a single buffer
+ * rather than a page at a time through `vm_ram_touch`. Each frame backing the range is mapped once, whatever
+ * its size. As with `vm_ram_touch`, a range mapped for writing gets frames of its own in place of any merged or
+ * zero pages. The range must not be released or merged until it is unmapped
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {uintptr_t} addr                  Guest physical address of the range
+ * @param {size_t} size                     Size of the range
+ * @param {bool} write                      Map the range for writing, otherwise it is mapped read-only
+ * @param {vm_ram_mapping_t *} mapping      Mapping to be initialised
+ * @return                                  -1 on failure, otherwise 0 for success
+ */
+int vm_ram_map(vm_t *vm, uintptr_t addr, size_t size, bool write, vm_ram_mapping_t *mapping);
+
+/***
+ * @function vm_ram_unmap(vm, mapping)
+ * Unmap a range of guest RAM mapped with `vm_ram_map`, logging it as written if it was mapped for writing
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vm_ram_mapping_t *} mapping      Mapping to be removed
+ */
+void vm_ram_unmap(vm_t *vm, vm_ram_mapping_t *mapping);
+
 /***
  * @function vm_ram_find_largest_free_region(vm, addr, size)
  * Find the largest free ram region
@@ -135,6 +194,44 @@ uintptr_t vm_ram_allocate(vm_t *vm, size_t bytes);
  */
 void vm_ram_free(vm_t *vm, uintptr_t start, size_t bytes);
 
+/***
+ * @function vm_ram_release(vm, start, bytes, released)
+ * Return the frames backing a range of guest RAM to the allocator, e.g. for memory the guest has given
+ * up to a balloon device. Only frames lying entirely within the range are released. The range remains
+ * RAM, a later access faults in fresh frames a page at a time. RAM registered with
+ * `vm_ram_register_at_custom_iterator` is never released and counts as zero bytes
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} start         Starting guest physical address of the range being released
+ * @param {size_t} bytes            The size of the range being released
+ * @param {size_t *} released       Pointer to be set with the number of bytes returned to the allocator
+ * @return                          -1 on failure, otherwise 0 for success
+ */
+int vm_ram_release(vm_t *vm, uintptr_t start, size_t bytes, size_t *released);
+
+/***
+ * @function vm_ram_enable_zero_pages(vm, pool_size)
+ * Back untouched pages of RAM registered from now on with a single read-only frame of zeros, so that memory
+ * the guest never writes to is not given frames of its own. A page gets its own frame on its first write,
+ * taken from a pool of frames zeroed ahead of time by `vm_ram_refill_zero_pool`. Applies to RAM registered
+ * with `vm_ram_register`, or with `vm_ram_register_at` when not using untyped memory. Such RAM is backed by
+ * 4K frames only
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {size_t} pool_size        Number of zeroed frames the pool holds when full
+ * @return                          -1 on failure, otherwise 0 for success
+ */
+int vm_ram_enable_zero_pages(vm_t *vm, size_t pool_size);
+
+/***
+ * @function vm_ram_refill_zero_pool(vm, max_pages)
+ * Zero frames for the pool used by `vm_ram_enable_zero_pages`, so that first writes to zero pages don't wait for a
+ * frame to be allocated and cleared. Intended to be called by the VMM when idle, e.g. from its event loop or a
+ * timer. When the pool runs dry, frames are zeroed on the fault path instead
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {size_t} max_pages        Maximum number of frames to zero in this call
+ * @return                          -1 on failure, 1 if the pool is still short of its size, otherwise 0
+ */
+int vm_ram_refill_zero_pool(vm_t *vm, size_t max_pages);
+
 /***
  * @function vm_ram_reserve(vm, bytes)
  * Reserve a region of memory for guest RAM
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @module guest_snapshot.h
+ * The libsel4vm snapshot interface saves the state of a stopped VM to a byte stream and restores it into another
+ * VM instance. A snapshot holds the guest RAM, the state of each vcpu and the state of any devices registered
+ * with `vm_snapshot_register_device`. The stream is a sequence of self describing records, so it can be written
+ * to or read from a file, dataport or channel without buffering the whole image. Guest RAM pages that are zero,
+ * or were never mapped, are recorded without their contents. Other pages are not compressed, a stream that
+ * wants compression has to apply it in its write and read functions.
+ */
+
+/* Device ids from VM_SNAPSHOT_DEVICE_RESERVED up are used by the devices libsel4vm and
+ * libsel4vmmplatsupport register themselves */
+#define VM_SNAPSHOT_DEVICE_RESERVED 0x80000000u
+#define VM_SNAPSHOT_DEVICE_I8259 (VM_SNAPSHOT_DEVICE_RESERVED + 0)
+#define VM_SNAPSHOT_DEVICE_VGIC (VM_SNAPSHOT_DEVICE_RESERVED + 1)
+/* virtio devices are told apart by their I/O port base */
+#define VM_SNAPSHOT_DEVICE_VIRTIO(iobase) (VM_SNAPSHOT_DEVICE_RESERVED + 0x10000 + ((iobase) & 0xffff))
+
+/**
+ * Type signature of a snapshot stream write function
+ * @param {void *} cookie       User cookie supplied with the stream
+ * @param {const void *} buf    Data to write
+ * @param {size_t} len          Number of bytes to write
+ * @return                      0 if all len bytes were written, -1 on error
+ */
+typedef int (*vm_snapshot_write_fn)(void *cookie, const void *buf, size_t len);
+
+/**
+ * Type signature of a snapshot stream read function
+ * @param {void *} cookie       User cookie supplied with the stream
+ * @param {void *} buf          Buffer to read into
+ * @param {size_t} len          Number of bytes to read
+ * @return                      0 if exactly len bytes were read, -1 on error
+ */
+typedef int (*vm_snapshot_read_fn)(void *cookie, void *buf, size_t len);
+
+/***
+ * @struct vm_snapshot_stream
+ * Byte stream a snapshot is written to or read from
+ * @param {vm_snapshot_write_fn} write      Write function, required when saving
+ * @param {vm_snapshot_read_fn} read        Read function, required when restoring
+ * @param {void *} cookie                   User cookie passed to the write and read functions
+ */
+typedef struct vm_snapshot_stream {
+    vm_snapshot_write_fn write;
+    vm_snapshot_read_fn read;
+    void *cookie;
+} vm_snapshot_stream_t;
+
+/**
+ * Type signature of a device state save function, invoked when saving a snapshot
+ * @param {vm_t *} vm           A handle to the VM
+ * @param {void *} state        Buffer of the registered state size to save the device state into
+ * @param {void *} cookie       User cookie supplied on registration
+ * @return                      0 on success, -1 on error
+ */
+typedef int (*vm_snapshot_save_fn)(vm_t *vm, void *state, void *cookie);
+
+/**
+ * Type signature of a device state restore function, invoked when restoring a snapshot
+ * @param {vm_t *} vm           A handle to the VM
+ * @param {const void *} state  Device state previously saved by the device's save function
+ * @param {void *} cookie       User cookie supplied on registration
+ * @return                      0 on success, -1 on error
+ */
+typedef int (*vm_snapshot_restore_fn)(vm_t *vm, const void *state, void *cookie);
+
+/***
+ * @function vm_snapshot_register_device(vm, id, state_size, save, restore, cookie)
+ * Register a device whose state is saved and restored along with the VM. Devices are matched up between
+ * the saved and restored VM by their id, so each device must be registered with the same id and state size
+ * on both sides. Ids from VM_SNAPSHOT_DEVICE_RESERVED up are reserved for the library's own devices
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {uint32_t} id                         Identifier of the device, unique within the VM
+ * @param {size_t} state_size                   Size of the device state in bytes
+ * @param {vm_snapshot_save_fn} save            Function to save the device state
+ * @param {vm_snapshot_restore_fn} restore      Function to restore the device state
+ * @param {void *} cookie                       User cookie to pass onto the save and restore functions
+ * @return                                      0 on success, -1 on error
+ */
+int vm_snapshot_register_device(vm_t *vm, uint32_t id, size_t state_size, vm_snapshot_save_fn save,
+                                vm_snapshot_restore_fn restore, void *cookie);
+
+/***
+ * @function vm_snapshot_save(vm, stream)
+ * Save a snapshot of the VM to a stream. The VM's vcpus must be stopped, i.e. the VMM is not running the VM
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_snapshot_stream_t *} stream       Stream to write the snapshot to
+ * @return                                      0 on success, -1 on error
+ */
+int vm_snapshot_save(vm_t *vm, vm_snapshot_stream_t *stream);
+
+/***
+ * @function vm_snapshot_restore(vm, stream)
+ * Restore a snapshot into the VM. The VM must have been created with the same number of vcpus, RAM layout
+ * and registered devices as the saved VM, and its RAM must not have been written yet, as zero pages are
+ * not written back
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_snapshot_stream_t *} stream       Stream to read the snapshot from
+ * @return                                      0 on success, -1 on error
+ */
+int vm_snapshot_restore(vm_t *vm, vm_snapshot_stream_t *stream);
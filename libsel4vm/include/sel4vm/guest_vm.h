@@ -126,6 +126,8 @@ struct vm_tcb {
  * @param {int} target_cpu                  The target core the vcpu is assigned to
  * @param {bool} vcpu_online                Flag representing if the vcpu has been started
  * @param {struct vm_vcpu_arch} vcpu_arch   Architecture specific vcpu properties
+ * @param {vm_memory_reservation_t *} last_fault_reservation    Reservation of the last memory fault, checked first
+ * @param {unsigned int} last_fault_generation                  Reservation generation the cached entry is valid for
  */
 struct vm_vcpu {
     /* Parent vm */
@@ -142,6 +144,9 @@ struct vm_vcpu {
     bool vcpu_online;
     /* Architecture specfic vcpu */
     struct vm_vcpu_arch vcpu_arch;
+    /* Last reservation faulted on, valid while the generation matches */
+    vm_memory_reservation_t *last_fault_reservation;
+    unsigned int last_fault_generation;
 };
 
 /***
@@ -182,6 +187,8 @@ struct vm_cspace {
  * @param {ps_io_ops_t *} io_ops        Handle to platforms io ops
  * @param {simple_t *} simple           Handle to hosts simple environment
  * @param {seL4_Word} entry             Entry address for the loaded kernel
+ * @param {struct vm_snapshot_device *} snapshot_devices  Devices registered for saving in snapshots
+ * @param {unsigned int} num_snapshot_devices       Number of devices registered for saving in snapshots
  * @param {char *} vm_name              String used to describe VM. Useful for debugging
  * @param {unsigned int} vm_id          Identifier for VM. Useful for debugging
  * @param {bool} vm_initialised         Boolean flagging whether VM is intialised or not
@@ -208,6 +215,10 @@ struct vm {
     /* vm entry address */
     seL4_Word entry;
 
+    /* Devices saved and restored with snapshots */
+    struct vm_snapshot_device *snapshot_devices;
+    unsigned int num_snapshot_devices;
+
     /* Debugging & Identification */
     char *vm_name;
     unsigned int vm_id;
@@ -25,8 +25,10 @@ uintptr_t vm_arm_ipa_to_pa(vm_t *vm, uintptr_t ipa_base, size_t size)
             return 0;
         }
         /* Find mapping size */
-        bits = vspace_get_cookie(vspace, (void *)ipa);
-        assert(bits == 12 || bits == 21);
+        bits = vm_memory_page_size_bits(vm, ipa);
+        if (!bits) {
+            return 0;
+        }
         /* Find the physical address */
         ret = seL4_ARM_Page_GetAddress(cap);
         if (ret.error) {
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#include <sel4/sel4.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/arch/guest_arm_context.h>
+
+#include "guest_snapshot.h"
+
+typedef struct vcpu_snapshot {
+    seL4_UserContext context;
+    uintptr_t vcpu_regs[seL4_VCPUReg_Num];
+} vcpu_snapshot_t;
+
+size_t vm_snapshot_vcpu_size_arch(void)
+{
+    return sizeof(vcpu_snapshot_t);
+}
+
+int vm_snapshot_save_vcpu_arch(vm_vcpu_t *vcpu, void *state)
+{
+    vcpu_snapshot_t *snapshot = state;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    int err = vm_get_thread_context(vcpu, &snapshot->context);
+    if (err) {
+        return -1;
+    }
+    for (int i = 0; i < seL4_VCPUReg_Num; i++) {
+        err = vm_get_arm_vcpu_reg(vcpu, i, &snapshot->vcpu_regs[i]);
+        if (err) {
+            ZF_LOGE("Failed to save vcpu: Unable to read vcpu register %d", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vm_snapshot_restore_vcpu_arch(vm_vcpu_t *vcpu, const void *state)
+{
+    const vcpu_snapshot_t *snapshot = state;
+
+    for (int i = 0; i < seL4_VCPUReg_Num; i++) {
+        int err = vm_set_arm_vcpu_reg(vcpu, i, snapshot->vcpu_regs[i]);
+        if (err) {
+            ZF_LOGE("Failed to restore vcpu: Unable to write vcpu register %d", i);
+            return -1;
+        }
+    }
+    return vm_set_thread_context(vcpu, snapshot->context);
+}
@@ -47,7 +47,7 @@ int handle_page_fault(vm_t *vm, vm_vcpu_t *vcpu, fault_t *fault)
     uintptr_t addr = fault_get_address(fault);
     size_t fault_size = fault_get_width_size(fault);
 
-    memory_fault_result_t fault_result = vm_memory_handle_fault(vm, vcpu, addr, fault_size);
+    memory_fault_result_t fault_result = vm_memory_handle_fault(vm, vcpu, addr, fault_size, fault_is_write(fault));
     switch (fault_result) {
     case FAULT_HANDLED:
         return 0;
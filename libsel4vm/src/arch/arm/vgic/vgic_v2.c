@@ -49,6 +49,7 @@
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_irq_controller.h>
+#include <sel4vm/guest_snapshot.h>
 #include <sel4vm/guest_vm_util.h>
 
 #include "vgicv2_defs.h"
@@ -283,6 +284,89 @@ static vm_frame_t vgic_vcpu_iterator(uintptr_t addr, void *cookie)
     return frame_result;
 }
 
+/* Saved vGIC state. IRQs in the list registers and queues are pending in the distributor, so they
+ * are injected again from there on restore */
+struct vgic_snapshot {
+    struct gic_dist_map dist;
+    struct {
+        int virq;
+        int level;
+    } spis[NUM_SLOTS_SPI_VIRQ];
+    int local_levels[CONFIG_MAX_NUM_NODES][NUM_VCPU_LOCAL_VIRQS];
+};
+
+static int vgic_snapshot_save(vm_t *vm, void *state, void *cookie)
+{
+    struct vgic_snapshot *snapshot = state;
+    vgic_t *vgic = vgic_dist->vgic;
+
+    memcpy(&snapshot->dist, vgic->dist, sizeof(snapshot->dist));
+    for (int i = 0; i < ARRAY_SIZE(vgic->vspis); i++) {
+        virq_handle_t virq = vgic->vspis[i];
+        snapshot->spis[i].virq = virq ? virq->virq : -1;
+        snapshot->spis[i].level = virq ? virq->level : 0;
+    }
+    for (int i = 0; i < ARRAY_SIZE(vgic->vgic_vcpu); i++) {
+        for (int j = 0; j < NUM_VCPU_LOCAL_VIRQS; j++) {
+            virq_handle_t virq = vgic->vgic_vcpu[i].local_virqs[j];
+            snapshot->local_levels[i][j] = virq ? virq->level : 0;
+        }
+    }
+    return 0;
+}
+
+static int vgic_snapshot_inject_pending(vgic_t *vgic, vm_vcpu_t *vcpu, int irq)
+{
+    if (!is_pending(vgic->dist, irq, vcpu->vcpu_id) || !is_enabled(vgic->dist, irq, vcpu->vcpu_id)
+        || !virq_find_irq_data(vgic, vcpu, irq)) {
+        return 0;
+    }
+    set_pending(vgic->dist, irq, false, vcpu->vcpu_id);
+    return vgic_dist_set_pending_irq(vgic, vcpu, irq);
+}
+
+static int vgic_snapshot_restore(vm_t *vm, const void *state, void *cookie)
+{
+    const struct vgic_snapshot *snapshot = state;
+    vgic_t *vgic = vgic_dist->vgic;
+
+    memcpy(vgic->dist, &snapshot->dist, sizeof(*vgic->dist));
+    for (int i = 0; i < ARRAY_SIZE(snapshot->spis); i++) {
+        if (snapshot->spis[i].virq < 0) {
+            continue;
+        }
+        virq_handle_t virq = virq_find_spi_irq_data(vgic, snapshot->spis[i].virq);
+        if (!virq) {
+            ZF_LOGE("Failed to restore vGIC: virq %d is not registered", snapshot->spis[i].virq);
+            return -1;
+        }
+        virq->level = snapshot->spis[i].level;
+    }
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vm->vcpus[i]->vcpu_id);
+        for (int j = 0; j < NUM_VCPU_LOCAL_VIRQS; j++) {
+            if (vgic_vcpu->local_virqs[j]) {
+                vgic_vcpu->local_virqs[j]->level = snapshot->local_levels[vm->vcpus[i]->vcpu_id][j];
+            }
+        }
+    }
+
+    /* The list registers of the new vcpus are empty, load the pending IRQs into them */
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        for (int irq = 0; irq < NUM_VCPU_LOCAL_VIRQS; irq++) {
+            if (vgic_snapshot_inject_pending(vgic, vm->vcpus[i], irq)) {
+                return -1;
+            }
+        }
+    }
+    for (int i = 0; i < ARRAY_SIZE(vgic->vspis) && vm->num_vcpus; i++) {
+        if (vgic->vspis[i] && vgic_snapshot_inject_pending(vgic, vm->vcpus[0], vgic->vspis[i]->virq)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /*
  * 1) completely virtual the distributor
  * 2) remap vcpu to cpu. Full access
@@ -315,10 +399,16 @@ int vm_install_vgic(vm_t *vm)
     vgic_dist->vgic = vgic;
     vgic_dist_reset(vgic_dist);
 
+    int err = vm_snapshot_register_device(vm, VM_SNAPSHOT_DEVICE_VGIC, sizeof(struct vgic_snapshot),
+                                          vgic_snapshot_save, vgic_snapshot_restore, NULL);
+    if (err) {
+        return -1;
+    }
+
     /* Remap VCPU to CPU */
     vm_memory_reservation_t *vgic_vcpu_reservation = vm_reserve_memory_at(vm, GIC_CPU_PADDR, PAGE_SIZE_4K,
                                                                           handle_vgic_vcpu_fault, NULL);
-    int err = vm_map_reservation(vm, vgic_vcpu_reservation, vgic_vcpu_iterator, (void *)vm);
+    err = vm_map_reservation(vm, vgic_vcpu_reservation, vgic_vcpu_iterator, (void *)vm);
     if (err) {
         free(vgic_dist->vgic);
         return -1;
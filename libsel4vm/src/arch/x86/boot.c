@@ -27,9 +27,12 @@
 #include "guest_memory.h"
 #include "guest_state.h"
 #include "vmcs.h"
+#include "halt.h"
 #include "processor/decode.h"
 #include "processor/apicdef.h"
+#include "processor/cpuid.h"
 #include "processor/lapic.h"
+#include "processor/msr.h"
 #include "processor/platfeature.h"
 
 #define VM_VMCS_CR0_MASK           (X86_CR0_PG | X86_CR0_PE)
@@ -212,6 +215,16 @@ int vm_init_arch(vm_t *vm)
     vm->arch.ioport_list.num_ioports = 0;
     vm->arch.ioport_list.ioports = NULL;
 
+    /* Compute the CPUID leaves the guest will see once, rather than on every exit */
+    err = vm_cpuid_init(vm);
+    if (err) {
+        return -1;
+    }
+    err = vm_msr_init(vm);
+    if (err) {
+        return -1;
+    }
+
     /* Create an EPT which is the pd for all the vcpu tcbs */
     err = vka_alloc_ept_pml4(vm->vka, &vm->mem.vm_vspace_root);
     if (err) {
@@ -246,6 +259,7 @@ int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
     assert(err == seL4_NoError);
     /* All LAPICs are created enabled, in virtual wire mode */
     vm_create_lapic(vcpu, 1);
+    vm_halt_poll_init(vcpu);
     vcpu->vcpu_arch.guest_state = calloc(1, sizeof(guest_state_t));
     if (!vcpu->vcpu_arch.guest_state) {
         return -1;
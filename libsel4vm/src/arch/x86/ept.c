@@ -24,6 +24,7 @@
 #define EPT_VIOL_READ(qual) ((qual) & BIT(0))
 #define EPT_VIOL_WRITE(qual) ((qual) & BIT(1))
 #define EPT_VIOL_FETCH(qual) ((qual) & BIT(2))
+#define EPT_VIOL_READABLE(qual) ((qual) & BIT(3))
 
 void print_ept_violation(vm_vcpu_t *vcpu)
 {
@@ -75,16 +76,28 @@ int vm_ept_violation_handler(vm_vcpu_t *vcpu)
         return VM_EXIT_HANDLE_ERROR;
     }
 
+    if (write && EPT_VIOL_READABLE(qualification)) {
+        /* A write to mapped memory, check for dirty logging before decoding */
+        memory_fault_result_t dirty_result = vm_memory_handle_dirty_fault(vcpu->vm, vcpu, guest_phys);
+        if (dirty_result == FAULT_RESTART) {
+            return VM_EXIT_HANDLED;
+        } else if (dirty_result == FAULT_ERROR) {
+            print_ept_violation(vcpu);
+            return -1;
+        }
+    }
+
     int reg;
     seL4_Word imm;
     int size;
     vm_decode_ept_violation(vcpu, &reg, &imm, &size);
-    memory_fault_result_t fault_result = vm_memory_handle_fault(vcpu->vm, vcpu, guest_phys, size);
+    memory_fault_result_t fault_result = vm_memory_handle_fault(vcpu->vm, vcpu, guest_phys, size, write);
     switch (fault_result) {
     case FAULT_ERROR:
         print_ept_violation(vcpu);
         return -1;
     case FAULT_HANDLED:
+    case FAULT_RESTART:
         return VM_EXIT_HANDLED;
     case FAULT_IGNORE:
         vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
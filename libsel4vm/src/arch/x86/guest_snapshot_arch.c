@@ -0,0 +1,195 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/vmcs_fields.h>
+
+#include "guest_snapshot.h"
+#include "guest_state.h"
+#include "vmcs.h"
+#include "processor/lapic.h"
+#include "processor/apicdef.h"
+#include "processor/msr.h"
+
+/* Guest state held in the VMCS, the instruction pointer and entry controls are kept
+ * by the VMM in the guest state and handed to the kernel on every VMEnter */
+static const seL4_Word snapshot_vmcs_fields[] = {
+    VMX_GUEST_ES_SELECTOR, VMX_GUEST_CS_SELECTOR, VMX_GUEST_SS_SELECTOR, VMX_GUEST_DS_SELECTOR,
+    VMX_GUEST_FS_SELECTOR, VMX_GUEST_GS_SELECTOR, VMX_GUEST_LDTR_SELECTOR, VMX_GUEST_TR_SELECTOR,
+    VMX_GUEST_ES_LIMIT, VMX_GUEST_CS_LIMIT, VMX_GUEST_SS_LIMIT, VMX_GUEST_DS_LIMIT,
+    VMX_GUEST_FS_LIMIT, VMX_GUEST_GS_LIMIT, VMX_GUEST_LDTR_LIMIT, VMX_GUEST_TR_LIMIT,
+    VMX_GUEST_ES_ACCESS_RIGHTS, VMX_GUEST_CS_ACCESS_RIGHTS, VMX_GUEST_SS_ACCESS_RIGHTS, VMX_GUEST_DS_ACCESS_RIGHTS,
+    VMX_GUEST_FS_ACCESS_RIGHTS, VMX_GUEST_GS_ACCESS_RIGHTS, VMX_GUEST_LDTR_ACCESS_RIGHTS, VMX_GUEST_TR_ACCESS_RIGHTS,
+    VMX_GUEST_ES_BASE, VMX_GUEST_CS_BASE, VMX_GUEST_SS_BASE, VMX_GUEST_DS_BASE,
+    VMX_GUEST_FS_BASE, VMX_GUEST_GS_BASE, VMX_GUEST_LDTR_BASE, VMX_GUEST_TR_BASE,
+    VMX_GUEST_GDTR_BASE, VMX_GUEST_GDTR_LIMIT, VMX_GUEST_IDTR_BASE, VMX_GUEST_IDTR_LIMIT,
+    VMX_GUEST_CR0, VMX_GUEST_CR3, VMX_GUEST_CR4,
+    VMX_CONTROL_CR0_MASK, VMX_CONTROL_CR4_MASK, VMX_CONTROL_CR0_READ_SHADOW, VMX_CONTROL_CR4_READ_SHADOW,
+    VMX_GUEST_RSP, VMX_GUEST_RFLAGS, VMX_GUEST_INTERRUPTABILITY, VMX_GUEST_ACTIVITY,
+    VMX_GUEST_SYSENTER_CS, VMX_GUEST_SYSENTER_ESP, VMX_GUEST_SYSENTER_EIP,
+    VMX_GUEST_DR7, VMX_GUEST_PENDING_DEBUG_EXCEPTIONS, VMX_CONTROL_ENTRY_EXCEPTION_ERROR_CODE,
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    VMX_GUEST_EFER,
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+};
+
+#define NUM_SNAPSHOT_VMCS_FIELDS ARRAY_SIZE(snapshot_vmcs_fields)
+
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+/* Guest MSRs the kernel keeps outside the VMCS and switches with the vcpu */
+static const seL4_Word snapshot_msrs[] = {
+    MSR_STAR, MSR_LSTAR, MSR_CSTAR, MSR_SYSCALL_MASK, MSR_SHADOW_GS_BASE,
+};
+
+#define NUM_SNAPSHOT_MSRS ARRAY_SIZE(snapshot_msrs)
+
+static int snapshot_read_msrs(seL4_CPtr vcpu, seL4_Word *values)
+{
+    for (int i = 0; i < NUM_SNAPSHOT_MSRS; i++) {
+        seL4_X86_VCPU_ReadMSR_t result = seL4_X86_VCPU_ReadMSR(vcpu, snapshot_msrs[i]);
+        if (result.error != seL4_NoError) {
+            ZF_LOGE("Failed to read MSR 0x"SEL4_PRIx_word, snapshot_msrs[i]);
+            return -1;
+        }
+        values[i] = result.value;
+    }
+    return 0;
+}
+
+static int snapshot_write_msrs(seL4_CPtr vcpu, const seL4_Word *values)
+{
+    for (int i = 0; i < NUM_SNAPSHOT_MSRS; i++) {
+        seL4_X86_VCPU_WriteMSR_t result = seL4_X86_VCPU_WriteMSR(vcpu, snapshot_msrs[i], values[i]);
+        if (result.error != seL4_NoError) {
+            ZF_LOGE("Failed to write MSR 0x"SEL4_PRIx_word, snapshot_msrs[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+
+typedef struct vcpu_snapshot {
+    seL4_VCPUContext context;
+    seL4_Word vmcs[NUM_SNAPSHOT_VMCS_FIELDS];
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    seL4_Word msrs[NUM_SNAPSHOT_MSRS];
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+    seL4_Word eip;
+    seL4_Word control_entry;
+    seL4_Word control_ppc;
+    guest_virt_state_t virt;
+    /* Local APIC */
+    uint32_t apic_base;
+    uint32_t divide_count;
+    bool irr_pending;
+    int16_t isr_count;
+    int highest_isr_cache;
+    unsigned int sipi_vector;
+    enum vm_lapic_state state;
+    int arb_prio;
+    struct local_apic_regs apic_regs;
+} vcpu_snapshot_t;
+
+size_t vm_snapshot_vcpu_size_arch(void)
+{
+    return sizeof(vcpu_snapshot_t);
+}
+
+int vm_snapshot_save_vcpu_arch(vm_vcpu_t *vcpu, void *state)
+{
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    vm_lapic_t *lapic = vcpu->vcpu_arch.lapic;
+    vcpu_snapshot_t *snapshot = state;
+
+    /* Write back anything the VMM has changed so the VMCS holds the whole guest state */
+    int err = vm_sync_guest_context(vcpu);
+    if (err) {
+        return -1;
+    }
+    vm_sync_guest_vmcs_state(vcpu);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    err = vm_get_thread_context(vcpu, &snapshot->context);
+    if (err) {
+        return -1;
+    }
+    err = vm_vmcs_read_fields(vcpu->vcpu.cptr, snapshot_vmcs_fields, snapshot->vmcs, NUM_SNAPSHOT_VMCS_FIELDS);
+    if (err) {
+        ZF_LOGE("Failed to save vcpu: Unable to read VMCS");
+        return -1;
+    }
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    if (snapshot_read_msrs(vcpu->vcpu.cptr, snapshot->msrs)) {
+        ZF_LOGE("Failed to save vcpu: Unable to read MSRs");
+        return -1;
+    }
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+    snapshot->eip = vm_guest_state_get_eip(gs);
+    snapshot->control_entry = vm_guest_state_get_control_entry(gs);
+    snapshot->control_ppc = vm_guest_state_get_control_ppc(gs);
+    snapshot->virt = gs->virt;
+
+    snapshot->apic_base = lapic->apic_base;
+    snapshot->divide_count = lapic->divide_count;
+    snapshot->irr_pending = lapic->irr_pending;
+    snapshot->isr_count = lapic->isr_count;
+    snapshot->highest_isr_cache = lapic->highest_isr_cache;
+    snapshot->sipi_vector = lapic->sipi_vector;
+    snapshot->state = lapic->state;
+    snapshot->arb_prio = lapic->arb_prio;
+    memcpy(&snapshot->apic_regs, lapic->regs, sizeof(snapshot->apic_regs));
+    return 0;
+}
+
+int vm_snapshot_restore_vcpu_arch(vm_vcpu_t *vcpu, const void *state)
+{
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    vm_lapic_t *lapic = vcpu->vcpu_arch.lapic;
+    const vcpu_snapshot_t *snapshot = state;
+
+    int err = vm_sync_guest_context(vcpu);
+    if (err) {
+        return -1;
+    }
+    vm_sync_guest_vmcs_state(vcpu);
+
+    err = vm_vmcs_write_fields(vcpu->vcpu.cptr, snapshot_vmcs_fields, snapshot->vmcs, NUM_SNAPSHOT_VMCS_FIELDS);
+    if (err) {
+        ZF_LOGE("Failed to restore vcpu: Unable to write VMCS");
+        return -1;
+    }
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    if (snapshot_write_msrs(vcpu->vcpu.cptr, snapshot->msrs)) {
+        ZF_LOGE("Failed to restore vcpu: Unable to write MSRs");
+        return -1;
+    }
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+    /* Anything cached from the VMCS is now stale */
+    vm_guest_state_invalidate_all(gs);
+    vm_set_thread_context(vcpu, snapshot->context);
+    vm_guest_state_set_eip(gs, snapshot->eip);
+    vm_guest_state_set_control_entry(gs, snapshot->control_entry);
+    vm_guest_state_set_control_ppc(gs, snapshot->control_ppc);
+    gs->virt = snapshot->virt;
+
+    lapic->apic_base = snapshot->apic_base;
+    lapic->divide_count = snapshot->divide_count;
+    lapic->irr_pending = snapshot->irr_pending;
+    lapic->isr_count = snapshot->isr_count;
+    lapic->highest_isr_cache = snapshot->highest_isr_cache;
+    lapic->sipi_vector = snapshot->sipi_vector;
+    lapic->state = snapshot->state;
+    lapic->arb_prio = snapshot->arb_prio;
+    memcpy(lapic->regs, &snapshot->apic_regs, sizeof(snapshot->apic_regs));
+    return 0;
+}
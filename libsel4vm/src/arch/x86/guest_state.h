@@ -91,6 +91,31 @@ typedef struct guest_machine_state {
     seL4_Word control_ppc;
 } guest_machine_state_t;
 
+/* Bits identifying the lazily fetched machine state that is backed by the VMCS.
+ * Exit handlers declare the set of fields they are going to use so that any
+ * unknown ones can be gathered from the VMCS in a single batch */
+#define GUEST_STATE_CR0                 BIT(0)
+#define GUEST_STATE_CR3                 BIT(1)
+#define GUEST_STATE_CR4                 BIT(2)
+#define GUEST_STATE_RFLAGS              BIT(3)
+#define GUEST_STATE_INTERRUPTIBILITY    BIT(4)
+#define GUEST_STATE_IDT_BASE            BIT(5)
+#define GUEST_STATE_IDT_LIMIT           BIT(6)
+#define GUEST_STATE_GDT_BASE            BIT(7)
+#define GUEST_STATE_GDT_LIMIT           BIT(8)
+#define GUEST_STATE_CS_SELECTOR         BIT(9)
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+#define GUEST_STATE_SS_SELECTOR         BIT(10)
+#define GUEST_STATE_DS_SELECTOR         BIT(11)
+#define GUEST_STATE_ES_SELECTOR         BIT(12)
+#define GUEST_STATE_FS_SELECTOR         BIT(13)
+#define GUEST_STATE_GS_SELECTOR         BIT(14)
+#define GUEST_STATE_ESP                 BIT(15)
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+/* Maximum number of VMCS fields that can be moved in one batch. This also
+ * covers the entry exception error code, which is only ever written */
+#define GUEST_STATE_MAX_BATCH           17
+
 /* Define the seL4_UserContext layout so we can treat it as an array */
 typedef enum guest_user_context {
     USER_CONTEXT_EAX = 0,
@@ -206,6 +231,83 @@ static inline void vm_guest_state_invalidate_all(guest_state_t *gs)
     MACHINE_STATE_INVAL(gs->machine.entry_exception_error_code);
 }
 
+#define GUEST_STATE_GATHER(gs, wanted, bit, name, vmcs_field, fields, num) do { \
+    if (((wanted) & (bit)) && IS_MACHINE_STATE_UNKNOWN((gs)->machine.name)) { \
+        (fields)[(num)++] = (vmcs_field); \
+    } \
+} while(0)
+
+#define GUEST_STATE_SCATTER(gs, wanted, bit, name, values, num) do { \
+    if (((wanted) & (bit)) && IS_MACHINE_STATE_UNKNOWN((gs)->machine.name)) { \
+        MACHINE_STATE_READ((gs)->machine.name, (values)[(num)++]); \
+    } \
+} while(0)
+
+/**
+ * Fetch any unknown machine state in the given set of GUEST_STATE_* bits from the VMCS
+ * in a single batch. State that is already valid or modified is left untouched, so
+ * this is cheap to call when everything needed is already cached
+ * @param[in] gs        Guest state to populate
+ * @param[in] vcpu      Handle to the vcpu
+ * @param[in] wanted    Mask of GUEST_STATE_* bits to make valid
+ * @return              0 on success, otherwise -1 for error
+ */
+static inline int vm_guest_state_fetch(guest_state_t *gs, seL4_CPtr vcpu, seL4_Word wanted)
+{
+    seL4_Word fields[GUEST_STATE_MAX_BATCH];
+    seL4_Word values[GUEST_STATE_MAX_BATCH];
+    int num = 0;
+
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_CR0, cr0, VMX_GUEST_CR0, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_CR3, cr3, VMX_GUEST_CR3, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_CR4, cr4, VMX_GUEST_CR4, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_RFLAGS, rflags, VMX_GUEST_RFLAGS, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_INTERRUPTIBILITY, guest_interruptibility, VMX_GUEST_INTERRUPTABILITY,
+                       fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_IDT_BASE, idt_base, VMX_GUEST_IDTR_BASE, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_IDT_LIMIT, idt_limit, VMX_GUEST_IDTR_LIMIT, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_GDT_BASE, gdt_base, VMX_GUEST_GDTR_BASE, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_GDT_LIMIT, gdt_limit, VMX_GUEST_GDTR_LIMIT, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_CS_SELECTOR, cs_selector, VMX_GUEST_CS_SELECTOR, fields, num);
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_SS_SELECTOR, ss_selector, VMX_GUEST_SS_SELECTOR, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_DS_SELECTOR, ds_selector, VMX_GUEST_DS_SELECTOR, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_ES_SELECTOR, es_selector, VMX_GUEST_ES_SELECTOR, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_FS_SELECTOR, fs_selector, VMX_GUEST_FS_SELECTOR, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_GS_SELECTOR, gs_selector, VMX_GUEST_GS_SELECTOR, fields, num);
+    GUEST_STATE_GATHER(gs, wanted, GUEST_STATE_ESP, esp, VMX_GUEST_RSP, fields, num);
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+
+    if (num == 0) {
+        return 0;
+    }
+    if (vm_vmcs_read_fields(vcpu, fields, values, num)) {
+        return -1;
+    }
+
+    /* Walk the fields in the same order, so the values line up with what we gathered */
+    num = 0;
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_CR0, cr0, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_CR3, cr3, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_CR4, cr4, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_RFLAGS, rflags, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_INTERRUPTIBILITY, guest_interruptibility, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_IDT_BASE, idt_base, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_IDT_LIMIT, idt_limit, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_GDT_BASE, gdt_base, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_GDT_LIMIT, gdt_limit, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_CS_SELECTOR, cs_selector, values, num);
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_SS_SELECTOR, ss_selector, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_DS_SELECTOR, ds_selector, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_ES_SELECTOR, es_selector, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_FS_SELECTOR, fs_selector, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_GS_SELECTOR, gs_selector, values, num);
+    GUEST_STATE_SCATTER(gs, wanted, GUEST_STATE_ESP, esp, values, num);
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+    return 0;
+}
+
 /* get */
 static inline seL4_Word vm_guest_state_get_eip(guest_state_t *gs)
 {
@@ -677,26 +779,70 @@ static inline void vm_guest_state_sync_entry_exception_error_code(guest_state_t
     }
 }
 
+#define GUEST_STATE_FLUSH(gs, name, vmcs_field, fields, values, num) do { \
+    if (IS_MACHINE_STATE_MODIFIED((gs)->machine.name)) { \
+        (fields)[(num)] = (vmcs_field); \
+        (values)[(num)++] = (gs)->machine.name; \
+    } \
+} while(0)
+
+#define GUEST_STATE_FLUSHED(gs, name) do { \
+    if (IS_MACHINE_STATE_MODIFIED((gs)->machine.name)) { \
+        MACHINE_STATE_SYNC((gs)->machine.name); \
+    } \
+} while(0)
+
 static inline void vm_sync_guest_vmcs_state(vm_vcpu_t *vcpu)
 {
-    vm_guest_state_sync_cr0(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_cr3(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_cr4(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_rflags(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_idt_base(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_idt_limit(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_gdt_base(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_gdt_limit(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_cs_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    seL4_Word fields[GUEST_STATE_MAX_BATCH];
+    seL4_Word values[GUEST_STATE_MAX_BATCH];
+    int num = 0;
+
+    /* Collect every modified field and write them back in one batch */
+    GUEST_STATE_FLUSH(gs, cr0, VMX_GUEST_CR0, fields, values, num);
+    GUEST_STATE_FLUSH(gs, cr3, VMX_GUEST_CR3, fields, values, num);
+    GUEST_STATE_FLUSH(gs, cr4, VMX_GUEST_CR4, fields, values, num);
+    GUEST_STATE_FLUSH(gs, rflags, VMX_GUEST_RFLAGS, fields, values, num);
+    GUEST_STATE_FLUSH(gs, idt_base, VMX_GUEST_IDTR_BASE, fields, values, num);
+    GUEST_STATE_FLUSH(gs, idt_limit, VMX_GUEST_IDTR_LIMIT, fields, values, num);
+    GUEST_STATE_FLUSH(gs, gdt_base, VMX_GUEST_GDTR_BASE, fields, values, num);
+    GUEST_STATE_FLUSH(gs, gdt_limit, VMX_GUEST_GDTR_LIMIT, fields, values, num);
+    GUEST_STATE_FLUSH(gs, cs_selector, VMX_GUEST_CS_SELECTOR, fields, values, num);
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    GUEST_STATE_FLUSH(gs, ss_selector, VMX_GUEST_SS_SELECTOR, fields, values, num);
+    GUEST_STATE_FLUSH(gs, ds_selector, VMX_GUEST_DS_SELECTOR, fields, values, num);
+    GUEST_STATE_FLUSH(gs, es_selector, VMX_GUEST_ES_SELECTOR, fields, values, num);
+    GUEST_STATE_FLUSH(gs, fs_selector, VMX_GUEST_FS_SELECTOR, fields, values, num);
+    GUEST_STATE_FLUSH(gs, gs_selector, VMX_GUEST_GS_SELECTOR, fields, values, num);
+    GUEST_STATE_FLUSH(gs, esp, VMX_GUEST_RSP, fields, values, num);
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+    GUEST_STATE_FLUSH(gs, entry_exception_error_code, VMX_CONTROL_ENTRY_EXCEPTION_ERROR_CODE, fields, values, num);
+
+    if (num == 0) {
+        return;
+    }
+    int UNUSED err = vm_vmcs_write_fields(vcpu->vcpu.cptr, fields, values, num);
+    assert(!err);
+
+    GUEST_STATE_FLUSHED(gs, cr0);
+    GUEST_STATE_FLUSHED(gs, cr3);
+    GUEST_STATE_FLUSHED(gs, cr4);
+    GUEST_STATE_FLUSHED(gs, rflags);
+    GUEST_STATE_FLUSHED(gs, idt_base);
+    GUEST_STATE_FLUSHED(gs, idt_limit);
+    GUEST_STATE_FLUSHED(gs, gdt_base);
+    GUEST_STATE_FLUSHED(gs, gdt_limit);
+    GUEST_STATE_FLUSHED(gs, cs_selector);
 #ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
-    vm_guest_state_sync_ss_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_ds_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_es_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_fs_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_gs_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_esp(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    GUEST_STATE_FLUSHED(gs, ss_selector);
+    GUEST_STATE_FLUSHED(gs, ds_selector);
+    GUEST_STATE_FLUSHED(gs, es_selector);
+    GUEST_STATE_FLUSHED(gs, fs_selector);
+    GUEST_STATE_FLUSHED(gs, gs_selector);
+    GUEST_STATE_FLUSHED(gs, esp);
 #endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
-    vm_guest_state_sync_entry_exception_error_code(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    GUEST_STATE_FLUSHED(gs, entry_exception_error_code);
 }
 
 /**
@@ -182,6 +182,33 @@ int vm_vmcs_write(seL4_CPtr vcpu, seL4_Word field, seL4_Word value)
     return 0;
 }
 
+/* Read a set of VMCS fields. The kernel does not provide a batched VMCS
+ * invocation, so this issues one read per field. Callers gather all the fields
+ * they need up front, which keeps this the single place to change once the
+ * kernel interface allows a set of fields to be moved in one call */
+int vm_vmcs_read_fields(seL4_CPtr vcpu, const seL4_Word *fields, seL4_Word *values, int num_fields)
+{
+    for (int i = 0; i < num_fields; i++) {
+        if (vm_vmcs_read(vcpu, fields[i], &values[i])) {
+            ZF_LOGE("Failed to read VMCS field 0x"SEL4_PRIx_word, fields[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write a set of VMCS fields, see vm_vmcs_read_fields */
+int vm_vmcs_write_fields(seL4_CPtr vcpu, const seL4_Word *fields, const seL4_Word *values, int num_fields)
+{
+    for (int i = 0; i < num_fields; i++) {
+        if (vm_vmcs_write(vcpu, fields[i], values[i])) {
+            ZF_LOGE("Failed to write VMCS field 0x"SEL4_PRIx_word, fields[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int vm_sync_guest_context(vm_vcpu_t *vcpu)
 {
     if (IS_MACHINE_STATE_MODIFIED(vcpu->vcpu_arch.guest_state->machine.context)) {
@@ -6,17 +6,25 @@
 
 /*vm exits related with hlt'ing*/
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
+#include <platsupport/arch/tsc.h>
 
 #include <sel4vm/guest_vm.h>
 
 #include "vm.h"
 #include "guest_state.h"
+#include "halt.h"
 #include "processor/lapic.h"
 
+/* Window the poller starts from once it has seen a short halt */
+#define HALT_POLL_WINDOW_START 10000ull
+
 /* Handling halt instruction VMExit Events. */
 int vm_hlt_handler(vm_vcpu_t *vcpu)
 {
@@ -27,8 +35,82 @@ int vm_hlt_handler(vm_vcpu_t *vcpu)
     if (vm_apic_has_interrupt(vcpu) == -1) {
         /* Halted, don't reply until we get an interrupt */
         vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 1;
+        vcpu->vcpu_arch.halt_poll.num_halts++;
     }
 
     vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
     return VM_EXIT_HANDLED;
 }
+
+void vm_halt_poll_init(vm_vcpu_t *vcpu)
+{
+    memset(&vcpu->vcpu_arch.halt_poll, 0, sizeof(vm_halt_poll_t));
+    vcpu->vcpu_arch.halt_poll.max_window = CONFIG_LIB_VM_HALT_POLL_MAX_CYCLES;
+}
+
+bool vm_halt_poll(vm_vcpu_t *vcpu, seL4_Word *badge)
+{
+    vm_halt_poll_t *poll = &vcpu->vcpu_arch.halt_poll;
+    if (!poll->max_window) {
+        return false;
+    }
+
+    /* Interrupts for the guest are delivered to us through the host notification,
+     * so an event arriving here is what would otherwise wake us from blocking */
+    uint64_t start = rdtsc_pure();
+    uint64_t now;
+    do {
+        *badge = 0;
+        seL4_Poll(vcpu->vm->host_endpoint, badge);
+        now = rdtsc_pure();
+        if (*badge) {
+            poll->poll_success++;
+            poll->poll_cycles += now - start;
+            return true;
+        }
+    } while (now - start < poll->window);
+
+    poll->poll_fail++;
+    poll->poll_cycles += now - start;
+    poll->block_start = now;
+    return false;
+}
+
+void vm_halt_poll_woken(vm_vcpu_t *vcpu)
+{
+    vm_halt_poll_t *poll = &vcpu->vcpu_arch.halt_poll;
+    if (!poll->max_window) {
+        return;
+    }
+
+    uint64_t blocked = rdtsc_pure() - poll->block_start;
+    if (blocked <= poll->max_window) {
+        /* We would have caught this wakeup with a bigger window */
+        poll->window = poll->window ? MIN(poll->window * 2, poll->max_window) :
+                       MIN(HALT_POLL_WINDOW_START, poll->max_window);
+    } else {
+        /* Long idle period, polling just burns cycles */
+        poll->window /= 2;
+    }
+}
+
+int vm_set_halt_poll_max(vm_vcpu_t *vcpu, uint64_t max_cycles)
+{
+    if (!vcpu) {
+        ZF_LOGE("Failed to set halt poll window: Invalid vcpu");
+        return -1;
+    }
+    vcpu->vcpu_arch.halt_poll.max_window = max_cycles;
+    vcpu->vcpu_arch.halt_poll.window = MIN(vcpu->vcpu_arch.halt_poll.window, max_cycles);
+    return 0;
+}
+
+int vm_get_halt_poll_stats(vm_vcpu_t *vcpu, vm_halt_poll_t *stats)
+{
+    if (!vcpu || !stats) {
+        ZF_LOGE("Failed to get halt poll stats: Invalid arguments");
+        return -1;
+    }
+    *stats = vcpu->vcpu_arch.halt_poll;
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <sel4/sel4.h>
+
+#include <sel4vm/guest_vm.h>
+
+/* Reset the halt polling state of a vcpu to the configured defaults */
+void vm_halt_poll_init(vm_vcpu_t *vcpu);
+
+/* Poll the host notification of a halted vcpu for up to its current polling
+ * window. Returns true, with the badge set, if an event arrived in time.
+ * Otherwise the caller is expected to block and then call vm_halt_poll_woken */
+bool vm_halt_poll(vm_vcpu_t *vcpu, seL4_Word *badge);
+
+/* Adjust the polling window after a halted vcpu blocked and was woken up */
+void vm_halt_poll_woken(vm_vcpu_t *vcpu);
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sel4/sel4.h>
 #include <stdio.h>
 #include <utils/util.h>
@@ -22,6 +23,7 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_irq_controller.h>
+#include <sel4vm/guest_snapshot.h>
 #include <sel4vm/arch/ioports.h>
 #include "i8259.h"
 
@@ -653,6 +655,11 @@ int i8259_get_interrupt(vm_t *vm)
     }
     if (!i8259_has_irq(vm)) {
         vm->arch.i8259_gs->emitagain = 1;
+    err = vm_snapshot_register_device(vm, VM_SNAPSHOT_DEVICE_I8259, sizeof(struct i8259), i8259_snapshot_save,
+                                      i8259_snapshot_restore, NULL);
+    if (err) {
+        return err;
+    }
     }
     return ret;
 }
@@ -669,6 +676,22 @@ vm_ioport_entry_t pic_ioports[] = {
     {{X86_IO_ELCR_START, X86_IO_ELCR_END}, {NULL, i8259_port_in, i8259_port_out, "ELCR (edge/level control register) for IRQ line"}}
 };
 
+static int i8259_snapshot_save(vm_t *vm, void *state, void *cookie)
+{
+    memcpy(state, vm->arch.i8259_gs, sizeof(struct i8259));
+    return 0;
+}
+
+static int i8259_snapshot_restore(vm_t *vm, const void *state, void *cookie)
+{
+    struct i8259 *s = vm->arch.i8259_gs;
+    memcpy(s, state, sizeof(*s));
+    /* The saved back pointers are those of the saved VM */
+    s->pics[0].pics_state = s;
+    s->pics[1].pics_state = s;
+    return 0;
+}
+
 int i8259_pre_init(vm_t *vm)
 {
     int err;
@@ -679,6 +702,11 @@ int i8259_pre_init(vm_t *vm)
     }
     i8259_init_state(vm->arch.i8259_gs);
     vm->arch.i8259_gs->emitagain = 1;
+    err = vm_snapshot_register_device(vm, VM_SNAPSHOT_DEVICE_I8259, sizeof(struct i8259), i8259_snapshot_save,
+                                      i8259_snapshot_restore, NULL);
+    if (err) {
+        return err;
+    }
     for (int i = 0; i < ARRAY_SIZE(pic_ioports); i++) {
         vm_ioport_range_t pic_range = pic_ioports[i].range;
         vm_ioport_interface_t pic_interface = pic_ioports[i].interface;
@@ -63,6 +63,11 @@ void wait_for_guest_ready(vm_vcpu_t *vcpu)
 
 int can_inject(vm_vcpu_t *vcpu)
 {
+    /* Outside of an exit neither of these are known, so grab them together */
+    if (vm_guest_state_fetch(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr,
+                             GUEST_STATE_RFLAGS | GUEST_STATE_INTERRUPTIBILITY)) {
+        return 0;
+    }
     uint32_t rflags = vm_guest_state_get_rflags(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
     uint32_t guest_int = vm_guest_state_get_interruptibility(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
     uint32_t int_control = vm_guest_state_get_control_entry(vcpu->vcpu_arch.guest_state);
@@ -13,11 +13,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/cpuid.h>
 
 #include "processor/cpuid.h"
 #include "processor/cpufeature.h"
@@ -386,6 +388,209 @@ break;
 }
 #endif
 
+/* Index of the first entry whose function is not less than the given function */
+static unsigned int cpuid_lower_bound(vm_t *vm, uint32_t function)
+{
+    unsigned int lo = 0;
+    unsigned int hi = vm->arch.cpuid_num_entries;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (vm->arch.cpuid_entries[mid].function < function) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static vm_cpuid_entry_t *cpuid_find_entry(vm_t *vm, uint32_t function, uint32_t index)
+{
+    for (unsigned int i = cpuid_lower_bound(vm, function);
+         i < vm->arch.cpuid_num_entries && vm->arch.cpuid_entries[i].function == function; i++) {
+        vm_cpuid_entry_t *entry = &vm->arch.cpuid_entries[i];
+        if (!(entry->flags & VM_CPUID_FLAG_SIGNIFICANT_INDEX) || entry->index == index) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int cpuid_entry_compare(const void *a, const void *b)
+{
+    const vm_cpuid_entry_t *a_entry = (const vm_cpuid_entry_t *)a;
+    const vm_cpuid_entry_t *b_entry = (const vm_cpuid_entry_t *)b;
+    if (a_entry->function != b_entry->function) {
+        return a_entry->function < b_entry->function ? -1 : 1;
+    }
+    if (a_entry->index != b_entry->index) {
+        return a_entry->index < b_entry->index ? -1 : 1;
+    }
+    return 0;
+}
+
+int vm_cpuid_set_entry(vm_t *vm, vm_cpuid_entry_t *entry)
+{
+    if (!vm || !entry) {
+        ZF_LOGE("Failed to set cpuid entry: Invalid arguments");
+        return -1;
+    }
+
+    vm_cpuid_entry_t *existing = cpuid_find_entry(vm, entry->function, entry->index);
+    if (existing && (existing->flags & VM_CPUID_FLAG_SIGNIFICANT_INDEX) ==
+        (entry->flags & VM_CPUID_FLAG_SIGNIFICANT_INDEX)) {
+        *existing = *entry;
+        return 0;
+    }
+
+    vm_cpuid_entry_t *entries = realloc(vm->arch.cpuid_entries,
+                                        sizeof(vm_cpuid_entry_t) * (vm->arch.cpuid_num_entries + 1));
+    if (!entries) {
+        ZF_LOGE("Failed to set cpuid entry: Unable to grow table");
+        return -1;
+    }
+    vm->arch.cpuid_entries = entries;
+
+    /* Keep the table sorted so lookups can binary search it */
+    unsigned int pos = cpuid_lower_bound(vm, entry->function);
+    while (pos < vm->arch.cpuid_num_entries && cpuid_entry_compare(&entries[pos], entry) < 0) {
+        pos++;
+    }
+    memmove(&entries[pos + 1], &entries[pos], sizeof(vm_cpuid_entry_t) * (vm->arch.cpuid_num_entries - pos));
+    entries[pos] = *entry;
+    vm->arch.cpuid_num_entries++;
+    return 0;
+}
+
+int vm_cpuid_get_entry(vm_t *vm, uint32_t function, uint32_t index, vm_cpuid_entry_t *entry)
+{
+    if (!vm || !entry) {
+        ZF_LOGE("Failed to get cpuid entry: Invalid arguments");
+        return -1;
+    }
+    vm_cpuid_entry_t *found = cpuid_find_entry(vm, function, index);
+    if (!found) {
+        return -1;
+    }
+    *entry = *found;
+    return 0;
+}
+
+int vm_cpuid_set_table(vm_t *vm, vm_cpuid_entry_t *entries, unsigned int num_entries)
+{
+    if (!vm || (num_entries && !entries)) {
+        ZF_LOGE("Failed to set cpuid table: Invalid arguments");
+        return -1;
+    }
+
+    vm_cpuid_entry_t *table = NULL;
+    if (num_entries) {
+        table = malloc(sizeof(vm_cpuid_entry_t) * num_entries);
+        if (!table) {
+            ZF_LOGE("Failed to set cpuid table: Unable to allocate table");
+            return -1;
+        }
+        memcpy(table, entries, sizeof(vm_cpuid_entry_t) * num_entries);
+        qsort(table, num_entries, sizeof(vm_cpuid_entry_t), cpuid_entry_compare);
+    }
+
+    free(vm->arch.cpuid_entries);
+    vm->arch.cpuid_entries = table;
+    vm->arch.cpuid_num_entries = num_entries;
+    return 0;
+}
+
+/* Virtualise a leaf and add it to the table. Leaves we do not virtualise are left out,
+ * guest queries for them take the same path as before through vm_cpuid_virt */
+static int cpuid_add_leaf(vm_t *vm, uint32_t function, uint32_t index, uint32_t flags, struct cpuid_val *val)
+{
+    if (vm_cpuid_virt(function, index, val, NULL)) {
+        return 0;
+    }
+    vm_cpuid_entry_t entry = {
+        .function = function,
+        .index = index,
+        .flags = flags,
+        .eax = val->eax,
+        .ebx = val->ebx,
+        .ecx = val->ecx,
+        .edx = val->edx,
+    };
+    return vm_cpuid_set_entry(vm, &entry);
+}
+
+/* Leaves with sub-leaves we enumerate, bounded to keep the table small */
+#define CPUID_MAX_SUBLEAVES 16
+
+int vm_cpuid_init(vm_t *vm)
+{
+    struct cpuid_val val;
+    unsigned int max_basic, max_ext;
+    int err;
+
+    vm->arch.cpuid_entries = NULL;
+    vm->arch.cpuid_num_entries = 0;
+
+    /* Leaf 0 is virtualised to clamp the highest basic function we expose */
+    err = cpuid_add_leaf(vm, 0, 0, 0, &val);
+    max_basic = val.eax;
+    for (uint32_t function = 1; !err && function <= max_basic; function++) {
+        switch (function) {
+        case 4:
+            /* Deterministic cache parameters, until a null cache type */
+            for (uint32_t index = 0; !err && index < CPUID_MAX_SUBLEAVES; index++) {
+                err = cpuid_add_leaf(vm, function, index, VM_CPUID_FLAG_SIGNIFICANT_INDEX, &val);
+                if (!(val.eax & 0x1f)) {
+                    break;
+                }
+            }
+            break;
+        case 7: {
+            /* Extended features, sub-leaf 0 reports the highest sub-leaf */
+            unsigned int native_eax = 7, native_ebx, native_ecx = 0, native_edx;
+            native_cpuid(&native_eax, &native_ebx, &native_ecx, &native_edx);
+            for (uint32_t index = 0; !err && index <= MIN(native_eax, CPUID_MAX_SUBLEAVES - 1); index++) {
+                err = cpuid_add_leaf(vm, function, index, VM_CPUID_FLAG_SIGNIFICANT_INDEX, &val);
+            }
+            break;
+        }
+        case 8:
+        case 9:
+            /* Reserved and DCA leaves are not virtualised, skip them rather than log an error per VM */
+            break;
+        default:
+            err = cpuid_add_leaf(vm, function, 0, 0, &val);
+        }
+    }
+
+    /* Hypervisor leaves, we are not KVM */
+    if (!err) {
+        err = cpuid_add_leaf(vm, VMM_CPUID_KVM_SIGNATURE, 0, 0, &val);
+    }
+    if (!err) {
+        err = cpuid_add_leaf(vm, VMM_CPUID_KVM_FEATURES, 0, 0, &val);
+    }
+
+    if (!err) {
+        err = cpuid_add_leaf(vm, 0x80000000, 0, 0, &val);
+    }
+    max_ext = val.eax;
+    for (uint32_t function = 0x80000001; !err && function <= MIN(max_ext, 0x80000008); function++) {
+        err = cpuid_add_leaf(vm, function, 0, 0, &val);
+    }
+
+    /* Centaur leaves */
+    for (uint32_t function = 0xC0000002; !err && function <= 0xC0000004; function++) {
+        err = cpuid_add_leaf(vm, function, 0, 0, &val);
+    }
+
+    if (err) {
+        ZF_LOGE("Failed to build cpuid table");
+        return -1;
+    }
+    return 0;
+}
+
 /* VM exit handler: for the CPUID instruction. */
 int vm_cpuid_handler(vm_vcpu_t *vcpu)
 {
@@ -400,10 +605,20 @@ int vm_cpuid_handler(vm_vcpu_t *vcpu)
         return VM_EXIT_HANDLE_ERROR;
     }
 
-    /* Virtualise the CPUID instruction. */
-    ret = vm_cpuid_virt(function, index, &val, vcpu);
-    if (ret) {
-        return VM_EXIT_HANDLE_ERROR;
+    /* Serve the leaf from the table built at VM creation, only falling
+     * back to the host CPUID for leaves we did not precompute */
+    vm_cpuid_entry_t *entry = cpuid_find_entry(vcpu->vm, function, index);
+    if (entry) {
+        val.eax = entry->eax;
+        val.ebx = entry->ebx;
+        val.ecx = entry->ecx;
+        val.edx = entry->edx;
+    } else {
+        /* Virtualise the CPUID instruction. */
+        ret = vm_cpuid_virt(function, index, &val, vcpu);
+        if (ret) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
     }
 
     /* Set the return values in guest context. */
@@ -6,7 +6,6 @@
 
 /* This file contains macros for CPUID emulation in x86.
  * Most of the code in this file is from arch/x86/kvm/cpuid.h Linux 3.8.8
- * This file should used only by cpuid.c
  *
  *     Authors:
  *         Qian Ge
@@ -16,6 +15,8 @@
 
 #include <utils/util.h>
 
+#include <sel4vm/guest_vm.h>
+
 #define F(x) BIT( (X86_FEATURE_##x) & 31)
 
 /* Basic information for the processor P4 hyperthread. */
@@ -44,3 +45,5 @@ struct cpuid_val {
     unsigned int edx;
 };
 
+/* Build the virtualised CPUID table of a VM from the host CPUID */
+int vm_cpuid_init(vm_t *vm);
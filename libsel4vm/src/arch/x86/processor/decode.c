@@ -138,8 +138,8 @@ inline static seL4_Word guest_get_phys_word(vm_t *vm, uintptr_t addr)
 {
     seL4_Word val;
 
-    vm_ram_touch(vm, addr, sizeof(seL4_Word),
-                 vm_guest_ram_read_callback, &val);
+    vm_ram_touch_readonly(vm, addr, sizeof(seL4_Word),
+                          vm_guest_ram_read_callback, &val);
 
     return val;
 }
@@ -237,8 +237,8 @@ int vm_fetch_instruction(vm_vcpu_t *vcpu, uintptr_t eip, uintptr_t cr3,
 
 fetch:
     /* Fetch instruction */
-    vm_ram_touch(vcpu->vm, instr_phys, read_instr,
-                 vm_guest_ram_read_callback, buf);
+    vm_ram_touch_readonly(vcpu->vm, instr_phys, read_instr,
+                          vm_guest_ram_read_callback, buf);
 
     if (extra_instr > 0) {
         vm_fetch_instruction(vcpu, eip + read_instr, cr3, extra_instr, buf + read_instr);
@@ -397,10 +397,10 @@ uintptr_t vm_emulate_realmode(vm_vcpu_t *vcpu, uint8_t *instr_buf,
                     instr += 2;
 
                     /* Limit is first 2 bytes, base is next 4 bytes */
-                    vm_ram_touch(vcpu->vm, mem,
-                                 2, vm_guest_ram_read_callback, &limit);
-                    vm_ram_touch(vcpu->vm, mem + 2,
-                                 4, vm_guest_ram_read_callback, &base);
+                    vm_ram_touch_readonly(vcpu->vm, mem,
+                                          2, vm_guest_ram_read_callback, &limit);
+                    vm_ram_touch_readonly(vcpu->vm, mem + 2,
+                                          4, vm_guest_ram_read_callback, &base);
                     ZF_LOGD("lidtl %p\n", (void *)mem);
 
                     vm_guest_state_set_idt_base(gs, base);
@@ -413,10 +413,10 @@ uintptr_t vm_emulate_realmode(vm_vcpu_t *vcpu, uint8_t *instr_buf,
                     instr += 2;
 
                     /* Limit is first 2 bytes, base is next 4 bytes */
-                    vm_ram_touch(vcpu->vm, mem,
-                                 2, vm_guest_ram_read_callback, &limit);
-                    vm_ram_touch(vcpu->vm, mem + 2,
-                                 4, vm_guest_ram_read_callback, &base);
+                    vm_ram_touch_readonly(vcpu->vm, mem,
+                                          2, vm_guest_ram_read_callback, &limit);
+                    vm_ram_touch_readonly(vcpu->vm, mem + 2,
+                                          4, vm_guest_ram_read_callback, &base);
                     ZF_LOGD("lgdtl %p; base = %x, limit = %x\n", (void *)mem,
                             base, limit);
 
@@ -509,8 +509,8 @@ uintptr_t vm_emulate_realmode(vm_vcpu_t *vcpu, uint8_t *instr_buf,
 #endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
                 ZF_LOGD("mov %p, eax\n", (void *)mem);
                 uint32_t eax;
-                vm_ram_touch(vcpu->vm, mem,
-                             4, vm_guest_ram_read_callback, &eax);
+                vm_ram_touch_readonly(vcpu->vm, mem,
+                                      4, vm_guest_ram_read_callback, &eax);
                 vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, eax);
                 break;
 #ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
@@ -538,8 +538,8 @@ uintptr_t vm_emulate_realmode(vm_vcpu_t *vcpu, uint8_t *instr_buf,
                     memcpy(&mem, instr, 4);
                     instr += 4;
                     uint32_t edx;
-                    vm_ram_touch(vcpu->vm, mem,
-                                 4, vm_guest_ram_read_callback, &edx);
+                    vm_ram_touch_readonly(vcpu->vm, mem,
+                                          4, vm_guest_ram_read_callback, &edx);
                     ZF_LOGD("mov %x, edx\n", edx);
                     vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EDX, mem);
                 }
@@ -8,11 +8,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/msr.h>
 
 #include "vm.h"
 #include "guest_state.h"
@@ -46,95 +48,225 @@ static void vm_msr_write(seL4_CPtr vcpu, unsigned int field, seL4_Word value)
 }
 #endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
 
-int vm_rdmsr_handler(vm_vcpu_t *vcpu)
+static int msr_apicbase_read(vm_vcpu_t *vcpu, uint32_t msr, uint64_t *value, void *cookie)
+{
+    *value = vm_lapic_get_base_msr(vcpu);
+    return 0;
+}
+
+static int msr_apicbase_write(vm_vcpu_t *vcpu, uint32_t msr, uint64_t value, void *cookie)
+{
+    vm_lapic_set_base_msr(vcpu, (uint32_t)value);
+    return 0;
+}
+
+static int msr_ignore_write(vm_vcpu_t *vcpu, uint32_t msr, uint64_t value, void *cookie)
+{
+    return 0;
+}
+
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+/* MSRs whose guest value lives in a VMCS field, the field is the cookie */
+static int msr_vmcs_read(vm_vcpu_t *vcpu, uint32_t msr, uint64_t *value, void *cookie)
+{
+    seL4_Word vm_data;
+    if (vm_get_vmcs_field(vcpu, (seL4_Word)(uintptr_t)cookie, &vm_data)) {
+        return -1;
+    }
+    *value = (uint64_t) vm_data;
+    return 0;
+}
+
+static int msr_vmcs_write(vm_vcpu_t *vcpu, uint32_t msr, uint64_t value, void *cookie)
+{
+    return vm_set_vmcs_field(vcpu, (seL4_Word)(uintptr_t)cookie, (seL4_Word)value);
+}
+
+static int msr_efer_write(vm_vcpu_t *vcpu, uint32_t msr, uint64_t value, void *cookie)
+{
+    /* Only the low half of EFER is defined */
+    return vm_set_vmcs_field(vcpu, VMX_GUEST_EFER, (uint32_t)value);
+}
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+
+/* Default policy installed for every VM.
+ * src reference: Linux kernel 3.11 kvm arch/x86/kvm/x86.c */
+static const vm_msr_entry_t default_msrs[] = {
+    { .msr = MSR_IA32_PLATFORM_ID, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_EBL_CR_POWERON, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_DEBUGCTLMSR, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_LASTBRANCHFROMIP, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_LASTBRANCHTOIP, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_LASTINTFROMIP, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_LASTINTTOIP, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_MISC_ENABLE, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 0 },
+    { .msr = MSR_IA32_UCODE_REV, .policy = VM_MSR_CONSTANT, .value = 0x100000000ULL },
+    { .msr = MSR_IA32_UCODE_WRITE, .policy = VM_MSR_EMULATED, .write = msr_ignore_write },
+    /* performance counters not supported. */
+    { .msr = MSR_P6_PERFCTR0, .policy = VM_MSR_CONSTANT, .value = 0 },
+    { .msr = MSR_P6_PERFCTR1, .policy = VM_MSR_CONSTANT, .value = 0 },
+    { .msr = MSR_P6_EVNTSEL0, .policy = VM_MSR_CONSTANT, .value = 0 },
+    { .msr = MSR_P6_EVNTSEL1, .policy = VM_MSR_CONSTANT, .value = 0 },
+    { .msr = MSR_IA32_PERF_GLOBAL_STATUS_SET, .policy = VM_MSR_CONSTANT, .value = 0 },
+    /* fsb frequency */
+    { .msr = MSR_FSB_FREQ, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 3 },
+    { .msr = MSR_EBC_FREQUENCY_ID, .policy = VM_MSR_CONSTANT_READ_ONLY, .value = 1 << 24 },
+    { .msr = MSR_IA32_APICBASE, .policy = VM_MSR_EMULATED, .read = msr_apicbase_read, .write = msr_apicbase_write },
+#ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
+    {
+        .msr = MSR_EFER, .policy = VM_MSR_EMULATED, .read = msr_vmcs_read, .write = msr_efer_write,
+        .cookie = (void *)(uintptr_t)VMX_GUEST_EFER
+    },
+    {
+        .msr = MSR_FS_BASE, .policy = VM_MSR_EMULATED, .read = msr_vmcs_read, .write = msr_vmcs_write,
+        .cookie = (void *)(uintptr_t)VMX_GUEST_FS_BASE
+    },
+    {
+        .msr = MSR_GS_BASE, .policy = VM_MSR_EMULATED, .read = msr_vmcs_read, .write = msr_vmcs_write,
+        .cookie = (void *)(uintptr_t)VMX_GUEST_GS_BASE
+    },
+    /* Syscall MSRs are saved and restored by the kernel on vcpu switch */
+    { .msr = MSR_STAR, .policy = VM_MSR_PASSTHROUGH },
+    { .msr = MSR_LSTAR, .policy = VM_MSR_PASSTHROUGH },
+    { .msr = MSR_CSTAR, .policy = VM_MSR_PASSTHROUGH },
+    { .msr = MSR_SYSCALL_MASK, .policy = VM_MSR_PASSTHROUGH },
+#endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+};
+
+static int msr_compare(const void *pkey, const void *pelem)
+{
+    uint32_t key = (uint32_t)(uintptr_t)pkey;
+    const vm_msr_entry_t *entry = (const vm_msr_entry_t *)pelem;
+    if (key < entry->msr) {
+        return -1;
+    }
+    if (key > entry->msr) {
+        return 1;
+    }
+    return 0;
+}
+
+static vm_msr_entry_t *search_msr(vm_t *vm, uint32_t msr)
+{
+    return (vm_msr_entry_t *)bsearch((void *)(uintptr_t)msr, vm->arch.msr_entries, vm->arch.msr_num_entries,
+                                     sizeof(vm_msr_entry_t), msr_compare);
+}
+
+int vm_register_msr(vm_t *vm, vm_msr_entry_t *entry)
+{
+    if (!vm || !entry) {
+        ZF_LOGE("Failed to register msr: Invalid arguments");
+        return -1;
+    }
+#ifndef CONFIG_X86_64_VTX_64BIT_GUESTS
+    if (entry->policy == VM_MSR_PASSTHROUGH) {
+        ZF_LOGE("Failed to register msr 0x%x: Passthrough is only supported for 64-bit guests", entry->msr);
+        return -1;
+    }
+#endif /* not CONFIG_X86_64_VTX_64BIT_GUESTS */
+
+    vm_msr_entry_t *existing = search_msr(vm, entry->msr);
+    if (existing) {
+        *existing = *entry;
+        return 0;
+    }
+
+    vm_msr_entry_t *entries = realloc(vm->arch.msr_entries, sizeof(vm_msr_entry_t) * (vm->arch.msr_num_entries + 1));
+    if (!entries) {
+        ZF_LOGE("Failed to register msr 0x%x: Unable to grow table", entry->msr);
+        return -1;
+    }
+    vm->arch.msr_entries = entries;
+
+    /* Keep the table sorted for lookups on the exit path */
+    unsigned int pos = 0;
+    while (pos < vm->arch.msr_num_entries && entries[pos].msr < entry->msr) {
+        pos++;
+    }
+    memmove(&entries[pos + 1], &entries[pos], sizeof(vm_msr_entry_t) * (vm->arch.msr_num_entries - pos));
+    entries[pos] = *entry;
+    vm->arch.msr_num_entries++;
+    return 0;
+}
+
+int vm_unregister_msr(vm_t *vm, uint32_t msr)
 {
+    if (!vm) {
+        ZF_LOGE("Failed to unregister msr: Invalid vm");
+        return -1;
+    }
+    vm_msr_entry_t *entry = search_msr(vm, msr);
+    if (!entry) {
+        return -1;
+    }
+    unsigned int pos = entry - vm->arch.msr_entries;
+    memmove(&vm->arch.msr_entries[pos], &vm->arch.msr_entries[pos + 1],
+            sizeof(vm_msr_entry_t) * (vm->arch.msr_num_entries - pos - 1));
+    vm->arch.msr_num_entries--;
+    return 0;
+}
 
-    int ret = 0;
+int vm_msr_init(vm_t *vm)
+{
+    vm->arch.msr_entries = NULL;
+    vm->arch.msr_num_entries = 0;
+    for (int i = 0; i < ARRAY_SIZE(default_msrs); i++) {
+        vm_msr_entry_t entry = default_msrs[i];
+        if (vm_register_msr(vm, &entry)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vm_rdmsr_handler(vm_vcpu_t *vcpu)
+{
     seL4_Word msr_no;
     if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &msr_no)) {
         return VM_EXIT_HANDLE_ERROR;
     }
     uint64_t data = 0;
-    seL4_Word vm_data;
+    int fault = 0;
 
     ZF_LOGD("rdmsr ecx 0x"SEL4_PRIx_word"\n", msr_no);
 
-    // src reference: Linux kernel 3.11 kvm arch/x86/kvm/x86.c
-    switch (msr_no) {
-    case MSR_IA32_PLATFORM_ID:
-    case MSR_IA32_EBL_CR_POWERON:
-    case MSR_IA32_DEBUGCTLMSR:
-    case MSR_IA32_LASTBRANCHFROMIP:
-    case MSR_IA32_LASTBRANCHTOIP:
-    case MSR_IA32_LASTINTFROMIP:
-    case MSR_IA32_LASTINTTOIP:
-    case MSR_IA32_MISC_ENABLE:
-        data = 0;
-        break;
-
-    case MSR_IA32_UCODE_REV:
-        data = 0x100000000ULL;
-        break;
-
-    case MSR_P6_PERFCTR0:
-    case MSR_P6_PERFCTR1:
-    case MSR_P6_EVNTSEL0:
-    case MSR_P6_EVNTSEL1:
-    case MSR_IA32_PERF_GLOBAL_STATUS_SET:
-        /* performance counters not supported. */
-        data = 0;
-        break;
-
-    case 0xcd: /* fsb frequency */
-        data = 3;
-        break;
-
-    case MSR_EBC_FREQUENCY_ID:
-        data = 1 << 24;
-        break;
-
-    case MSR_IA32_APICBASE:
-        data = vm_lapic_get_base_msr(vcpu);
-        break;
-
+    vm_msr_entry_t *entry = search_msr(vcpu->vm, (uint32_t)msr_no);
+    if (!entry) {
+        fault = -1;
+    } else {
+        switch (entry->policy) {
 #ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
-    case MSR_EFER:
-        vm_get_vmcs_field(vcpu, VMX_GUEST_EFER, &vm_data);
-        data = (uint64_t) vm_data;
-        break;
-
-    case MSR_STAR:
-    case MSR_LSTAR:
-    case MSR_CSTAR:
-    case MSR_SYSCALL_MASK:
-        vm_data = vm_msr_read(vcpu->vcpu.cptr, msr_no);
-        data = (uint64_t) vm_data;
-        break;
+        case VM_MSR_PASSTHROUGH:
+            data = (uint64_t) vm_msr_read(vcpu->vcpu.cptr, msr_no);
+            break;
 #endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+        case VM_MSR_EMULATED:
+            fault = entry->read ? entry->read(vcpu, entry->msr, &data, entry->cookie) : -1;
+            break;
+        case VM_MSR_CONSTANT:
+        case VM_MSR_CONSTANT_READ_ONLY:
+            data = entry->value;
+            break;
+        default:
+            fault = -1;
+        }
+    }
 
-    default:
+    if (fault) {
         ZF_LOGW("rdmsr WARNING unsupported msr_no 0x%x\n", msr_no);
         // generate a GP fault
         vm_inject_exception(vcpu, 13, 1, 0);
         return VM_EXIT_HANDLED;
-
     }
 
-    if (!ret) {
-        vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, (uint32_t)(data & 0xffffffff));
-        vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EDX, (uint32_t)(data >> 32));
-        vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-        return VM_EXIT_HANDLED;
-    }
-
-    return VM_EXIT_HANDLE_ERROR;
+    vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, (uint32_t)(data & 0xffffffff));
+    vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EDX, (uint32_t)(data >> 32));
+    vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    return VM_EXIT_HANDLED;
 }
 
 int vm_wrmsr_handler(vm_vcpu_t *vcpu)
 {
-
-    int ret = 0;
-
     seL4_Word msr_no;
     if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &msr_no)) {
         return VM_EXIT_HANDLE_ERROR;
@@ -145,41 +277,32 @@ int vm_wrmsr_handler(vm_vcpu_t *vcpu)
         || vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, &val_low)) {
         return VM_EXIT_HANDLE_ERROR;
     }
+    uint64_t data = ((uint64_t)(uint32_t)val_high << 32) | (uint32_t)val_low;
+    int fault = 0;
 
     ZF_LOGD("wrmsr ecx 0x%x   value: 0x%x  0x%x\n", msr_no, val_high, val_low);
 
-    // src reference: Linux kernel 3.11 kvm arch/x86/kvm/x86.c
-    switch (msr_no) {
-    case MSR_IA32_UCODE_REV:
-    case MSR_IA32_UCODE_WRITE:
-        break;
-
-    case MSR_P6_PERFCTR0:
-    case MSR_P6_PERFCTR1:
-    case MSR_P6_EVNTSEL0:
-    case MSR_P6_EVNTSEL1:
-    case MSR_IA32_PERF_GLOBAL_STATUS_SET:
-        /* performance counters not supported. */
-        break;
-
-    case MSR_IA32_APICBASE:
-        vm_lapic_set_base_msr(vcpu, val_low);
-        break;
-
+    vm_msr_entry_t *entry = search_msr(vcpu->vm, (uint32_t)msr_no);
+    if (!entry) {
+        fault = -1;
+    } else {
+        switch (entry->policy) {
 #ifdef CONFIG_X86_64_VTX_64BIT_GUESTS
-    case MSR_EFER:
-        vm_set_vmcs_field(vcpu, VMX_GUEST_EFER, val_low);
-        break;
-
-    case MSR_STAR:
-    case MSR_LSTAR:
-    case MSR_CSTAR:
-    case MSR_SYSCALL_MASK:
-        vm_msr_write(vcpu->vcpu.cptr, msr_no, (seL4_Word)(((seL4_Word)val_high << 32ull) | val_low));
-        break;
+        case VM_MSR_PASSTHROUGH:
+            vm_msr_write(vcpu->vcpu.cptr, msr_no, (seL4_Word)data);
+            break;
 #endif /* CONFIG_X86_64_VTX_64BIT_GUESTS */
+        case VM_MSR_EMULATED:
+            fault = entry->write ? entry->write(vcpu, entry->msr, data, entry->cookie) : -1;
+            break;
+        case VM_MSR_CONSTANT:
+            break;
+        default:
+            fault = -1;
+        }
+    }
 
-    default:
+    if (fault) {
         ZF_LOGW("wrmsr WARNING unsupported msr_no 0x%x\n", msr_no);
         // generate a GP fault
         vm_inject_exception(vcpu, 13, 1, 0);
@@ -188,5 +311,4 @@ int vm_wrmsr_handler(vm_vcpu_t *vcpu)
 
     vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
     return VM_EXIT_HANDLED;
-
 }
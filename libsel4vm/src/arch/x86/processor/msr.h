@@ -294,3 +294,8 @@
 #define MSR_GS_BASE         0xc0000101 /* 64bit GS base */
 #define MSR_SHADOW_GS_BASE  0xc0000102 /* SwapGS GS shadow */
 #define MSR_TSC_AUX         0xc0000103 /* Auxiliary TSC */
+
+typedef struct vm vm_t;
+
+/* Install the default MSR policy table of a VM */
+int vm_msr_init(vm_t *vm);
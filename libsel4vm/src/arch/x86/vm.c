@@ -25,6 +25,7 @@
 #include "interrupt.h"
 #include "guest_state.h"
 #include "debug.h"
+#include "halt.h"
 #include "vmexit.h"
 
 #define VMM_INITIAL_STACK 0x96000
@@ -42,6 +43,15 @@ static vm_exit_handler_fn_t x86_exit_handlers[VM_EXIT_REASON_NUM] = {
     [EXIT_REASON_VMCALL] = vm_vmcall_handler,
 };
 
+/* Machine state (GUEST_STATE_* bits) each exit handler is going to use beyond what
+ * the kernel already delivers in the fault message (eip, rflags, interruptibility,
+ * cr3 and the GPRs). This is gathered from the VMCS in one batch before calling the
+ * handler, exits such as CPUID and RDMSR/WRMSR need nothing further */
+static seL4_Word x86_exit_handler_state[VM_EXIT_REASON_NUM] = {
+    [EXIT_REASON_EPT_VIOLATION] = GUEST_STATE_CR4,
+    [EXIT_REASON_CR_ACCESS] = GUEST_STATE_CR4,
+};
+
 /* Reply to the VM exit exception to resume guest. */
 static void vm_resume(vm_vcpu_t *vcpu)
 {
@@ -80,6 +90,13 @@ static int handle_vm_exit(vm_vcpu_t *vcpu)
         return -1;
     }
 
+    /* Gather the state the handler needs up front. */
+    if (vm_guest_state_fetch(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr, x86_exit_handler_state[reason])) {
+        ZF_LOGE("Failed to fetch guest state for exit reason 0x%x", reason);
+        vcpu->vcpu_online = false;
+        return -1;
+    }
+
     /* Call the handler. */
     ret = x86_exit_handlers[reason](vcpu);
     if (ret == -1) {
@@ -184,20 +201,20 @@ int vm_run_arch(vm_t *vm)
             if (fault == SEL4_VMENTER_RESULT_FAULT) {
                 /* We in a fault */
                 vcpu->vcpu_arch.guest_state->exit.in_exit = 1;
-                /* Update the guest state from a fault */
-                seL4_Word fault_message[SEL4_VMENTER_RESULT_FAULT_LEN];
-                for (int i = 0 ; i < SEL4_VMENTER_RESULT_FAULT_LEN; i++) {
-                    fault_message[i] = seL4_GetMR(i);
-                }
-                vm_update_guest_state_from_fault(vcpu, fault_message);
+                /* Update the guest state from a fault. The message is consumed straight out of the
+                 * IPC buffer, this has to happen before any further kernel invocation overwrites it */
+                vm_update_guest_state_from_fault(vcpu, seL4_GetIPCBuffer()->msg);
             } else {
                 /* update the guest state from a non fault */
-                seL4_Word int_message[SEL4_VMENTER_RESULT_NOTIF_LEN];
-                for (int i = 0 ; i < SEL4_VMENTER_RESULT_NOTIF_LEN; i++) {
-                    int_message[i] = seL4_GetMR(i);
-                }
-                vm_update_guest_state_from_interrupt(vcpu, int_message);
+                vm_update_guest_state_from_interrupt(vcpu, seL4_GetIPCBuffer()->msg);
             }
+        } else if (vcpu->vcpu_online && vcpu->vcpu_arch.guest_state->virt.interrupt_halt) {
+            /* Give a wakeup a chance to arrive before we go through the blocking path */
+            if (!vm_halt_poll(vcpu, &badge)) {
+                seL4_Wait(vm->host_endpoint, &badge);
+                vm_halt_poll_woken(vcpu);
+            }
+            fault = SEL4_VMENTER_RESULT_NOTIF;
         } else {
             seL4_Wait(vm->host_endpoint, &badge);
             fault = SEL4_VMENTER_RESULT_NOTIF;
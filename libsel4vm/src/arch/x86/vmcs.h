@@ -12,4 +12,6 @@
 
 int vm_vmcs_read(seL4_CPtr vcpu, seL4_Word field, seL4_Word *value);
 int vm_vmcs_write(seL4_CPtr vcpu, seL4_Word field, seL4_Word value);
+int vm_vmcs_read_fields(seL4_CPtr vcpu, const seL4_Word *fields, seL4_Word *values, int num_fields);
+int vm_vmcs_write_fields(seL4_CPtr vcpu, const seL4_Word *fields, const seL4_Word *values, int num_fields);
 void vm_vmcs_init_guest(vm_vcpu_t *vcpu);
@@ -4,22 +4,47 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <utils/util.h>
 #include <utils/sglib.h>
+#include <vka/object.h>
+#include <vka/capops.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 
 #include "guest_memory.h"
+#include "guest_merge.h"
+#include "guest_vspace.h"
+
+/* Granularity at which deferred reservations are mapped on fault, 0 maps the whole
+ * reservation on the first fault */
+#if defined(CONFIG_LIB_SEL4VM_DEFER_MEMORY_MAP) && defined(CONFIG_LIB_SEL4VM_DEMAND_MAP_CHUNK_BITS)
+#define DEMAND_MAP_CHUNK_BITS CONFIG_LIB_SEL4VM_DEMAND_MAP_CHUNK_BITS
+#else
+#define DEMAND_MAP_CHUNK_BITS 0
+#endif
 
 typedef enum reservation_type {
     MEM_REGULAR_RES,
     MEM_ANON_RES
 } reservation_type_t;
 
+/* A run of contiguous, equally sized frames mapped into a reservation */
+typedef struct frame_run {
+    uintptr_t addr;
+    size_t size_bits;
+    size_t num_frames;
+    /* Rights the frames were mapped with, before any write protection */
+    seL4_CapRights_t rights;
+} frame_run_t;
+
 /* VM Memory reservation object: Represents a reservation in the guest VM's memory */
 struct vm_memory_reservation {
     /* VM to which this reservation belongs */
@@ -28,8 +53,19 @@ struct vm_memory_reservation {
     uintptr_t addr;
     /* Size of memory region */
     size_t size;
-    /* Bits in page size of memory region */
+    /* Bits in the smallest page size mapped into the memory region */
     size_t page_size_bits;
+    /* Frames mapped into the memory region, in ascending address order */
+    frame_run_t *frame_runs;
+    int num_frame_runs;
+    /* Bytes of the memory region backed by frames so far */
+    size_t mapped_bytes;
+    /* Next address of the memory region to map when prefaulting */
+    uintptr_t prefault_addr;
+    /* One bit per 4K page written since the log was last cleared, NULL unless dirty logging */
+    unsigned long *dirty_bitmap;
+    /* Shared frame mapped read-only at each 4K page, NULL until a page is merged */
+    vm_shared_frame_t **shared_frames;
     /* Callback to be invoked if memory region is faulted on*/
     memory_fault_callback_fn fault_callback;
     /* Iterator to be invoked for performing a map on the reservation region */
@@ -37,6 +73,13 @@ struct vm_memory_reservation {
     /* Cookies to pass onto callback and iterator functions */
     void *fault_callback_cookie;
     void *memory_iterator_cookie;
+    /* Iterator and cookie used to map fresh frames over memory released by vm_reservation_release */
+    memory_map_iterator_fn refill_iterator;
+    void *refill_cookie;
+    /* Frames have been released, faults map single pages back rather than chunks */
+    bool released;
+    /* Untouched pages are mapped to the VM's zero frame rather than frames from the map iterator */
+    bool zero_fill;
     /* The reservation in the vm's vspace object */
     reservation_t vspace_reservation;
     /* The type of reservation i.e regular, anonymous */
@@ -91,27 +134,79 @@ SGLIB_DEFINE_RBTREE_FUNCTIONS(res_tree, left, right, color_field, reservation_no
 struct vm_memory_reservation_cookie {
     struct res_tree *regular_res_tree;
     struct res_tree *anon_res_tree;
+    /* Regular and anonymous reservations sorted by address, used for lookups */
+    vm_memory_reservation_t **res_index;
+    int num_res_index;
+    /* Bumped whenever a reservation is removed, invalidating cached lookups */
+    unsigned int res_generation;
+    /* Number of reservations with dirty logging enabled */
+    int num_dirty_logging;
+    /* Frame of zeros mapped read-only at untouched pages of zero filled reservations, NULL until enabled */
+    vm_shared_frame_t *zero_frame;
+    /* Zeroed frames ready to back the first write to a zero page */
+    vka_object_t *zero_pool;
+    size_t zero_pool_count;
+    size_t zero_pool_size;
 };
 
-static res_tree *find_memory_reservation_by_addr(vm_t *vm, uintptr_t addr)
+static int reservation_index_cmp(const void *key, const void *elem)
+{
+    uintptr_t addr = *(const uintptr_t *)key;
+    const vm_memory_reservation_t *reservation = *(vm_memory_reservation_t *const *)elem;
+    if (addr < reservation->addr) {
+        return -1;
+    }
+    if (addr - reservation->addr >= reservation->size) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Position at which a reservation starting at addr belongs in the index */
+static int reservation_index_lower_bound(vm_memory_reservation_cookie_t *res_cookie, uintptr_t addr)
+{
+    int lo = 0;
+    int hi = res_cookie->num_res_index;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (res_cookie->res_index[mid]->addr < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int add_reservation_index(vm_t *vm, vm_memory_reservation_t *reservation)
 {
-    res_tree *result_node;
     vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
-    if (!res_cookie) {
-        ZF_LOGE("Failed to find memory reservation: VM memory backend not initialised");
-        return NULL;
+    vm_memory_reservation_t **extended_index = realloc(res_cookie->res_index,
+                                                       sizeof(vm_memory_reservation_t *) * (res_cookie->num_res_index + 1));
+    if (!extended_index) {
+        ZF_LOGE("Failed to index memory reservation: Unable to extend index");
+        return -1;
     }
-    res_tree search_node;
-    search_node.addr = addr;
-    search_node.size = 0;
-    /* Search the regular reservation tree to begin with */
-    result_node = sglib_res_tree_find_member(res_cookie->regular_res_tree, &search_node);
-    if (result_node) {
-        return result_node;
+    res_cookie->res_index = extended_index;
+    int pos = reservation_index_lower_bound(res_cookie, reservation->addr);
+    memmove(&res_cookie->res_index[pos + 1], &res_cookie->res_index[pos],
+            sizeof(vm_memory_reservation_t *) * (res_cookie->num_res_index - pos));
+    res_cookie->res_index[pos] = reservation;
+    res_cookie->num_res_index++;
+    return 0;
+}
+
+static void remove_reservation_index(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    int pos = reservation_index_lower_bound(res_cookie, reservation->addr);
+    if (pos >= res_cookie->num_res_index || res_cookie->res_index[pos] != reservation) {
+        return;
     }
-    /* Search the anonymous reservation tree if nothing found */
-    result_node = sglib_res_tree_find_member(res_cookie->anon_res_tree, &search_node);
-    return result_node;
+    res_cookie->num_res_index--;
+    memmove(&res_cookie->res_index[pos], &res_cookie->res_index[pos + 1],
+            sizeof(vm_memory_reservation_t *) * (res_cookie->num_res_index - pos));
+    res_cookie->res_generation++;
 }
 
 static void remove_memory_reservation_node(vm_t *vm,  uintptr_t addr, size_t size, reservation_type_t res_type)
@@ -222,6 +317,12 @@ static void free_vm_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
         return;
     }
     ps_io_ops_t *ops = vm->io_ops;
+    free(reservation->frame_runs);
+    if (reservation->dirty_bitmap) {
+        vm->mem.reservation_cookie->num_dirty_logging--;
+    }
+    free(reservation->dirty_bitmap);
+    free(reservation->shared_frames);
     ps_free(&ops->malloc_ops, sizeof(vm_memory_reservation_t), reservation);
 }
 
@@ -253,58 +354,469 @@ static vm_memory_reservation_t *allocate_vm_reservation(vm_t *vm, uintptr_t addr
     new_reservation->addr = addr;
     new_reservation->size = size;
     new_reservation->page_size_bits = 0;
+    new_reservation->prefault_addr = addr;
     new_reservation->vspace_reservation = vspace_reservation;
     return new_reservation;
 }
 
-static vm_memory_reservation_t *find_anon_reservation_by_addr(uintptr_t addr,
-                                                              anon_region_t *anon_region)
+/* Index of the first frame run that ends above addr */
+static int frame_run_lower_bound(vm_memory_reservation_t *reservation, uintptr_t addr)
 {
-    int num_anon_reservations;
-    vm_memory_reservation_t **reservations;
+    int lo = 0;
+    int hi = reservation->num_frame_runs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        frame_run_t *run = &reservation->frame_runs[mid];
+        if (run->addr + (run->num_frames << run->size_bits) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    if (!anon_region) {
-        ZF_LOGE("Failed to find anonymous reservation: anon region NULL");
-        return NULL;
+/* Record a frame mapped at addr. Frames may be mapped in any order, e.g. as the guest faults on
+ * chunks of a deferred reservation, so the runs are kept sorted for lookups */
+static int push_reservation_frame(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size_bits,
+                                  seL4_CapRights_t rights)
+{
+    int idx = frame_run_lower_bound(reservation, addr);
+    if (idx > 0) {
+        frame_run_t *run = &reservation->frame_runs[idx - 1];
+        if (run->size_bits == size_bits && run->addr + (run->num_frames << size_bits) == addr &&
+            run->rights.words[0] == rights.words[0]) {
+            run->num_frames++;
+            return 0;
+        }
+    }
+    if (idx < reservation->num_frame_runs) {
+        frame_run_t *run = &reservation->frame_runs[idx];
+        if (run->size_bits == size_bits && addr + BIT(size_bits) == run->addr &&
+            run->rights.words[0] == rights.words[0]) {
+            run->addr = addr;
+            run->num_frames++;
+            return 0;
+        }
+    }
+    frame_run_t *extended_runs = realloc(reservation->frame_runs,
+                                         sizeof(frame_run_t) * (reservation->num_frame_runs + 1));
+    if (!extended_runs) {
+        return -1;
     }
-    num_anon_reservations = anon_region->num_reservations;
-    reservations = anon_region->reservations;
+    reservation->frame_runs = extended_runs;
+    memmove(&extended_runs[idx + 1], &extended_runs[idx], sizeof(frame_run_t) * (reservation->num_frame_runs - idx));
+    extended_runs[idx].addr = addr;
+    extended_runs[idx].size_bits = size_bits;
+    extended_runs[idx].num_frames = 1;
+    extended_runs[idx].rights = rights;
+    reservation->num_frame_runs++;
+    return 0;
+}
 
-    if (!reservations) {
-        ZF_LOGE("Failed to find anonymous reservation: anon region has no reservations");
+static frame_run_t *find_frame_run(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    int idx = frame_run_lower_bound(reservation, addr);
+    if (idx < reservation->num_frame_runs && reservation->frame_runs[idx].addr <= addr) {
+        return &reservation->frame_runs[idx];
+    }
+    return NULL;
+}
+
+static vm_shared_frame_t *shared_frame_at(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    if (!reservation->shared_frames) {
         return NULL;
     }
+    return reservation->shared_frames[(addr - reservation->addr) >> seL4_PageBits];
+}
+
+/* Drop a page's reference to the shared frame it mapped. cow is set when the page was given a frame of its own */
+static void put_shared_frame(vm_memory_reservation_t *reservation, vm_shared_frame_t *shared, bool cow)
+{
+    if (shared == reservation->vm->mem.reservation_cookie->zero_frame) {
+        /* The zero frame lives as long as the VM */
+        shared->refs--;
+        return;
+    }
+    vm_merge_frame_put(shared, cow);
+}
+
+/* Drop the references held on shared frames by pages in [start, start + size), once they have been unmapped */
+static void put_shared_frames(vm_memory_reservation_t *reservation, uintptr_t start, size_t size)
+{
+    if (!reservation->shared_frames) {
+        return;
+    }
+    size_t first = (start - reservation->addr) >> seL4_PageBits;
+    size_t last = (start - reservation->addr + size - 1) >> seL4_PageBits;
+    for (size_t page = first; page <= last; page++) {
+        if (reservation->shared_frames[page]) {
+            put_shared_frame(reservation, reservation->shared_frames[page], false);
+            reservation->shared_frames[page] = NULL;
+        }
+    }
+}
+
+static void unmap_reservation_frames(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    put_shared_frames(reservation, reservation->addr, reservation->size);
+    for (int i = 0; i < reservation->num_frame_runs; i++) {
+        frame_run_t *run = &reservation->frame_runs[i];
+        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)run->addr, run->num_frames, run->size_bits, vm->vka);
+    }
+    free(reservation->frame_runs);
+    reservation->frame_runs = NULL;
+    reservation->num_frame_runs = 0;
+    reservation->mapped_bytes = 0;
+}
+
+static size_t dirty_log_words(vm_memory_reservation_t *reservation)
+{
+    size_t num_pages = ROUND_UP(reservation->size, BIT(seL4_PageBits)) >> seL4_PageBits;
+    return ROUND_UP(num_pages, DIRTY_LOG_WORD_BITS) / DIRTY_LOG_WORD_BITS;
+}
 
-    for (int i = 0; i < num_anon_reservations; i++) {
-        vm_memory_reservation_t *curr_res = reservations[i];
-        if (is_subregion(curr_res->addr, curr_res->size, addr, 1)) {
-            return curr_res;
+/* Sets or clears the dirty bits of every page in [start, start + size) */
+static void dirty_log_update(vm_memory_reservation_t *reservation, uintptr_t start, size_t size, bool dirty)
+{
+    size_t first = (start - reservation->addr) >> seL4_PageBits;
+    size_t end = MIN(reservation->size, start - reservation->addr + size);
+    size_t last = (end - 1) >> seL4_PageBits;
+    for (size_t page = first; page <= last; page++) {
+        unsigned long mask = 1ul << (page % DIRTY_LOG_WORD_BITS);
+        if (dirty) {
+            reservation->dirty_bitmap[page / DIRTY_LOG_WORD_BITS] |= mask;
+        } else {
+            reservation->dirty_bitmap[page / DIRTY_LOG_WORD_BITS] &= ~mask;
         }
     }
+}
 
-    return NULL;
+static int set_frame_writable(vm_memory_reservation_t *reservation, frame_run_t *run, uintptr_t frame_start,
+                              bool writable)
+{
+    seL4_CapRights_t rights = run->rights;
+    if (!writable || shared_frame_at(reservation, frame_start)) {
+        /* Shared frames stay read-only until copied on write */
+        rights = seL4_CapRights_set_capAllowWrite(rights, 0);
+    }
+    return guest_vspace_remap(&reservation->vm->mem.vm_vspace, (void *)frame_start, run->size_bits, rights);
+}
+
+static int set_reservation_writable(vm_memory_reservation_t *reservation, bool writable)
+{
+    for (int i = 0; i < reservation->num_frame_runs; i++) {
+        frame_run_t *run = &reservation->frame_runs[i];
+        if (!seL4_CapRights_get_capAllowWrite(run->rights)) {
+            continue;
+        }
+        for (size_t j = 0; j < run->num_frames; j++) {
+            int err = set_frame_writable(reservation, run, run->addr + (j << run->size_bits), writable);
+            if (err) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* A write to a frame that was write protected for dirty logging, or while it was compared for merging.
+ * The whole frame becomes writable again, so the whole frame is logged as dirty */
+static memory_fault_result_t handle_dirty_fault(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    frame_run_t *run = find_frame_run(reservation, addr);
+    if (!run || !seL4_CapRights_get_capAllowWrite(run->rights)) {
+        return FAULT_UNHANDLED;
+    }
+
+    uintptr_t frame_start = ROUND_DOWN(addr, BIT(run->size_bits));
+    int err = set_frame_writable(reservation, run, frame_start, true);
+    if (err) {
+        ZF_LOGE("Failed to log dirty page: Unable to make 0x%"PRIxPTR" writable", frame_start);
+        return FAULT_ERROR;
+    }
+    if (reservation->dirty_bitmap) {
+        dirty_log_update(reservation, frame_start, BIT(run->size_bits), true);
+    }
+    return FAULT_RESTART;
+}
+
+/* Delete the guest's cap to a frame that has been unmapped with VSPACE_PRESERVE, freeing the frame's
+ * untyped along with it when cookie is set, as vspace_unmap_pages does */
+static void free_guest_frame_cap(vm_t *vm, seL4_CPtr cap, uintptr_t cookie, size_t size_bits)
+{
+    cspacepath_t path;
+    vka_cspace_make_path(vm->vka, cap, &path);
+    vka_cnode_delete(&path);
+    vka_cspace_free(vm->vka, cap);
+    if (cookie) {
+        vka_utspace_free(vm->vka, kobject_get_type(KOBJECT_FRAME, size_bits), size_bits, cookie);
+    }
+}
+
+/* Map new_cap at page_start in place of the 4K frame mapped there, which is only released once new_cap is
+ * mapped. On failure the old frame is mapped back with old_rights */
+static int replace_guest_page(vm_memory_reservation_t *reservation, uintptr_t page_start, seL4_CPtr new_cap,
+                              uintptr_t new_cookie, seL4_CapRights_t new_rights, seL4_CapRights_t old_rights)
+{
+    vm_t *vm = reservation->vm;
+    seL4_CPtr old_cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)page_start);
+    uintptr_t old_cookie = vspace_get_cookie(&vm->mem.vm_vspace, (void *)page_start);
+
+    vspace_unmap_pages(&vm->mem.vm_vspace, (void *)page_start, 1, seL4_PageBits, VSPACE_PRESERVE);
+    int err = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &new_cap, &new_cookie,
+                                                        (void *)page_start, 1, seL4_PageBits, new_rights,
+                                                        reservation->vspace_reservation);
+    if (err) {
+        err = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &old_cap, &old_cookie,
+                                                        (void *)page_start, 1, seL4_PageBits, old_rights,
+                                                        reservation->vspace_reservation);
+        if (err) {
+            ZF_LOGE("Failed to map back page 0x%"PRIxPTR" into guest vm vspace", page_start);
+        }
+        return -1;
+    }
+    free_guest_frame_cap(vm, old_cap, old_cookie, seL4_PageBits);
+    return 0;
+}
+
+/* Allocate a 4K frame of zeros. The kernel clears frames retyped from RAM, frames of device memory are cleared here */
+static int alloc_zeroed_frame(vm_t *vm, vka_object_t *frame)
+{
+    if (!vka_alloc_frame(vm->vka, seL4_PageBits, frame)) {
+        return 0;
+    }
+    int err = vka_alloc_frame_maybe_device(vm->vka, seL4_PageBits, true, frame);
+    if (err) {
+        return -1;
+    }
+    void *vaddr = vspace_map_pages(&vm->mem.vmm_vspace, &frame->cptr, NULL, seL4_AllRights, 1, seL4_PageBits, 1);
+    if (!vaddr) {
+        vka_free_object(vm->vka, frame);
+        return -1;
+    }
+    memset(vaddr, 0, BIT(seL4_PageBits));
+    vspace_unmap_pages(&vm->mem.vmm_vspace, vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+    return 0;
+}
+
+/* Take a frame from the zero pool, only zeroing one on the spot when the pool has run dry */
+static int take_zeroed_frame(vm_t *vm, vka_object_t *frame)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (res_cookie->zero_pool_count) {
+        *frame = res_cookie->zero_pool[--res_cookie->zero_pool_count];
+        return 0;
+    }
+    return alloc_zeroed_frame(vm, frame);
+}
+
+/* Allocate a frame holding a copy of a shared frame */
+static int copy_shared_frame(vm_t *vm, vm_shared_frame_t *shared, vka_object_t *frame)
+{
+    int err = vka_alloc_frame(vm->vka, seL4_PageBits, frame);
+    if (err) {
+        return -1;
+    }
+    void *vaddr = vspace_map_pages(&vm->mem.vmm_vspace, &frame->cptr, NULL, seL4_AllRights, 1, seL4_PageBits, 1);
+    if (!vaddr) {
+        vka_free_object(vm->vka, frame);
+        return -1;
+    }
+    memcpy(vaddr, shared->vaddr, BIT(seL4_PageBits));
+    vspace_unmap_pages(&vm->mem.vmm_vspace, vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+    return 0;
+}
+
+/* Give the page at addr a frame of its own in place of the shared frame it is mapped to, either a copy
+ * of a merged frame or a zeroed frame for a page of the zero frame */
+static int unshare_page(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    vm_t *vm = reservation->vm;
+    uintptr_t page_start = ROUND_DOWN(addr, BIT(seL4_PageBits));
+    vm_shared_frame_t *shared = shared_frame_at(reservation, page_start);
+    frame_run_t *run = find_frame_run(reservation, page_start);
+
+    vka_object_t object;
+    int err;
+    if (shared == vm->mem.reservation_cookie->zero_frame) {
+        err = take_zeroed_frame(vm, &object);
+    } else {
+        err = copy_shared_frame(vm, shared, &object);
+    }
+    if (err) {
+        ZF_LOGE("Failed to unshare page 0x%"PRIxPTR": Unable to allocate frame", page_start);
+        return -1;
+    }
+
+    /* The guest's copy of the shared frame cap is deleted once the new frame is in place */
+    err = replace_guest_page(reservation, page_start, object.cptr, object.ut, run->rights, seL4_CanRead);
+    if (err) {
+        ZF_LOGE("Failed to unshare page 0x%"PRIxPTR": Unable to map frame into guest", page_start);
+        vka_free_object(vm->vka, &object);
+        return -1;
+    }
+    reservation->shared_frames[(page_start - reservation->addr) >> seL4_PageBits] = NULL;
+    if (reservation->dirty_bitmap) {
+        /* The new frame is mapped writable, so the write about to happen must be logged now */
+        dirty_log_update(reservation, page_start, BIT(seL4_PageBits), true);
+    }
+    put_shared_frame(reservation, shared, true);
+    return 0;
+}
+
+/* A write to a page mapped read-only, either a shared page or one write protected for dirty logging */
+static memory_fault_result_t handle_write_fault(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    if (shared_frame_at(reservation, ROUND_DOWN(addr, BIT(seL4_PageBits)))) {
+        return unshare_page(reservation, addr) ? FAULT_ERROR : FAULT_RESTART;
+    }
+    return handle_dirty_fault(reservation, addr);
+}
+
+static int alloc_shared_frame_table(vm_memory_reservation_t *reservation)
+{
+    if (!reservation->shared_frames) {
+        size_t num_pages = ROUND_UP(reservation->size, BIT(seL4_PageBits)) >> seL4_PageBits;
+        reservation->shared_frames = calloc(num_pages, sizeof(vm_shared_frame_t *));
+    }
+    return reservation->shared_frames ? 0 : -1;
+}
+
+/* Each mapping of a shared frame needs its own cap to the frame */
+static int copy_frame_cap(vm_t *vm, seL4_CPtr frame, cspacepath_t *dest)
+{
+    cspacepath_t src;
+    vka_cspace_make_path(vm->vka, frame, &src);
+    int err = vka_cspace_alloc_path(vm->vka, dest);
+    if (err) {
+        return -1;
+    }
+    err = vka_cnode_copy(dest, &src, seL4_AllRights);
+    if (err) {
+        vka_cspace_free_path(vm->vka, *dest);
+        return -1;
+    }
+    return 0;
+}
+
+/* Map the zero frame read-only at the untouched page containing addr */
+static int map_zero_page(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    vm_t *vm = reservation->vm;
+    vm_shared_frame_t *zero_frame = vm->mem.reservation_cookie->zero_frame;
+    uintptr_t page_start = ROUND_DOWN(addr, BIT(seL4_PageBits));
+    cspacepath_t cap;
+    if (alloc_shared_frame_table(reservation) || copy_frame_cap(vm, zero_frame->frame.cptr, &cap)) {
+        ZF_LOGE("Failed to map zero page 0x%"PRIxPTR": Unable to allocate zero frame cap", page_start);
+        return -1;
+    }
+
+    uintptr_t cookie = 0;
+    int err = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &cap.capPtr, &cookie, (void *)page_start,
+                                                        1, seL4_PageBits, seL4_CanRead,
+                                                        reservation->vspace_reservation);
+    if (err) {
+        ZF_LOGE("Failed to map zero page 0x%"PRIxPTR" into guest vm vspace", page_start);
+        vka_cnode_delete(&cap);
+        vka_cspace_free_path(vm->vka, cap);
+        return -1;
+    }
+    /* Recorded with the rights the page's own frame is mapped with on its first write */
+    err = push_reservation_frame(reservation, page_start, seL4_PageBits, seL4_AllRights);
+    if (err) {
+        ZF_LOGE("Failed to record zero page mapped at 0x%"PRIxPTR, page_start);
+        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)page_start, 1, seL4_PageBits, vm->vka);
+        return -1;
+    }
+    reservation->shared_frames[(page_start - reservation->addr) >> seL4_PageBits] = zero_frame;
+    zero_frame->refs++;
+    reservation->page_size_bits = seL4_PageBits;
+    reservation->mapped_bytes += BIT(seL4_PageBits);
+    return 0;
+}
+
+/* Map a private zeroed frame at the untouched page containing addr, when the first access to it is a write
+ * that would only copy the zero frame straight away */
+static int map_zeroed_page(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    vm_t *vm = reservation->vm;
+    uintptr_t page_start = ROUND_DOWN(addr, BIT(seL4_PageBits));
+    vka_object_t object;
+    if (take_zeroed_frame(vm, &object)) {
+        ZF_LOGE("Failed to map zeroed page 0x%"PRIxPTR": Unable to allocate frame", page_start);
+        return -1;
+    }
+
+    uintptr_t cookie = object.ut;
+    int err = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &object.cptr, &cookie,
+                                                        (void *)page_start, 1, seL4_PageBits, seL4_AllRights,
+                                                        reservation->vspace_reservation);
+    if (err) {
+        ZF_LOGE("Failed to map zeroed page 0x%"PRIxPTR" into guest vm vspace", page_start);
+        vka_free_object(vm->vka, &object);
+        return -1;
+    }
+    err = push_reservation_frame(reservation, page_start, seL4_PageBits, seL4_AllRights);
+    if (err) {
+        ZF_LOGE("Failed to record zeroed page mapped at 0x%"PRIxPTR, page_start);
+        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)page_start, 1, seL4_PageBits, vm->vka);
+        return -1;
+    }
+    if (reservation->dirty_bitmap) {
+        /* Mapped writable for the write about to happen, which must be logged now */
+        dirty_log_update(reservation, page_start, BIT(seL4_PageBits), true);
+    }
+    reservation->page_size_bits = seL4_PageBits;
+    reservation->mapped_bytes += BIT(seL4_PageBits);
+    return 0;
 }
 
 vm_memory_reservation_t *vm_reservation_find_by_addr(vm_t *vm, uintptr_t addr)
 {
-    res_tree *node = find_memory_reservation_by_addr(vm, addr);
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie) {
+        ZF_LOGE("Failed to find memory reservation: VM memory backend not initialised");
+        return NULL;
+    }
 
-    if (!node) {
+    vm_memory_reservation_t **result = bsearch(&addr, res_cookie->res_index, res_cookie->num_res_index,
+                                               sizeof(vm_memory_reservation_t *), reservation_index_cmp);
+    if (!result) {
         ZF_LOGW("No reservation for addr 0x%"PRIxPTR, addr);
         return NULL;
     }
 
-    if (node->res_type == MEM_REGULAR_RES) {
-        return (vm_memory_reservation_t *)node->data;
+    return *result;
+}
+
+static vm_memory_reservation_t *vcpu_find_reservation_by_addr(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!vcpu || !res_cookie) {
+        return vm_reservation_find_by_addr(vm, addr);
+    }
+
+    /* Faults tend to hit the same device or RAM region as last time */
+    vm_memory_reservation_t *cached = vcpu->last_fault_reservation;
+    if (cached && vcpu->last_fault_generation == res_cookie->res_generation &&
+        is_subregion(cached->addr, cached->size, addr, 1)) {
+        return cached;
     }
 
-    return find_anon_reservation_by_addr(addr, (anon_region_t *)node->data);
+    vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, addr);
+    if (reservation) {
+        vcpu->last_fault_reservation = reservation;
+        vcpu->last_fault_generation = res_cookie->res_generation;
+    }
+    return reservation;
 }
 
-memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size)
+memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size, bool write)
 {
     int err;
-    vm_memory_reservation_t *fault_reservation = vm_reservation_find_by_addr(vm, addr);
+    vm_memory_reservation_t *fault_reservation = vcpu_find_reservation_by_addr(vm, vcpu, addr);
     if (!fault_reservation) {
         ZF_LOGW("No reservation at 0x%"PRIxPTR", fault unhandled", addr);
         return FAULT_UNHANDLED;
@@ -315,11 +827,18 @@ memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
         return FAULT_ERROR;
     }
 
+    if (fault_reservation->dirty_bitmap || fault_reservation->shared_frames) {
+        memory_fault_result_t write_result = handle_write_fault(fault_reservation, addr);
+        if (write_result != FAULT_UNHANDLED) {
+            return write_result;
+        }
+    }
+
     if (!vm_reservation_is_mapped(fault_reservation) &&
-        vm_reservation_is_mappable(fault_reservation)) {
+        vm_reservation_is_mappable(fault_reservation) &&
+        !vm_reservation_page_size_bits_at(fault_reservation, addr)) {
         /* Deferred mapping */
-        err = map_vm_memory_reservation(vm, fault_reservation,
-                                        fault_reservation->memory_map_iterator, fault_reservation->memory_iterator_cookie);
+        err = vm_reservation_map_addr(fault_reservation, addr, write);
         if (err) {
             ZF_LOGE("Unable to handle memory fault: Failed to map memory");
             return FAULT_ERROR;
@@ -335,6 +854,118 @@ memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
     return fault_reservation->fault_callback(vm, vcpu, addr, size, fault_reservation->fault_callback_cookie);
 }
 
+memory_fault_result_t vm_memory_handle_dirty_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr)
+{
+    vm_memory_reservation_t *reservation = vcpu_find_reservation_by_addr(vm, vcpu, addr);
+    if (!reservation) {
+        return FAULT_UNHANDLED;
+    }
+    return handle_write_fault(reservation, addr);
+}
+
+void vm_memory_log_write(vm_t *vm, uintptr_t addr, size_t size)
+{
+    if (!vm->mem.reservation_cookie->num_dirty_logging || size == 0) {
+        return;
+    }
+    uintptr_t end = addr + size;
+    while (addr < end) {
+        vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, addr);
+        if (!reservation) {
+            addr = ROUND_DOWN(addr, BIT(seL4_PageBits)) + BIT(seL4_PageBits);
+            continue;
+        }
+        uintptr_t res_end = reservation->addr + reservation->size;
+        if (reservation->dirty_bitmap) {
+            dirty_log_update(reservation, addr, MIN(end, res_end) - addr, true);
+        }
+        addr = res_end;
+    }
+}
+
+int vm_set_dirty_log(vm_memory_reservation_t *reservation, bool enable)
+{
+    if (!reservation) {
+        ZF_LOGE("Failed to set dirty log: Invalid reservation");
+        return -1;
+    }
+
+    if (!enable) {
+        if (!reservation->dirty_bitmap) {
+            return 0;
+        }
+        int err = set_reservation_writable(reservation, true);
+        free(reservation->dirty_bitmap);
+        reservation->dirty_bitmap = NULL;
+        reservation->vm->mem.reservation_cookie->num_dirty_logging--;
+        if (err) {
+            ZF_LOGE("Failed to disable dirty log: Unable to make reservation writable");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (reservation->dirty_bitmap) {
+        return 0;
+    }
+    reservation->dirty_bitmap = calloc(dirty_log_words(reservation), sizeof(unsigned long));
+    if (!reservation->dirty_bitmap) {
+        ZF_LOGE("Failed to enable dirty log: Unable to allocate bitmap");
+        return -1;
+    }
+    reservation->vm->mem.reservation_cookie->num_dirty_logging++;
+    int err = set_reservation_writable(reservation, false);
+    if (err) {
+        ZF_LOGE("Failed to enable dirty log: Unable to write protect reservation");
+        vm_set_dirty_log(reservation, false);
+        return -1;
+    }
+    return 0;
+}
+
+size_t vm_dirty_log_bitmap_size(vm_memory_reservation_t *reservation)
+{
+    return reservation ? dirty_log_words(reservation) * sizeof(unsigned long) : 0;
+}
+
+int vm_get_dirty_log(vm_memory_reservation_t *reservation, unsigned long *bitmap, bool clear)
+{
+    if (!reservation || !reservation->dirty_bitmap) {
+        ZF_LOGE("Failed to get dirty log: Dirty logging not enabled on reservation");
+        return -1;
+    }
+
+    size_t num_words = dirty_log_words(reservation);
+    if (bitmap) {
+        memcpy(bitmap, reservation->dirty_bitmap, num_words * sizeof(unsigned long));
+    }
+    if (!clear) {
+        return 0;
+    }
+
+    /* Write protect each dirty frame again. Writes that land before this are already in
+     * the returned log, so the caller sees them when it reads the page contents */
+    for (size_t i = 0; i < num_words; i++) {
+        while (reservation->dirty_bitmap[i]) {
+            size_t page = i * DIRTY_LOG_WORD_BITS + CTZL(reservation->dirty_bitmap[i]);
+            uintptr_t addr = reservation->addr + (page << seL4_PageBits);
+            frame_run_t *run = find_frame_run(reservation, addr);
+            if (!run) {
+                dirty_log_update(reservation, addr, BIT(seL4_PageBits), false);
+                continue;
+            }
+            uintptr_t frame_start = ROUND_DOWN(addr, BIT(run->size_bits));
+            int err = set_frame_writable(reservation, run, frame_start, false);
+            if (err) {
+                ZF_LOGE("Failed to clear dirty log: Unable to write protect 0x%"PRIxPTR, frame_start);
+                return -1;
+            }
+            dirty_log_update(reservation, frame_start, BIT(run->size_bits), false);
+        }
+    }
+    return 0;
+}
+
 vm_memory_reservation_t *vm_reserve_memory_at(vm_t *vm, uintptr_t addr, size_t size,
                                               memory_fault_callback_fn fault_callback, void *cookie)
 {
@@ -372,6 +1003,13 @@ vm_memory_reservation_t *vm_reserve_memory_at(vm_t *vm, uintptr_t addr, size_t s
         free_vm_reservation(vm, new_reservation);
         return NULL;
     }
+    err = add_reservation_index(vm, new_reservation);
+    if (err) {
+        remove_memory_reservation_node(vm, addr, size, MEM_REGULAR_RES);
+        vspace_free_reservation(&vm->mem.vm_vspace, vspace_reservation);
+        free_vm_reservation(vm, new_reservation);
+        return NULL;
+    }
     return new_reservation;
 }
 
@@ -448,6 +1086,12 @@ vm_memory_reservation_t *vm_reserve_anon_memory(vm_t *vm, size_t size, size_t al
     }
     allocable_region->reservations = extended_reservations;
 
+    err = add_reservation_index(vm, new_reservation);
+    if (err) {
+        free_vm_reservation(vm, new_reservation);
+        return NULL;
+    }
+
     allocable_region->reservations[allocable_region->num_reservations] = new_reservation;
     allocable_region->alloc_addr = reservation_addr + ROUND_UP(size, BIT(seL4_PageBits));
     allocable_region->num_reservations += 1;
@@ -472,11 +1116,8 @@ int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation)
     }
 
     remove_memory_reservation_node(vm, reservation->addr, reservation->size, reservation->res_type);
-    if (vm_reservation_is_mapped(reservation)) {
-        size_t page_size = vm_reservation_page_size_bits(reservation);
-        int num_pages = ROUND_UP(reservation->size, BIT(page_size)) >> page_size;
-        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)reservation->addr, num_pages, page_size, vm->vka);
-    }
+    remove_reservation_index(vm, reservation);
+    unmap_reservation_frames(vm, reservation);
     vspace_free_reservation(&vm->mem.vm_vspace, reservation->vspace_reservation);
     free_vm_reservation(vm, reservation);
     return 0;
@@ -487,6 +1128,96 @@ int vm_reservation_free(vm_memory_reservation_t *reservation)
     return vm_free_reserved_memory(reservation->vm, reservation);
 }
 
+static int map_reservation_range(vm_t *vm, vm_memory_reservation_t *vm_reservation,
+                                 memory_map_iterator_fn map_iterator, void *map_cookie,
+                                 uintptr_t start, size_t size)
+{
+    uintptr_t current_addr = start;
+    uintptr_t end_addr = start + size;
+    uintptr_t reservation_end = vm_reservation->addr + vm_reservation->size;
+
+    while (current_addr < end_addr) {
+        size_t mapped_bits = vm_reservation_page_size_bits_at(vm_reservation, current_addr);
+        if (mapped_bits) {
+            /* Already backed, e.g. by an earlier demand fault */
+            current_addr = ROUND_DOWN(current_addr, BIT(mapped_bits)) + BIT(mapped_bits);
+            continue;
+        }
+
+        vm_frame_t reservation_frame = map_iterator(current_addr, map_cookie);
+
+        if (reservation_frame.cptr == seL4_CapNull) {
+            ZF_LOGE("Failed to get frame for reservation address 0x%"PRIxPTR, current_addr);
+            return -1;
+        }
+
+        if (reservation_end - current_addr < BIT(reservation_frame.size_bits)) {
+            ZF_LOGE("Mapping frame of size %zu to 0x%"PRIxPTR "overflows reservation %zu bytes at 0x%"PRIxPTR,
+                    BIT(reservation_frame.size_bits), current_addr,
+                    vm_reservation->size, vm_reservation->addr);
+            return -1;
+        }
+
+        if (vm_reservation_range_is_mapped(vm_reservation, reservation_frame.vaddr, BIT(reservation_frame.size_bits))) {
+            ZF_LOGE("Mapping frame of size %zu to 0x%"PRIxPTR" overlaps frames already mapped",
+                    BIT(reservation_frame.size_bits), reservation_frame.vaddr);
+            return -1;
+        }
+
+        seL4_CapRights_t map_rights = reservation_frame.rights;
+        if (vm_reservation->dirty_bitmap) {
+            /* Catch the first write so it can be logged */
+            map_rights = seL4_CapRights_set_capAllowWrite(map_rights, 0);
+        }
+        /* Storing the allocator cookie means the frame's untyped is freed along with it on unmap */
+        int ret = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &reservation_frame.cptr,
+                                                            &reservation_frame.cookie,
+                                                            (void *)reservation_frame.vaddr, 1, reservation_frame.size_bits,
+                                                            map_rights, vm_reservation->vspace_reservation);
+        if (ret) {
+            ZF_LOGE("Failed to map address 0x%"PRIxPTR" into guest vm vspace", reservation_frame.vaddr);
+            return -1;
+        }
+
+        ret = push_reservation_frame(vm_reservation, reservation_frame.vaddr, reservation_frame.size_bits,
+                                     reservation_frame.rights);
+        if (ret) {
+            ZF_LOGE("Failed to record frame mapped at 0x%"PRIxPTR, reservation_frame.vaddr);
+            vspace_unmap_pages(&vm->mem.vm_vspace, (void *)reservation_frame.vaddr, 1, reservation_frame.size_bits,
+                               vm->vka);
+            return -1;
+        }
+
+        if (!vm_reservation->page_size_bits || reservation_frame.size_bits < vm_reservation->page_size_bits) {
+            vm_reservation->page_size_bits = reservation_frame.size_bits;
+        }
+        vm_reservation->mapped_bytes += BIT(reservation_frame.size_bits);
+        current_addr += BIT(reservation_frame.size_bits);
+    }
+
+    return 0;
+}
+
+static int map_reservation_chunk(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    uintptr_t chunk_start = ROUND_DOWN(addr, BIT(DEMAND_MAP_CHUNK_BITS));
+    uintptr_t start = MAX(reservation->addr, chunk_start);
+    uintptr_t end = MIN(reservation->addr + reservation->size, chunk_start + BIT(DEMAND_MAP_CHUNK_BITS));
+
+    int err = map_reservation_range(reservation->vm, reservation, reservation->memory_map_iterator,
+                                    reservation->memory_iterator_cookie, start, end - start);
+    if (err) {
+        return -1;
+    }
+
+    if (vm_reservation_is_mapped(reservation)) {
+        reservation->memory_map_iterator = NULL;
+        reservation->memory_iterator_cookie = NULL;
+        reservation->released = false;
+    }
+    return 0;
+}
+
 int map_vm_memory_reservation(vm_t *vm, vm_memory_reservation_t *vm_reservation,
                               memory_map_iterator_fn map_iterator, void *map_cookie)
 {
@@ -509,61 +1240,121 @@ int map_vm_memory_reservation(vm_t *vm, vm_memory_reservation_t *vm_reservation,
         return -1;
     }
 
-    uintptr_t current_addr = vm_reservation->addr;
-    size_t bytes_left = vm_reservation->size;
-    size_t page_size_bits = 0;
+    int err = map_reservation_range(vm, vm_reservation, map_iterator, map_cookie, vm_reservation->addr,
+                                    vm_reservation->size);
+    if (err) {
+        return err;
+    }
 
-    while (bytes_left) {
-        vm_frame_t reservation_frame = map_iterator(current_addr, map_cookie);
+    vm_reservation->memory_map_iterator = NULL;
+    vm_reservation->memory_iterator_cookie = NULL;
+    vm_reservation->released = false;
 
-        if (reservation_frame.cptr == seL4_CapNull) {
-            ZF_LOGE("Failed to get frame for reservation address 0x%"PRIxPTR, current_addr);
-            break;
-        }
+    return vm_reservation_is_mapped(vm_reservation) ? 0 : -1;
+}
 
-        if (bytes_left < BIT(reservation_frame.size_bits)) {
-            ZF_LOGE("Mapping frame of size %zu to 0x%"PRIxPTR "overflows reservation %zu bytes at 0x%"PRIxPTR,
-                    BIT(reservation_frame.size_bits), current_addr,
-                    vm_reservation->size, vm_reservation->addr);
-            break;
-        }
+int vm_reservation_map(vm_memory_reservation_t *reservation)
+{
+    return map_vm_memory_reservation(reservation->vm, reservation,
+                                     reservation->memory_map_iterator,
+                                     reservation->memory_iterator_cookie);
+}
 
-        if (page_size_bits != reservation_frame.size_bits) {
-            if (!page_size_bits) {
-                page_size_bits = reservation_frame.size_bits;
-            } else {
-                ZF_LOGE("Mixed page sizes within reservation not supported");
-                break;
-            }
-        }
+int vm_reservation_map_addr(vm_memory_reservation_t *reservation, uintptr_t addr, bool write)
+{
+    if (vm_reservation_is_mapped(reservation) || vm_reservation_page_size_bits_at(reservation, addr)) {
+        return 0;
+    }
 
-        int ret = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &reservation_frame.cptr, NULL,
-                                                            (void *)reservation_frame.vaddr, 1, reservation_frame.size_bits,
-                                                            reservation_frame.rights, vm_reservation->vspace_reservation);
-        if (ret) {
-            ZF_LOGE("Failed to map address 0x%"PRIxPTR" into guest vm vspace", reservation_frame.vaddr);
-            break;
+    if (reservation->zero_fill || reservation->released) {
+        /* Only back what is touched, the rest stays as the zero frame or with the allocator */
+        int err;
+        if (reservation->zero_fill) {
+            err = write ? map_zeroed_page(reservation, addr) : map_zero_page(reservation, addr);
+        } else {
+            err = map_reservation_range(reservation->vm, reservation, reservation->memory_map_iterator,
+                                        reservation->memory_iterator_cookie, ROUND_DOWN(addr, BIT(seL4_PageBits)),
+                                        BIT(seL4_PageBits));
+        }
+        if (!err && vm_reservation_is_mapped(reservation)) {
+            reservation->memory_map_iterator = NULL;
+            reservation->memory_iterator_cookie = NULL;
+            reservation->released = false;
         }
+        return err;
+    }
 
-        /* No underflow here: bytes_left >= frame size, see check above */
-        bytes_left -= BIT(reservation_frame.size_bits);
-        current_addr += BIT(reservation_frame.size_bits);
+    if (!DEMAND_MAP_CHUNK_BITS) {
+        return vm_reservation_map(reservation);
     }
 
-    vm_reservation->memory_map_iterator = NULL;
-    vm_reservation->memory_iterator_cookie = NULL;
-    if (!bytes_left) {
-        vm_reservation->page_size_bits = page_size_bits;
+    if (!reservation->memory_map_iterator) {
+        ZF_LOGE("Failed to map 0x%"PRIxPTR": reservation has no map iterator", addr);
+        return -1;
     }
 
-    return vm_reservation_is_mapped(vm_reservation) ? 0 : -1;
+    return map_reservation_chunk(reservation, addr);
 }
 
-int vm_reservation_map(vm_memory_reservation_t *reservation)
+static int prefault_reservation(vm_memory_reservation_t *reservation, size_t *budget)
 {
-    return map_vm_memory_reservation(reservation->vm, reservation,
-                                     reservation->memory_map_iterator,
-                                     reservation->memory_iterator_cookie);
+    while (*budget && !vm_reservation_is_mapped(reservation)) {
+        if (!reservation->memory_map_iterator || reservation->released || reservation->zero_fill) {
+            /* Not lazily mapped, or mapping would take back memory the guest isn't using */
+            return 0;
+        }
+        if (reservation->prefault_addr - reservation->addr >= reservation->size) {
+            reservation->prefault_addr = reservation->addr;
+        }
+
+        size_t mapped_before = reservation->mapped_bytes;
+        int err;
+        if (!DEMAND_MAP_CHUNK_BITS) {
+            err = vm_reservation_map(reservation);
+        } else {
+            err = map_reservation_chunk(reservation, reservation->prefault_addr);
+            reservation->prefault_addr = ROUND_DOWN(reservation->prefault_addr, BIT(DEMAND_MAP_CHUNK_BITS)) +
+                                         BIT(DEMAND_MAP_CHUNK_BITS);
+        }
+        if (err) {
+            ZF_LOGE("Failed to prefault reservation at 0x%"PRIxPTR, reservation->addr);
+            return -1;
+        }
+        *budget -= MIN(*budget, reservation->mapped_bytes - mapped_before);
+    }
+    return 0;
+}
+
+int vm_memory_prefault(vm_t *vm, size_t max_bytes)
+{
+    struct sglib_res_tree_iterator it;
+    res_tree *node;
+    size_t budget = max_bytes;
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie) {
+        ZF_LOGE("Failed to prefault memory: VM memory backend not initialised");
+        return -1;
+    }
+
+    for (node = sglib_res_tree_it_init_inorder(&it, res_cookie->regular_res_tree); node != NULL && budget;
+         node = sglib_res_tree_it_next(&it)) {
+        if (prefault_reservation((vm_memory_reservation_t *)node->data, &budget)) {
+            return -1;
+        }
+    }
+
+    for (node = sglib_res_tree_it_init_inorder(&it, res_cookie->anon_res_tree); node != NULL && budget;
+         node = sglib_res_tree_it_next(&it)) {
+        anon_region_t *region = (anon_region_t *)node->data;
+        for (int i = 0; i < region->num_reservations && budget; i++) {
+            if (prefault_reservation(region->reservations[i], &budget)) {
+                return -1;
+            }
+        }
+    }
+
+    /* An exhausted budget means there may be more left to map */
+    return budget ? 0 : 1;
 }
 
 int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation,
@@ -583,7 +1374,7 @@ int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation,
 
     reservation->memory_map_iterator = map_iterator;
     reservation->memory_iterator_cookie = cookie;
-    if (!config_set(CONFIG_LIB_SEL4VM_DEFER_MEMORY_MAP)) {
+    if (!config_set(CONFIG_LIB_SEL4VM_DEFER_MEMORY_MAP) && !reservation->zero_fill) {
         err = vm_reservation_map(reservation);
         /* We remove the iterator after attempting the mapping (regardless of success or fail)
          * If failed its left to the caller to update the memory map iterator */
@@ -603,6 +1394,216 @@ int vm_reservation_map_lazy(vm_memory_reservation_t *reservation,
     return vm_map_reservation(reservation->vm, reservation, map_iterator, cookie);
 }
 
+void vm_reservation_set_refill(vm_memory_reservation_t *reservation, memory_map_iterator_fn refill_iterator,
+                               void *cookie)
+{
+    reservation->refill_iterator = refill_iterator;
+    reservation->refill_cookie = cookie;
+}
+
+int vm_reservation_release(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size, size_t *released)
+{
+    vm_t *vm = reservation->vm;
+    *released = 0;
+    if (!reservation->refill_iterator) {
+        ZF_LOGE("Failed to release memory at 0x%"PRIxPTR": Reservation cannot be refilled", addr);
+        return -1;
+    }
+    if (!is_subregion(reservation->addr, reservation->size, addr, size)) {
+        ZF_LOGE("Failed to release memory at 0x%"PRIxPTR": Invalid region", addr);
+        return -1;
+    }
+    uintptr_t end = addr + size;
+
+    /* The released range is contiguous, so at most one run is split in two */
+    frame_run_t *runs = malloc(sizeof(frame_run_t) * (reservation->num_frame_runs + 1));
+    if (!runs) {
+        ZF_LOGE("Failed to release memory at 0x%"PRIxPTR": Unable to allocate frame runs", addr);
+        return -1;
+    }
+    int num_runs = 0;
+    for (int i = 0; i < reservation->num_frame_runs; i++) {
+        frame_run_t *run = &reservation->frame_runs[i];
+        size_t frame_size = BIT(run->size_bits);
+        uintptr_t run_end = run->addr + (run->num_frames << run->size_bits);
+        /* Only frames lying entirely within the range are released */
+        uintptr_t release_start = MIN(MAX(ROUND_UP(addr, frame_size), run->addr), run_end);
+        uintptr_t release_end = MAX(MIN(ROUND_DOWN(end, frame_size), run_end), release_start);
+        if (release_start == release_end) {
+            runs[num_runs++] = *run;
+            continue;
+        }
+
+        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)release_start, (release_end - release_start) >> run->size_bits,
+                           run->size_bits, vm->vka);
+        put_shared_frames(reservation, release_start, release_end - release_start);
+        if (release_start > run->addr) {
+            runs[num_runs] = *run;
+            runs[num_runs++].num_frames = (release_start - run->addr) >> run->size_bits;
+        }
+        if (release_end < run_end) {
+            runs[num_runs] = *run;
+            runs[num_runs].addr = release_end;
+            runs[num_runs++].num_frames = (run_end - release_end) >> run->size_bits;
+        }
+        if (reservation->dirty_bitmap) {
+            /* The contents of released pages are lost */
+            dirty_log_update(reservation, release_start, release_end - release_start, true);
+        }
+        *released += release_end - release_start;
+    }
+    free(reservation->frame_runs);
+    reservation->frame_runs = runs;
+    reservation->num_frame_runs = num_runs;
+
+    if (*released) {
+        reservation->mapped_bytes -= *released;
+        reservation->memory_map_iterator = reservation->refill_iterator;
+        reservation->memory_iterator_cookie = reservation->refill_cookie;
+        reservation->released = true;
+    }
+    return 0;
+}
+
+bool vm_reservation_can_release(vm_memory_reservation_t *reservation)
+{
+    return reservation->refill_iterator != NULL;
+}
+
+bool vm_reservation_is_released(vm_memory_reservation_t *reservation)
+{
+    return reservation->released;
+}
+
+bool vm_reservation_page_mergeable(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    frame_run_t *run = find_frame_run(reservation, addr);
+    /* Large frames are left alone, as are pages being logged for migration */
+    return run && run->size_bits == seL4_PageBits && seL4_CapRights_get_capAllowWrite(run->rights) &&
+           !reservation->dirty_bitmap && !shared_frame_at(reservation, addr);
+}
+
+static int compare_page_callback(void *access_addr, void *vaddr, void *cookie)
+{
+    return memcmp(vaddr, cookie, BIT(seL4_PageBits)) ? 1 : 0;
+}
+
+int vm_reservation_share_page(vm_memory_reservation_t *reservation, uintptr_t addr, vm_shared_frame_t *shared)
+{
+    vm_t *vm = reservation->vm;
+    if (!vm_reservation_page_mergeable(reservation, addr)) {
+        return -1;
+    }
+    if (alloc_shared_frame_table(reservation)) {
+        ZF_LOGE("Failed to share page 0x%"PRIxPTR": Unable to allocate shared frame table", addr);
+        return -1;
+    }
+
+    /* Write protect the page before the final compare, so the guest can't change it between the
+     * compare and the swap. A write in between faults and waits for the swap to finish */
+    frame_run_t *run = find_frame_run(reservation, addr);
+    int err = set_frame_writable(reservation, run, addr, false);
+    if (err) {
+        ZF_LOGE("Failed to share page 0x%"PRIxPTR": Unable to write protect page", addr);
+        return -1;
+    }
+    int changed = vspace_access_page_with_callback(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)addr,
+                                                   seL4_PageBits, seL4_CanRead, 1, compare_page_callback,
+                                                   shared->vaddr);
+    cspacepath_t dest;
+    if (!changed) {
+        err = copy_frame_cap(vm, shared->frame.cptr, &dest);
+        if (err) {
+            ZF_LOGE("Failed to share page 0x%"PRIxPTR": Unable to copy frame cap", addr);
+            changed = -1;
+        }
+    }
+    if (changed) {
+        if (set_frame_writable(reservation, run, addr, true)) {
+            ZF_LOGE("Failed to share page 0x%"PRIxPTR": Unable to make page writable again", addr);
+            return -1;
+        }
+        return changed < 0 ? -1 : 1;
+    }
+
+    /* The page's own frame is freed once the copy of the shared frame cap, which is not backed by an
+     * untyped of its own, is mapped in its place */
+    err = replace_guest_page(reservation, addr, dest.capPtr, 0, seL4_CapRights_set_capAllowWrite(run->rights, 0),
+                             run->rights);
+    if (err) {
+        ZF_LOGE("Failed to share page 0x%"PRIxPTR": Unable to map shared frame into guest", addr);
+        vka_cnode_delete(&dest);
+        vka_cspace_free_path(vm->vka, dest);
+        return -1;
+    }
+    reservation->shared_frames[(addr - reservation->addr) >> seL4_PageBits] = shared;
+    shared->refs++;
+    return 0;
+}
+
+int vm_reservation_unshare(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size)
+{
+    if (!reservation->shared_frames) {
+        return 0;
+    }
+    uintptr_t end = addr + size;
+    for (uintptr_t page = ROUND_DOWN(addr, BIT(seL4_PageBits)); page < end; page += BIT(seL4_PageBits)) {
+        if (shared_frame_at(reservation, page) && unshare_page(reservation, page)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void vm_reservation_set_zero_fill(vm_memory_reservation_t *reservation)
+{
+    reservation->zero_fill = reservation->vm->mem.reservation_cookie->zero_frame != NULL;
+}
+
+int vm_memory_enable_zero_pages(vm_t *vm, size_t pool_size)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (res_cookie->zero_frame) {
+        ZF_LOGE("Failed to enable zero pages: Already enabled");
+        return -1;
+    }
+    vm_shared_frame_t *zero_frame = calloc(1, sizeof(*zero_frame));
+    vka_object_t *pool = calloc(MAX(pool_size, 1), sizeof(vka_object_t));
+    if (!zero_frame || !pool) {
+        ZF_LOGE("Failed to enable zero pages: Unable to allocate zero pool");
+        free(zero_frame);
+        free(pool);
+        return -1;
+    }
+    if (alloc_zeroed_frame(vm, &zero_frame->frame)) {
+        ZF_LOGE("Failed to enable zero pages: Unable to allocate zero frame");
+        free(zero_frame);
+        free(pool);
+        return -1;
+    }
+    res_cookie->zero_frame = zero_frame;
+    res_cookie->zero_pool = pool;
+    res_cookie->zero_pool_size = pool_size;
+    return 0;
+}
+
+int vm_memory_refill_zero_pool(vm_t *vm, size_t max_pages)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie->zero_frame) {
+        ZF_LOGE("Failed to refill zero pool: Zero pages not enabled");
+        return -1;
+    }
+    for (; max_pages && res_cookie->zero_pool_count < res_cookie->zero_pool_size; max_pages--) {
+        if (alloc_zeroed_frame(vm, &res_cookie->zero_pool[res_cookie->zero_pool_count])) {
+            ZF_LOGE("Failed to refill zero pool: Unable to allocate frame");
+            return -1;
+        }
+        res_cookie->zero_pool_count++;
+    }
+    return res_cookie->zero_pool_count < res_cookie->zero_pool_size ? 1 : 0;
+}
+
 static vm_frame_t frames_map_memory_iterator(uintptr_t page_start, void *cookie)
 {
     vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
@@ -659,12 +1660,43 @@ vm_mem_t *vm_reservation_guest_memory(vm_memory_reservation_t *reservation)
 
 size_t vm_reservation_page_size_bits(vm_memory_reservation_t *reservation)
 {
-    return reservation ? reservation->page_size_bits : 0;
+    return vm_reservation_is_mapped(reservation) ? reservation->page_size_bits : 0;
+}
+
+size_t vm_reservation_page_size_bits_at(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    if (!reservation) {
+        return 0;
+    }
+    int idx = frame_run_lower_bound(reservation, addr);
+    if (idx < reservation->num_frame_runs && reservation->frame_runs[idx].addr <= addr) {
+        return reservation->frame_runs[idx].size_bits;
+    }
+    return 0;
+}
+
+bool vm_reservation_range_is_mapped(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size)
+{
+    int idx = frame_run_lower_bound(reservation, addr);
+    if (idx >= reservation->num_frame_runs) {
+        return false;
+    }
+    uintptr_t run_addr = reservation->frame_runs[idx].addr;
+    return run_addr <= addr || run_addr - addr < size;
+}
+
+size_t vm_memory_page_size_bits(vm_t *vm, uintptr_t addr)
+{
+    vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, addr);
+    if (!reservation) {
+        return 0;
+    }
+    return vm_reservation_page_size_bits_at(reservation, addr);
 }
 
 bool vm_reservation_is_mapped(vm_memory_reservation_t *reservation)
 {
-    return vm_reservation_page_size_bits(reservation) != 0;
+    return reservation && reservation->mapped_bytes && reservation->mapped_bytes == reservation->size;
 }
 
 bool vm_reservation_is_mappable(vm_memory_reservation_t *reservation)
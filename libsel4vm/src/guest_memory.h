@@ -9,6 +9,11 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 
+typedef struct vm_shared_frame vm_shared_frame_t;
+
+/* Number of pages tracked by each word of a dirty log bitmap */
+#define DIRTY_LOG_WORD_BITS (sizeof(unsigned long) * 8)
+
 /**
  * Check whether a region is a subregion of another region
  * @param {uintptr_t} start           Start of parent region
@@ -49,6 +54,50 @@ vm_mem_t *vm_reservation_guest_memory(vm_memory_reservation_t *reservation);
  */
 int vm_reservation_map(vm_memory_reservation_t *reservation);
 
+/* Ensure addr within a lazily mapped reservation is backed, mapping either the
+ * whole reservation or just the chunk around addr when demand mapping is enabled.
+ * A zero filled page about to be written gets a private frame rather than the zero frame */
+int vm_reservation_map_addr(vm_memory_reservation_t *reservation, uintptr_t addr, bool write);
+
+/* Whether any frame is mapped within [addr, addr + size) of the reservation */
+bool vm_reservation_range_is_mapped(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size);
+
+/* Set the iterator used to map fresh frames over memory released from the reservation */
+void vm_reservation_set_refill(vm_memory_reservation_t *reservation, memory_map_iterator_fn refill_iterator,
+                               void *cookie);
+
+/* Unmap the frames lying entirely within [addr, addr + size) of the reservation and return them to the
+ * allocator, setting released to the number of bytes freed. Faults on released memory map fresh frames */
+int vm_reservation_release(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size, size_t *released);
+
+/* Whether the reservation has a refill iterator, so its memory can be released */
+bool vm_reservation_can_release(vm_memory_reservation_t *reservation);
+
+/* Whether memory has been released from the reservation, faults then map single pages */
+bool vm_reservation_is_released(vm_memory_reservation_t *reservation);
+
+/* Whether the page at addr is backed by a private, writable 4K frame that can be merged */
+bool vm_reservation_page_mergeable(vm_memory_reservation_t *reservation, uintptr_t addr);
+
+/* Replace the frame backing the page at addr with a read-only mapping of a shared frame, freeing the page's
+ * own frame. The page is write protected and compared with the shared frame first, and is left alone if it
+ * no longer matches. The page gets a private copy of the frame again when it is next written.
+ * Returns 0 once shared, 1 if the contents differ and -1 on error */
+int vm_reservation_share_page(vm_memory_reservation_t *reservation, uintptr_t addr, vm_shared_frame_t *shared);
+
+/* Give any shared pages in [addr, addr + size) of the reservation private copies, ahead of a VMM write */
+int vm_reservation_unshare(vm_memory_reservation_t *reservation, uintptr_t addr, size_t size);
+
+/* Map untouched pages of the reservation to the VM's zero frame on fault, giving each page a zeroed frame of its
+ * own on its first write. Has no effect unless zero pages have been enabled for the VM */
+void vm_reservation_set_zero_fill(vm_memory_reservation_t *reservation);
+
+/* Allocate the VM's zero frame and a pool of pool_size zeroed frames, filled by vm_memory_refill_zero_pool */
+int vm_memory_enable_zero_pages(vm_t *vm, size_t pool_size);
+
+/* Zero up to max_pages frames for the zero pool. Returns 1 if the pool is still short, 0 once full, -1 on error */
+int vm_memory_refill_zero_pool(vm_t *vm, size_t max_pages);
+
 /***
  * @function vm_reservation_map_lazy(reservation)
  * Create a request for deferred mapping of reservation into the VM's virtual address space.
@@ -66,9 +115,13 @@ int vm_reservation_map_lazy(vm_memory_reservation_t *reservation,
  * @param {vm_vcpu_t *} vcpu        A handle to the faulting vcpu
  * @param {uintptr_t} addr          Faulting address
  * @param {size_t} size             Size of the faulting region
+ * @param {bool} write              The fault was caused by a write
  * @return                          Fault handling status code: HANDLED, UNHANDLED, RESTART, ERROR
  */
-memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size);
+memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size, bool write);
+
+/* Handles a write to a page write protected for dirty logging, FAULT_UNHANDLED if it was not one */
+memory_fault_result_t vm_memory_handle_dirty_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr);
 
 /**
  * Map a vm memory reservation - this invokation is performed immediately (mapping is not deferred)
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_merge.h>
+
+#include "guest_memory.h"
+#include "guest_merge.h"
+
+#define PAGE_SIZE_4K BIT(seL4_PageBits)
+
+/* Number of hash buckets for shared frames */
+#define SHARED_BUCKETS 4096
+
+/* Marks the end of an unstable bucket chain */
+#define NO_PAGE UINT32_MAX
+
+/* A reservation backing guest RAM, its pages numbered consecutively after those of the previous region */
+typedef struct merge_region {
+    vm_t *vm;
+    vm_memory_reservation_t *reservation;
+    uintptr_t addr;
+    size_t first_page;
+    size_t num_pages;
+} merge_region_t;
+
+struct vm_merge {
+    vka_t *vka;
+    vspace_t *vmm_vspace;
+    merge_region_t *regions;
+    int num_regions;
+    size_t num_pages;
+    /* Checksum of each page seen on the previous pass, pages are only merged once their contents settle */
+    uint32_t *checksums;
+    /* Pages seen during this pass that are not shared, chained by hash bucket. Rebuilt on every pass
+     * as their contents may change at any time */
+    uint32_t *unstable_heads;
+    uint32_t *unstable_next;
+    uint64_t *unstable_hash;
+    size_t unstable_mask;
+    /* Shared frames by hash */
+    vm_shared_frame_t *shared[SHARED_BUCKETS];
+    /* Next page to scan and the region it lies in */
+    size_t cursor;
+    int cursor_region;
+    vm_merge_stats_t stats;
+    /* Contents of the page being scanned and of a candidate match */
+    uint64_t page[PAGE_SIZE_4K / sizeof(uint64_t)];
+    uint64_t candidate[PAGE_SIZE_4K / sizeof(uint64_t)];
+};
+
+static uint64_t hash_page(const uint64_t *words)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < PAGE_SIZE_4K / sizeof(uint64_t); i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static int read_page_callback(void *access_addr, void *vaddr, void *cookie)
+{
+    memcpy(cookie, vaddr, PAGE_SIZE_4K);
+    return 0;
+}
+
+/* Read a guest page without going through vm_ram_touch, which would unshare it */
+static int read_page(vm_t *vm, uintptr_t addr, uint64_t *buf)
+{
+    return vspace_access_page_with_callback(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)addr, seL4_PageBits,
+                                            seL4_CanRead, 1, read_page_callback, buf);
+}
+
+static merge_region_t *find_region(vm_merge_t *merge, size_t index)
+{
+    int lo = 0;
+    int hi = merge->num_regions - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (merge->regions[mid].first_page <= index) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &merge->regions[lo];
+}
+
+static uintptr_t region_page_addr(merge_region_t *region, size_t index)
+{
+    return region->addr + ((index - region->first_page) << seL4_PageBits);
+}
+
+static void free_shared_frame(vm_shared_frame_t *shared)
+{
+    vm_merge_t *merge = shared->merge;
+    vm_shared_frame_t **link = &merge->shared[shared->hash % SHARED_BUCKETS];
+    while (*link != shared) {
+        link = &(*link)->next;
+    }
+    *link = shared->next;
+    vspace_unmap_pages(merge->vmm_vspace, shared->vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+    vka_free_object(merge->vka, &shared->frame);
+    merge->stats.pages_shared--;
+    free(shared);
+}
+
+static vm_shared_frame_t *new_shared_frame(vm_merge_t *merge, uint64_t hash, const uint64_t *contents)
+{
+    vm_shared_frame_t *shared = calloc(1, sizeof(*shared));
+    if (!shared) {
+        ZF_LOGE("Failed to create shared frame: Unable to allocate shared frame");
+        return NULL;
+    }
+    int err = vka_alloc_frame(merge->vka, seL4_PageBits, &shared->frame);
+    if (err) {
+        ZF_LOGE("Failed to create shared frame: Unable to allocate frame");
+        free(shared);
+        return NULL;
+    }
+    shared->vaddr = vspace_map_pages(merge->vmm_vspace, &shared->frame.cptr, NULL, seL4_AllRights, 1,
+                                     seL4_PageBits, 1);
+    if (!shared->vaddr) {
+        ZF_LOGE("Failed to create shared frame: Unable to map frame");
+        vka_free_object(merge->vka, &shared->frame);
+        free(shared);
+        return NULL;
+    }
+    memcpy(shared->vaddr, contents, PAGE_SIZE_4K);
+    shared->merge = merge;
+    shared->hash = hash;
+    shared->next = merge->shared[hash % SHARED_BUCKETS];
+    merge->shared[hash % SHARED_BUCKETS] = shared;
+    merge->stats.pages_shared++;
+    return shared;
+}
+
+void vm_merge_frame_put(vm_shared_frame_t *shared, bool cow)
+{
+    vm_merge_t *merge = shared->merge;
+    merge->stats.pages_sharing--;
+    if (cow) {
+        merge->stats.cow_breaks++;
+    }
+    if (--shared->refs == 0) {
+        free_shared_frame(shared);
+    }
+}
+
+/* The page is only merged if it still matches once write protected, returns 1 if it changed since it was read */
+static int merge_page(vm_merge_t *merge, merge_region_t *region, uintptr_t addr, vm_shared_frame_t *shared)
+{
+    int err = vm_reservation_share_page(region->reservation, addr, shared);
+    if (err) {
+        return err;
+    }
+    merge->stats.pages_sharing++;
+    return 0;
+}
+
+/* Look for an unshared page seen earlier in this pass with the same contents, and share a new frame between them */
+static int merge_unstable(vm_merge_t *merge, merge_region_t *region, uintptr_t addr, uint64_t hash)
+{
+    for (uint32_t other = merge->unstable_heads[hash & merge->unstable_mask]; other != NO_PAGE;
+         other = merge->unstable_next[other]) {
+        if (merge->unstable_hash[other] != hash) {
+            continue;
+        }
+        merge_region_t *other_region = find_region(merge, other);
+        uintptr_t other_addr = region_page_addr(other_region, other);
+        if (!vm_reservation_page_mergeable(other_region->reservation, other_addr) ||
+            read_page(other_region->vm, other_addr, merge->candidate) ||
+            memcmp(merge->page, merge->candidate, PAGE_SIZE_4K)) {
+            continue;
+        }
+
+        vm_shared_frame_t *shared = new_shared_frame(merge, hash, merge->page);
+        if (!shared) {
+            return -1;
+        }
+        if (merge_page(merge, other_region, other_addr, shared) == 0) {
+            merge_page(merge, region, addr, shared);
+        }
+        if (!shared->refs) {
+            free_shared_frame(shared);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int scan_page(vm_merge_t *merge, merge_region_t *region, size_t index)
+{
+    uintptr_t addr = region_page_addr(region, index);
+    if (!vm_reservation_page_mergeable(region->reservation, addr)) {
+        return 0;
+    }
+    int err = read_page(region->vm, addr, merge->page);
+    if (err) {
+        ZF_LOGE("Failed to scan page 0x%"PRIxPTR": Unable to read page", addr);
+        return -1;
+    }
+
+    uint64_t hash = hash_page(merge->page);
+    uint32_t checksum = (uint32_t)(hash >> 32) ^ (uint32_t)hash;
+    if (merge->checksums[index] != checksum) {
+        /* Pages that change often would be copied straight back, wait for the contents to settle */
+        merge->checksums[index] = checksum;
+        return 0;
+    }
+
+    for (vm_shared_frame_t *shared = merge->shared[hash % SHARED_BUCKETS]; shared; shared = shared->next) {
+        if (shared->hash == hash && !memcmp(shared->vaddr, merge->page, PAGE_SIZE_4K)) {
+            merge_page(merge, region, addr, shared);
+            return 0;
+        }
+    }
+
+    err = merge_unstable(merge, region, addr, hash);
+    if (err) {
+        return err < 0 ? -1 : 0;
+    }
+    merge->unstable_hash[index] = hash;
+    merge->unstable_next[index] = merge->unstable_heads[hash & merge->unstable_mask];
+    merge->unstable_heads[hash & merge->unstable_mask] = index;
+    return 0;
+}
+
+static void reset_unstable(vm_merge_t *merge)
+{
+    memset(merge->unstable_heads, 0xff, sizeof(uint32_t) * (merge->unstable_mask + 1));
+}
+
+static int add_merge_region(vm_merge_t *merge, vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    /* RAM regions are sorted, so a reservation spanning several of them was the last one added */
+    if (merge->num_regions && merge->regions[merge->num_regions - 1].reservation == reservation) {
+        return 0;
+    }
+    merge_region_t *regions = realloc(merge->regions, sizeof(*regions) * (merge->num_regions + 1));
+    if (!regions) {
+        return -1;
+    }
+    merge->regions = regions;
+    size_t num_pages = vm_reservation_size(reservation) >> seL4_PageBits;
+    regions[merge->num_regions++] = (merge_region_t) {
+        .vm = vm,
+        .reservation = reservation,
+        .addr = vm_reservation_addr(reservation),
+        .first_page = merge->num_pages,
+        .num_pages = num_pages
+    };
+    merge->num_pages += num_pages;
+    return 0;
+}
+
+/* Size the per page tables for the registered regions, keeping the checksums already seen */
+static int resize_page_tables(vm_merge_t *merge, size_t old_pages)
+{
+    if (merge->num_pages >= NO_PAGE) {
+        ZF_LOGE("Failed to add vm to page merging: Too many pages");
+        return -1;
+    }
+    size_t num_buckets = 1;
+    while (num_buckets < merge->num_pages) {
+        num_buckets <<= 1;
+    }
+    uint32_t *checksums = realloc(merge->checksums, sizeof(uint32_t) * merge->num_pages);
+    if (!checksums) {
+        return -1;
+    }
+    merge->checksums = checksums;
+    memset(&checksums[old_pages], 0, sizeof(uint32_t) * (merge->num_pages - old_pages));
+
+    free(merge->unstable_heads);
+    free(merge->unstable_next);
+    free(merge->unstable_hash);
+    merge->unstable_heads = malloc(sizeof(uint32_t) * num_buckets);
+    merge->unstable_next = malloc(sizeof(uint32_t) * merge->num_pages);
+    merge->unstable_hash = malloc(sizeof(uint64_t) * merge->num_pages);
+    if (!merge->unstable_heads || !merge->unstable_next || !merge->unstable_hash) {
+        return -1;
+    }
+    merge->unstable_mask = num_buckets - 1;
+    /* Start a fresh pass, as pages already in the unstable table were indexed with the old mask */
+    reset_unstable(merge);
+    merge->cursor = 0;
+    merge->cursor_region = 0;
+    return 0;
+}
+
+vm_merge_t *vm_merge_create(vka_t *vka, vspace_t *vmm_vspace)
+{
+    if (!vka || !vmm_vspace) {
+        ZF_LOGE("Failed to create page merging: Invalid arguments");
+        return NULL;
+    }
+    vm_merge_t *merge = calloc(1, sizeof(*merge));
+    if (!merge) {
+        ZF_LOGE("Failed to create page merging: Unable to allocate page merging");
+        return NULL;
+    }
+    merge->vka = vka;
+    merge->vmm_vspace = vmm_vspace;
+    return merge;
+}
+
+int vm_merge_add_vm(vm_merge_t *merge, vm_t *vm)
+{
+    size_t old_pages = merge->num_pages;
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        uintptr_t addr = vm->mem.ram_regions[i].start;
+        uintptr_t end = addr + vm->mem.ram_regions[i].size;
+        while (addr < end) {
+            vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, addr);
+            if (!reservation) {
+                ZF_LOGE("Failed to add vm to page merging: No reservation backing ram at 0x%"PRIxPTR, addr);
+                return -1;
+            }
+            if (add_merge_region(merge, vm, reservation)) {
+                ZF_LOGE("Failed to add vm to page merging: Unable to allocate region");
+                return -1;
+            }
+            addr = vm_reservation_addr(reservation) + vm_reservation_size(reservation);
+        }
+    }
+    if (resize_page_tables(merge, old_pages)) {
+        ZF_LOGE("Failed to add vm to page merging: Unable to allocate page tables");
+        return -1;
+    }
+    return 0;
+}
+
+int vm_merge_scan(vm_merge_t *merge, size_t max_pages)
+{
+    if (!merge->num_pages) {
+        return 0;
+    }
+    for (size_t i = 0; i < max_pages; i++) {
+        if (merge->cursor == merge->num_pages) {
+            merge->cursor = 0;
+            merge->cursor_region = 0;
+            merge->stats.full_scans++;
+            reset_unstable(merge);
+        }
+        merge_region_t *region = &merge->regions[merge->cursor_region];
+        while (merge->cursor >= region->first_page + region->num_pages) {
+            region = &merge->regions[++merge->cursor_region];
+        }
+        int err = scan_page(merge, region, merge->cursor);
+        if (err) {
+            return -1;
+        }
+        merge->cursor++;
+        merge->stats.pages_scanned++;
+    }
+    return 0;
+}
+
+void vm_merge_get_stats(vm_merge_t *merge, vm_merge_stats_t *stats)
+{
+    *stats = merge->stats;
+}
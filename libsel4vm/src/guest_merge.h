@@ -0,0 +1,30 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <vka/object.h>
+
+#include <sel4vm/guest_merge.h>
+
+#include "guest_memory.h"
+
+/* A frame shared read-only by identical guest pages */
+struct vm_shared_frame {
+    vm_merge_t *merge;
+    vka_object_t frame;
+    /* Mapping of the frame in the VMM, kept while the frame is shared */
+    void *vaddr;
+    uint64_t hash;
+    /* Number of guest pages mapping the frame */
+    unsigned int refs;
+    /* Next shared frame in the same hash bucket */
+    struct vm_shared_frame *next;
+};
+
+/* Drop a guest page's reference to a shared frame once the page no longer maps it, freeing the
+ * frame with the last reference. cow is set when the page was given a private copy on a write */
+void vm_merge_frame_put(vm_shared_frame_t *shared, bool cow);
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_migration.h>
+
+#include "guest_memory.h"
+#include "guest_snapshot.h"
+
+/* A reservation backing guest RAM, logged for the duration of the migration */
+typedef struct migration_reservation {
+    vm_memory_reservation_t *reservation;
+    unsigned long *bitmap;
+} migration_reservation_t;
+
+struct vm_migration {
+    vm_t *vm;
+    vm_snapshot_stream_t *stream;
+    vm_migration_params_t params;
+    migration_reservation_t *reservations;
+    int num_reservations;
+    /* Number of rounds sent after the initial copy */
+    unsigned int rounds;
+    /* Bytes sent in the previous round */
+    size_t last_round_bytes;
+};
+
+static void free_migration(vm_migration_t *migration)
+{
+    for (int i = 0; i < migration->num_reservations; i++) {
+        vm_set_dirty_log(migration->reservations[i].reservation, false);
+        free(migration->reservations[i].bitmap);
+    }
+    free(migration->reservations);
+    free(migration);
+}
+
+static int add_migration_reservation(vm_migration_t *migration, vm_memory_reservation_t *reservation)
+{
+    /* RAM regions are sorted, so a reservation spanning several of them was the last one added */
+    if (migration->num_reservations &&
+        migration->reservations[migration->num_reservations - 1].reservation == reservation) {
+        return 0;
+    }
+    migration_reservation_t *reservations = realloc(migration->reservations,
+                                                    sizeof(*reservations) * (migration->num_reservations + 1));
+    if (!reservations) {
+        return -1;
+    }
+    migration->reservations = reservations;
+    unsigned long *bitmap = malloc(vm_dirty_log_bitmap_size(reservation));
+    if (!bitmap) {
+        return -1;
+    }
+    reservations[migration->num_reservations++] = (migration_reservation_t) {
+        .reservation = reservation,
+        .bitmap = bitmap
+    };
+    return vm_set_dirty_log(reservation, true);
+}
+
+/* Find every reservation backing guest RAM and start logging writes to it */
+static int log_guest_ram(vm_migration_t *migration)
+{
+    vm_t *vm = migration->vm;
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        uintptr_t addr = vm->mem.ram_regions[i].start;
+        uintptr_t end = addr + vm->mem.ram_regions[i].size;
+        while (addr < end) {
+            vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, addr);
+            if (!reservation) {
+                ZF_LOGE("Failed to start migration: No reservation backing ram at 0x%"PRIxPTR, addr);
+                return -1;
+            }
+            if (add_migration_reservation(migration, reservation)) {
+                ZF_LOGE("Failed to start migration: Unable to log writes to ram at 0x%"PRIxPTR, addr);
+                return -1;
+            }
+            addr = vm_reservation_addr(reservation) + vm_reservation_size(reservation);
+        }
+    }
+    return 0;
+}
+
+/* Send each run of dirty pages in the reservation, clearing its log */
+static int send_dirty_reservation(vm_migration_t *migration, migration_reservation_t *logged,
+                                  snapshot_writer_t *writer, size_t *sent)
+{
+    vm_memory_reservation_t *reservation = logged->reservation;
+    unsigned long *bitmap = logged->bitmap;
+    int err = vm_get_dirty_log(reservation, bitmap, true);
+    if (err) {
+        return -1;
+    }
+
+    uintptr_t res_addr = vm_reservation_addr(reservation);
+    size_t res_size = vm_reservation_size(reservation);
+    size_t num_pages = ROUND_UP(res_size, BIT(seL4_PageBits)) >> seL4_PageBits;
+    size_t page = 0;
+    while (page < num_pages) {
+        unsigned long word = bitmap[page / DIRTY_LOG_WORD_BITS] >> (page % DIRTY_LOG_WORD_BITS);
+        if (!word) {
+            page = ROUND_DOWN(page, DIRTY_LOG_WORD_BITS) + DIRTY_LOG_WORD_BITS;
+            continue;
+        }
+        page += CTZL(word);
+        size_t first = page;
+        while (page < num_pages && (bitmap[page / DIRTY_LOG_WORD_BITS] & BIT(page % DIRTY_LOG_WORD_BITS))) {
+            page++;
+        }
+        uintptr_t addr = res_addr + (first << seL4_PageBits);
+        size_t size = MIN(res_size, page << seL4_PageBits) - (first << seL4_PageBits);
+        err = vm_snapshot_write_ram(migration->vm, writer, addr, size);
+        if (err) {
+            return -1;
+        }
+        *sent += size;
+    }
+    return 0;
+}
+
+/* Send every page dirtied since the last round, returning the number of bytes sent */
+static int send_dirty_round(vm_migration_t *migration, size_t *sent)
+{
+    snapshot_writer_t writer = {
+        .stream = migration->stream,
+        /* Pages sent again may have been zeroed since they were first sent */
+        .clear_zero = true
+    };
+    *sent = 0;
+    for (int i = 0; i < migration->num_reservations; i++) {
+        int err = send_dirty_reservation(migration, &migration->reservations[i], &writer, sent);
+        if (err) {
+            ZF_LOGE("Failed to send dirty guest ram");
+            return -1;
+        }
+    }
+    return vm_snapshot_flush_ram(&writer);
+}
+
+vm_migration_t *vm_migration_start(vm_t *vm, vm_snapshot_stream_t *stream, vm_migration_params_t *params)
+{
+    if (!stream || !stream->write || !params) {
+        ZF_LOGE("Failed to start migration: Invalid arguments");
+        return NULL;
+    }
+    vm_migration_t *migration = calloc(1, sizeof(*migration));
+    if (!migration) {
+        ZF_LOGE("Failed to start migration: Unable to allocate migration");
+        return NULL;
+    }
+    migration->vm = vm;
+    migration->stream = stream;
+    migration->params = *params;
+
+    /* Start logging before the initial copy so writes made while it is being sent are sent again */
+    int err = log_guest_ram(migration);
+    if (err) {
+        free_migration(migration);
+        return NULL;
+    }
+
+    err = vm_snapshot_write_header(vm, stream);
+    snapshot_writer_t writer = {
+        .stream = stream
+    };
+    for (int i = 0; i < vm->mem.num_ram_regions && !err; i++) {
+        err = vm_snapshot_write_ram(vm, &writer, vm->mem.ram_regions[i].start, vm->mem.ram_regions[i].size);
+    }
+    if (err || vm_snapshot_flush_ram(&writer)) {
+        ZF_LOGE("Failed to start migration: Unable to send guest ram");
+        free_migration(migration);
+        return NULL;
+    }
+    migration->last_round_bytes = SIZE_MAX;
+    return migration;
+}
+
+int vm_migration_iterate(vm_migration_t *migration)
+{
+    size_t sent;
+    int err = send_dirty_round(migration, &sent);
+    if (err) {
+        return -1;
+    }
+    migration->rounds++;
+
+    /* Once the guest dirties pages as fast as they are sent, further rounds don't reduce the downtime */
+    bool converged = sent <= migration->params.stop_bytes || sent >= migration->last_round_bytes;
+    migration->last_round_bytes = sent;
+    return converged || migration->rounds >= migration->params.max_rounds;
+}
+
+int vm_migration_complete(vm_migration_t *migration)
+{
+    size_t sent;
+    int err = send_dirty_round(migration, &sent);
+    if (!err) {
+        err = vm_snapshot_write_state(migration->vm, migration->stream);
+    }
+    if (err) {
+        ZF_LOGE("Failed to complete migration");
+    }
+    free_migration(migration);
+    return err;
+}
+
+void vm_migration_abort(vm_migration_t *migration)
+{
+    free_migration(migration);
+}
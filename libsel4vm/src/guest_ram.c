@@ -4,11 +4,13 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <sel4/sel4.h>
+#include <vka/capops.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_ram.h>
@@ -16,6 +18,21 @@
 
 #include "guest_memory.h"
 
+/* Frame sizes used to back guest RAM, largest first. Each frame gets the
+ * largest size that is aligned and fits within the RAM reservation. 1G frames
+ * are left out on x86, where EPT support for them depends on the processor */
+static const size_t ram_frame_size_bits[] = {
+#ifdef CONFIG_ARCH_AARCH64
+    seL4_HugePageBits,
+#endif
+#ifdef CONFIG_ARCH_AARCH32
+    seL4_SuperSectionBits,
+    seL4_SectionBits,
+#endif
+    seL4_LargePageBits,
+    seL4_PageBits
+};
+
 struct guest_mem_touch_params {
     void *data;
     size_t size;
@@ -48,7 +65,28 @@ static int ram_region_cmp(const void *a, const void *b)
 {
     const vm_ram_region_t *aa = a;
     const vm_ram_region_t *bb = b;
-    return aa->start - bb->start;
+    /* Compare rather than subtract, the difference may not fit in an int */
+    return (aa->start > bb->start) - (aa->start < bb->start);
+}
+
+static int ram_region_addr_cmp(const void *key, const void *elem)
+{
+    uintptr_t addr = *(const uintptr_t *)key;
+    const vm_ram_region_t *region = elem;
+    if (addr < region->start) {
+        return -1;
+    }
+    if (addr - region->start >= region->size) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Regions are kept sorted and non-overlapping, so at most one can contain addr */
+static vm_ram_region_t *find_guest_ram_region(vm_mem_t *guest_memory, uintptr_t addr)
+{
+    return bsearch(&addr, guest_memory->ram_regions, guest_memory->num_ram_regions, sizeof(vm_ram_region_t),
+                   ram_region_addr_cmp);
 }
 
 static void sort_guest_ram_regions(vm_mem_t *guest_memory)
@@ -109,16 +147,8 @@ static int expand_guest_ram_region(vm_memory_reservation_t *reservation)
 
 bool is_ram_region(vm_t *vm, uintptr_t addr, size_t size)
 {
-    vm_mem_t *guest_memory = &vm->mem;
-    for (int i = 0; i < guest_memory->num_ram_regions; i++) {
-        if (is_subregion(guest_memory->ram_regions[i].start,
-                         guest_memory->ram_regions[i].size,
-                         addr, size)) {
-            /* We are within RAM region */
-            return true;
-        }
-    }
-    return false;
+    vm_ram_region_t *region = find_guest_ram_region(&vm->mem, addr);
+    return region && is_subregion(region->start, region->size, addr, size);
 }
 
 static memory_fault_result_t default_ram_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
@@ -152,7 +182,8 @@ static int touch_access_callback(void *access_addr, void *vaddr, void *cookie)
                                  guest_touch->size, guest_touch->offset, guest_touch->data);
 }
 
-int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie)
+static int ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie,
+                     bool write)
 {
     struct guest_mem_touch_params access_cookie;
     uintptr_t current_addr;
@@ -165,16 +196,33 @@ int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn to
     access_cookie.touch_fn = touch_callback;
     access_cookie.data = cookie;
     access_cookie.vm = vm;
+    vm_memory_reservation_t *reservation = NULL;
     for (current_addr = addr; current_addr < end_addr; current_addr = next_addr) {
-        vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, current_addr);
+        /* Consecutive pages usually fall within the same reservation */
+        if (!reservation || !is_subregion(vm_reservation_addr(reservation), vm_reservation_size(reservation),
+                                          current_addr, 1)) {
+            reservation = vm_reservation_find_by_addr(vm, current_addr);
+            if (!reservation) {
+                ZF_LOGE("Failed to touch ram region: No reservation at 0x%"PRIxPTR, current_addr);
+                return -1;
+            }
+        }
 
-        int err = vm_reservation_map(reservation);
+        int err = vm_reservation_map_addr(reservation, current_addr, write);
         if (err) {
             ZF_LOGE("Cannot make reservation mapped (%d)", err);
             return -1;
         }
+        if (write) {
+            /* Merged pages are shared with other guests, the callback must write to a private copy */
+            err = vm_reservation_unshare(reservation, current_addr, 1);
+            if (err) {
+                ZF_LOGE("Failed to touch ram region: Unable to unshare page at 0x%"PRIxPTR, current_addr);
+                return -1;
+            }
+        }
 
-        size_t size_bits = vm_reservation_page_size_bits(reservation);
+        size_t size_bits = vm_reservation_page_size_bits_at(reservation, current_addr);
         uintptr_t current_aligned = PAGE_ALIGN(current_addr, BIT(size_bits));
         uintptr_t next_page_start = current_aligned + BIT(size_bits);
         next_addr = MIN(end_addr, next_page_start);
@@ -182,14 +230,147 @@ int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn to
         access_cookie.offset = current_addr - addr;
         access_cookie.current_addr = current_addr;
         int result = vspace_access_page_with_callback(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)current_aligned,
-                                                      size_bits, seL4_AllRights, 1, touch_access_callback, &access_cookie);
+                                                      size_bits, write ? seL4_AllRights : seL4_CanRead, 1,
+                                                      touch_access_callback, &access_cookie);
         if (result) {
             return result;
         }
+        if (write) {
+            /* The VMM's mapping bypasses the write protection dirty logging relies on */
+            vm_memory_log_write(vm, current_addr, access_cookie.size);
+        }
+    }
+    return 0;
+}
+
+int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie)
+{
+    return ram_touch(vm, addr, size, touch_callback, cookie, true);
+}
+
+int vm_ram_touch_readonly(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie)
+{
+    return ram_touch(vm, addr, size, touch_callback, cookie, false);
+}
+
+/* Back every page of [addr, addr + size) and give shared pages their own frames ahead of a write, finding the
+ * largest frame backing the range */
+static int back_ram_range(vm_t *vm, uintptr_t addr, size_t size, bool write, size_t *max_size_bits)
+{
+    uintptr_t end_addr = addr + size;
+    vm_memory_reservation_t *reservation = NULL;
+    *max_size_bits = seL4_PageBits;
+    for (uintptr_t current_addr = addr; current_addr < end_addr;) {
+        if (!reservation || !is_subregion(vm_reservation_addr(reservation), vm_reservation_size(reservation),
+                                          current_addr, 1)) {
+            reservation = vm_reservation_find_by_addr(vm, current_addr);
+            if (!reservation) {
+                ZF_LOGE("Failed to map ram: No reservation at 0x%"PRIxPTR, current_addr);
+                return -1;
+            }
+        }
+        int err = vm_reservation_map_addr(reservation, current_addr, write);
+        if (!err && write) {
+            err = vm_reservation_unshare(reservation, current_addr, 1);
+        }
+        if (err) {
+            ZF_LOGE("Failed to map ram: Unable to back page at 0x%"PRIxPTR, current_addr);
+            return -1;
+        }
+        size_t size_bits = vm_reservation_page_size_bits_at(reservation, current_addr);
+        *max_size_bits = MAX(*max_size_bits, size_bits);
+        current_addr = ROUND_DOWN(current_addr, BIT(size_bits)) + BIT(size_bits);
     }
     return 0;
 }
 
+/* Unmap the frames mapped so far, deleting the copies of their caps */
+static void unmap_ram_frames(vm_t *vm, vm_ram_mapping_t *mapping)
+{
+    uintptr_t current_addr = mapping->addr;
+    while (current_addr < mapping->mapped_end) {
+        size_t size_bits = vm_memory_page_size_bits(vm, current_addr);
+        uintptr_t frame_start = ROUND_DOWN(current_addr, BIT(size_bits));
+        vspace_unmap_pages(&vm->mem.vmm_vspace, mapping->base + (frame_start - mapping->guest_base), 1, size_bits,
+                           vm->vka);
+        current_addr = frame_start + BIT(size_bits);
+    }
+    vspace_free_reservation(&vm->mem.vmm_vspace, mapping->reservation);
+}
+
+int vm_ram_map(vm_t *vm, uintptr_t addr, size_t size, bool write, vm_ram_mapping_t *mapping)
+{
+    if (!size || !is_ram_region(vm, addr, size)) {
+        ZF_LOGE("Failed to map ram: Not registered RAM region");
+        return -1;
+    }
+    size_t max_size_bits;
+    int err = back_ram_range(vm, addr, size, write, &max_size_bits);
+    if (err) {
+        return -1;
+    }
+
+    /* Guest frames are mapped at the same offsets from an address aligned to the largest of them, which keeps
+     * every frame naturally aligned in the VMM */
+    uintptr_t end_addr = addr + size;
+    *mapping = (vm_ram_mapping_t) {
+        .addr = addr,
+        .size = size,
+        .write = write,
+        .guest_base = ROUND_DOWN(addr, BIT(max_size_bits)),
+        .mapped_end = addr
+    };
+    seL4_CapRights_t rights = write ? seL4_AllRights : seL4_CanRead;
+    mapping->reservation = vspace_reserve_range_aligned(&vm->mem.vmm_vspace,
+                                                        ROUND_UP(end_addr, BIT(max_size_bits)) - mapping->guest_base,
+                                                        max_size_bits, rights, 1, &mapping->base);
+    if (!mapping->reservation.res) {
+        ZF_LOGE("Failed to map ram: Unable to reserve vmm vspace");
+        return -1;
+    }
+
+    while (mapping->mapped_end < end_addr) {
+        size_t size_bits = vm_memory_page_size_bits(vm, mapping->mapped_end);
+        uintptr_t frame_start = ROUND_DOWN(mapping->mapped_end, BIT(size_bits));
+        /* The guest keeps its own cap, the VMM maps a copy */
+        cspacepath_t src, dest;
+        vka_cspace_make_path(vm->vka, vspace_get_cap(&vm->mem.vm_vspace, (void *)frame_start), &src);
+        err = vka_cspace_alloc_path(vm->vka, &dest);
+        if (!err) {
+            err = vka_cnode_copy(&dest, &src, seL4_AllRights);
+            if (err) {
+                vka_cspace_free_path(vm->vka, dest);
+            }
+        }
+        if (!err) {
+            err = vspace_map_pages_at_vaddr(&vm->mem.vmm_vspace, &dest.capPtr, NULL,
+                                            mapping->base + (frame_start - mapping->guest_base), 1, size_bits,
+                                            mapping->reservation);
+            if (err) {
+                vka_cnode_delete(&dest);
+                vka_cspace_free_path(vm->vka, dest);
+            }
+        }
+        if (err) {
+            ZF_LOGE("Failed to map ram: Unable to map frame at 0x%"PRIxPTR, frame_start);
+            unmap_ram_frames(vm, mapping);
+            return -1;
+        }
+        mapping->mapped_end = frame_start + BIT(size_bits);
+    }
+    mapping->vaddr = mapping->base + (addr - mapping->guest_base);
+    return 0;
+}
+
+void vm_ram_unmap(vm_t *vm, vm_ram_mapping_t *mapping)
+{
+    unmap_ram_frames(vm, mapping);
+    if (mapping->write) {
+        vm_memory_log_write(vm, mapping->addr, mapping->size);
+    }
+    mapping->vaddr = NULL;
+}
+
 int vm_ram_find_largest_free_region(vm_t *vm, uintptr_t *addr, size_t *size)
 {
     vm_mem_t *guest_memory = &vm->mem;
@@ -219,15 +400,10 @@ void vm_ram_mark_allocated(vm_t *vm, uintptr_t start, size_t bytes)
 {
     vm_mem_t *guest_memory = &vm->mem;
     /* Find the region */
-    int i;
     int region = -1;
-    for (i = 0; i < guest_memory->num_ram_regions; i++) {
-        if (is_subregion(guest_memory->ram_regions[i].start,
-                         guest_memory->ram_regions[i].size,
-                         start, bytes)) {
-            region = i;
-            break;
-        }
+    vm_ram_region_t *found = find_guest_ram_region(guest_memory, start);
+    if (found && is_subregion(found->start, found->size, start, bytes)) {
+        region = found - guest_memory->ram_regions;
     }
     if (region == -1 || guest_memory->ram_regions[region].allocated) {
         return;
@@ -258,6 +434,25 @@ uintptr_t vm_ram_allocate(vm_t *vm, size_t bytes)
     return 0;
 }
 
+static bool ram_frame_fits(vm_t *vm, uintptr_t frame_start, size_t size_bits)
+{
+    uintptr_t res_addr;
+    size_t res_size;
+    if (!IS_ALIGNED(frame_start, size_bits)) {
+        return false;
+    }
+    vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, frame_start);
+    if (!reservation) {
+        return false;
+    }
+    vm_get_reservation_memory_region(reservation, &res_addr, &res_size);
+    /* Demand mapped reservations may already have frames mapped nearby. Released memory is refilled a page
+     * at a time, so touching one page doesn't take back a whole large frame the guest gave up */
+    return is_subregion(res_addr, res_size, frame_start, BIT(size_bits)) &&
+           !vm_reservation_is_released(reservation) &&
+           !vm_reservation_range_is_mapped(reservation, frame_start, BIT(size_bits));
+}
+
 static vm_frame_t ram_alloc_iterator(uintptr_t addr, void *cookie)
 {
     int ret;
@@ -267,49 +462,64 @@ static vm_frame_t ram_alloc_iterator(uintptr_t addr, void *cookie)
     if (!vm) {
         return frame_result;
     }
-    int page_size = seL4_PageBits;
-    uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
-    ret = vka_alloc_frame_maybe_device(vm->vka, page_size, true, &object);
-    if (ret) {
-        ZF_LOGE("Failed to allocate frame for address 0x%"PRIxPTR, addr);
+    uintptr_t frame_start = ROUND_DOWN(addr, BIT(seL4_PageBits));
+    for (int i = 0; i < ARRAY_SIZE(ram_frame_size_bits); i++) {
+        size_t page_size = ram_frame_size_bits[i];
+        if (page_size != seL4_PageBits && !ram_frame_fits(vm, frame_start, page_size)) {
+            continue;
+        }
+        ret = vka_alloc_frame_maybe_device(vm->vka, page_size, true, &object);
+        if (ret) {
+            /* Fall back to the next smaller frame size */
+            continue;
+        }
+        frame_result.cptr = object.cptr;
+        frame_result.rights = seL4_AllRights;
+        frame_result.vaddr = frame_start;
+        frame_result.size_bits = page_size;
+        frame_result.cookie = object.ut;
         return frame_result;
     }
-    frame_result.cptr = object.cptr;
-    frame_result.rights = seL4_AllRights;
-    frame_result.vaddr = frame_start;
-    frame_result.size_bits = page_size;
+    ZF_LOGE("Failed to allocate frame for address 0x%"PRIxPTR, addr);
     return frame_result;
 }
 
 static vm_frame_t ram_ut_alloc_iterator(uintptr_t addr, void *cookie)
 {
-    int ret;
     int error;
     vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
     vm_t *vm = (vm_t *)cookie;
     if (!vm) {
         return frame_result;
     }
-    int page_size = seL4_PageBits;
-    uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
+    uintptr_t frame_start = ROUND_DOWN(addr, BIT(seL4_PageBits));
     cspacepath_t path;
     error = vka_cspace_alloc_path(vm->vka, &path);
     if (error) {
         ZF_LOGE("Failed to allocate path");
         return frame_result;
     }
-    seL4_Word vka_cookie;
-    error = vka_utspace_alloc_at(vm->vka, &path, kobject_get_type(KOBJECT_FRAME, page_size), page_size, frame_start,
-                                 &vka_cookie);
-    if (error) {
-        ZF_LOGE("Failed to allocate page");
-        vka_cspace_free_path(vm->vka, path);
+    for (int i = 0; i < ARRAY_SIZE(ram_frame_size_bits); i++) {
+        size_t page_size = ram_frame_size_bits[i];
+        if (page_size != seL4_PageBits && !ram_frame_fits(vm, frame_start, page_size)) {
+            continue;
+        }
+        seL4_Word vka_cookie;
+        error = vka_utspace_alloc_at(vm->vka, &path, kobject_get_type(KOBJECT_FRAME, page_size), page_size, frame_start,
+                                     &vka_cookie);
+        if (error) {
+            /* Fall back to the next smaller frame size */
+            continue;
+        }
+        frame_result.cptr = path.capPtr;
+        frame_result.rights = seL4_AllRights;
+        frame_result.vaddr = frame_start;
+        frame_result.size_bits = page_size;
+        frame_result.cookie = vka_cookie;
         return frame_result;
     }
-    frame_result.cptr = path.capPtr;
-    frame_result.rights = seL4_AllRights;
-    frame_result.vaddr = frame_start;
-    frame_result.size_bits = page_size;
+    ZF_LOGE("Failed to allocate page");
+    vka_cspace_free_path(vm->vka, path);
     return frame_result;
 }
 
@@ -368,12 +578,14 @@ uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
         return 0;
     }
 
+    vm_reservation_set_zero_fill(ram_reservation);
     int err = vm_reservation_map_lazy(ram_reservation, ram_alloc_iterator, vm);
     if (err) {
         ZF_LOGE("vm_reservation_map_lazy() failed: %d", err);
         vm_reservation_free(ram_reservation);
         return 0;
     }
+    vm_reservation_set_refill(ram_reservation, ram_alloc_iterator, vm);
 
     return vm_reservation_addr(ram_reservation);
 }
@@ -396,6 +608,10 @@ int vm_ram_register_at_custom_iterator(vm_t *vm, uintptr_t start, size_t bytes,
         ZF_LOGE("vm_ram_reserve_at() failed");
         return -1;
     }
+    if (map_iterator == ram_alloc_iterator) {
+        /* Other iterators may need frames at particular physical addresses, these are never zero filled */
+        vm_reservation_set_zero_fill(ram_reservation);
+    }
 
     int err = vm_reservation_map_lazy(ram_reservation, map_iterator, cookie);
     if (err) {
@@ -403,6 +619,10 @@ int vm_ram_register_at_custom_iterator(vm_t *vm, uintptr_t start, size_t bytes,
         vm_reservation_free(ram_reservation);
         return -1;
     }
+    if (map_iterator == ram_alloc_iterator || map_iterator == ram_ut_alloc_iterator) {
+        /* A custom iterator may hand out particular frames, whose memory can't be given back */
+        vm_reservation_set_refill(ram_reservation, map_iterator, cookie);
+    }
 
     return 0;
 }
@@ -411,3 +631,46 @@ void vm_ram_free(vm_t *vm, uintptr_t start, size_t bytes)
 {
     return;
 }
+
+int vm_ram_enable_zero_pages(vm_t *vm, size_t pool_size)
+{
+    return vm_memory_enable_zero_pages(vm, pool_size);
+}
+
+int vm_ram_refill_zero_pool(vm_t *vm, size_t max_pages)
+{
+    return vm_memory_refill_zero_pool(vm, max_pages);
+}
+
+int vm_ram_release(vm_t *vm, uintptr_t start, size_t bytes, size_t *released)
+{
+    uintptr_t addr = start;
+    uintptr_t end = start + bytes;
+    *released = 0;
+    if (!is_ram_region(vm, start, bytes)) {
+        ZF_LOGE("Failed to release ram: 0x%"PRIxPTR" of size 0x%zx is not ram", start, bytes);
+        return -1;
+    }
+
+    while (addr < end) {
+        vm_memory_reservation_t *reservation = vm_reservation_find_by_addr(vm, addr);
+        if (!reservation) {
+            ZF_LOGE("Failed to release ram: No reservation backing ram at 0x%"PRIxPTR, addr);
+            return -1;
+        }
+        uintptr_t res_end = vm_reservation_addr(reservation) + vm_reservation_size(reservation);
+        if (!vm_reservation_can_release(reservation)) {
+            /* RAM with a custom iterator stays resident */
+            addr = res_end;
+            continue;
+        }
+        size_t res_released;
+        int err = vm_reservation_release(reservation, addr, MIN(end, res_end) - addr, &res_released);
+        if (err) {
+            return -1;
+        }
+        *released += res_released;
+        addr = res_end;
+    }
+    return 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_snapshot.h>
+
+#include "guest_snapshot.h"
+
+#define SNAPSHOT_MAGIC 0x746f6e7370616e73ull /* "snapshot" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE_BITS seL4_PageBits
+
+typedef enum snapshot_record_type {
+    /* Guest RAM contents, followed by 'len' bytes of data */
+    SNAPSHOT_RAM_DATA = 1,
+    /* Guest RAM that is all zeros, no data follows */
+    SNAPSHOT_RAM_ZERO,
+    /* Guest RAM that may have been written before and must be zeroed, no data follows */
+    SNAPSHOT_RAM_CLEAR,
+    /* State of the vcpu with index 'id' */
+    SNAPSHOT_VCPU,
+    /* State of the registered device 'id' */
+    SNAPSHOT_DEVICE,
+    /* Last record in the stream */
+    SNAPSHOT_END
+} snapshot_record_type_t;
+
+typedef struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_vcpus;
+    uint32_t vcpu_state_size;
+    uint32_t page_bits;
+} snapshot_header_t;
+
+typedef struct snapshot_record {
+    uint32_t type;
+    uint32_t id;
+    uint64_t addr;
+    uint64_t len;
+} snapshot_record_t;
+
+struct vm_snapshot_device {
+    uint32_t id;
+    size_t state_size;
+    vm_snapshot_save_fn save;
+    vm_snapshot_restore_fn restore;
+    void *cookie;
+};
+
+static int write_record(vm_snapshot_stream_t *stream, uint32_t type, uint32_t id, uintptr_t addr, size_t len,
+                        const void *data)
+{
+    snapshot_record_t record = {
+        .type = type,
+        .id = id,
+        .addr = addr,
+        .len = len
+    };
+    if (stream->write(stream->cookie, &record, sizeof(record))) {
+        ZF_LOGE("Failed to write snapshot record");
+        return -1;
+    }
+    if (data && len && stream->write(stream->cookie, data, len)) {
+        ZF_LOGE("Failed to write snapshot record data");
+        return -1;
+    }
+    return 0;
+}
+
+static int flush_zero_run(snapshot_writer_t *writer)
+{
+    if (writer->zero_len == 0) {
+        return 0;
+    }
+    uint32_t type = writer->clear_zero ? SNAPSHOT_RAM_CLEAR : SNAPSHOT_RAM_ZERO;
+    int err = write_record(writer->stream, type, 0, writer->zero_start, writer->zero_len, NULL);
+    writer->zero_len = 0;
+    return err;
+}
+
+static int add_zero_run(snapshot_writer_t *writer, uintptr_t addr, size_t len)
+{
+    if (writer->zero_len && writer->zero_start + writer->zero_len == addr) {
+        writer->zero_len += len;
+        return 0;
+    }
+    int err = flush_zero_run(writer);
+    writer->zero_start = addr;
+    writer->zero_len = len;
+    return err;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const unsigned long *word = page;
+    for (int i = 0; i < BIT(SNAPSHOT_PAGE_BITS) / sizeof(*word); i++) {
+        if (word[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int save_ram_data(snapshot_writer_t *writer, uintptr_t addr, const void *data, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    if (flush_zero_run(writer)) {
+        return -1;
+    }
+    return write_record(writer->stream, SNAPSHOT_RAM_DATA, 0, addr, len, data);
+}
+
+static int save_ram_callback(vm_t *vm, uintptr_t guest_addr, void *vmm_vaddr, size_t size, size_t offset,
+                             void *cookie)
+{
+    snapshot_writer_t *writer = cookie;
+    char *data = vmm_vaddr;
+    size_t data_len = 0;
+
+    /* Write out runs of non zero pages straight from the mapping, gathering the zero pages in between */
+    for (size_t page = 0; page < size; page += BIT(SNAPSHOT_PAGE_BITS)) {
+        size_t len = MIN(size - page, BIT(SNAPSHOT_PAGE_BITS));
+        if (len < BIT(SNAPSHOT_PAGE_BITS) || !page_is_zero(data + page)) {
+            data_len += len;
+            continue;
+        }
+        if (save_ram_data(writer, guest_addr + page - data_len, data + page - data_len, data_len)
+            || add_zero_run(writer, guest_addr + page, len)) {
+            return -1;
+        }
+        data_len = 0;
+    }
+    return save_ram_data(writer, guest_addr + size - data_len, data + size - data_len, data_len);
+}
+
+int vm_snapshot_write_ram(vm_t *vm, snapshot_writer_t *writer, uintptr_t addr, size_t size)
+{
+    uintptr_t end = addr + size;
+
+    while (addr < end) {
+        size_t page_bits = vm_memory_page_size_bits(vm, addr);
+        if (page_bits == 0) {
+            /* Memory the guest has never faulted in is still zero, don't map it in just to read it */
+            if (add_zero_run(writer, addr, BIT(SNAPSHOT_PAGE_BITS))) {
+                return -1;
+            }
+            addr += BIT(SNAPSHOT_PAGE_BITS);
+            continue;
+        }
+        uintptr_t frame_end = MIN(ROUND_DOWN(addr, BIT(page_bits)) + BIT(page_bits), end);
+        int err = vm_ram_touch_readonly(vm, addr, frame_end - addr, save_ram_callback, writer);
+        if (err) {
+            ZF_LOGE("Failed to save guest ram at 0x%"PRIxPTR, addr);
+            return -1;
+        }
+        addr = frame_end;
+    }
+    return 0;
+}
+
+int vm_snapshot_flush_ram(snapshot_writer_t *writer)
+{
+    return flush_zero_run(writer);
+}
+
+static int save_vcpus(vm_t *vm, vm_snapshot_stream_t *stream)
+{
+    size_t state_size = vm_snapshot_vcpu_size_arch();
+    void *state = malloc(state_size);
+    if (!state) {
+        ZF_LOGE("Failed to allocate vcpu snapshot state");
+        return -1;
+    }
+    int err = 0;
+    for (int i = 0; i < vm->num_vcpus && !err; i++) {
+        err = vm_snapshot_save_vcpu_arch(vm->vcpus[i], state);
+        if (err) {
+            ZF_LOGE("Failed to save state of vcpu %d", i);
+            break;
+        }
+        err = write_record(stream, SNAPSHOT_VCPU, i, 0, state_size, state);
+    }
+    free(state);
+    return err;
+}
+
+static int save_devices(vm_t *vm, vm_snapshot_stream_t *stream)
+{
+    for (int i = 0; i < vm->num_snapshot_devices; i++) {
+        struct vm_snapshot_device *device = &vm->snapshot_devices[i];
+        void *state = calloc(1, device->state_size);
+        if (!state) {
+            ZF_LOGE("Failed to allocate device snapshot state");
+            return -1;
+        }
+        int err = device->save(vm, state, device->cookie);
+        if (err) {
+            ZF_LOGE("Failed to save state of device %u", device->id);
+        } else {
+            err = write_record(stream, SNAPSHOT_DEVICE, device->id, 0, device->state_size, state);
+        }
+        free(state);
+        if (err) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static struct vm_snapshot_device *find_snapshot_device(vm_t *vm, uint32_t id)
+{
+    for (int i = 0; i < vm->num_snapshot_devices; i++) {
+        if (vm->snapshot_devices[i].id == id) {
+            return &vm->snapshot_devices[i];
+        }
+    }
+    return NULL;
+}
+
+int vm_snapshot_register_device(vm_t *vm, uint32_t id, size_t state_size, vm_snapshot_save_fn save,
+                                vm_snapshot_restore_fn restore, void *cookie)
+{
+    if (!save || !restore || state_size == 0) {
+        ZF_LOGE("Failed to register snapshot device: Invalid arguments");
+        return -1;
+    }
+    if (find_snapshot_device(vm, id)) {
+        ZF_LOGE("Failed to register snapshot device: Device %u already registered", id);
+        return -1;
+    }
+    struct vm_snapshot_device *devices = realloc(vm->snapshot_devices,
+                                                 sizeof(*devices) * (vm->num_snapshot_devices + 1));
+    if (!devices) {
+        ZF_LOGE("Failed to register snapshot device: Unable to allocate device");
+        return -1;
+    }
+    devices[vm->num_snapshot_devices] = (struct vm_snapshot_device) {
+        .id = id,
+        .state_size = state_size,
+        .save = save,
+        .restore = restore,
+        .cookie = cookie
+    };
+    vm->snapshot_devices = devices;
+    vm->num_snapshot_devices++;
+    return 0;
+}
+
+int vm_snapshot_write_header(vm_t *vm, vm_snapshot_stream_t *stream)
+{
+    snapshot_header_t header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .num_vcpus = vm->num_vcpus,
+        .vcpu_state_size = vm_snapshot_vcpu_size_arch(),
+        .page_bits = SNAPSHOT_PAGE_BITS
+    };
+    if (stream->write(stream->cookie, &header, sizeof(header))) {
+        ZF_LOGE("Failed to write snapshot header");
+        return -1;
+    }
+    return 0;
+}
+
+int vm_snapshot_write_state(vm_t *vm, vm_snapshot_stream_t *stream)
+{
+    if (save_vcpus(vm, stream) || save_devices(vm, stream)) {
+        return -1;
+    }
+    return write_record(stream, SNAPSHOT_END, 0, 0, 0, NULL);
+}
+
+int vm_snapshot_save(vm_t *vm, vm_snapshot_stream_t *stream)
+{
+    if (!stream || !stream->write) {
+        ZF_LOGE("Failed to save snapshot: Invalid stream");
+        return -1;
+    }
+    if (vm_snapshot_write_header(vm, stream)) {
+        return -1;
+    }
+
+    snapshot_writer_t writer = {
+        .stream = stream
+    };
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        vm_ram_region_t *region = &vm->mem.ram_regions[i];
+        if (vm_snapshot_write_ram(vm, &writer, region->start, region->size)) {
+            return -1;
+        }
+    }
+    if (vm_snapshot_flush_ram(&writer)) {
+        return -1;
+    }
+    return vm_snapshot_write_state(vm, stream);
+}
+
+static int restore_ram_callback(vm_t *vm, uintptr_t guest_addr, void *vmm_vaddr, size_t size, size_t offset,
+                                void *cookie)
+{
+    vm_snapshot_stream_t *stream = cookie;
+    return stream->read(stream->cookie, vmm_vaddr, size);
+}
+
+static int clear_ram_callback(vm_t *vm, uintptr_t guest_addr, void *vmm_vaddr, size_t size, size_t offset,
+                              void *cookie)
+{
+    memset(vmm_vaddr, 0, size);
+    return 0;
+}
+
+/* Zero runs are gathered across the whole RAM map, so a RAM record can span adjacent RAM regions.
+ * Apply it a region at a time */
+static int restore_ram(vm_t *vm, vm_snapshot_stream_t *stream, snapshot_record_t *record)
+{
+    uint64_t record_end = record->addr + record->len;
+    if (record_end < record->addr || (uintptr_t)record_end != record_end) {
+        ZF_LOGE("Failed to restore snapshot: Ram record 0x%"PRIx64" is outside of guest ram", record->addr);
+        return -1;
+    }
+    uintptr_t addr = record->addr;
+    uintptr_t end = record_end;
+    while (addr < end) {
+        vm_ram_region_t *region = NULL;
+        for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+            vm_ram_region_t *r = &vm->mem.ram_regions[i];
+            if (addr >= r->start && addr - r->start < r->size) {
+                region = r;
+                break;
+            }
+        }
+        if (!region) {
+            ZF_LOGE("Failed to restore snapshot: Ram record address 0x%"PRIxPTR" is outside of guest ram", addr);
+            return -1;
+        }
+        size_t len = MIN(end - addr, region->start + region->size - addr);
+        /* The VM is freshly created so its RAM is already zero, unless this is a page sent again */
+        int err = 0;
+        if (record->type == SNAPSHOT_RAM_DATA) {
+            err = vm_ram_touch(vm, addr, len, restore_ram_callback, stream);
+        } else if (record->type == SNAPSHOT_RAM_CLEAR) {
+            err = vm_ram_touch(vm, addr, len, clear_ram_callback, NULL);
+        }
+        if (err) {
+            return -1;
+        }
+        addr += len;
+    }
+    return 0;
+}
+
+/* Restores a vcpu, or the given device, from the state in the record */
+static int restore_state(vm_t *vm, vm_snapshot_stream_t *stream, snapshot_record_t *record, size_t state_size,
+                         struct vm_snapshot_device *device)
+{
+    if (record->len != state_size) {
+        ZF_LOGE("Failed to restore snapshot: Record %u has size %"PRIu64", expected %zu", record->id, record->len,
+                state_size);
+        return -1;
+    }
+    void *state = malloc(state_size);
+    if (!state) {
+        ZF_LOGE("Failed to restore snapshot: Unable to allocate state");
+        return -1;
+    }
+    int err = stream->read(stream->cookie, state, state_size);
+    if (err) {
+        ZF_LOGE("Failed to restore snapshot: Unable to read state");
+    } else if (device) {
+        err = device->restore(vm, state, device->cookie);
+    } else {
+        err = vm_snapshot_restore_vcpu_arch(vm->vcpus[record->id], state);
+    }
+    free(state);
+    return err;
+}
+
+int vm_snapshot_restore(vm_t *vm, vm_snapshot_stream_t *stream)
+{
+    if (!stream || !stream->read) {
+        ZF_LOGE("Failed to restore snapshot: Invalid stream");
+        return -1;
+    }
+
+    snapshot_header_t header;
+    if (stream->read(stream->cookie, &header, sizeof(header))) {
+        ZF_LOGE("Failed to restore snapshot: Unable to read header");
+        return -1;
+    }
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        ZF_LOGE("Failed to restore snapshot: Unrecognised stream format");
+        return -1;
+    }
+    if (header.num_vcpus != vm->num_vcpus || header.vcpu_state_size != vm_snapshot_vcpu_size_arch()) {
+        ZF_LOGE("Failed to restore snapshot: Snapshot of %u vcpus doesn't match VM", header.num_vcpus);
+        return -1;
+    }
+
+    while (true) {
+        snapshot_record_t record;
+        if (stream->read(stream->cookie, &record, sizeof(record))) {
+            ZF_LOGE("Failed to restore snapshot: Unable to read record");
+            return -1;
+        }
+        int err = 0;
+        switch (record.type) {
+        case SNAPSHOT_RAM_DATA:
+        case SNAPSHOT_RAM_ZERO:
+        case SNAPSHOT_RAM_CLEAR:
+            err = restore_ram(vm, stream, &record);
+            break;
+        case SNAPSHOT_VCPU:
+            if (record.id >= vm->num_vcpus) {
+                ZF_LOGE("Failed to restore snapshot: Invalid vcpu %u", record.id);
+                return -1;
+            }
+            err = restore_state(vm, stream, &record, vm_snapshot_vcpu_size_arch(), NULL);
+            break;
+        case SNAPSHOT_DEVICE: {
+            struct vm_snapshot_device *device = find_snapshot_device(vm, record.id);
+            if (!device) {
+                ZF_LOGE("Failed to restore snapshot: Device %u is not registered", record.id);
+                return -1;
+            }
+            err = restore_state(vm, stream, &record, device->state_size, device);
+            break;
+        }
+        case SNAPSHOT_END:
+            return 0;
+        default:
+            ZF_LOGE("Failed to restore snapshot: Unknown record type %u", record.type);
+            return -1;
+        }
+        if (err) {
+            ZF_LOGE("Failed to restore snapshot record at 0x%"PRIx64, record.addr);
+            return -1;
+        }
+    }
+}
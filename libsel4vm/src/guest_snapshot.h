@@ -0,0 +1,41 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_snapshot.h>
+
+/* Writes the RAM records of a snapshot stream. Runs of zero pages are coalesced into a
+ * single record, which is flushed before any other record is written */
+typedef struct snapshot_writer {
+    vm_snapshot_stream_t *stream;
+    /* Zero pages overwrite what the target already has, rather than relying on it being fresh */
+    bool clear_zero;
+    uintptr_t zero_start;
+    size_t zero_len;
+} snapshot_writer_t;
+
+/* Write the stream header describing the VM */
+int vm_snapshot_write_header(vm_t *vm, vm_snapshot_stream_t *stream);
+
+/* Write the contents of a range of guest RAM, the range must be page aligned */
+int vm_snapshot_write_ram(vm_t *vm, snapshot_writer_t *writer, uintptr_t addr, size_t size);
+
+/* Write out any pending run of zero pages */
+int vm_snapshot_flush_ram(snapshot_writer_t *writer);
+
+/* Write the state of each vcpu and registered device, followed by the end of the stream */
+int vm_snapshot_write_state(vm_t *vm, vm_snapshot_stream_t *stream);
+
+/* Size in bytes of the architecture specific vcpu state saved in a snapshot */
+size_t vm_snapshot_vcpu_size_arch(void);
+
+/* Save the architecture specific state of a stopped vcpu into a buffer of 'vm_snapshot_vcpu_size_arch' bytes */
+int vm_snapshot_save_vcpu_arch(vm_vcpu_t *vcpu, void *state);
+
+/* Restore the architecture specific state of a vcpu previously saved with 'vm_snapshot_save_vcpu_arch' */
+int vm_snapshot_restore_vcpu_arch(vm_vcpu_t *vcpu, const void *state);
@@ -161,6 +161,53 @@ int vm_guest_add_iospace(vm_t *vm, vspace_t *loader, seL4_CPtr iospace)
     return 0;
 }
 
+int guest_vspace_remap(vspace_t *vspace, void *vaddr, size_t size_bits, seL4_CapRights_t rights)
+{
+    seL4_CPtr cap = vspace_get_cap(vspace, vaddr);
+    if (cap == seL4_CapNull) {
+        ZF_LOGE("Failed to remap %p: not mapped", vaddr);
+        return -1;
+    }
+    /* A mapped frame can't be mapped again on every architecture (EPT refuses it),
+     * so unmap it and map it back with the new rights */
+    int error = seL4_ARCH_Page_Unmap(cap);
+    if (error) {
+        ZF_LOGE("Failed to unmap %p for remapping", vaddr);
+        return -1;
+    }
+    error = guest_vspace_map_page_arch(vspace, cap, vaddr, rights, 1, size_bits);
+    if (error) {
+        ZF_LOGE("Failed to remap %p", vaddr);
+        return -1;
+    }
+
+#if defined(CONFIG_TK1_SMMU) || defined(CONFIG_IOMMU)
+    struct sel4utils_alloc_data *data = get_alloc_data(vspace);
+    guest_vspace_t *guest_vspace = (guest_vspace_t *) data;
+    /* devices must not write behind a write protected mapping either */
+    for (int i = 0; i < guest_vspace->num_iospaces; i++) {
+        guest_iospace_t *guest_iospace = guest_vspace->iospaces[i];
+        seL4_CPtr iospace_frame_cap_copy = vspace_get_cap(&guest_iospace->iospace_vspace, vaddr);
+        if (iospace_frame_cap_copy == seL4_CapNull) {
+            continue;
+        }
+        error = seL4_ARCH_Page_Unmap(iospace_frame_cap_copy);
+        if (error) {
+            ZF_LOGE("Failed to unmap page from iospace");
+            return -1;
+        }
+        error = sel4utils_map_iospace_page(guest_vspace->vspace_data.vka, guest_iospace->iospace,
+                                           iospace_frame_cap_copy, (uintptr_t)vaddr, rights, 1,
+                                           size_bits, NULL, NULL);
+        if (error) {
+            ZF_LOGE("Failed to remap page into iospace");
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
 int vm_init_guest_vspace(vspace_t *loader, vspace_t *vmm, vspace_t *new_vspace, vka_t *vka, seL4_CPtr page_directory)
 {
     int error;
@@ -10,5 +10,8 @@
 #include <vspace/vspace.h>
 #include <vka/vka.h>
 
+/* Changes the rights of a frame already mapped into the guest vspace, and of its copies mapped into the IO spaces */
+int guest_vspace_remap(vspace_t *vspace, void *vaddr, size_t size_bits, seL4_CapRights_t rights);
+
 /* Constructs a vspace that will duplicate mappings between a page directory and several IO spaces */
 int vm_init_guest_vspace(vspace_t *loader, vspace_t *vmm, vspace_t *new_vspace, vka_t *vka, seL4_CPtr page_directory);
@@ -21,6 +21,8 @@ enum img_type {
     IMG_INITRD_GZ,
     /* Flattened device tree blob */
     IMG_DTB,
+    /* lz4 compressed image */
+    IMG_LZ4,
 };
 
 struct guest_kernel_image_arch {};
@@ -17,6 +17,7 @@
 /* Virtio device IDs  */
 #define VIRTIO_NET_PCI_DEVICE_ID        0x1000
 #define VIRTIO_BLOCK_PCI_DEVICE_ID      0x1001
+#define VIRTIO_BALLOON_PCI_DEVICE_ID    0x1002
 #define VIRTIO_CONSOLE_PCI_DEVICE_ID    0x1003
 #define VIRTIO_VSOCK_PCI_DEVICE_ID      0x1012
 
@@ -24,6 +25,7 @@
 #define VIRTIO_ID_NET                   1
 #define VIRTIO_ID_BLOCK                 2
 #define VIRTIO_ID_CONSOLE               3
+#define VIRTIO_ID_BALLOON               5
 #define VIRTIO_ID_VSOCK                 19
 
 /* Virtio PCI device classes, source: https://pci-ids.ucw.cz/read/PD/ */
@@ -35,3 +37,5 @@
 #define VIRTIO_PCI_CLASS_CONSOLE        0x078000
 /* Device class 07 (communication controller), subclass 80 (communication controller) */
 #define VIRTIO_PCI_CLASS_VSOCK          0x078000
+/* Device class ff (unassigned class), subclass 00 */
+#define VIRTIO_PCI_CLASS_BALLOON        0xff0000
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_balloon.h
+ * This interface provides the ability to initalise a VMM virtio balloon driver. This creates a virtio PCI
+ * device in the VM's virtual pci, through which the VMM can ask the guest to give up memory, read the guest's
+ * memory statistics and receive reports of free guest memory. Memory given up or reported free by the guest
+ * is returned to the VMM's allocator, if the guest touches it again it faults in fresh frames.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+#include <sel4vmmplatsupport/ioports.h>
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/***
+ * @struct virtio_balloon
+ * Virtio Balloon Driver Interface
+ * @param {unsigned int} iobase                                     IO Port base for virtio balloon device
+ * @param {virtio_emul_t *} emul                                    Virtio balloon emulation interface: VMM <-> Guest
+ * @param {struct virtio_balloon_driver *} emul_driver              Balloon driver interface: VMM <-> emulation
+ * @param {struct virtio_balloon_passthrough} emul_driver_funcs     Virtio balloon backend functions: VMM <-> Guest
+ * @param {ps_io_ops_t} ioops                                       Platform support io ops datastructure
+ */
+typedef struct virtio_balloon {
+    unsigned int iobase;
+    virtio_emul_t *emul;
+    struct virtio_balloon_driver *emul_driver;
+    struct virtio_balloon_passthrough emul_driver_funcs;
+    ps_io_ops_t ioops;
+} virtio_balloon_t;
+
+/***
+ * @function common_make_virtio_balloon(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line, backend)
+ * Initialise a new virtio_balloon device with Base Address Registers (BARs) starting at iobase and backend functions
+ * specified by the balloon_passthrough struct. The device offers the stats queue, deflate on OOM and free page
+ * reporting features
+ * @param {vm_t *} vm                                   Handle to the VM
+ * @param {vmm_pci_space_t *} pci                       PCI library instance to register virtio balloon device
+ * @param {vmm_io_port_list_t *} ioport                 IOPort library instance to register virtio balloon ioport
+ * @param {ioport_range_t} ioport_range                 BAR port for front end emulation
+ * @param {ioport_type_t} port_type                     Type of ioport i.e. whether to alloc or use given range
+ * @param {unsigned int} interrupt_pin                  PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line                 PCI interrupt line for virtio balloon IRQS
+ * @param {struct virtio_balloon_passthrough} backend   Function pointers to backend implementation
+ * @return                                              Pointer to an initialised virtio_balloon_t, NULL if error.
+ */
+virtio_balloon_t *common_make_virtio_balloon(vm_t *vm,
+                                             vmm_pci_space_t *pci,
+                                             vmm_io_port_list_t *ioport,
+                                             ioport_range_t ioport_range,
+                                             ioport_type_t port_type,
+                                             unsigned int interrupt_pin,
+                                             unsigned int interrupt_line,
+                                             struct virtio_balloon_passthrough backend);
+
+/***
+ * @function virtio_balloon_set_target(balloon, num_pages)
+ * Set the size the guest should inflate or deflate the balloon to, raising a configuration change interrupt
+ * @param {virtio_balloon_t *} balloon      Handle to the virtio balloon device
+ * @param {uint32_t} num_pages              Number of 4K pages the guest should give up
+ */
+void virtio_balloon_set_target(virtio_balloon_t *balloon, uint32_t num_pages);
+
+/***
+ * @function virtio_balloon_get_actual(balloon)
+ * Get the number of pages the guest reports as held by the balloon
+ * @param {virtio_balloon_t *} balloon      Handle to the virtio balloon device
+ * @return                                  Number of 4K pages the guest has given up
+ */
+uint32_t virtio_balloon_get_actual(virtio_balloon_t *balloon);
+
+/***
+ * @function virtio_balloon_request_stats(balloon)
+ * Ask the guest for fresh memory statistics. The guest answers asynchronously, after which the statistics can
+ * be read with `virtio_balloon_get_stats`
+ * @param {virtio_balloon_t *} balloon      Handle to the virtio balloon device
+ * @return                                  -1 if the guest has no stats buffer with the device, otherwise 0
+ */
+int virtio_balloon_request_stats(virtio_balloon_t *balloon);
+
+/***
+ * @function virtio_balloon_get_stats(balloon, stats)
+ * Get the last memory statistics received from the guest, indexed by VIRTIO_BALLOON_S_* tag. Statistics the
+ * guest does not report are left as 0
+ * @param {virtio_balloon_t *} balloon      Handle to the virtio balloon device
+ * @param {uint64_t *} stats                Array of VIRTIO_BALLOON_S_NR entries to be filled with the statistics
+ * @return                                  -1 if the guest has not reported statistics yet, otherwise 0
+ */
+int virtio_balloon_get_stats(virtio_balloon_t *balloon, uint64_t *stats);
+
+/***
+ * @function virtio_balloon_released_bytes(balloon)
+ * Get the number of bytes of guest RAM the device has returned to the VMM's allocator
+ * @param {virtio_balloon_t *} balloon      Handle to the virtio balloon device
+ * @return                                  Number of bytes released since the device was created
+ */
+size_t virtio_balloon_released_bytes(virtio_balloon_t *balloon);
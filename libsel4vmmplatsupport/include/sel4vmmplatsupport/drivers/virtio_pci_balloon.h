@@ -0,0 +1,95 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct virtio_emul virtio_emul_t;
+
+/* The following constants are found in the virtio spec (Traditional Memory Balloon Device) */
+
+/* Feature bits */
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST     0
+#define VIRTIO_BALLOON_F_STATS_VQ           1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM     2
+#define VIRTIO_BALLOON_F_REPORTING          5
+
+/* Inflate and deflate queues hold 4K page frame numbers, regardless of the guest page size */
+#define VIRTIO_BALLOON_PFN_SHIFT            12
+
+/* Memory statistics tags */
+#define VIRTIO_BALLOON_S_SWAP_IN            0
+#define VIRTIO_BALLOON_S_SWAP_OUT           1
+#define VIRTIO_BALLOON_S_MAJFLT             2
+#define VIRTIO_BALLOON_S_MINFLT             3
+#define VIRTIO_BALLOON_S_MEMFREE            4
+#define VIRTIO_BALLOON_S_MEMTOT             5
+#define VIRTIO_BALLOON_S_AVAIL              6
+#define VIRTIO_BALLOON_S_CACHES             7
+#define VIRTIO_BALLOON_S_HTLB_PGALLOC       8
+#define VIRTIO_BALLOON_S_HTLB_PGFAIL        9
+#define VIRTIO_BALLOON_S_NR                 10
+
+/* Device configuration, following the common legacy header */
+#define VIRTIO_BALLOON_CFG_NUM_PAGES        VIRTIO_PCI_CONFIG_OFF(false)
+#define VIRTIO_BALLOON_CFG_ACTUAL           (VIRTIO_PCI_CONFIG_OFF(false) + 4)
+
+/* Interrupt status bits */
+#define VIRTIO_BALLOON_ISR_QUEUE            0x1
+#define VIRTIO_BALLOON_ISR_CONFIG           0x2
+
+struct virtio_balloon_config {
+    /* Number of pages the host wants the guest to give up */
+    uint32_t num_pages;
+    /* Number of pages the guest has given up */
+    uint32_t actual;
+};
+
+/***
+ * @struct virtio_balloon_callbacks
+ * Callback functions provided by the emul layer of virtio balloon
+ *
+ * @param set_target set the number of 4K pages the guest should give up
+ * @param get_actual get the number of 4K pages the guest has given up
+ * @param request_stats ask the guest for fresh memory statistics
+ * @param get_stats get the last memory statistics received from the guest
+ * @param released_bytes get the number of bytes of guest RAM returned to the allocator
+ */
+typedef struct virtio_balloon_callbacks {
+    void (*set_target)(virtio_emul_t *emul, uint32_t num_pages);
+    uint32_t (*get_actual)(virtio_emul_t *emul);
+    int (*request_stats)(virtio_emul_t *emul);
+    int (*get_stats)(virtio_emul_t *emul, uint64_t *stats);
+    size_t (*released_bytes)(virtio_emul_t *emul);
+} virtio_balloon_callbacks_t;
+
+/***
+ * @struct virtio_balloon_passthrough
+ * Virtio balloon backend layer interface
+ *
+ * @param injectIRQ inject the device interrupt into the guest
+ * @param balloon_data data specified by the backend
+ */
+typedef struct virtio_balloon_passthrough {
+    void (*injectIRQ)(void *cookie);
+    void *balloon_data;
+} virtio_balloon_passthrough_t;
+
+/***
+ * @struct virtio_balloon_driver
+ * Structure to hold the interface for a virtio balloon driver
+ *
+ * @param backend_fn backend layer interface
+ * @param emul_cb emul layer interface
+ */
+struct virtio_balloon_driver {
+    virtio_balloon_passthrough_t backend_fn;
+    virtio_balloon_callbacks_t emul_cb;
+};
+
+typedef int (*balloon_driver_init)(struct virtio_balloon_driver *driver, ps_io_ops_t io_ops, void *config);
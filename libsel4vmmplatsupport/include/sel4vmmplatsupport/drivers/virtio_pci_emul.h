@@ -13,6 +13,7 @@
 #include <satadrivers/raw.h>
 #include <sel4vmmplatsupport/drivers/virtio_pci_console.h>
 #include <sel4vmmplatsupport/drivers/virtio_pci_vsock.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_balloon.h>
 #include <sel4vm/guest_vm.h>
 #include <virtio/virtio_ring.h>
 #include <virtio/virtio_pci.h>
@@ -29,6 +30,7 @@ typedef enum virtio_pci_devices {
     VIRTIO_CONSOLE,
     VIRTIO_BLOCK,
     VIRTIO_VSOCK,
+    VIRTIO_BALLOON,
 } virtio_pci_devices_t;
 
 #define VQUEUE_NUM_VRINGS (VIRTIO_CON_MAX_PORTS*2+2)
@@ -62,6 +64,10 @@ typedef struct virtio_emul {
 virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, vm_t *vm, void *driver,
                                 void *config, virtio_pci_devices_t device);
 
+/* Save and restore the virtqueue state of emul with VM snapshots. iobase tells the device apart from the
+ * other virtio devices of the VM. The state of the device's backend is not included */
+int virtio_emul_snapshot_register(virtio_emul_t *emul, unsigned int iobase);
+
 void ring_used_add(virtio_emul_t *emul, struct vring *vring, struct vring_used_elem elem);
 
 struct vring_desc ring_desc(virtio_emul_t *emul, struct vring *vring, uint16_t idx);
@@ -77,3 +83,5 @@ void *console_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, console_
 void *block_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, diskif_driver_init driver, void *config);
 
 void *vsock_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, vsock_driver_init driver, void *config);
+
+void *balloon_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, balloon_driver_init driver, void *config);
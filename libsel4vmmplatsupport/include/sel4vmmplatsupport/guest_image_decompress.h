@@ -0,0 +1,65 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_image_decompress.h
+ * The guest image decompression interface decompresses guest images (e.g. kernel, initrd) as they are read from a
+ * file, so that they can be stored compressed and written out uncompressed straight into guest RAM. Images in the
+ * gzip format and in both the current and legacy lz4 formats are supported. Output is written to a single buffer,
+ * which doubles as the decompression window.
+ */
+
+#include <stddef.h>
+
+/***
+ * @enum image_compression
+ * Compression formats recognised by the image loaders
+ */
+typedef enum image_compression {
+    IMAGE_UNCOMPRESSED,
+    IMAGE_GZIP,
+    IMAGE_LZ4,
+    IMAGE_LZ4_LEGACY,
+    /* Recognised, so that such images are not loaded verbatim, but not supported */
+    IMAGE_ZSTD,
+} image_compression_t;
+
+/***
+ * @function image_get_compression(header, len)
+ * Detect the compression format of an image from its first bytes
+ * @param {const void *} header     Start of the image
+ * @param {size_t} len              Number of bytes available at header
+ * @return                          Compression format of the image, IMAGE_UNCOMPRESSED if not recognised
+ */
+image_compression_t image_get_compression(const void *header, size_t len);
+
+/***
+ * @function image_decompressed_size(fd, compression, size)
+ * Find the size of a compressed image once decompressed. Images in the lz4 formats don't always record their size,
+ * in which case the size returned is an upper bound, at most one lz4 block larger. The file offset is reset to the
+ * start of the image
+ * @param {int} fd                              Open file holding the image
+ * @param {image_compression_t} compression     Compression format of the image
+ * @param {size_t *} size                       Pointer to be set with the decompressed size
+ * @return                                      0 on success, -1 on error
+ */
+int image_decompressed_size(int fd, image_compression_t compression, size_t *size);
+
+/***
+ * @function image_decompress(fd, compression, dest, dest_size, decompressed_size)
+ * Decompress an image from the start of a file into a buffer, reading the file in large blocks. The gzip checksum
+ * and size are verified
+ * @param {int} fd                              Open file holding the image, read from its current offset
+ * @param {image_compression_t} compression     Compression format of the image
+ * @param {void *} dest                         Buffer to decompress the image into
+ * @param {size_t} dest_size                    Size of the buffer
+ * @param {size_t *} decompressed_size          Pointer to be set with the number of bytes written to dest
+ * @return                                      0 on success, -1 on error
+ */
+int image_decompress(int fd, image_compression_t compression, void *dest, size_t dest_size,
+                     size_t *decompressed_size);
@@ -6,6 +6,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -20,6 +22,7 @@
 #include <sel4vm/guest_ram.h>
 
 #include <sel4vmmplatsupport/guest_image.h>
+#include <sel4vmmplatsupport/guest_image_decompress.h>
 
 #define UIMAGE_MAGIC 0x56190527
 #define ZIMAGE_MAGIC 0x016F2818
@@ -82,6 +85,12 @@ static int is_initrd(void *file)
     return hdr->magic != INITRD_GZ_MAGIC;
 }
 
+static bool is_lz4(void *file)
+{
+    image_compression_t compression = image_get_compression(file, sizeof(uint32_t));
+    return compression == IMAGE_LZ4 || compression == IMAGE_LZ4_LEGACY;
+}
+
 static enum img_type image_get_type(void *file)
 {
     if (elf_check_magic(file) == 0) {
@@ -94,6 +103,8 @@ static enum img_type image_get_type(void *file)
         return IMG_DTB;
     } else if (is_initrd(file) == 0) {
         return IMG_INITRD_GZ;
+    } else if (is_lz4(file)) {
+        return IMG_LZ4;
     } else {
         return IMG_BIN;
     }
@@ -126,27 +137,95 @@ static int get_guest_image_type(const char *image_name, enum img_type *image_typ
     return 0;
 }
 
-static int guest_write_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+/* Read the whole file into the mapped range, the file server may return less than asked for */
+static int read_image(int fd, void *vaddr, size_t size)
 {
-    int fd = *((int *)cookie);
-
-    /* Load the image */
-    size_t len = read(fd, vaddr, size);
-    if (len != size) {
-        ZF_LOGE("Bytes read from the file server (%d) don't match expected length (%d)", len, size);
-        return -1;
+    size_t loaded = 0;
+    while (loaded < size) {
+        ssize_t len = read(fd, vaddr + loaded, size - loaded);
+        if (len <= 0) {
+            ZF_LOGE("Bytes read from the file server (%zu) don't match expected length (%zu)", loaded, size);
+            return -1;
+        }
+        loaded += len;
     }
+    return 0;
+}
 
-    if (vm->mem.clean_cache) {
+/* Clean the loaded image from the data cache, one invocation per frame backing it */
+static int clean_image(vm_t *vm, vm_ram_mapping_t *mapping)
+{
+    uintptr_t paddr = mapping->addr;
+    uintptr_t end = mapping->addr + mapping->size;
+    while (paddr < end) {
+        size_t size_bits = vm_memory_page_size_bits(vm, paddr);
+        void *vaddr = mapping->vaddr + (paddr - mapping->addr);
         seL4_CPtr cap = vspace_get_cap(&vm->mem.vmm_vspace, vaddr);
         if (cap == seL4_CapNull) {
             /* Not sure how we would get here, something has gone pretty wrong */
             ZF_LOGE("Failed to get vmm cap for vaddr: %p", vaddr);
             return -1;
         }
-        int error = seL4_ARM_Page_CleanInvalidate_Data(cap, 0, PAGE_SIZE_4K);
+        /* Guest RAM may be backed by large frames, clean relative to the frame start */
+        uintptr_t frame_end = ROUND_DOWN(paddr, BIT(size_bits)) + BIT(size_bits);
+        seL4_Word frame_offset = paddr & MASK(size_bits);
+        int error = seL4_ARM_Page_CleanInvalidate_Data(cap, frame_offset, frame_offset + MIN(end, frame_end) - paddr);
         ZF_LOGF_IFERR(error, "seL4_ARM_Page_CleanInvalidate_Data failed");
+        paddr = MIN(end, frame_end);
+    }
+    return 0;
+}
+
+/*
+ * Bytes from addr to the end of the RAM region holding it, 0 if addr is not RAM. Mappings can't span
+ * regions, and the next one may already hold another image
+ */
+static size_t ram_space_from(vm_t *vm, uintptr_t addr)
+{
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        vm_ram_region_t *region = &vm->mem.ram_regions[i];
+        if (region->start <= addr && addr < region->start + region->size) {
+            return region->start + region->size - addr;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Decompress the image straight into guest RAM, mapping room for the largest size it can decompress to. The lz4
+ * bound can be a whole block past the real size, so the mapping stops at the end of the RAM region
+ */
+static int load_compressed_image(vm_t *vm, int fd, image_compression_t compression, uintptr_t load_addr,
+                                 size_t *resulting_image_size)
+{
+    size_t bound;
+    int error = image_decompressed_size(fd, compression, &bound);
+    if (error || bound == 0) {
+        return -1;
+    }
+    size_t space = ram_space_from(vm, load_addr);
+    if (space == 0) {
+        ZF_LOGE("Load address 0x%"PRIxPTR" is not in guest RAM", load_addr);
+        return -1;
+    }
+    bound = MIN(bound, space);
+    vm_ram_mapping_t mapping;
+    error = vm_ram_map(vm, load_addr, bound, true, &mapping);
+    if (error) {
+        return -1;
+    }
+    size_t image_size;
+    error = image_decompress(fd, compression, mapping.vaddr, bound, &image_size);
+    if (!error && vm->mem.clean_cache) {
+        mapping.size = image_size;
+        error = clean_image(vm, &mapping);
     }
+    vm_ram_unmap(vm, &mapping);
+    if (error) {
+        return -1;
+    }
+    vm_ram_mark_allocated(vm, load_addr, ROUND_UP(image_size, PAGE_SIZE_4K));
+    *resulting_image_size = image_size;
     return 0;
 }
 
@@ -166,19 +245,44 @@ static int load_image(vm_t *vm, const char *image_name, uintptr_t load_addr,  si
 
     if (0 == file_size) {
         ZF_LOGE("Error: \'%s\' has zero size", image_name);
+        close(fd);
         return -1;
     }
 
+    uint32_t magic = 0;
+    if (read(fd, &magic, sizeof(magic)) < 0) {
+        magic = 0;
+    }
+    lseek(fd, 0, SEEK_SET);
+    image_compression_t compression = image_get_compression(&magic, MIN(file_size, sizeof(magic)));
+    if (compression != IMAGE_UNCOMPRESSED) {
+        error = load_compressed_image(vm, fd, compression, load_addr, resulting_image_size);
+        close(fd);
+        if (error) {
+            ZF_LOGE("Error: Failed to decompress \'%s\'", image_name);
+            return -1;
+        }
+        return 0;
+    }
+
     vm_ram_mark_allocated(vm, load_addr, ROUND_UP(file_size, PAGE_SIZE_4K));
-    error = vm_ram_touch(vm, load_addr, file_size, guest_write_address, (void *)&fd);
+    /* Map the destination once and read the image straight into it, rather than a page at a time */
+    vm_ram_mapping_t mapping;
+    error = vm_ram_map(vm, load_addr, file_size, true, &mapping);
+    if (!error) {
+        error = read_image(fd, mapping.vaddr, file_size);
+        if (!error && vm->mem.clean_cache) {
+            error = clean_image(vm, &mapping);
+        }
+        vm_ram_unmap(vm, &mapping);
+    }
+    close(fd);
     if (error) {
         ZF_LOGE("Error: Failed to load \'%s\'", image_name);
-        close(fd);
         return -1;
     }
 
     *resulting_image_size = file_size;
-    close(fd);
     return 0;
 }
 
@@ -196,6 +300,9 @@ static uintptr_t load_guest_kernel_image(vm_t *vm, const char *kernel_image_name
     /* Determine the load address */
     switch (ret_file_type) {
     case IMG_BIN:
+    /* Compressed kernels are raw images once decompressed by load_image */
+    case IMG_INITRD_GZ:
+    case IMG_LZ4:
         load_addr = vm->entry;
         break;
     case IMG_ZIMAGE:
@@ -226,6 +333,7 @@ static uintptr_t load_guest_module_image(vm_t *vm, const char *image_name, uintp
     switch (ret_file_type) {
     case IMG_DTB:
     case IMG_INITRD_GZ:
+    case IMG_LZ4:
         load_addr = load_base_addr;
         break;
     default:
@@ -28,11 +28,6 @@
 #define ISELF32(elfFile) ( ((Elf32_Ehdr *)elfFile)->e_ident[EI_CLASS] == ELFCLASS32 )
 #define ISELF64(elfFile) ( ((Elf64_Ehdr *)elfFile)->e_ident[EI_CLASS] == ELFCLASS64 )
 
-typedef struct boot_guest_cookie {
-    vm_t *vm;
-    FILE *file;
-} boot_guest_cookie_t;
-
 /* Reads the elf header and elf program headers from a file when given a sufficiently
  * large memory buffer
  */
@@ -62,18 +57,6 @@ static int read_elf_headers(void *buf, vm_t *vm, FILE *file, size_t buf_size, el
     return elf_newFile_maybe_unsafe(buf, buf_size, true, false, elf);
 }
 
-static int guest_elf_write_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
-{
-    memcpy(vaddr, cookie + offset, size);
-    return 0;
-}
-
-static int guest_elf_read_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
-{
-    memcpy(cookie + offset, vaddr, size);
-    return 0;
-}
-
 int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image_t *image)
 {
     int delta = image->kernel_image_arch.relocation_offset;
@@ -115,124 +98,91 @@ int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image
      *
      * src: Linux kernel 3.5.3 arch/x86/boot/compressed/misc.c
      */
-    uint32_t last_relocated_vaddr = 0xFFFFFFFF;
-    uint32_t num_relocations = relocs_size / sizeof(uint32_t) - 1;
-    for (int i = 0; ; i++) {
-        uint32_t vaddr;
-        /* Get the next relocation from the relocs file. */
-        uint32_t offset = relocs_size - (sizeof(uint32_t) * (i + 1));
-        fseek(file, offset, SEEK_SET);
-        size_t result = fread(&vaddr, sizeof(uint32_t), 1, file);
-        ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-        if (!vaddr) {
-            break;
-        }
-        assert(i * sizeof(uint32_t) < relocs_size);
-        last_relocated_vaddr = vaddr;
+    uint32_t *relocs = malloc(relocs_size);
+    if (!relocs) {
+        ZF_LOGE("Failed to allocate buffer for %zu bytes of relocations", relocs_size);
+        fclose(file);
+        return -1;
+    }
+    /* Read the relocations in one go rather than seeking to each of them */
+    size_t result = fread(relocs, relocs_size, 1, file);
+    fclose(file);
+    ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
+    size_t end = relocs_size / sizeof(uint32_t);
+    size_t first = end;
+    while (first > 0 && relocs[first - 1]) {
+        first--;
+    }
+    uint32_t num_relocations = end - first;
+    if (num_relocations == 0) {
+        ZF_LOGE("Relocation required, but Kernel has not been build with CONFIG_RELOCATABLE.");
+        free(relocs);
+        return -1;
+    }
+
+    /* Calculate the corresponding guest-physical addresses at which we have already
+       allocated and mapped the ELF contents into, and map all of them at once. */
+    uintptr_t reloc_base = (uintptr_t)(load_addr + delta) - (uintptr_t)image->kernel_image_arch.link_vaddr;
+    uint32_t lowest_vaddr = UINT32_MAX;
+    uint32_t highest_vaddr = 0;
+    for (size_t i = first; i < end; i++) {
+        assert(relocs[i] >= (uint32_t)image->kernel_image_arch.link_vaddr);
+        lowest_vaddr = MIN(lowest_vaddr, relocs[i]);
+        highest_vaddr = MAX(highest_vaddr, relocs[i]);
+    }
+    vm_ram_mapping_t mapping;
+    int err = vm_ram_map(vm, reloc_base + lowest_vaddr, highest_vaddr - lowest_vaddr + sizeof(uint32_t), true,
+                         &mapping);
+    if (err) {
+        ZF_LOGE("Failed to map guest kernel for relocation");
+        free(relocs);
+        return -1;
+    }
 
-        /* Calculate the corresponding guest-physical address at which we have already
-           allocated and mapped the ELF contents into. */
-        assert(vaddr >= (uint32_t)image->kernel_image_arch.link_vaddr);
-        uintptr_t guest_paddr = (uintptr_t)vaddr - (uintptr_t)image->kernel_image_arch.link_vaddr +
-                                (uintptr_t)(load_addr + delta);
+    /* Work backwards from the end of the file, as the kernel decompressor does */
+    for (size_t i = end; i > first; i--) {
+        uint32_t vaddr = relocs[i - 1];
+        uintptr_t guest_paddr = reloc_base + vaddr;
 
         /* Perform the relocation. */
         ZF_LOGI("   reloc vaddr 0x%x guest_addr 0x%x", (unsigned int)vaddr, (unsigned int)guest_paddr);
+        void *reloc_vaddr = mapping.vaddr + (vaddr - lowest_vaddr);
         uint32_t addr;
-        vm_ram_touch(vm, guest_paddr, sizeof(int),
-                     guest_elf_read_address, &addr);
+        memcpy(&addr, reloc_vaddr, sizeof(addr));
         addr += delta;
-        vm_ram_touch(vm, guest_paddr, sizeof(int),
-                     guest_elf_write_address, &addr);
-
-        if (i && i % 50000 == 0) {
-            ZF_LOGE("    %u relocs done.", i);
-        }
+        memcpy(reloc_vaddr, &addr, sizeof(addr));
     }
-    ZF_LOGI("plat: last relocated addr was %d", last_relocated_vaddr);
+    vm_ram_unmap(vm, &mapping);
+    ZF_LOGI("plat: last relocated addr was %d", relocs[first]);
     ZF_LOGI("plat: %d kernel relocations completed.", num_relocations);
-    (void) last_relocated_vaddr;
-
-    if (num_relocations == 0) {
-        ZF_LOGE("Relocation required, but Kernel has not been build with CONFIG_RELOCATABLE.");
-        return -1;
-    }
 
-    fclose(file);
+    free(relocs);
     return 0;
 }
 
-/* TODO: Refactor and stop rewriting fucking elf loading code */
 static int load_guest_segment(vm_t *vm, seL4_Word source_offset,
                               seL4_Word dest_addr, unsigned int segment_size, unsigned int file_size, FILE *file)
 {
-
-    int ret;
-    unsigned int page_size = seL4_PageBits;
     assert(file_size <= segment_size);
 
-    /* Allocate a cslot for duplicating frame caps */
-    cspacepath_t dup_slot;
-    ret = vka_cspace_alloc_path(vm->vka, &dup_slot);
+    /* Map the whole segment once and read its contents straight into it, rather than a frame at a time */
+    vm_ram_mapping_t mapping;
+    int ret = vm_ram_map(vm, dest_addr, segment_size, true, &mapping);
     if (ret) {
-        ZF_LOGE("Failed to allocate slot");
-        return ret;
+        ZF_LOGE("Failed to map elf segment at %p", (void *)dest_addr);
+        return -1;
     }
 
-    size_t current = 0;
-    size_t remain = file_size;
-    while (current < segment_size) {
-        /* Retrieve the mapping */
-        seL4_CPtr cap;
-        cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)dest_addr);
-        if (!cap) {
-            ZF_LOGE("Failed to find frame cap while loading elf segment at %p", (void *)dest_addr);
-            return -1;
-        }
-        cspacepath_t cap_path;
-        vka_cspace_make_path(vm->vka, cap, &cap_path);
-
-        /* Copy cap and map into our vspace */
-        vka_cnode_copy(&dup_slot, &cap_path, seL4_AllRights);
-        void *map_vaddr = vspace_map_pages(&vm->mem.vmm_vspace, &dup_slot.capPtr, NULL, seL4_AllRights, 1, page_size, 1);
-        if (!map_vaddr) {
-            ZF_LOGE("Failed to map page into host vspace");
-            return -1;
-        }
-
-        /* Copy the contents of page from ELF into the mapped frame. */
-        size_t offset = dest_addr & ((BIT(page_size)) - 1);
-
-        void *copy_vaddr = map_vaddr + offset;
-        size_t copy_len = (BIT(page_size)) - offset;
-
-        if (remain > 0) {
-            if (copy_len > remain) {
-                /* Don't copy past end of data. */
-                copy_len = remain;
-            }
-
-            ZF_LOGI("load page src %zu dest %p remain %zu offset %zu copy vaddr %p "
-                    "copy len %zu\n", source_offset, (void *)dest_addr, remain, offset, copy_vaddr, copy_len);
-
-            fseek(file, source_offset, SEEK_SET);
-            size_t result = fread(copy_vaddr, copy_len, 1, file);
-            ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-            source_offset += copy_len;
-            remain -= copy_len;
-        } else {
-            memset(copy_vaddr, 0, copy_len);
-        }
-
-        dest_addr += copy_len;
-
-        current += copy_len;
-
-        /* Unamp the page and delete the temporary cap */
-        vspace_unmap_pages(&vm->mem.vmm_vspace, map_vaddr, 1, page_size, NULL);
-        vka_cnode_delete(&dup_slot);
+    ZF_LOGI("load segment src %zu dest %p file size %u segment size %u", (size_t)source_offset, (void *)dest_addr,
+            file_size, segment_size);
+    if (file_size) {
+        fseek(file, source_offset, SEEK_SET);
+        size_t result = fread(mapping.vaddr, file_size, 1, file);
+        ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
     }
+    memset(mapping.vaddr + file_size, 0, segment_size - file_size);
 
+    vm_ram_unmap(vm, &mapping);
     return 0;
 }
 
@@ -352,16 +302,6 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
     return err;
 }
 
-static int load_module_continued(vm_t *vm, uintptr_t paddr, void *addr, size_t size, size_t offset, void *cookie)
-{
-    boot_guest_cookie_t *pass = (boot_guest_cookie_t *) cookie;
-    fseek(pass->file, offset, SEEK_SET);
-    size_t result = fread(addr, size, 1, pass->file);
-    ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-
-    return 0;
-}
-
 int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
                          guest_image_t *guest_image)
 {
@@ -382,8 +322,17 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
     }
 
     vm_ram_mark_allocated(vm, load_address, module_size);
-    boot_guest_cookie_t pass = { .vm = vm, .file = file};
-    vm_ram_touch(vm, load_address, module_size, load_module_continued, &pass);
+    /* Map the destination once and read the module straight into it, rather than a page at a time */
+    vm_ram_mapping_t mapping;
+    int err = vm_ram_map(vm, load_address, module_size, true, &mapping);
+    if (err) {
+        ZF_LOGE("Failed to map module \"%s\" into guest ram", module_name);
+        fclose(file);
+        return -1;
+    }
+    size_t result = fread(mapping.vaddr, module_size, 1, file);
+    ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
+    vm_ram_unmap(vm, &mapping);
 
     fclose(file);
 
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platsupport/io.h>
+
+#include <sel4vmmplatsupport/drivers/virtio.h>
+#include <sel4vmmplatsupport/drivers/virtio_balloon.h>
+
+#include <pci/helper.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#define QUEUE_SIZE 128
+
+static ps_io_ops_t ops;
+
+static int virtio_balloon_io_in(void *cookie, unsigned int port_no, unsigned int size, unsigned int *result)
+{
+    virtio_balloon_t *balloon = (virtio_balloon_t *)cookie;
+    unsigned int offset = port_no - balloon->iobase;
+    unsigned int val;
+    int err = balloon->emul->io_in(balloon->emul, offset, size, &val);
+    if (err) {
+        return err;
+    }
+    *result = val;
+    return 0;
+}
+
+static int virtio_balloon_io_out(void *cookie, unsigned int port_no, unsigned int size, unsigned int value)
+{
+    virtio_balloon_t *balloon = (virtio_balloon_t *)cookie;
+    unsigned int offset = port_no - balloon->iobase;
+    return balloon->emul->io_out(balloon->emul, offset, size, value);
+}
+
+static int emul_balloon_driver_init(struct virtio_balloon_driver *driver, ps_io_ops_t io_ops, void *config)
+{
+    virtio_balloon_t *balloon = (virtio_balloon_t *) config;
+    driver->backend_fn = balloon->emul_driver_funcs;
+    balloon->emul_driver = driver;
+    return 0;
+}
+
+static vmm_pci_entry_t vmm_virtio_balloon_pci_bar(unsigned int iobase, size_t iobase_size_bits,
+                                                  unsigned int interrupt_pin, unsigned int interrupt_line)
+{
+    vmm_pci_device_def_t *pci_config;
+    int err = ps_calloc(&ops.malloc_ops, 1, sizeof(*pci_config), (void **) &pci_config);
+    ZF_LOGF_IF(err, "Failed to allocate pci_config");
+    *pci_config = (vmm_pci_device_def_t) {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_BALLOON_PCI_DEVICE_ID,
+        .command = PCI_COMMAND_IO,
+        .header_type = PCI_HEADER_TYPE_NORMAL,
+        .subsystem_vendor_id = VIRTIO_PCI_SUBSYSTEM_VENDOR_ID,
+        .subsystem_id = VIRTIO_ID_BALLOON,
+        .interrupt_pin = interrupt_pin,
+        .interrupt_line = interrupt_line,
+        .bar0 = iobase | PCI_BASE_ADDRESS_SPACE_IO,
+        .cache_line_size = 64,
+        .latency_timer = 64,
+        .prog_if = VIRTIO_PCI_CLASS_BALLOON & 0xff,
+        .subclass = (VIRTIO_PCI_CLASS_BALLOON >> 8) & 0xff,
+        .class_code = (VIRTIO_PCI_CLASS_BALLOON >> 16) & 0xff,
+    };
+    vmm_pci_entry_t entry = (vmm_pci_entry_t) {
+        .cookie = pci_config,
+        .ioread = vmm_pci_mem_device_read,
+        .iowrite = vmm_pci_entry_ignore_write
+    };
+
+    vmm_pci_bar_t bars[1] = {{
+            .mem_type = NON_MEM,
+            .address = iobase,
+            .size_bits = iobase_size_bits
+        }
+    };
+
+    return vmm_pci_create_bar_emulation(entry, 1, bars);
+}
+
+virtio_balloon_t *common_make_virtio_balloon(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                             ioport_range_t ioport_range, ioport_type_t port_type,
+                                             unsigned int interrupt_pin, unsigned int interrupt_line,
+                                             struct virtio_balloon_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_balloon_t *balloon;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*balloon), (void **)&balloon);
+    ZF_LOGF_IF(err, "Failed to allocate virtio balloon");
+
+    ioport_interface_t virtio_io_interface = {balloon, virtio_balloon_io_in, virtio_balloon_io_out, "VIRTIO BALLOON"};
+    ioport_entry_t *io_entry = vmm_io_port_add_handler(ioport, ioport_range, virtio_io_interface, port_type);
+    if (!io_entry) {
+        ZF_LOGE("Failed to add vmm io port handler");
+        return NULL;
+    }
+
+    size_t iobase_size_bits = BYTES_TO_SIZE_BITS(io_entry->range.size);
+    balloon->iobase = io_entry->range.start;
+
+    vmm_pci_entry_t entry = vmm_virtio_balloon_pci_bar(io_entry->range.start, iobase_size_bits, interrupt_pin,
+                                                       interrupt_line);
+    vmm_pci_add_entry(pci, entry, NULL);
+
+    balloon->ioops = ops;
+    balloon->emul_driver_funcs = backend;
+    balloon->emul = virtio_emul_init(ops, QUEUE_SIZE, vm, emul_balloon_driver_init, balloon, VIRTIO_BALLOON);
+    if (!balloon->emul) {
+        ZF_LOGE("Failed to initialise virtio balloon emulation");
+        return NULL;
+    }
+    if (virtio_emul_snapshot_register(balloon->emul, balloon->iobase)) {
+        ZF_LOGE("Failed to register virtio balloon for snapshots");
+        return NULL;
+    }
+    return balloon;
+}
+
+void virtio_balloon_set_target(virtio_balloon_t *balloon, uint32_t num_pages)
+{
+    balloon->emul_driver->emul_cb.set_target(balloon->emul, num_pages);
+}
+
+uint32_t virtio_balloon_get_actual(virtio_balloon_t *balloon)
+{
+    return balloon->emul_driver->emul_cb.get_actual(balloon->emul);
+}
+
+int virtio_balloon_request_stats(virtio_balloon_t *balloon)
+{
+    return balloon->emul_driver->emul_cb.request_stats(balloon->emul);
+}
+
+int virtio_balloon_get_stats(virtio_balloon_t *balloon, uint64_t *stats)
+{
+    return balloon->emul_driver->emul_cb.get_stats(balloon->emul, stats);
+}
+
+size_t virtio_balloon_released_bytes(virtio_balloon_t *balloon)
+{
+    return balloon->emul_driver->emul_cb.released_bytes(balloon->emul);
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_memory.h>
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+#include "virtio_emul_helpers.h"
+
+#define BALLOON_HOST_FEATURES (BIT(VIRTIO_BALLOON_F_STATS_VQ) | BIT(VIRTIO_BALLOON_F_DEFLATE_ON_OOM) | \
+                               BIT(VIRTIO_BALLOON_F_REPORTING))
+
+/* Number of page frame numbers read from the guest at a time */
+#define PFN_BATCH 256
+
+#define BITMAP_WORD_BITS (sizeof(unsigned long) * 8)
+
+typedef enum balloon_queue {
+    INFLATE_QUEUE,
+    DEFLATE_QUEUE,
+    STATS_QUEUE,
+    REPORTING_QUEUE,
+    UNKNOWN_QUEUE
+} balloon_queue_t;
+
+/* A single entry of the stats buffer, packed as laid out by the guest */
+struct virtio_balloon_stat {
+    uint16_t tag;
+    uint64_t val;
+} __attribute__((packed));
+
+typedef struct balloon_internal {
+    struct virtio_balloon_driver driver;
+    struct virtio_balloon_config cfg;
+    uint32_t guest_features;
+    /* Pending interrupt status, cleared when read by the guest */
+    uint8_t isr;
+    /* One bit per 4K page of guest RAM held by the balloon, allocated on first inflate */
+    unsigned long *inflated;
+    uintptr_t ram_start;
+    size_t ram_pages;
+    /* The guest keeps one stats buffer with the device, which is handed back to request fresh stats */
+    bool stats_held;
+    uint16_t stats_head;
+    bool stats_valid;
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    /* Bytes of guest RAM returned to the allocator */
+    size_t released_bytes;
+} balloon_internal_t;
+
+static void balloon_inject_irq(balloon_internal_t *balloon, uint8_t isr)
+{
+    balloon->isr |= isr;
+    balloon->driver.backend_fn.injectIRQ(balloon->driver.backend_fn.balloon_data);
+}
+
+/* Without MSI-X the guest numbers its queues consecutively, skipping those whose feature it did not accept */
+static balloon_queue_t balloon_queue_type(balloon_internal_t *balloon, unsigned int queue)
+{
+    if (queue == INFLATE_QUEUE || queue == DEFLATE_QUEUE) {
+        return queue;
+    }
+    unsigned int next = STATS_QUEUE;
+    if (balloon->guest_features & BIT(VIRTIO_BALLOON_F_STATS_VQ)) {
+        if (queue == next) {
+            return STATS_QUEUE;
+        }
+        next++;
+    }
+    if ((balloon->guest_features & BIT(VIRTIO_BALLOON_F_REPORTING)) && queue == next) {
+        return REPORTING_QUEUE;
+    }
+    return UNKNOWN_QUEUE;
+}
+
+static bool page_inflated(balloon_internal_t *balloon, size_t page)
+{
+    return balloon->inflated[page / BITMAP_WORD_BITS] & BIT(page % BITMAP_WORD_BITS);
+}
+
+static int balloon_init_bitmap(balloon_internal_t *balloon, vm_t *vm)
+{
+    if (balloon->inflated) {
+        return 0;
+    }
+    if (!vm->mem.num_ram_regions) {
+        ZF_LOGE("Failed to inflate balloon: VM has no ram");
+        return -1;
+    }
+    /* Ram regions are kept sorted */
+    vm_ram_region_t *last = &vm->mem.ram_regions[vm->mem.num_ram_regions - 1];
+    balloon->ram_start = vm->mem.ram_regions[0].start;
+    balloon->ram_pages = (last->start + last->size - balloon->ram_start) >> seL4_PageBits;
+    balloon->inflated = calloc(ROUND_UP(balloon->ram_pages, BITMAP_WORD_BITS) / BITMAP_WORD_BITS,
+                               sizeof(unsigned long));
+    if (!balloon->inflated) {
+        ZF_LOGE("Failed to inflate balloon: Unable to allocate page bitmap");
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the frame backing addr to the allocator once every page within it is held by the balloon.
+ * Frames larger than a page stay resident while the guest still uses part of them */
+static void balloon_release_frame(balloon_internal_t *balloon, vm_t *vm, uintptr_t addr)
+{
+    size_t size_bits = vm_memory_page_size_bits(vm, addr);
+    if (!size_bits) {
+        /* Not backed, nothing to give back */
+        return;
+    }
+    uintptr_t frame_start = ROUND_DOWN(addr, BIT(size_bits));
+    if (frame_start < balloon->ram_start) {
+        return;
+    }
+    size_t first = (frame_start - balloon->ram_start) >> seL4_PageBits;
+    size_t num_pages = BIT(size_bits - seL4_PageBits);
+    if (first + num_pages > balloon->ram_pages) {
+        return;
+    }
+    for (size_t page = first; page < first + num_pages; page++) {
+        if (!page_inflated(balloon, page)) {
+            return;
+        }
+    }
+
+    size_t released;
+    int err = vm_ram_release(vm, frame_start, BIT(size_bits), &released);
+    if (err) {
+        ZF_LOGE("Failed to release ballooned frame at 0x%"PRIxPTR, frame_start);
+        return;
+    }
+    balloon->released_bytes += released;
+}
+
+static void balloon_handle_pfns(balloon_internal_t *balloon, vm_t *vm, uint32_t *pfns, size_t num_pfns,
+                                bool inflate)
+{
+    for (size_t i = 0; i < num_pfns; i++) {
+        uintptr_t addr = (uintptr_t)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT;
+        size_t page = (addr - balloon->ram_start) >> seL4_PageBits;
+        if (addr < balloon->ram_start || page >= balloon->ram_pages) {
+            ZF_LOGW("Ignoring balloon page 0x%"PRIxPTR" outside of ram", addr);
+            continue;
+        }
+        if (inflate) {
+            balloon->inflated[page / BITMAP_WORD_BITS] |= BIT(page % BITMAP_WORD_BITS);
+            balloon_release_frame(balloon, vm, addr);
+        } else {
+            /* The guest has reclaimed the page, a later access faults in a fresh frame */
+            balloon->inflated[page / BITMAP_WORD_BITS] &= ~BIT(page % BITMAP_WORD_BITS);
+        }
+    }
+}
+
+static void balloon_handle_pages(virtio_emul_t *emul, int queue, bool inflate)
+{
+    balloon_internal_t *balloon = emul->internal;
+    vqueue_t *virtq = &emul->virtq;
+    struct vring *vring = &virtq->vring[queue];
+    uint32_t pfns[PFN_BATCH];
+
+    if (inflate && balloon_init_bitmap(balloon, emul->vm)) {
+        return;
+    }
+
+    uint16_t guest_idx = ring_avail_idx(emul, vring);
+    uint16_t idx = virtq->last_idx[queue];
+    if (idx == guest_idx) {
+        return;
+    }
+    while (idx != guest_idx) {
+        uint16_t desc_head = ring_avail(emul, vring, idx);
+        struct vring_desc desc;
+        uint16_t desc_idx = desc_head;
+        bool failed = false;
+        do {
+            desc = ring_desc(emul, vring, desc_idx);
+            for (uint32_t offset = 0; offset < desc.len && balloon->inflated;) {
+                size_t num_pfns = MIN(PFN_BATCH, (desc.len - offset) / sizeof(uint32_t));
+                if (!num_pfns) {
+                    break;
+                }
+                if (vm_guest_read_mem(emul->vm, pfns, (uintptr_t)desc.addr + offset, num_pfns * sizeof(uint32_t))) {
+                    /* Drop the rest of the request rather than act on pfns that weren't read */
+                    ZF_LOGE("Failed to read balloon pfns at 0x%"PRIx64, desc.addr + offset);
+                    failed = true;
+                    break;
+                }
+                balloon_handle_pfns(balloon, emul->vm, pfns, num_pfns, inflate);
+                offset += num_pfns * sizeof(uint32_t);
+            }
+            desc_idx = desc.next;
+        } while (!failed && (desc.flags & VRING_DESC_F_NEXT));
+
+        struct vring_used_elem used_elem = {desc_head, 0};
+        ring_used_add(emul, vring, used_elem);
+        idx++;
+    }
+    virtq->last_idx[queue] = idx;
+    balloon_inject_irq(balloon, VIRTIO_BALLOON_ISR_QUEUE);
+}
+
+static void balloon_handle_stats(virtio_emul_t *emul, int queue)
+{
+    balloon_internal_t *balloon = emul->internal;
+    vqueue_t *virtq = &emul->virtq;
+    struct vring *vring = &virtq->vring[queue];
+
+    uint16_t guest_idx = ring_avail_idx(emul, vring);
+    uint16_t idx = virtq->last_idx[queue];
+    while (idx != guest_idx) {
+        if (balloon->stats_held) {
+            /* Only one buffer is ever outstanding, hand back any stale one */
+            struct vring_used_elem used_elem = {balloon->stats_head, 0};
+            ring_used_add(emul, vring, used_elem);
+        }
+        uint16_t desc_head = ring_avail(emul, vring, idx);
+        struct vring_desc desc = ring_desc(emul, vring, desc_head);
+        struct virtio_balloon_stat stat;
+        uint64_t stats[VIRTIO_BALLOON_S_NR];
+        bool failed = false;
+        memcpy(stats, balloon->stats, sizeof(stats));
+        for (uint32_t offset = 0; offset + sizeof(stat) <= desc.len; offset += sizeof(stat)) {
+            if (vm_guest_read_mem(emul->vm, &stat, (uintptr_t)desc.addr + offset, sizeof(stat))) {
+                ZF_LOGE("Failed to read balloon stats at 0x%"PRIx64, desc.addr + offset);
+                failed = true;
+                break;
+            }
+            /* Tags added by newer guests are ignored */
+            if (stat.tag < VIRTIO_BALLOON_S_NR) {
+                stats[stat.tag] = stat.val;
+            }
+        }
+        idx++;
+        if (failed) {
+            /* Hand the buffer straight back, keeping the last good stats */
+            struct vring_used_elem used_elem = {desc_head, 0};
+            ring_used_add(emul, vring, used_elem);
+            balloon->stats_held = false;
+            balloon_inject_irq(balloon, VIRTIO_BALLOON_ISR_QUEUE);
+            continue;
+        }
+        memcpy(balloon->stats, stats, sizeof(stats));
+        balloon->stats_valid = true;
+        balloon->stats_held = true;
+        balloon->stats_head = desc_head;
+    }
+    virtq->last_idx[queue] = idx;
+}
+
+static void balloon_handle_reports(virtio_emul_t *emul, int queue)
+{
+    balloon_internal_t *balloon = emul->internal;
+    vqueue_t *virtq = &emul->virtq;
+    struct vring *vring = &virtq->vring[queue];
+
+    uint16_t guest_idx = ring_avail_idx(emul, vring);
+    uint16_t idx = virtq->last_idx[queue];
+    if (idx == guest_idx) {
+        return;
+    }
+    while (idx != guest_idx) {
+        uint16_t desc_head = ring_avail(emul, vring, idx);
+        struct vring_desc desc;
+        uint16_t desc_idx = desc_head;
+        do {
+            /* Each descriptor is a block of free guest memory */
+            desc = ring_desc(emul, vring, desc_idx);
+            size_t released;
+            int err = vm_ram_release(emul->vm, desc.addr, desc.len, &released);
+            if (err) {
+                ZF_LOGW("Failed to release reported free memory at 0x%"PRIx64, desc.addr);
+            } else {
+                balloon->released_bytes += released;
+            }
+            desc_idx = desc.next;
+        } while (desc.flags & VRING_DESC_F_NEXT);
+
+        struct vring_used_elem used_elem = {desc_head, 0};
+        ring_used_add(emul, vring, used_elem);
+        idx++;
+    }
+    virtq->last_idx[queue] = idx;
+    balloon_inject_irq(balloon, VIRTIO_BALLOON_ISR_QUEUE);
+}
+
+static void balloon_handle_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    balloon_internal_t *balloon = emul->internal;
+    switch (balloon_queue_type(balloon, queue)) {
+    case INFLATE_QUEUE:
+        balloon_handle_pages(emul, queue, true);
+        break;
+    case DEFLATE_QUEUE:
+        balloon_handle_pages(emul, queue, false);
+        break;
+    case STATS_QUEUE:
+        balloon_handle_stats(emul, queue);
+        break;
+    case REPORTING_QUEUE:
+        balloon_handle_reports(emul, queue);
+        break;
+    default:
+        ZF_LOGW("Ignoring notification of unknown balloon queue %u", queue);
+        break;
+    }
+}
+
+static void emul_balloon_notify(virtio_emul_t *emul)
+{
+    for (unsigned int queue = INFLATE_QUEUE; queue < UNKNOWN_QUEUE; queue++) {
+        if (balloon_queue_type(emul->internal, queue) != UNKNOWN_QUEUE) {
+            balloon_handle_queue(emul, queue);
+        }
+    }
+}
+
+static void balloon_reset(balloon_internal_t *balloon)
+{
+    /* Pages already released stay released, the guest faults in fresh frames when it touches them */
+    free(balloon->inflated);
+    balloon->inflated = NULL;
+    balloon->cfg.actual = 0;
+    balloon->guest_features = 0;
+    balloon->isr = 0;
+    balloon->stats_held = false;
+}
+
+static void emul_balloon_set_target(virtio_emul_t *emul, uint32_t num_pages)
+{
+    balloon_internal_t *balloon = emul->internal;
+    balloon->cfg.num_pages = num_pages;
+    balloon_inject_irq(balloon, VIRTIO_BALLOON_ISR_CONFIG);
+}
+
+static uint32_t emul_balloon_get_actual(virtio_emul_t *emul)
+{
+    balloon_internal_t *balloon = emul->internal;
+    return balloon->cfg.actual;
+}
+
+static int emul_balloon_request_stats(virtio_emul_t *emul)
+{
+    balloon_internal_t *balloon = emul->internal;
+    if (!balloon->stats_held) {
+        ZF_LOGE("Failed to request balloon stats: Guest has not provided a stats buffer");
+        return -1;
+    }
+    /* Handing the buffer back asks the guest to refill it */
+    struct vring *vring = &emul->virtq.vring[STATS_QUEUE];
+    struct vring_used_elem used_elem = {balloon->stats_head, 0};
+    ring_used_add(emul, vring, used_elem);
+    balloon->stats_held = false;
+    balloon_inject_irq(balloon, VIRTIO_BALLOON_ISR_QUEUE);
+    return 0;
+}
+
+static int emul_balloon_get_stats(virtio_emul_t *emul, uint64_t *stats)
+{
+    balloon_internal_t *balloon = emul->internal;
+    if (!balloon->stats_valid) {
+        return -1;
+    }
+    memcpy(stats, balloon->stats, sizeof(balloon->stats));
+    return 0;
+}
+
+static size_t emul_balloon_released_bytes(virtio_emul_t *emul)
+{
+    balloon_internal_t *balloon = emul->internal;
+    return balloon->released_bytes;
+}
+
+static virtio_balloon_callbacks_t emul_callbacks = {
+    .set_target = emul_balloon_set_target,
+    .get_actual = emul_balloon_get_actual,
+    .request_stats = emul_balloon_request_stats,
+    .get_stats = emul_balloon_get_stats,
+    .released_bytes = emul_balloon_released_bytes
+};
+
+static bool balloon_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                      unsigned int *result)
+{
+    balloon_internal_t *balloon = emul->internal;
+
+    bool handled = false;
+    switch (offset) {
+    case VIRTIO_PCI_HOST_FEATURES:
+        handled = true;
+        assert(size == 4);
+        *result = BALLOON_HOST_FEATURES;
+        break;
+    case VIRTIO_PCI_ISR:
+        handled = true;
+        assert(size == 1);
+        /* Reading the status acknowledges the interrupt */
+        *result = balloon->isr;
+        balloon->isr = 0;
+        break;
+    case VIRTIO_BALLOON_CFG_NUM_PAGES ... VIRTIO_BALLOON_CFG_NUM_PAGES + sizeof(struct virtio_balloon_config) - 1:
+        handled = true;
+        assert(offset - VIRTIO_BALLOON_CFG_NUM_PAGES + size <= sizeof(struct virtio_balloon_config));
+        *result = 0;
+        memcpy(result, ((uint8_t *)&balloon->cfg) + offset - VIRTIO_BALLOON_CFG_NUM_PAGES, size);
+        break;
+    }
+
+    return handled;
+}
+
+static bool balloon_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                       unsigned int value)
+{
+    balloon_internal_t *balloon = emul->internal;
+
+    bool handled = false;
+    switch (offset) {
+    case VIRTIO_PCI_GUEST_FEATURES:
+        handled = true;
+        assert(size == 4);
+        balloon->guest_features = value & BALLOON_HOST_FEATURES;
+        break;
+    case VIRTIO_PCI_STATUS:
+        /* Left to the generic handler, a zero status resets the device */
+        if (!value) {
+            balloon_reset(balloon);
+        }
+        break;
+    case VIRTIO_PCI_QUEUE_NOTIFY:
+        handled = true;
+        balloon_handle_queue(emul, value);
+        break;
+    case VIRTIO_BALLOON_CFG_ACTUAL ... VIRTIO_BALLOON_CFG_ACTUAL + sizeof(uint32_t) - 1:
+        /* Legacy guests write the config a byte at a time */
+        handled = true;
+        assert(offset - VIRTIO_BALLOON_CFG_ACTUAL + size <= sizeof(uint32_t));
+        memcpy(((uint8_t *)&balloon->cfg.actual) + offset - VIRTIO_BALLOON_CFG_ACTUAL, &value, size);
+        break;
+    }
+
+    return handled;
+}
+
+void *balloon_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, balloon_driver_init driver, void *config)
+{
+    balloon_internal_t *internal = calloc(1, sizeof(*internal));
+    if (!internal) {
+        goto error;
+    }
+
+    emul->notify = emul_balloon_notify;
+    emul->device_io_in = balloon_device_emul_io_in;
+    emul->device_io_out = balloon_device_emul_io_out;
+    internal->driver.emul_cb = emul_callbacks;
+
+    int err = driver(&internal->driver, io_ops, config);
+    if (err) {
+        ZF_LOGE("Failed to initialize driver");
+        goto error;
+    }
+
+    return (void *)internal;
+error:
+    if (internal) {
+        free(internal);
+    }
+    return NULL;
+}
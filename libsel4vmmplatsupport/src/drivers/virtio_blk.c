@@ -163,6 +163,10 @@ virtio_blk_t *common_make_virtio_blk(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
     blk->emul = virtio_emul_init(ioops, QUEUE_SIZE, vm, emul_driver_init, blk, VIRTIO_BLOCK);
 
     assert(blk->emul);
+    if (virtio_emul_snapshot_register(blk->emul, blk->iobase)) {
+        ZF_LOGE("Failed to register virtio device for snapshots");
+        return NULL;
+    }
     return blk;
 }
 
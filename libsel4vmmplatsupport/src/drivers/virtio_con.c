@@ -116,5 +116,9 @@ virtio_con_t *common_make_virtio_con(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
     con->emul = virtio_emul_init(ioops, QUEUE_SIZE, vm, emul_con_driver_init, con, VIRTIO_CONSOLE);
 
     assert(con->emul);
+    if (virtio_emul_snapshot_register(con->emul, con->iobase)) {
+        ZF_LOGE("Failed to register virtio device for snapshots");
+        return NULL;
+    }
     return con;
 }
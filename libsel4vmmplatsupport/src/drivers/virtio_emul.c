@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sel4vm/guest_snapshot.h>
 #include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
 
 #include "virtio_emul_helpers.h"
@@ -131,6 +132,9 @@ virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, vm_t *vm, vo
     case VIRTIO_VSOCK:
         emul->internal = vsock_virtio_emul_init(emul, io_ops, (vsock_driver_init)driver, config);
         break;
+    case VIRTIO_BALLOON:
+        emul->internal = balloon_virtio_emul_init(emul, io_ops, (balloon_driver_init)driver, config);
+        break;
     }
     if (emul->internal == NULL) {
         return NULL;
@@ -146,3 +150,29 @@ virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, vm_t *vm, vo
 
     return emul;
 }
+
+static int virtio_emul_snapshot_save(vm_t *vm, void *state, void *cookie)
+{
+    virtio_emul_t *emul = cookie;
+    vqueue_t *snapshot = state;
+    memcpy(snapshot, &emul->virtq, sizeof(*snapshot));
+    return 0;
+}
+
+static int virtio_emul_snapshot_restore(vm_t *vm, const void *state, void *cookie)
+{
+    virtio_emul_t *emul = cookie;
+    memcpy(&emul->virtq, state, sizeof(emul->virtq));
+    /* the rings are guest physical addresses, set up again from the saved pfns */
+    for (int i = 0; i < VQUEUE_NUM_VRINGS; i++) {
+        vring_init(&emul->virtq.vring[i], emul->virtq.queue_size[i],
+                   (void *)((uintptr_t)emul->virtq.queue_pfn[i] << 12), VIRTIO_PCI_VRING_ALIGN);
+    }
+    return 0;
+}
+
+int virtio_emul_snapshot_register(virtio_emul_t *emul, unsigned int iobase)
+{
+    return vm_snapshot_register_device(emul->vm, VM_SNAPSHOT_DEVICE_VIRTIO(iobase), sizeof(vqueue_t),
+                                       virtio_emul_snapshot_save, virtio_emul_snapshot_restore, emul);
+}
@@ -30,5 +30,5 @@ int vm_guest_write_mem(vm_t *vm, void *data, uintptr_t address, size_t size)
 
 int vm_guest_read_mem(vm_t *vm, void *data, uintptr_t address, size_t size)
 {
-    return vm_ram_touch(vm, address, size, read_guest_mem, data);
+    return vm_ram_touch_readonly(vm, address, size, read_guest_mem, data);
 }
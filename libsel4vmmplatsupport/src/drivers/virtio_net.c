@@ -197,5 +197,9 @@ virtio_net_t *common_make_virtio_net(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
     net->emul = virtio_emul_init(ioops, QUEUE_SIZE, vm, emul_driver_init, net, VIRTIO_NET);
 
     assert(net->emul);
+    if (virtio_emul_snapshot_register(net->emul, net->iobase)) {
+        ZF_LOGE("Failed to register virtio device for snapshots");
+        return NULL;
+    }
     return net;
 }
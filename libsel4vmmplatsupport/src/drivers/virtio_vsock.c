@@ -121,5 +121,9 @@ virtio_vsock_t *common_make_virtio_vsock(vm_t *vm, vmm_pci_space_t *pci, vmm_io_
     vsock->emul = virtio_emul_init(ioops, QUEUE_SIZE, vm, emul_vsock_driver_init, vsock, VIRTIO_VSOCK);
 
     assert(vsock->emul);
+    if (virtio_emul_snapshot_register(vsock->emul, vsock->iobase)) {
+        ZF_LOGE("Failed to register virtio device for snapshots");
+        return NULL;
+    }
     return vsock;
 }
@@ -0,0 +1,935 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ * Copyright (C) 2002-2013 Mark Adler
+ *
+ * SPDX-License-Identifier: BSD-2-Clause AND Zlib
+ */
+
+/*
+ * The inflate decoder (get_bits() to inflate()) is derived from puff.c, the reference deflate decoder distributed
+ * with zlib, which carries the following notice:
+ *
+ *  Copyright (C) 2002-2013 Mark Adler, all rights reserved
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty.  In no event will the author be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *  1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *  3. This notice may not be removed or altered from any source distribution.
+ *
+ *  Mark Adler    madler@alumni.caltech.edu
+ *
+ * The code here has been altered to read its input from a file in large blocks and to use this library's types.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/util.h>
+
+#include <sel4vmmplatsupport/guest_image_decompress.h>
+
+#define GZIP_MAGIC          0x8b1f
+#define GZIP_DEFLATE        8
+#define GZIP_FHCRC          BIT(1)
+#define GZIP_FEXTRA         BIT(2)
+#define GZIP_FNAME          BIT(3)
+#define GZIP_FCOMMENT       BIT(4)
+#define GZIP_FRESERVED      0xe0
+
+#define LZ4_MAGIC           0x184D2204
+#define LZ4_LEGACY_MAGIC    0x184C2102
+#define LZ4_LEGACY_BLOCK    (8 * 1024 * 1024)
+/* Largest compressed size of a legacy block, for incompressible data */
+#define LZ4_LEGACY_BOUND    (LZ4_LEGACY_BLOCK + LZ4_LEGACY_BLOCK / 255 + 16)
+#define LZ4_FLG_VERSION     0x40
+#define LZ4_FLG_BLOCK_CSUM  BIT(4)
+#define LZ4_FLG_SIZE        BIT(3)
+#define LZ4_FLG_CONTENT_CSUM BIT(2)
+#define LZ4_FLG_DICT_ID     BIT(0)
+#define LZ4_BLOCK_RAW       BIT(31)
+#define LZ4_MIN_MATCH       4
+
+#define ZSTD_MAGIC          0xFD2FB528
+
+/* The file is read in large blocks, rather than a byte or a page at a time */
+#define INPUT_CHUNK_SIZE    0x10000
+
+/* Deflate limits, from RFC 1951 */
+#define MAXBITS     15
+#define MAXLCODES   286
+#define MAXDCODES   30
+#define MAXCODES    (MAXLCODES + MAXDCODES)
+#define FIXLCODES   288
+
+typedef struct input {
+    int fd;
+    uint8_t *buf;
+    size_t pos;
+    size_t len;
+} input_t;
+
+typedef struct inflate_state {
+    input_t *in;
+    uint8_t *out;
+    size_t outlen;
+    size_t outcnt;
+    uint32_t bitbuf;
+    int bitcnt;
+} inflate_state_t;
+
+typedef struct huffman {
+    uint16_t *count;
+    uint16_t *symbol;
+} huffman_t;
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint16_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint16_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint32_t crc_table[256];
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (!crc_table[1]) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            crc_table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static int input_fill(input_t *in)
+{
+    ssize_t len = read(in->fd, in->buf, INPUT_CHUNK_SIZE);
+    if (len <= 0) {
+        return -1;
+    }
+    in->pos = 0;
+    in->len = len;
+    return 0;
+}
+
+static bool input_eof(input_t *in)
+{
+    return in->pos == in->len && input_fill(in);
+}
+
+static int input_bytes(input_t *in, void *dest, size_t len)
+{
+    while (len) {
+        if (in->pos == in->len && input_fill(in)) {
+            ZF_LOGE("Image is truncated");
+            return -1;
+        }
+        size_t count = MIN(len, in->len - in->pos);
+        if (dest) {
+            memcpy(dest, in->buf + in->pos, count);
+            dest += count;
+        }
+        in->pos += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static int input_skip(input_t *in, size_t len)
+{
+    return input_bytes(in, NULL, len);
+}
+
+static int input_byte(input_t *in, uint8_t *byte)
+{
+    return input_bytes(in, byte, 1);
+}
+
+static int get_bits(inflate_state_t *s, int need, unsigned int *val)
+{
+    uint32_t buf = s->bitbuf;
+    while (s->bitcnt < need) {
+        uint8_t byte;
+        if (input_byte(s->in, &byte)) {
+            return -1;
+        }
+        buf |= (uint32_t)byte << s->bitcnt;
+        s->bitcnt += 8;
+    }
+    *val = buf & MASK(need);
+    s->bitbuf = buf >> need;
+    s->bitcnt -= need;
+    return 0;
+}
+
+static int inflate_stored(inflate_state_t *s)
+{
+    /* Stored blocks start on a byte boundary, drop the rest of the current byte */
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    uint8_t hdr[4];
+    if (input_bytes(s->in, hdr, sizeof(hdr))) {
+        return -1;
+    }
+    size_t len = hdr[0] | (hdr[1] << 8);
+    if (hdr[2] != (~hdr[0] & 0xff) || hdr[3] != (~hdr[1] & 0xff)) {
+        ZF_LOGE("Corrupt stored block length");
+        return -1;
+    }
+    if (len > s->outlen - s->outcnt) {
+        ZF_LOGE("Decompressed image is larger than the destination");
+        return -1;
+    }
+    if (input_bytes(s->in, s->out + s->outcnt, len)) {
+        return -1;
+    }
+    s->outcnt += len;
+    return 0;
+}
+
+/* Decode a symbol a bit at a time using canonical code counts, as codes fill the range in order of length */
+static int decode(inflate_state_t *s, const huffman_t *h, int *symbol)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len <= MAXBITS; len++) {
+        unsigned int bit;
+        if (get_bits(s, 1, &bit)) {
+            return -1;
+        }
+        code |= bit;
+        int count = h->count[len];
+        if (code - count < first) {
+            *symbol = h->symbol[index + (code - first)];
+            return 0;
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    ZF_LOGE("Invalid huffman code");
+    return -1;
+}
+
+/* Returns 0 for a complete code, > 0 for an incomplete code and < 0 for an over-subscribed code */
+static int construct(huffman_t *h, const uint16_t *length, int n)
+{
+    uint16_t offs[MAXBITS + 1];
+    memset(h->count, 0, (MAXBITS + 1) * sizeof(*h->count));
+    for (int symbol = 0; symbol < n; symbol++) {
+        h->count[length[symbol]]++;
+    }
+    if (h->count[0] == n) {
+        return 0;
+    }
+    int left = 1;
+    for (int len = 1; len <= MAXBITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) {
+            return left;
+        }
+    }
+    offs[1] = 0;
+    for (int len = 1; len < MAXBITS; len++) {
+        offs[len + 1] = offs[len] + h->count[len];
+    }
+    for (int symbol = 0; symbol < n; symbol++) {
+        if (length[symbol] != 0) {
+            h->symbol[offs[length[symbol]]++] = symbol;
+        }
+    }
+    return left;
+}
+
+static int inflate_codes(inflate_state_t *s, const huffman_t *lencode, const huffman_t *distcode)
+{
+    int symbol;
+    do {
+        if (decode(s, lencode, &symbol)) {
+            return -1;
+        }
+        if (symbol < 256) {
+            if (s->outcnt == s->outlen) {
+                ZF_LOGE("Decompressed image is larger than the destination");
+                return -1;
+            }
+            s->out[s->outcnt++] = symbol;
+        } else if (symbol > 256) {
+            unsigned int extra;
+            symbol -= 257;
+            if (symbol >= (int)ARRAY_SIZE(length_base) || get_bits(s, length_extra[symbol], &extra)) {
+                ZF_LOGE("Invalid length code");
+                return -1;
+            }
+            size_t len = length_base[symbol] + extra;
+            if (decode(s, distcode, &symbol) || symbol >= (int)ARRAY_SIZE(dist_base)
+                || get_bits(s, dist_extra[symbol], &extra)) {
+                ZF_LOGE("Invalid distance code");
+                return -1;
+            }
+            size_t dist = dist_base[symbol] + extra;
+            if (dist > s->outcnt) {
+                ZF_LOGE("Distance too far back");
+                return -1;
+            }
+            if (len > s->outlen - s->outcnt) {
+                ZF_LOGE("Decompressed image is larger than the destination");
+                return -1;
+            }
+            /* The destination is the window, copies may overlap the bytes they produce */
+            uint8_t *out = s->out + s->outcnt;
+            for (size_t i = 0; i < len; i++) {
+                out[i] = out[i - dist];
+            }
+            s->outcnt += len;
+        }
+    } while (symbol != 256);
+    return 0;
+}
+
+static int inflate_fixed(inflate_state_t *s)
+{
+    uint16_t lencnt[MAXBITS + 1], lensym[FIXLCODES];
+    uint16_t distcnt[MAXBITS + 1], distsym[MAXDCODES];
+    uint16_t lengths[FIXLCODES];
+    huffman_t lencode = {lencnt, lensym};
+    huffman_t distcode = {distcnt, distsym};
+
+    int symbol = 0;
+    for (; symbol < 144; symbol++) {
+        lengths[symbol] = 8;
+    }
+    for (; symbol < 256; symbol++) {
+        lengths[symbol] = 9;
+    }
+    for (; symbol < 280; symbol++) {
+        lengths[symbol] = 7;
+    }
+    for (; symbol < FIXLCODES; symbol++) {
+        lengths[symbol] = 8;
+    }
+    construct(&lencode, lengths, FIXLCODES);
+    for (symbol = 0; symbol < MAXDCODES; symbol++) {
+        lengths[symbol] = 5;
+    }
+    construct(&distcode, lengths, MAXDCODES);
+    return inflate_codes(s, &lencode, &distcode);
+}
+
+static int inflate_dynamic(inflate_state_t *s)
+{
+    uint16_t lengths[MAXCODES];
+    uint16_t lencnt[MAXBITS + 1], lensym[MAXLCODES];
+    uint16_t distcnt[MAXBITS + 1], distsym[MAXDCODES];
+    huffman_t lencode = {lencnt, lensym};
+    huffman_t distcode = {distcnt, distsym};
+    unsigned int nlen, ndist, ncode;
+
+    if (get_bits(s, 5, &nlen) || get_bits(s, 5, &ndist) || get_bits(s, 4, &ncode)) {
+        return -1;
+    }
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if (nlen > MAXLCODES || ndist > MAXDCODES) {
+        ZF_LOGE("Bad code counts in dynamic block");
+        return -1;
+    }
+
+    /* Read the code length code lengths, then the literal/length and distance code lengths */
+    unsigned int index = 0;
+    for (; index < ncode; index++) {
+        unsigned int len;
+        if (get_bits(s, 3, &len)) {
+            return -1;
+        }
+        lengths[code_length_order[index]] = len;
+    }
+    for (; index < 19; index++) {
+        lengths[code_length_order[index]] = 0;
+    }
+    if (construct(&lencode, lengths, 19) != 0) {
+        ZF_LOGE("Incomplete code length code");
+        return -1;
+    }
+    index = 0;
+    while (index < nlen + ndist) {
+        int symbol;
+        unsigned int repeat;
+        uint16_t len = 0;
+        if (decode(s, &lencode, &symbol)) {
+            return -1;
+        }
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+        if (symbol == 16) {
+            if (index == 0) {
+                ZF_LOGE("Repeat with no previous length");
+                return -1;
+            }
+            len = lengths[index - 1];
+            if (get_bits(s, 2, &repeat)) {
+                return -1;
+            }
+            repeat += 3;
+        } else if (symbol == 17) {
+            if (get_bits(s, 3, &repeat)) {
+                return -1;
+            }
+            repeat += 3;
+        } else {
+            if (get_bits(s, 7, &repeat)) {
+                return -1;
+            }
+            repeat += 11;
+        }
+        if (index + repeat > nlen + ndist) {
+            ZF_LOGE("Too many code lengths");
+            return -1;
+        }
+        while (repeat--) {
+            lengths[index++] = len;
+        }
+    }
+    if (lengths[256] == 0) {
+        ZF_LOGE("Missing end of block code");
+        return -1;
+    }
+
+    /* Only a single length code may be left incomplete */
+    int err = construct(&lencode, lengths, nlen);
+    if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1)) {
+        ZF_LOGE("Invalid literal/length code");
+        return -1;
+    }
+    err = construct(&distcode, lengths + nlen, ndist);
+    if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1)) {
+        ZF_LOGE("Invalid distance code");
+        return -1;
+    }
+    return inflate_codes(s, &lencode, &distcode);
+}
+
+static int inflate(inflate_state_t *s)
+{
+    unsigned int last, type;
+    do {
+        if (get_bits(s, 1, &last) || get_bits(s, 2, &type)) {
+            return -1;
+        }
+        int err;
+        switch (type) {
+        case 0:
+            err = inflate_stored(s);
+            break;
+        case 1:
+            err = inflate_fixed(s);
+            break;
+        case 2:
+            err = inflate_dynamic(s);
+            break;
+        default:
+            ZF_LOGE("Invalid deflate block type");
+            return -1;
+        }
+        if (err) {
+            return -1;
+        }
+    } while (!last);
+    return 0;
+}
+
+static int skip_string(input_t *in)
+{
+    uint8_t c;
+    do {
+        if (input_byte(in, &c)) {
+            return -1;
+        }
+    } while (c != 0);
+    return 0;
+}
+
+static int gunzip(input_t *in, uint8_t *dest, size_t dest_size, size_t *decompressed_size)
+{
+    uint8_t hdr[10];
+    if (input_bytes(in, hdr, sizeof(hdr))) {
+        return -1;
+    }
+    uint8_t flags = hdr[3];
+    if ((hdr[0] | (hdr[1] << 8)) != GZIP_MAGIC || hdr[2] != GZIP_DEFLATE || (flags & GZIP_FRESERVED)) {
+        ZF_LOGE("Unsupported gzip header");
+        return -1;
+    }
+    if (flags & GZIP_FEXTRA) {
+        uint8_t xlen[2];
+        if (input_bytes(in, xlen, sizeof(xlen)) || input_skip(in, xlen[0] | (xlen[1] << 8))) {
+            return -1;
+        }
+    }
+    if ((flags & GZIP_FNAME) && skip_string(in)) {
+        return -1;
+    }
+    if ((flags & GZIP_FCOMMENT) && skip_string(in)) {
+        return -1;
+    }
+    if ((flags & GZIP_FHCRC) && input_skip(in, 2)) {
+        return -1;
+    }
+
+    inflate_state_t s = {
+        .in = in,
+        .out = dest,
+        .outlen = dest_size,
+    };
+    if (inflate(&s)) {
+        return -1;
+    }
+
+    /* The trailer starts on the byte boundary following the last block */
+    uint8_t trailer[8];
+    if (input_bytes(in, trailer, sizeof(trailer))) {
+        return -1;
+    }
+    if (get_le32(trailer) != crc32(0, dest, s.outcnt)) {
+        ZF_LOGE("gzip checksum mismatch");
+        return -1;
+    }
+    if (get_le32(trailer + 4) != (uint32_t)s.outcnt) {
+        ZF_LOGE("gzip size mismatch");
+        return -1;
+    }
+    *decompressed_size = s.outcnt;
+    return 0;
+}
+
+/* Decode an lz4 block to dest + *pos. Matches may reach back into earlier blocks, as dest holds the whole image */
+static int lz4_decode_block(const uint8_t *src, size_t src_len, uint8_t *dest, size_t dest_size, size_t *pos)
+{
+    size_t ip = 0;
+    size_t op = *pos;
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip == src_len) {
+                    goto corrupt;
+                }
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > src_len - ip || lit > dest_size - op) {
+            goto corrupt;
+        }
+        memcpy(dest + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        /* The last sequence of a block is literals only */
+        if (ip == src_len) {
+            break;
+        }
+        if (src_len - ip < 2) {
+            goto corrupt;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            goto corrupt;
+        }
+        size_t len = token & 0xf;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (ip == src_len) {
+                    goto corrupt;
+                }
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ4_MIN_MATCH;
+        if (len > dest_size - op) {
+            goto corrupt;
+        }
+        uint8_t *out = dest + op;
+        for (size_t i = 0; i < len; i++) {
+            out[i] = out[i - offset];
+        }
+        op += len;
+    }
+    *pos = op;
+    return 0;
+
+corrupt:
+    ZF_LOGE("Corrupt lz4 block, or decompressed image is larger than the destination");
+    return -1;
+}
+
+/* Read a compressed block and decode it, growing the block buffer as needed */
+static int lz4_block(input_t *in, uint8_t **block, size_t *block_size, size_t len, uint8_t *dest,
+                     size_t dest_size, size_t *pos)
+{
+    if (len > *block_size) {
+        uint8_t *new_block = realloc(*block, len);
+        if (!new_block) {
+            ZF_LOGE("Failed to allocate lz4 block buffer");
+            return -1;
+        }
+        *block = new_block;
+        *block_size = len;
+    }
+    if (input_bytes(in, *block, len)) {
+        return -1;
+    }
+    return lz4_decode_block(*block, len, dest, dest_size, pos);
+}
+
+static size_t lz4_block_max(uint8_t bd)
+{
+    /* Block maximum sizes 4 to 7 are 64K, 256K, 1M and 4M */
+    int id = (bd >> 4) & 0x7;
+    return id < 4 ? 0 : BIT(8 + 2 * id);
+}
+
+static int lz4_frame_header(input_t *in, uint8_t *flg, size_t *block_max, uint64_t *content_size)
+{
+    uint8_t hdr[6];
+    if (input_bytes(in, hdr, sizeof(hdr))) {
+        return -1;
+    }
+    *flg = hdr[4];
+    *block_max = lz4_block_max(hdr[5]);
+    if (get_le32(hdr) != LZ4_MAGIC || (*flg & 0xc0) != LZ4_FLG_VERSION || *block_max == 0) {
+        ZF_LOGE("Unsupported lz4 frame header");
+        return -1;
+    }
+    if (*flg & LZ4_FLG_DICT_ID) {
+        ZF_LOGE("lz4 frames with a dictionary are not supported");
+        return -1;
+    }
+    *content_size = 0;
+    if (*flg & LZ4_FLG_SIZE) {
+        uint8_t size[8];
+        if (input_bytes(in, size, sizeof(size))) {
+            return -1;
+        }
+        *content_size = get_le32(size) | ((uint64_t)get_le32(size + 4) << 32);
+    }
+    /* Header checksum, not verified */
+    return input_skip(in, 1);
+}
+
+static int unlz4_frame(input_t *in, uint8_t *dest, size_t dest_size, size_t *decompressed_size)
+{
+    uint8_t flg;
+    size_t block_max;
+    uint64_t content_size;
+    if (lz4_frame_header(in, &flg, &block_max, &content_size)) {
+        return -1;
+    }
+
+    uint8_t *block = NULL;
+    size_t block_size = 0;
+    size_t pos = 0;
+    int err = 0;
+    while (!err) {
+        uint8_t hdr[4];
+        err = input_bytes(in, hdr, sizeof(hdr));
+        if (err) {
+            break;
+        }
+        uint32_t len = get_le32(hdr);
+        if (len == 0) {
+            break;
+        }
+        bool raw = len & LZ4_BLOCK_RAW;
+        len &= ~LZ4_BLOCK_RAW;
+        if (len > block_max) {
+            ZF_LOGE("lz4 block larger than the frame's block size");
+            err = -1;
+            break;
+        }
+        if (raw) {
+            if (len > dest_size - pos) {
+                ZF_LOGE("Decompressed image is larger than the destination");
+                err = -1;
+                break;
+            }
+            err = input_bytes(in, dest + pos, len);
+            pos += len;
+        } else {
+            err = lz4_block(in, &block, &block_size, len, dest, dest_size, &pos);
+        }
+        /* Block checksum, not verified */
+        if (!err && (flg & LZ4_FLG_BLOCK_CSUM)) {
+            err = input_skip(in, 4);
+        }
+    }
+    free(block);
+    if (err) {
+        return -1;
+    }
+    if ((flg & LZ4_FLG_SIZE) && content_size != pos) {
+        ZF_LOGE("lz4 content size mismatch");
+        return -1;
+    }
+    *decompressed_size = pos;
+    return 0;
+}
+
+/*
+ * Legacy streams (as built by the Linux kernel) are a magic number followed by 8M blocks up to the end of the file.
+ * The kernel build appends the decompressed size, which shows up as a block header with no data following it
+ */
+static int unlz4_legacy(input_t *in, uint8_t *dest, size_t dest_size, size_t *decompressed_size)
+{
+    uint8_t *block = NULL;
+    size_t block_size = 0;
+    size_t pos = 0;
+    int err = 0;
+    while (!err && !input_eof(in)) {
+        uint8_t hdr[4];
+        err = input_bytes(in, hdr, sizeof(hdr));
+        if (err) {
+            break;
+        }
+        uint32_t len = get_le32(hdr);
+        if (len == LZ4_LEGACY_MAGIC || input_eof(in)) {
+            continue;
+        }
+        if (len > LZ4_LEGACY_BOUND) {
+            ZF_LOGE("lz4 block larger than the legacy block size");
+            err = -1;
+            break;
+        }
+        err = lz4_block(in, &block, &block_size, len, dest, dest_size, &pos);
+    }
+    free(block);
+    if (err) {
+        return -1;
+    }
+    *decompressed_size = pos;
+    return 0;
+}
+
+image_compression_t image_get_compression(const void *header, size_t len)
+{
+    const uint8_t *hdr = header;
+    if (len >= 2 && (hdr[0] | (hdr[1] << 8)) == GZIP_MAGIC) {
+        return IMAGE_GZIP;
+    }
+    if (len < 4) {
+        return IMAGE_UNCOMPRESSED;
+    }
+    switch (get_le32(hdr)) {
+    case LZ4_MAGIC:
+        return IMAGE_LZ4;
+    case LZ4_LEGACY_MAGIC:
+        return IMAGE_LZ4_LEGACY;
+    case ZSTD_MAGIC:
+        return IMAGE_ZSTD;
+    default:
+        return IMAGE_UNCOMPRESSED;
+    }
+}
+
+static int read_at(int fd, off_t offset, void *buf, size_t len)
+{
+    if (lseek(fd, offset, SEEK_SET) != offset) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = read(fd, buf + done, len - done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Walk the block headers of a frame without reading the blocks themselves */
+static int lz4_frame_size(int fd, size_t *size)
+{
+    uint8_t hdr[15];
+    if (read_at(fd, 0, hdr, 6)) {
+        return -1;
+    }
+    uint8_t flg = hdr[4];
+    size_t block_max = lz4_block_max(hdr[5]);
+    if ((flg & 0xc0) != LZ4_FLG_VERSION || block_max == 0) {
+        ZF_LOGE("Unsupported lz4 frame header");
+        return -1;
+    }
+    if (flg & LZ4_FLG_SIZE) {
+        if (read_at(fd, 6, hdr + 6, 8)) {
+            return -1;
+        }
+        *size = get_le32(hdr + 6) | ((uint64_t)get_le32(hdr + 10) << 32);
+        return 0;
+    }
+    off_t offset = 6 + ((flg & LZ4_FLG_DICT_ID) ? 4 : 0) + 1;
+    size_t total = 0;
+    while (true) {
+        uint8_t block_hdr[4];
+        if (read_at(fd, offset, block_hdr, sizeof(block_hdr))) {
+            ZF_LOGE("lz4 image is truncated");
+            return -1;
+        }
+        uint32_t len = get_le32(block_hdr);
+        if (len == 0) {
+            break;
+        }
+        /* Uncompressed blocks have an exact size, compressed blocks are bounded by the block size */
+        total += (len & LZ4_BLOCK_RAW) ? len & ~LZ4_BLOCK_RAW : block_max;
+        offset += sizeof(block_hdr) + (len & ~LZ4_BLOCK_RAW) + ((flg & LZ4_FLG_BLOCK_CSUM) ? 4 : 0);
+    }
+    *size = total;
+    return 0;
+}
+
+static int lz4_legacy_size(int fd, size_t *size)
+{
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    off_t offset = 4;
+    size_t total = 0;
+    while (offset < file_size) {
+        uint8_t block_hdr[4];
+        if (read_at(fd, offset, block_hdr, sizeof(block_hdr))) {
+            ZF_LOGE("lz4 image is truncated");
+            return -1;
+        }
+        uint32_t len = get_le32(block_hdr);
+        offset += sizeof(block_hdr);
+        if (len == LZ4_LEGACY_MAGIC) {
+            continue;
+        }
+        if (offset == file_size) {
+            /* Size appended by the kernel build, use it if it is consistent with the blocks */
+            if (len <= total && len + LZ4_LEGACY_BLOCK > total) {
+                total = len;
+            }
+            break;
+        }
+        total += LZ4_LEGACY_BLOCK;
+        offset += len;
+    }
+    *size = total;
+    return 0;
+}
+
+int image_decompressed_size(int fd, image_compression_t compression, size_t *size)
+{
+    int err;
+    uint8_t isize[4];
+    switch (compression) {
+    case IMAGE_UNCOMPRESSED:
+        *size = lseek(fd, 0, SEEK_END);
+        err = 0;
+        break;
+    case IMAGE_GZIP:
+        /* The size modulo 2^32 is the last field of the trailer */
+        err = read_at(fd, lseek(fd, 0, SEEK_END) - sizeof(isize), isize, sizeof(isize));
+        if (!err) {
+            *size = get_le32(isize);
+        }
+        break;
+    case IMAGE_LZ4:
+        err = lz4_frame_size(fd, size);
+        break;
+    case IMAGE_LZ4_LEGACY:
+        err = lz4_legacy_size(fd, size);
+        break;
+    default:
+        ZF_LOGE("Unsupported image compression format");
+        err = -1;
+        break;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return err;
+}
+
+int image_decompress(int fd, image_compression_t compression, void *dest, size_t dest_size,
+                     size_t *decompressed_size)
+{
+    if (compression == IMAGE_ZSTD || compression == IMAGE_UNCOMPRESSED) {
+        ZF_LOGE("Unsupported image compression format");
+        return -1;
+    }
+    input_t in = {
+        .fd = fd,
+        .buf = malloc(INPUT_CHUNK_SIZE),
+    };
+    if (!in.buf) {
+        ZF_LOGE("Failed to allocate input buffer");
+        return -1;
+    }
+    int err;
+    switch (compression) {
+    case IMAGE_GZIP:
+        err = gunzip(&in, dest, dest_size, decompressed_size);
+        break;
+    case IMAGE_LZ4:
+        err = unlz4_frame(&in, dest, dest_size, decompressed_size);
+        break;
+    default:
+        /* Skip the magic number, the block loop also accepts it between blocks */
+        err = input_skip(&in, 4);
+        if (!err) {
+            err = unlz4_legacy(&in, dest, dest_size, decompressed_size);
+        }
+        break;
+    }
+    free(in.buf);
+    return err;
+}